@@ -19,6 +19,7 @@ class Integrator;
 class Light;
 class Shape;
 class Sampler;
+class TriangleMeshData;
 class TriangleMeshRawData;
 
 } // namespace raytracer
@@ -52,6 +53,10 @@ raytracer::Film* MakeFilm(api::ResourceContext &_context, api::ParamSet const &_
 
 raytracer::TriangleMeshRawData* MakeTriangleMeshRawData(api::ResourceContext &_context,
 														api::ParamSet const &_params);
+// Object space mesh data of a triangle mesh shape loaded from the same file as other shapes,
+// built once and shared by all of them. nullptr when the file can't be loaded.
+raytracer::TriangleMeshData const* FetchSharedTriangleMeshData(api::ResourceContext &_context,
+																api::ParamSet const &_params);
 
 
 ShapeCallbackContainer_t const &shape_callbacks();
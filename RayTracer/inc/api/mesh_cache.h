@@ -0,0 +1,34 @@
+#pragma once
+#ifndef __YS_MESH_CACHE_HPP__
+#define __YS_MESH_CACHE_HPP__
+
+#include <cstdint>
+#include <string>
+
+#include "core/memory_region.h"
+
+
+namespace raytracer {
+class TriangleMeshRawData;
+} // namespace raytracer
+
+
+namespace api {
+
+
+// Cache files hold raw arrays as laid out in memory by the build that wrote them, headers
+// reject any file written with a different format or precision.
+std::string		MeshCacheFile(std::string const &_cache_dir, uint64_t _key,
+							  std::string const &_extension);
+// Key of everything built from the geometry of _raw_data, normals and uvs excluded
+uint64_t		HashMeshGeometry(raytracer::TriangleMeshRawData const &_raw_data);
+raytracer::TriangleMeshRawData	*ReadCachedRawData(std::string const &_cache_file,
+												   core::MemoryRegion &_mem_region);
+void			WriteCachedRawData(std::string const &_cache_file,
+								   raytracer::TriangleMeshRawData const &_raw_data);
+
+
+} // namespace api
+
+
+#endif // __YS_MESH_CACHE_HPP__
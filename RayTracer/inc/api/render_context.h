@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "api/transform_cache.h"
+#include "maths/transform.h"
 #include "core/memory_region.h"
 #include "core/noncopyable.h"
 #include "core/nonmovable.h"
@@ -14,6 +15,8 @@
 #include "raytracer/sampler.h"
 #include "raytracer/integrator.h"
 #include "raytracer/bvh_accelerator.h"
+#include "raytracer/mesh_instances.h"
+#include "raytracer/triangle_mesh_data.h"
 
 namespace api {
 
@@ -23,20 +26,57 @@ class RenderContext final
 public:
 	using PrimitiveContainer_t = std::vector<raytracer::Primitive const*>;
 	using LightContainer_t = std::vector<raytracer::Light const*>;
+	// A mesh moving from the first to the last frame of a sequence
+	struct MeshAnimation
+	{
+		raytracer::TriangleMeshData	*mesh_data;
+		maths::AnimatedTransform	world_transform;
+	};
+	using MeshAnimationContainer_t = std::vector<MeshAnimation>;
+	// Records of a group or of the scene and the BVH over the primitives of the group, updated
+	// in that order once the meshes moved. The scene level has no BVH of its own here, the
+	// scene BVH is updated last.
+	struct InstanceLevel
+	{
+		raytracer::MeshInstances	*instances;
+		raytracer::BvhAccelerator	*bvh;
+	};
+	using InstanceLevelContainer_t = std::vector<InstanceLevel>;
+	// Each mesh once, shared ones included, for the BVH report
+	using MeshDataContainer_t = std::vector<raytracer::TriangleMeshData const*>;
 public:
 	RenderContext();
 	RenderContext(raytracer::Integrator &_integrator,
 				  PrimitiveContainer_t &_primitives,
-				  LightContainer_t &_lights);
+				  LightContainer_t &_lights,
+				  MeshAnimationContainer_t const &_mesh_animations = {},
+				  raytracer::BvhAccelerator *_scene_bvh = nullptr,
+				  InstanceLevelContainer_t const &_instance_levels = {},
+				  MeshDataContainer_t const &_meshes = {});
 	void	Clear();
 	void	AddPrimitive(raytracer::Primitive *_prim);
+	void	SetThreadCount(uint32_t const _thread_count);
 public:
 	bool	GoodForRender() const;
+	// Writes the image to _path, and the statistics of the scene BVH and the traversal counters
+	// of the render to _path with a .bvh.json extension.
 	void	RenderAndWrite(std::string const &_path);
+	// Renders _frame_count frames with the animations spread from the first to the last one.
+	// Meshes and their BVHs are updated in place between frames, each frame is written to
+	// _path with its index appended to the file name.
+	void	RenderSequenceAndWrite(std::string const &_path, uint32_t _frame_count);
 private:
-	raytracer::Integrator	*integrator_ = nullptr;
-	PrimitiveContainer_t	primitives_{};
-	LightContainer_t		lights_{};
+	void	SetFrameTime_(maths::Decimal _time);
+	static std::string FramePath_(std::string const &_path, uint32_t _frame_index);
+	void	WriteBvhReport_(std::string const &_path) const;
+private:
+	raytracer::Integrator		*integrator_ = nullptr;
+	PrimitiveContainer_t		primitives_{};
+	LightContainer_t			lights_{};
+	MeshAnimationContainer_t	mesh_animations_{};
+	raytracer::BvhAccelerator	*scene_bvh_ = nullptr;
+	InstanceLevelContainer_t	instance_levels_{};		// nested groups first
+	MeshDataContainer_t			meshes_{};
 };
 
 
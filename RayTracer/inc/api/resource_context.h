@@ -2,10 +2,12 @@
 #ifndef __YS_RESOURCE_CONTEXT_HPP__
 #define __YS_RESOURCE_CONTEXT_HPP__
 
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "api/param_set.h"
+#include "api/render_context.h"
 #include "api/transform_cache.h"
 #include "core/memory_region.h"
 #include "core/noncopyable.h"
@@ -14,6 +16,7 @@
 
 namespace raytracer {
 class Shape;
+class TriangleMeshData;
 } // namespace raytracer
 
 
@@ -47,17 +50,14 @@ public:
 	};
 	using ObjectDescriptorContainer_t = std::vector<ObjectDescriptor const *>;
 private:
-	struct ObjectInstance
-	{
-		ObjectInstance(std::string const *const _unique_id, void *const _instance) :
-			unique_id{ _unique_id }, instance{ _instance }
-		{}
-		std::string const	*unique_id;
-		void				*instance;
-	};
-	using ObjectInstanceContainer_t = std::vector<ObjectInstance>;
+	// Lookups by id are hashed, scenes may declare millions of objects
+	using DescriptorIndex_t = std::unordered_map<std::string, ObjectDescriptor const*>;
+	using ObjectInstanceContainer_t = std::unordered_map<std::string, void*>;
 private:
 	using UsedShapePtrContainer_t = std::unordered_set<raytracer::Shape const*>;
+	using MeshPathCountContainer_t = std::unordered_map<std::string, uint32_t>;
+	using SharedMeshDataContainer_t =
+		std::unordered_map<std::string, raytracer::TriangleMeshData const*>;
 public:
 	explicit ResourceContext(std::string const &_workdir);
 	bool IsUniqueIdFree(std::string const &_unique_id) const;
@@ -73,21 +73,41 @@ public:
 	template <typename T> inline T const &GetInstance(std::string const &_unique_id) const;
 	void SetWorkdir(std::string const &_workdir);
 	std::string const	&workdir() const;
+	// Mesh data and BVHs are cached in this directory, caching is disabled when empty.
+	void SetCacheDir(std::string const &_cache_dir);
+	std::string const	&cache_dir() const;
 	core::MemoryRegion	&mem_region();
 	TransformCache		&transform_cache();
 public:
 	void FlagLightShape(raytracer::Shape const &_shape);
 	bool IsShapeLight(raytracer::Shape const &_shape) const;
+	void PushMeshAnimation(RenderContext::MeshAnimation const &_animation);
+	RenderContext::MeshAnimationContainer_t const &mesh_animations() const;
+	void PushMeshData(raytracer::TriangleMeshData const &_data);
+	RenderContext::MeshDataContainer_t const &meshes() const;
+	// Number of shapes loaded from the mesh file _path. Counted in a single pass over the shape
+	// descriptors on the first call after one was pushed, the parameters must be complete.
+	uint32_t MeshPathUseCount(std::string const &_path);
+	// Object space mesh data shared by all the shapes loaded from _path, nullptr until set
+	void SetSharedMeshData(std::string const &_path, raytracer::TriangleMeshData const &_data);
+	raytracer::TriangleMeshData const *FindSharedMeshData(std::string const &_path) const;
 private:
 	template <typename T> T* MakeObject_(ObjectDescriptor const &_object_desc);
 	void *GetInstanceImpl_(std::string const &_unique_id) const;
 private:
 	std::string						workdir_{ "" };
+	std::string						cache_dir_{ "" };
 	core::MemoryRegion				mem_region_{};
 	TransformCache					transform_cache_{};
 	ObjectDescriptorContainer_t		object_descriptors_{};
+	DescriptorIndex_t				descriptor_index_{};
 	ObjectInstanceContainer_t		object_instances_{};
 	UsedShapePtrContainer_t			light_shapes_{};
+	RenderContext::MeshAnimationContainer_t	mesh_animations_{};
+	RenderContext::MeshDataContainer_t		meshes_{};
+	MeshPathCountContainer_t		mesh_path_counts_{};
+	bool							mesh_path_counts_valid_{ false };
+	SharedMeshDataContainer_t		shared_mesh_data_{};
 };
 
 
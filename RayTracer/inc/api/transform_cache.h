@@ -2,7 +2,7 @@
 #ifndef __YS_TRANSFORM_CACHE_HPP__
 #define __YS_TRANSFORM_CACHE_HPP__
 
-#include <map>
+#include <unordered_map>
 
 #include "core/nonmovable.h"
 #include "core/noncopyable.h"
@@ -19,7 +19,12 @@ class TransformCache final :
 	private core::nonmovable
 {
 private:
-	using LookupTable_t = std::map<maths::Transform, maths::Transform*>;
+	// Hashed on the matrix, scenes may place millions of shapes
+	struct TransformHash
+	{
+		size_t operator()(maths::Transform const &_t) const;
+	};
+	using LookupTable_t = std::unordered_map<maths::Transform, maths::Transform*, TransformHash>;
 public:
 	maths::Transform const &Lookup(maths::Transform const &_t);
 private:
@@ -3,7 +3,11 @@
 #define __YS_TRANSLATION_STATE_HPP__
 
 #include <functional>
+#include <map>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "api/param_set.h"
 #include "api/render_context.h"
@@ -14,7 +18,10 @@
 #include "maths/maths.h"
 
 namespace raytracer {
+class MeshInstances;
+class Primitive;
 class Shape;
+class TriangleMeshData;
 } // namespace api
 
 
@@ -37,6 +44,7 @@ public:
 	void	ScopeEnd();
 	void	Workdir(std::string const &_path);
 	void	Output(std::string const &_file);
+	void	CacheDir(std::string const &_path);
 	void	ObjectId(std::string const &_object_id);
 	void	Film();
 	void	Camera();
@@ -44,6 +52,11 @@ public:
 	void	Light(std::string const &_type);
 	void	Sampler(std::string const &_type);
 	void	Integrator(std::string const &_type);
+	// Shapes and instances up to the end of the next scope belong to the group, in its own
+	// space. A group has to be defined before it is instanced.
+	void	GroupBegin(std::string const &_name);
+	// Places the group in the current group or in the scene, with the current transform
+	void	Instance(std::string const &_group_name);
 	void	Identity();
 	void	Translate(maths::Vec3f const &_t);
 	void	Rotate(maths::Decimal _angle, maths::Vec3f const &_axis);
@@ -52,8 +65,33 @@ public:
 public:
 	api::RenderContext	&render_context() { return render_context_; }
 	std::string output_path() const;
+private:
+	struct InstanceDesc_
+	{
+		std::string			parent;		// empty at the scene level
+		std::string			group;
+		maths::Transform	transform;
+	};
+	using InstanceDescContainer_t = std::vector<InstanceDesc_ const*>;
+	struct GroupAccelerator_
+	{
+		raytracer::Primitive const		*bvh;
+		raytracer::MeshInstances const	*instances;
+	};
+	using GroupAcceleratorTable_t = std::unordered_map<std::string, GroupAccelerator_>;
+	using InstancedMeshKey_t = std::pair<raytracer::TriangleMeshData const*, bool>;
+	// Primitive over the InstancedMesh shared by the records of a mesh
+	using InstancedMeshTable_t = std::map<InstancedMeshKey_t, raytracer::Primitive const*>;
 private:
 	void	SceneSetup_();
+	// Primitives of the scene or of a group. Shared meshes and group instances become records
+	// of a single MeshInstances, pushed last and returned.
+	raytracer::MeshInstances		*BuildInstanceLevel_(
+		ResourceContext::ObjectDescriptorContainer_t const &_shape_descs,
+		InstanceDescContainer_t const &_instance_descs,
+		GroupAcceleratorTable_t const &_groups,
+		InstancedMeshTable_t &io_meshes,
+		RenderContext::PrimitiveContainer_t &o_primitives);
 	void	PushObjectDesc_(ResourceContext::ObjectType const _type,
 							std::string const &_subtype_id);
 private:
@@ -66,6 +104,11 @@ private:
 	TransformStack_t		transform_stack_;
 	std::string				cached_object_id_;
 	ParamSet				*parameters_;
+
+	std::string					current_group_;
+	uint32_t					group_scope_depth_;
+	std::vector<std::string>	group_names_;		// in definition order
+	std::vector<InstanceDesc_>	instance_descs_;
 public:
 	void	ResetResourceCounters();
 private:
@@ -4,6 +4,7 @@
 
 //#define YS_DECIMAL_IS_DOUBLE
 //#define YS_NO_LOGS
+//#define YS_BVH_TRAVERSAL_STATS
 //#define QUADRATIC_RUNNING_ERROR_ON_DISCRIMINANT
 
 
@@ -0,0 +1,40 @@
+#pragma once
+#ifndef __YS_HASH_HPP__
+#define __YS_HASH_HPP__
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+
+namespace core {
+
+// 64 bit FNV-1a. Not collision resistant, used to key and validate cache files.
+constexpr uint64_t kHashSeed = 0xcbf29ce484222325ull;
+
+uint64_t HashBytes(void const *const _data, size_t const _size, uint64_t const _hash = kHashSeed);
+template <typename T>
+uint64_t HashValue(T const &_value, uint64_t const _hash = kHashSeed);
+// Hashes the content of a file, returns false when it could not be read.
+bool HashFile(std::string const &_path, uint64_t &_hash);
+
+
+} // namespace core
+
+
+namespace core {
+
+
+template <typename T>
+uint64_t
+HashValue(T const &_value, uint64_t const _hash)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Only raw bytes are hashed");
+	return HashBytes(&_value, sizeof(T), _hash);
+}
+
+
+} // namespace core
+
+
+#endif // __YS_HASH_HPP__
@@ -84,6 +84,8 @@ private:
 	};
 public:
 	explicit RNG(uint64_t _seed);
+	// Selects one of the 2^63 independent sequences, as pcg's set_stream does.
+	RNG(uint64_t _seed, uint64_t _stream);
 	uint32_t Get32b();
 	uint32_t Get32b(uint32_t _max);
 	uint64_t Get64b();
@@ -100,10 +102,12 @@ private:
 	template <> float GetFloat() { return GetSingle(); }
 	template <> double GetFloat() { return GetDouble(); }
 	static uint32_t __InvXorshift_(uint32_t _output, Bitcount_t _bitcount, Bitcount_t _shift);
+	void Seed_(uint64_t _seed);
 	uint32_t GeneratorValue_();
 	uint32_t ExtensionValue_();
 	void AdvanceExtension_();
 private:
+	uint64_t			increment_;
 	uint64_t			state_;
 	ExtensionArray_t	extension_;
 };
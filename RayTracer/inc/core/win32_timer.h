@@ -37,8 +37,10 @@ public:
 	{
 		total_time_ += _other.total_time_;
 		best_time_ = maths::Min(best_time_, _other.best_time_);
+		worst_time_ = maths::Max(worst_time_, _other.worst_time_);
 		total_cycles_ += _other.total_cycles_;
 		best_cycles_ = maths::Min(best_cycles_, _other.best_cycles_);
+		worst_cycles_ = maths::Max(worst_cycles_, _other.worst_cycles_);
 		call_count_ += _other.call_count_;
 	}
 
@@ -64,6 +64,11 @@ Bounds<T, n> Expand(Bounds<T, n> const &_v, T _delta);
 using Bounds2f = Bounds<maths::Decimal, 2>;
 using Bounds3f = Bounds<maths::Decimal, 3>;
 using Bounds4f = Bounds<maths::Decimal, 4>;
+// Single precision bounds, whatever Decimal is, for structures that store many of them.
+// Conversions from Bounds3f round outwards, the result still contains the source bounds.
+using Bounds3s = Bounds<float, 3>;
+Bounds3s	ToSingleBounds(Bounds3f const &_bounds);
+Bounds3f	ToDecimalBounds(Bounds3s const &_bounds);
 
 
 } // namespace maths
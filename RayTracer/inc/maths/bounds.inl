@@ -177,6 +177,37 @@ Expand(Bounds<T, n> const &_v, T _delta)
 	return Bounds<T, n>{_v.min - Vector<T, n>(_delta), _v.max + Vector<T, n>(_delta)};
 }
 
+inline Bounds3s
+ToSingleBounds(Bounds3f const &_bounds)
+{
+#ifdef YS_DECIMAL_IS_DOUBLE
+	Bounds3s result{};
+	for (uint32_t i = 0; i < 3; ++i)
+	{
+		result.min[i] = RoundDownToFloat(_bounds.min[i]);
+		result.max[i] = RoundUpToFloat(_bounds.max[i]);
+	}
+	return result;
+#else
+	return _bounds;
+#endif // YS_DECIMAL_IS_DOUBLE
+}
+inline Bounds3f
+ToDecimalBounds(Bounds3s const &_bounds)
+{
+#ifdef YS_DECIMAL_IS_DOUBLE
+	Bounds3f result{};
+	for (uint32_t i = 0; i < 3; ++i)
+	{
+		result.min[i] = _bounds.min[i];
+		result.max[i] = _bounds.max[i];
+	}
+	return result;
+#else
+	return _bounds;
+#endif // YS_DECIMAL_IS_DOUBLE
+}
+
 } // namespace maths
 
 
@@ -113,8 +113,16 @@ double	NextDecimalUp(double _v, uint64_t _delta = 1);
 double	NextDecimalDown(double _v, uint64_t _delta = 1);
 float	NextDecimalUp(float _v, uint32_t _delta = 1);
 float	NextDecimalDown(float _v, uint32_t _delta = 1);
+// Single precision value closest to _v on the given side, for data stored in float whatever
+// Decimal is. Values past the float range become the largest float or an infinity.
+float	RoundDownToFloat(double _v);
+float	RoundUpToFloat(double _v);
+inline float	RoundDownToFloat(float _v) { return _v; }
+inline float	RoundUpToFloat(float _v) { return _v; }
 
 bool	Quadratic(Decimal _a, Decimal _b, Decimal _c, Decimal &_t0, Decimal &_t1);
+// Interleaves the 10 low bits of each coordinate, bit i of the code comes from axis i % 3
+uint32_t	EncodeMorton3(uint32_t _x, uint32_t _y, uint32_t _z);
 } // namespace maths
 
 constexpr maths::Decimal operator "" _d(long double _v) { return maths::Decimal(_v); }
@@ -7,15 +7,32 @@
 #include "maths/bounds.h"
 #include "maths/redecimal.h"
 
+#ifndef YS_DECIMAL_IS_DOUBLE
+#include <emmintrin.h>
+#endif // !YS_DECIMAL_IS_DOUBLE
+
 
 namespace maths {
 
 
 struct Ray
 {
+	// Permutation and shear of the watertight triangle test (PBR 3.6.2), which bring the ray
+	// direction to +z. kz is the dominant axis of the direction. Read by
+	// Triangle::IntersectFaceWatertight and by the mesh leaves, which permute whole coordinate
+	// arrays with it.
+	struct Shear
+	{
+		uint32_t	kx, ky, kz;
+		Decimal		sx, sy, sz;
+	};
+
 	explicit Ray() = default;
 	Ray(Point3f _o, Vec3f _d, Decimal _tMax, Decimal _time) :
-		origin{ _o }, direction{ _d }, tMax{ _tMax }, time{ _time }
+		origin{ _o }, direction{ _d }, tMax{ _tMax }, time{ _time },
+		inverse_direction{ 1._d / _d.x, 1._d / _d.y, 1._d / _d.z },
+		is_negative{ inverse_direction.x < 0._d, inverse_direction.y < 0._d, inverse_direction.z < 0._d },
+		shear{ ComputeShear_(_d) }
 	{}
 	inline Point3f operator()(Decimal _t) const { return origin + direction * _t; }
 	inline bool HasNaNs() const { return 
@@ -25,6 +42,11 @@ struct Ray
 	Vec3f			direction;
 	mutable Decimal	tMax;
 	Decimal			time;
+	// Computed once from the direction by the constructor and reused by every bounds and triangle
+	// test of the traversal. Rays are never redirected, a new ray is built instead.
+	Vec3f			inverse_direction;
+	Vector<int, 3>	is_negative;		// used as indices in Bounds
+	Shear			shear;
 
 	template <typename T>
 	bool DoesIntersect(Bounds<T, 3> const &_bounds, Decimal &_hit0, Decimal &_hit1) const
@@ -38,9 +60,8 @@ struct Ray
 		Decimal t0{ 0._d }, t1{ tMax };
 		for (int i = 0; i < 3; ++i)
 		{
-			Decimal	const inv_dir = 1._d / direction[i];
-			Decimal	tNear = (_bounds.min[i] - origin[i]) * inv_dir;
-			Decimal tFar = (_bounds.max[i] - origin[i]) * inv_dir;
+			Decimal	tNear = (_bounds.min[i] - origin[i]) * inverse_direction[i];
+			Decimal tFar = (_bounds.max[i] - origin[i]) * inverse_direction[i];
 			if (tNear > tFar) std::swap(tNear, tFar);
 			tFar *= 1._d + 2._d * gamma(3u);
 			t0 = maths::Max(t0, tNear);
@@ -50,52 +71,74 @@ struct Ray
 		_hit0 = t0; _hit1 = t1;
 		return true;
 	}
-	template <typename T>
-	bool DoesIntersect(Bounds<T, 3> const &_bounds) const
+
+	// Slab test of BVH traversal (PBR 4.3.2), the three axes are tested at once with SSE.
+	// Far distances are pushed back to account for rounding errors, and the min/max operand order
+	// discards the NaNs coming from 0 * inf when the origin lies on a slab of a parallel ray.
+	bool DoesIntersect(Bounds3f const &_bounds) const
 	{
-		Decimal t0{ 0._d }, t1{ tMax };
+		Decimal const error_bound_factor = 1._d + 2._d * gamma(3u);
+#ifndef YS_DECIMAL_IS_DOUBLE
+		static_assert(sizeof(Bounds3f) == 6u * sizeof(Decimal) &&
+					  sizeof(Vec3f) == 3u * sizeof(Decimal), "Unexpected padding in maths types");
+		// Unaligned loads of three values and the next one, which is ignored. The second bounds
+		// load starts at min.z to stay inside the bounds. The fourth ray lane is cleared, the
+		// member behind it could be a denormal and slow every operation down.
+		__m128 const	xyz_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+		Decimal const *const	bounds = &_bounds.min.x;
+		__m128 const	bounds_min = _mm_loadu_ps(bounds);
+		__m128 const	bounds_high = _mm_loadu_ps(bounds + 2);
+		__m128 const	bounds_max = _mm_shuffle_ps(bounds_high, bounds_high, _MM_SHUFFLE(3, 3, 2, 1));
+		__m128 const	ray_origin = _mm_and_ps(_mm_loadu_ps(&origin.x), xyz_mask);
+		__m128 const	ray_inverse_direction = _mm_and_ps(_mm_loadu_ps(&inverse_direction.x), xyz_mask);
+		__m128 const	negative_mask = _mm_cmplt_ps(ray_inverse_direction, _mm_setzero_ps());
+		__m128 const	near_plane = _mm_or_ps(_mm_and_ps(negative_mask, bounds_max),
+											   _mm_andnot_ps(negative_mask, bounds_min));
+		__m128 const	far_plane = _mm_or_ps(_mm_and_ps(negative_mask, bounds_min),
+											  _mm_andnot_ps(negative_mask, bounds_max));
+		__m128 const	t_near = _mm_mul_ps(_mm_sub_ps(near_plane, ray_origin), ray_inverse_direction);
+		__m128 const	t_far = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far_plane, ray_origin),
+													  ray_inverse_direction),
+										   _mm_set1_ps(error_bound_factor));
+		__m128			t_min = _mm_max_ss(t_near, _mm_setzero_ps());
+		t_min = _mm_max_ss(_mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(1, 1, 1, 1)), t_min);
+		t_min = _mm_max_ss(_mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(2, 2, 2, 2)), t_min);
+		__m128			t_max = _mm_min_ss(t_far, _mm_set_ss(tMax));
+		t_max = _mm_min_ss(_mm_shuffle_ps(t_far, t_far, _MM_SHUFFLE(1, 1, 1, 1)), t_max);
+		t_max = _mm_min_ss(_mm_shuffle_ps(t_far, t_far, _MM_SHUFFLE(2, 2, 2, 2)), t_max);
+		return (_mm_movemask_ps(_mm_cmple_ss(t_min, t_max)) & 1) != 0;
+#else
+		Decimal t_min = 0._d, t_max = tMax;
 		for (int i = 0; i < 3; ++i)
 		{
-			Decimal	const inv_dir = 1._d / direction[i];
-			Decimal	tNear = (_bounds.min[i] - origin[i]) * inv_dir;
-			Decimal tFar = (_bounds.max[i] - origin[i]) * inv_dir;
-			if (tNear > tFar) std::swap(tNear, tFar);
-			tFar *= 1._d + 2._d * gamma(3u);
-			t0 = maths::Max(t0, tNear);
-			t1 = maths::Min(t1, tFar);
-			if (t0 > t1) return false;
+			Decimal const t_near = (_bounds[is_negative[i]][i] - origin[i]) * inverse_direction[i];
+			Decimal const t_far = (_bounds[1 - is_negative[i]][i] - origin[i]) * inverse_direction[i]
+				* error_bound_factor;
+			t_min = (t_near > t_min) ? t_near : t_min;
+			t_max = (t_far < t_max) ? t_far : t_max;
 		}
-		return true;
+		return t_min <= t_max;
+#endif // !YS_DECIMAL_IS_DOUBLE
 	}
-
-	// NOTE: pbrt book provides an optimized IntersectP function for BVH tree traversal (page 128).
-	//		 It will surely be useful later.
-	// Thanks, past self, you're the best.
-	template <typename T>
-	bool DoesIntersect(Bounds<T, 3> const &_bounds, Vec3f const &_direction_inverse,
-					   Vector<int, 3> const &_is_negative) const
+#ifdef YS_DECIMAL_IS_DOUBLE
+	// Single precision bounds are widened back to double, exactly, the test itself stays in
+	// double precision.
+	bool DoesIntersect(Bounds3s const &_bounds) const
 	{
-		Decimal const error_bound_factor = 1._d + 2._d * gamma(3u);
-		Decimal t_min = (_bounds[_is_negative.x].x - origin.x) * _direction_inverse.x;
-		Decimal t_max = (_bounds[1 - _is_negative.x].x - origin.x) * _direction_inverse.x
-			* error_bound_factor;
-		Decimal const y_min = (_bounds[_is_negative.y].y - origin.y) * _direction_inverse.y;
-		Decimal const y_max = (_bounds[1 - _is_negative.y].y - origin.y) * _direction_inverse.y
-			* error_bound_factor;
-		if (t_min > y_max || y_min > t_max)
-			return false;
-		t_min = Max(y_min, t_min);
-		t_max = Min(y_max, t_max);
-
-		Decimal const z_min = (_bounds[_is_negative.z].z - origin.z) * _direction_inverse.z;
-		Decimal const z_max = (_bounds[1 - _is_negative.z].z - origin.z) * _direction_inverse.z
-			* error_bound_factor;
-		if (t_min > z_max || z_min > t_max)
-			return false;
-		t_min = Max(z_min, t_min);
-		t_max = Min(z_max, t_max);
-
-		return (t_min < tMax) && (t_max > 0);// && (t_min <= t_max);
+		return DoesIntersect(ToDecimalBounds(_bounds));
+	}
+#endif // YS_DECIMAL_IS_DOUBLE
+private:
+	static Shear ComputeShear_(Vec3f const &_direction)
+	{
+		Shear shear;
+		shear.kz = MaximumDimension(Abs(_direction));
+		shear.kx = shear.kz + 1u == 3u ? 0u : shear.kz + 1u;
+		shear.ky = shear.kx + 1u == 3u ? 0u : shear.kx + 1u;
+		shear.sx = -_direction[shear.kx] / _direction[shear.kz];
+		shear.sy = -_direction[shear.ky] / _direction[shear.kz];
+		shear.sz = 1._d / _direction[shear.kz];
+		return shear;
 	}
 };
 
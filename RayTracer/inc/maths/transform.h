@@ -85,20 +85,41 @@ Transform Rotate(Decimal _theta, Vec3f const &_axis);
 Transform LookAt(Vec3f const &_position, Vec3f const &_target, Vec3f const &_up);
 
 
+// Interpolates between two transforms over [start_time, end_time], outside of it the closest
+// end transform is used. Both transforms are decomposed as Translation * Rotation * Scale, the
+// rotation is interpolated along the shortest arc and the other terms linearly.
 class AnimatedTransform final
 {
 public:
-	template <typename T> constexpr Point<T, 3> operator()(Decimal _t, Point<T, 3> const &_v) const;
-	template <typename T> constexpr Vector<T, 3> operator()(Decimal _t, Vector<T, 3> const &_v) const;
-	template <typename T> constexpr Vector<T, 4> operator()(Decimal _t, Vector<T, 4> const &_v) const;
-	template <typename T> constexpr Normal<T, 3> operator()(Decimal _t, Normal<T, 3> const &_v) const;
-	template <typename T> constexpr Bounds<T, 3> operator()(Decimal _t, Bounds<T, 3> const &_v) const;
+	AnimatedTransform(Transform const &_start_transform, Decimal _start_time,
+					  Transform const &_end_transform, Decimal _end_time);
+
+	Transform Interpolate(Decimal _t) const;
+	bool IsAnimated() const { return animated_; }
+
+	template <typename T> Point<T, 3> operator()(Decimal _t, Point<T, 3> const &_v) const;
+	template <typename T> Vector<T, 3> operator()(Decimal _t, Vector<T, 3> const &_v) const;
+	template <typename T> Vector<T, 4> operator()(Decimal _t, Vector<T, 4> const &_v) const;
+	template <typename T> Normal<T, 3> operator()(Decimal _t, Normal<T, 3> const &_v) const;
+	template <typename T> Bounds<T, 3> operator()(Decimal _t, Bounds<T, 3> const &_v) const;
 	inline Ray operator()(Ray const &_v) const;
 
+	Transform const &start_transform() const { return start_transform_; }
+	Transform const &end_transform() const { return end_transform_; }
+	Decimal start_time() const { return start_time_; }
+	Decimal end_time() const { return end_time_; }
+
 private:
-	struct DerivativeTerm
-	{
-	};
+	// Rotations are stored as quaternions (v.x, v.y, v.z, w), quaternion.h depends on this file.
+	static void Decompose_(Mat4x4f const &_m,
+						   Vec3f &_translation, Vec4f &_rotation, Mat4x4f &_scale);
+private:
+	Transform	start_transform_, end_transform_;
+	Decimal		start_time_, end_time_;
+	bool		animated_;
+	Vec3f		translations_[2];
+	Vec4f		rotations_[2];
+	Mat4x4f		scales_[2];
 };
 } // namespace maths
 
@@ -322,6 +343,43 @@ Scale(Decimal _x, Decimal _y, Decimal _z)
 	};
 }
 
+
+template <typename T>
+Point<T, 3>
+AnimatedTransform::operator()(Decimal _t, Point<T, 3> const &_v) const
+{
+	return animated_ ? Interpolate(_t)(_v) : start_transform_(_v);
+}
+template <typename T>
+Vector<T, 3>
+AnimatedTransform::operator()(Decimal _t, Vector<T, 3> const &_v) const
+{
+	return animated_ ? Interpolate(_t)(_v) : start_transform_(_v);
+}
+template <typename T>
+Vector<T, 4>
+AnimatedTransform::operator()(Decimal _t, Vector<T, 4> const &_v) const
+{
+	return animated_ ? Interpolate(_t)(_v) : start_transform_(_v);
+}
+template <typename T>
+Normal<T, 3>
+AnimatedTransform::operator()(Decimal _t, Normal<T, 3> const &_v) const
+{
+	return animated_ ? Interpolate(_t)(_v) : start_transform_(_v);
+}
+template <typename T>
+Bounds<T, 3>
+AnimatedTransform::operator()(Decimal _t, Bounds<T, 3> const &_v) const
+{
+	return animated_ ? Interpolate(_t)(_v) : start_transform_(_v);
+}
+inline Ray
+AnimatedTransform::operator()(Ray const &_v) const
+{
+	return animated_ ? Interpolate(_v.time)(_v) : start_transform_(_v);
+}
+
 } // namespace maths
 
 
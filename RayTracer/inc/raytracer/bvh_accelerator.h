@@ -2,6 +2,11 @@
 #ifndef __YS_BVH_ACCELERATOR_HPP__
 #define __YS_BVH_ACCELERATOR_HPP__
 
+#include <array>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "core/memory_region.h"
@@ -25,42 +30,398 @@ class BvhAccelerator
 
 public:
 	using PrimitiveArray_t = std::vector<Primitive const*>;
+	// Supported values for node_width, wide nodes are collapsed from the binary tree
+	static constexpr uint32_t kBinaryNodeWidth = 2u;
+	static constexpr uint32_t kBvh4NodeWidth = 4u;
+	static constexpr uint32_t kBvh8NodeWidth = 8u;
+	// Binned SAH gives the best trees. The linear builder sorts primitives along a Morton curve,
+	// builds a treelet per cell of a coarse grid and joins the treelets with SAH. It builds
+	// several times faster, for meshes rebuilt often such as in interactive mode.
+	// The spatial builder is the SAH builder extended with spatial splits, which cut primitives
+	// overlapping a split plane into a reference on each side. It gives tighter nodes around
+	// large or thin primitives, duplicates being capped by the duplication budget.
+	enum BuildMethod { kSahBuild = 0, kLinearBuild, kSpatialSahBuild };
+	// At most this fraction of the primitive count is added as duplicate references
+	static constexpr float kDefaultDuplicationBudget = .3f;
+	// Update rebuilds the subtrees whose cost grew by more than this factor since the last build
+	static constexpr double kDefaultRebuildThreshold = 1.5;
+	// Quantized nodes store leaf sizes on 8 bits
+	static constexpr uint32_t kMaxQuantizedLeafSize = 255u;
 
 	BvhAccelerator();
+	// Quantized nodes store 8 bit child bounds relative to their own bounds, they are only
+	// available for wide nodes and leaves of at most kMaxQuantizedLeafSize primitives.
+	// When _cache_file is set, nodes and primitive order are loaded from it if it was written
+	// with the same parameters and primitive count. Otherwise the BVH is built and saved to it.
+	// The caller is in charge of naming cache files after the primitives they were built from.
 	BvhAccelerator(PrimitiveArray_t const &_primitives,
-				   uint32_t _node_max_size);
+				   uint32_t _node_max_size,
+				   uint32_t _node_width = kBinaryNodeWidth,
+				   bool _quantized_nodes = false,
+				   BuildMethod _build_method = kSahBuild,
+				   float _duplication_budget = kDefaultDuplicationBudget,
+				   std::string const &_cache_file = "");
+	// Primitives only known by their bounds, such as the faces of a mesh. They don't need an
+	// object each, leaves are intersected by the owner through a LeafIntersector.
+	class PrimitiveSource
+	{
+	public:
+		virtual ~PrimitiveSource() = default;
+		virtual uint32_t		primitive_count() const = 0;
+		virtual maths::Bounds3f	PrimitiveBounds(uint32_t _primitive_index) const = 0;
+		// See Primitive::ClippedWorldBounds
+		virtual maths::Bounds3f	ClippedPrimitiveBounds(uint32_t _primitive_index,
+													   maths::Bounds3f const &_clip) const = 0;
+	};
+	// _source must outlive the BVH, refits and updates read the bounds from it again.
+	// Intersect and DoesIntersect without a LeafIntersector aren't available on such a BVH.
+	BvhAccelerator(PrimitiveSource const &_source,
+				   uint32_t _node_max_size,
+				   uint32_t _node_width = kBinaryNodeWidth,
+				   bool _quantized_nodes = false,
+				   BuildMethod _build_method = kSahBuild,
+				   float _duplication_budget = kDefaultDuplicationBudget,
+				   std::string const &_cache_file = "");
 	// TODO: implement proper copy assignment and ctor (at least for empty bvhs)
 	BvhAccelerator(BvhAccelerator const &_other) = delete;
 	BvhAccelerator &operator=(BvhAccelerator const &_other) = delete;
 	~BvhAccelerator();
 
+	bool	Intersect(maths::Ray &_ray, HitRecord &_hit) const override;
+	bool	DoesIntersect(maths::Ray const &_ray) const override;
+	// Binary BVHs traverse the packet as a whole, the nodes being tested against all of its
+	// rays at once. Subtrees reached by kPacketFallbackRayCount rays or less are finished one
+	// ray at a time, as are wide BVHs.
+	uint32_t	IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const override;
 
-	BvhNode		*BuildRecursive(core::MemoryRegion &_region,
-								std::vector<BvhPrimitiveDesc> &_primitive_desc,
-								uint32_t _first, uint32_t _end, int &_node_count,
-								PrimitiveArray_t &_ordered_primitives);
+	// Intersects leaves from data laid out in the reference order of the BVH, in place of the
+	// primitives' own routines. Hits closer than _ray.tMax shorten it and overwrite _hit, with
+	// the hit reference as index.
+	class LeafIntersector
+	{
+	public:
+		virtual ~LeafIntersector() = default;
+		virtual bool	IntersectLeaf(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+									  HitRecord &_hit) const = 0;
+		virtual bool	DoesIntersectLeaf(maths::Ray const &_ray, uint32_t _first,
+										  uint32_t _count) const = 0;
+	};
+	bool	Intersect(maths::Ray &_ray, LeafIntersector const &_leaf_intersector,
+					  HitRecord &_hit) const;
+	bool	DoesIntersect(maths::Ray const &_ray, LeafIntersector const &_leaf_intersector) const;
+	uint32_t	IntersectPacket(RayPacket &_packet, LeafIntersector const &_leaf_intersector,
+								uint32_t _ray_mask) const;
+	static constexpr uint32_t	kPacketFallbackRayCount = 1u;
 
-	bool	Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const override;
-	bool	DoesIntersect(maths::Ray const &_ray) const override;
+	// Binary trees are limited to this many levels when they are built, deeper subtrees being
+	// rebalanced. Traversal stacks are sized after it and can't overflow.
+	static constexpr uint32_t	kMaxTraversalDepth = 64u;
+	// Binary BVHs can instead be traversed with a short stack of kShortStackSize entries. When
+	// it runs out, the traversal restarts from the root and follows its restart trail, one bit
+	// per level telling whether the last child to visit at that level was reached (Laine 2010).
+	// Packets use it for the rays they finish alone, wide BVHs keep their full stack.
+	static constexpr uint32_t	kShortStackSize = 4u;
+	void		SetShortStackTraversal(bool _enabled) { short_stack_traversal_ = _enabled; }
+	bool		short_stack_traversal() const { return short_stack_traversal_; }
+
+	// Order of the nodes in memory. The build emits them depth first, each left child right
+	// after its parent. Treelet layouts cluster them into treelets that fill kLayoutBlockSize
+	// blocks, grown from their root by decreasing surface area, so that the next nodes a ray
+	// visits are more often on a page it already touched. Child treelets follow their parent
+	// depth first. The hot layout also keeps the top kHotTreeletSize bytes of the tree in a
+	// single treelet at the start of the nodes.
+	enum NodeLayout { kDepthFirstLayout = 0, kTreeletLayout, kHotTreeletLayout };
+	static constexpr size_t	kLayoutBlockSize = 4096u;
+	static constexpr size_t	kHotTreeletSize = 64u * 1024u;
+	// Reorders the nodes in place. Cache files always hold the depth first layout, rebuilds
+	// from Update keep the layout.
+	void		SetNodeLayout(NodeLayout _layout);
+	NodeLayout	node_layout() const { return node_layout_; }
 
 	maths::Bounds3f	WorldBounds() const override;
 
+	// For primitives that moved since the build, such as animated meshes.
+	// Refit recomputes the node bounds bottom-up and keeps the topology. The tree stays valid
+	// but its quality drops as primitives drift away from the positions it was built for.
+	// Spatial split references are refitted to the whole bounds of their primitive, the first
+	// update of a spatial BVH may rebuild the subtrees that depended on clipped references.
+	void		Refit();
+	// Refits, then rebuilds with SAH the subtrees whose cost relative to their surface area
+	// grew by more than _rebuild_threshold times since the last build, and by more than their
+	// children. Returns the number of subtrees rebuilt, sah_cost() is updated.
+	uint32_t	Update(double _rebuild_threshold = kDefaultRebuildThreshold);
+
+	uint32_t	node_width() const { return node_width_; }
+	bool		quantized_nodes() const { return quantized_nodes_; }
+	size_t		node_memory_size() const { return node_memory_size_; }
+	BuildMethod	build_method() const { return build_method_; }
+	// Time spent building or loading the BVH
+	double		build_milliseconds() const { return build_milliseconds_; }
+	// Expected cost of a ray going through the BVH, relative to a single primitive intersection.
+	// Lower is better, it measures the tree quality independently of the node format.
+	double		sah_cost() const { return sah_cost_; }
+	// Leaves reference primitives, spatial splits may reference a primitive from several leaves
+	size_t		reference_count() const { return primitive_indices_.size(); }
+	// Index in the source primitive array of the primitive behind each reference
+	std::vector<uint32_t> const	&reference_primitive_indices() const { return primitive_indices_; }
+
+	// Shape of the tree as it is laid out in memory, computed from the nodes so that it also
+	// describes loaded, refitted and updated trees. A wide node counts as a single node, its
+	// leaves are the lanes that reference primitives. The root is at depth 0.
+	struct Statistics
+	{
+		uint64_t				bvh_count = 0u;			// 1, or the number of BVHs added
+		uint64_t				node_count = 0u;
+		uint64_t				inner_node_count = 0u;
+		uint64_t				leaf_count = 0u;
+		uint64_t				reference_count = 0u;
+		uint32_t				max_depth = 0u;
+		double					sah_cost = 0.;
+		size_t					node_memory_size = 0u;
+		size_t					reference_memory_size = 0u;
+		// Size of binary unquantized nodes over the same leaves, the format to compare with
+		size_t					binary_node_memory_size = 0u;
+		std::vector<uint64_t>	leaf_size_histogram{};	// leaf count by reference count
+		std::vector<uint64_t>	depth_histogram{};		// leaf count by depth
+		// Sums the statistics of several BVHs, max_depth is the deepest of them. sah_cost
+		// becomes the sum of their costs, divide it by bvh_count for the mean.
+		void	Add(Statistics const &_other);
+	};
+	Statistics	ComputeStatistics() const;
+
+	// Per thread traversal counters, only maintained when YS_BVH_TRAVERSAL_STATS is defined.
+	// A ray going through the scene BVH then a mesh BVH counts as a traversal of each, rays
+	// are the traversals that are not started from the leaves of another one.
+	struct TraversalCounters
+	{
+		uint64_t	traversal_count = 0u;
+		uint64_t	node_visit_count = 0u;
+		uint64_t	primitive_test_count = 0u;		// leaf references tested, per ray
+		uint64_t	hit_count = 0u;
+		uint64_t	ray_count = 0u;
+		uint64_t	ray_hit_count = 0u;
+		void	Add(TraversalCounters const &_other);
+	};
+	static TraversalCounters const	&thread_traversal_counters();
+	// Adds the counters of the calling thread to the aggregate and resets them, see
+	// Profiler::GrabTimers
+	static void						GrabTraversalCounters();
+	// Returns the aggregate and resets it
+	static TraversalCounters		TakeTraversalCounters();
+
 private:
+	struct BuildContext;
+	struct RangeBounds;
+	struct SahBucketDesc;
+	struct CacheHeader;
+	struct NodeStorage;
+	using SahBucketArray_t = std::array<SahBucketDesc, 12>;
+
+	// Cost of a node visit relative to a primitive intersection
+	static constexpr maths::Decimal	kSahTraversalCost = .125_d;
+	// Nodes holding more primitives than this build their two subtrees concurrently
+	static constexpr uint32_t	kParallelBuildThreshold = 128u * 1024u;
+	static constexpr size_t		kNodeRegionBlockSize = 1024u * 1024u;
+
+	// Builds the BVH or loads it from _cache_file, shared by the constructors
+	void		BuildOrLoad_(std::string const &_cache_file);
+	// Returns the index in the source array of each primitive referenced by the leaves
+	std::vector<uint32_t>	Build_();
+	// Bounds of the primitive at _primitive_index in the source array
+	maths::Bounds3f	PrimitiveBounds_(uint32_t _primitive_index) const;
+	maths::Bounds3f	ClippedPrimitiveBounds_(uint32_t _primitive_index,
+											maths::Bounds3f const &_clip) const;
+	bool		ReadCache_(std::string const &_cache_file);
+	void		WriteCache_(std::string const &_cache_file,
+							uint32_t _primitive_count,
+							std::vector<uint32_t> const &_primitive_order) const;
+	NodeStorage	node_storage_() const;
+	NodeStorage	AllocateNodeStorage_(size_t _node_count);
+	void		ReleaseNodeStorage_();
+
+	// Nodes are allocated from _region, the primitive descs are partitioned in place and
+	// leaves index their range in _primitive_desc.
+	BvhNode		*BuildRecursive_(BuildContext &_context,
+								 core::MemoryRegion &_region,
+								 std::vector<BvhPrimitiveDesc> &_primitive_desc,
+								 uint32_t _first, uint32_t _last);
 	void		BuildLeafNode_(BvhNode *_node,
 							   maths::Bounds3f const &_bounds,
-							   std::vector<BvhPrimitiveDesc> &_primitive_desc,
-							   PrimitiveArray_t &_ordered_primitives,
-							   uint32_t _first, uint32_t _last, uint32_t _primitive_count) const;
+							   uint32_t _first, uint32_t _last) const;
+	// Returns the last bucket below the split, _lowest_cost is relative to a leaf primitive
+	static uint32_t	LowestCostSplit_(SahBucketArray_t const &_buckets,
+									 maths::Bounds3f const &_bounds,
+									 maths::Decimal &_lowest_cost);
+	static double	SahCostRecursive_(BvhNode const &_node);
+
+	struct MortonPrimitive;
+	using MortonArray_t = std::vector<MortonPrimitive>;
+	// Morton codes interleave kMortonBitsPerAxis bits of each centroid coordinate. Treelets
+	// gather the primitives sharing the kTreeletBits high bits of their code.
+	static constexpr uint32_t	kMortonBitsPerAxis = 10u;
+	static constexpr uint32_t	kMortonBitCount = 3u * kMortonBitsPerAxis;
+	static constexpr uint32_t	kTreeletBits = 12u;
+	// Spatial builds allocate a reference array per node, leaves move their references to
+	// leaf_references and index their range of it.
+	struct SpatialBuildState
+	{
+		std::vector<BvhPrimitiveDesc>	leaf_references;
+		uint32_t						remaining_duplicates;
+		maths::Decimal					min_overlap_area;
+	};
+	struct SpatialSplit;
+	static constexpr uint32_t	kSpatialBinCount = 16u;
+	// Spatial splits are only searched for when the children of the object split overlap over
+	// more than this fraction of the root surface area
+	static constexpr maths::Decimal	kSpatialSplitOverlapRatio = 1e-5_d;
+	BvhNode		*BuildSpatialRecursive_(BuildContext &_context,
+										core::MemoryRegion &_region,
+										SpatialBuildState &_state,
+										std::vector<BvhPrimitiveDesc> &_references);
+	SpatialSplit	FindSpatialSplit_(std::vector<BvhPrimitiveDesc> const &_references,
+									  maths::Bounds3f const &_bounds) const;
+	// Part of the reference between _min and _max along _axis, empty bounds when there is none
+	BvhPrimitiveDesc	ClipReference_(BvhPrimitiveDesc const &_reference, uint32_t _axis,
+									   maths::Decimal _min, maths::Decimal _max) const;
+
+	// Same contract as BuildRecursive_ over the whole range
+	BvhNode		*BuildLinear_(BuildContext &_context,
+							  core::MemoryRegion &_region,
+							  std::vector<BvhPrimitiveDesc> &_primitive_desc);
+	// Splits [_first, _last) on the highest bit below _bit_count where the codes differ
+	BvhNode		*EmitLinearTreelet_(BuildContext &_context,
+									core::MemoryRegion &_region,
+									std::vector<BvhPrimitiveDesc> const &_primitive_desc,
+									MortonArray_t const &_morton_primitives,
+									uint32_t _first, uint32_t _last, uint32_t _bit_count);
+	// Joins the treelets in [_first, _last), which it reorders
+	BvhNode		*BuildUpperSah_(BuildContext &_context,
+								core::MemoryRegion &_region,
+								std::vector<BvhNode*> &_treelets,
+								uint32_t _first, uint32_t _last);
+
+	// Rebalances in place the subtrees that reach deeper than kMaxTraversalDepth levels, over
+	// their leaves in the same order. Node count and reference ranges are unchanged.
+	static void		LimitDepth_(BvhNode &_root);
+	static void		LimitDepthRecursive_(BvhNode &_node, uint32_t _depth);
+	static uint32_t	SubtreeHeight_(BvhNode const &_node);
+	static void		BalanceSubtree_(BvhNode &_node);
+	// _depth is the depth of _node, the root being at depth 0
+	uint32_t	FlattenBvhRecursive_(BvhNode const &_node, uint32_t _depth, uint32_t &_offset);
+	// Replaces the node array with one in the node format and layout of the BVH
+	void		EmitNodes_(BvhNode const &_root, uint32_t _node_count);
+	// Reorders the stored nodes after node_layout_, children always stay after their parent
+	void		ApplyNodeLayout_();
+	template <typename Node_t>
+	void		ApplyWideNodeLayout_();
+
+	// Refits and updates work on a binary view of the node array. Wide nodes are expanded by
+	// pairing their lanes in order, the view of binary nodes is exact.
+	// Subtree costs are listed in pre-order over the view, relative to the subtree area.
+	struct RefitState
+	{
+		std::vector<maths::Bounds3f>	reference_bounds;
+		std::vector<float>				subtree_costs;
+		std::vector<bool>				is_degraded;
+		std::vector<BvhPrimitiveDesc>	primitive_desc;		// allocated by the first rebuild
+		double							rebuild_threshold;
+		uint32_t						node_index;
+		uint32_t						rebuilt_count;
+	};
+	std::vector<maths::Bounds3f>	ReferenceBounds_() const;
+	void		RefitNodes_(std::vector<maths::Bounds3f> const &_reference_bounds);
+	template <typename Node_t>
+	void		RefitWideNodes_(std::vector<maths::Bounds3f> const &_reference_bounds);
+	void		RecordSubtreeCosts_();
+	// Children are stored after their parent, depths are found in a single pass over the nodes
+	void		AddBinaryStatistics_(Statistics &_statistics) const;
+	template <typename Node_t>
+	void		AddWideStatistics_(Statistics &_statistics) const;
+	// Leaf bounds are read from the nodes when _reference_bounds is null
+	BvhNode		*ExpandNodes_(BuildContext &_context, core::MemoryRegion &_region,
+							  std::vector<maths::Bounds3f> const *_reference_bounds) const;
+	BvhNode		*ExpandBinaryRecursive_(BuildContext &_context, core::MemoryRegion &_region,
+										std::vector<maths::Bounds3f> const *_reference_bounds,
+										uint32_t _node_index) const;
+	template <typename Node_t>
+	BvhNode		*ExpandWideRecursive_(BuildContext &_context, core::MemoryRegion &_region,
+									  std::vector<maths::Bounds3f> const *_reference_bounds,
+									  uint32_t _node_index) const;
+	// A subtree is degraded when its cost grew past the threshold and more than the cost of
+	// each of its children, its own nodes then being the cause. Returns the cost growth.
+	double		FindDegradedRecursive_(RefitState &_state, BvhNode const &_node) const;
+	// Rebuilds the topmost degraded subtrees
+	BvhNode		*RebuildDegradedRecursive_(BuildContext &_context, core::MemoryRegion &_region,
+										   RefitState &_state, BvhNode &_node);
+	static double	SubtreeCostsRecursive_(BvhNode const &_node, std::vector<float> &_costs);
+	// Returns the node count of the subtree, [_first, _last) is the range of its references
+	static uint32_t	SubtreeExtent_(BvhNode const &_node, uint32_t &_first, uint32_t &_last);
+
+	template <uint32_t Width> struct WideBvhNode;
+	template <uint32_t Width> struct QuantizedBvhNode;
+	template <uint32_t Width> using WideNodeArray_t = std::vector<WideBvhNode<Width>>;
+	template <uint32_t Width> using QuantizedNodeArray_t = std::vector<QuantizedBvhNode<Width>>;
+	// Each wide node on the path to the deepest one leaves at most Width - 1 children on the stack
+	static constexpr uint32_t	kWideStackSize = kMaxTraversalDepth * (kBvh8NodeWidth - 1u);
 
-	uint32_t	FlattenBvhRecursive_(BvhNode const &_node, uint32_t &_offset);
+	static bool		ValidQuantizedNodes_(bool _quantized_nodes, uint32_t _node_max_size);
+	static uint32_t	ValidNodeWidth_(uint32_t _node_width, bool _quantized_nodes);
+	template <uint32_t Width>
+	void		BuildWideNodes_(BvhNode const &_root, uint32_t _binary_node_count);
+	template <uint32_t Width>
+	uint32_t	CollapseBvhRecursive_(BvhNode const &_node, WideNodeArray_t<Width> &_nodes) const;
+	template <uint32_t Width>
+	static QuantizedBvhNode<Width>	QuantizeNode_(WideBvhNode<Width> const &_node);
+	template <uint32_t Width>
+	static void		ClearLanes_(WideBvhNode<Width> &_node);
+	// Nearest child first traversal, _intersect_leaf(first_primitive, primitive_count) returns
+	// true on hit. Any hit traversals stop at the first leaf hit.
+	template <bool AnyHit, typename LeafFunc_t>
+	bool		Traverse_(maths::Ray const &_ray, LeafFunc_t const &_intersect_leaf) const;
+	// Binary traversal of the subtree at _root_index
+	template <bool AnyHit, typename LeafFunc_t>
+	bool		TraverseBinary_(maths::Ray const &_ray, uint32_t _root_index,
+								LeafFunc_t const &_intersect_leaf) const;
+	// Short stack traversal of the subtree at _root_index, see kShortStackSize
+	template <bool AnyHit, typename LeafFunc_t>
+	bool		TraverseShortStack_(maths::Ray const &_ray, uint32_t _root_index,
+									LeafFunc_t const &_intersect_leaf) const;
+	// _intersect_leaf(first_primitive, primitive_count, ray_mask) returns the mask of the rays hit
+	template <typename LeafFunc_t>
+	uint32_t	TraversePacket_(RayPacket &_packet, uint32_t _ray_mask,
+								LeafFunc_t const &_intersect_leaf) const;
+	template <bool AnyHit, typename LeafFunc_t>
+	bool		TraverseWide_(maths::Ray const &_ray, LeafFunc_t const &_intersect_leaf) const;
+	template <typename Node_t, bool AnyHit, typename LeafFunc_t>
+	bool		TraverseWide_(maths::Ray const &_ray, LeafFunc_t const &_intersect_leaf) const;
+	template <typename Node_t> std::vector<Node_t> const &node_array_() const;
+	template <typename Node_t> std::vector<Node_t> &node_array_();
 
+	// Source order, leaves reach them through primitive_indices_. Empty when built from a
+	// PrimitiveSource.
 	PrimitiveArray_t	primitives_;
+	PrimitiveSource const	*source_;
+	uint32_t const		primitive_count_;
 	LinearBvhNode		*nodes_;
 	uint32_t const		node_max_size_;
+	bool const			quantized_nodes_;
+	uint32_t const		node_width_;
+	BuildMethod const	build_method_;
+	float const			duplication_budget_;
+	bool				short_stack_traversal_;
+	NodeLayout			node_layout_;
+	size_t				node_memory_size_;
+	double				build_milliseconds_;
+	double				sah_cost_;
+	// Subtree costs and sah_cost_ after the last build, recorded by the first refit
+	std::vector<float>	subtree_costs_;
+	double				built_sah_cost_;
+	std::vector<uint32_t>	primitive_indices_;
 
 
 	struct BvhPrimitiveDesc
 	{
+		BvhPrimitiveDesc() = default;
 		BvhPrimitiveDesc(uint32_t _primitive_index, maths::Bounds3f const &_bounds) :
 			primitive_index{ _primitive_index }, bounds{ _bounds },
 			centroid{ maths::Blend<maths::Point3f>::Do({
@@ -83,31 +444,134 @@ private:
 		uint32_t			split_axis;
 	};
 
+	// Node bounds are stored in single precision whatever maths::Decimal is, rounded outwards.
+	// Rays test them in Decimal precision, so that double builds keep their robustness with
+	// the node size of float builds.
 	struct LinearBvhNode
 	{
-		maths::Bounds3f		bounds;				// 2 * 3 * 4 || 2 * 3 * 8
-		union									// 4 || 8
+		maths::Bounds3s		bounds;				// 2 * 3 * 4
+		union									// 4
 		{
 			uint32_t	first_primitive_index;
 			uint32_t	right_child_offset;
 		};
 		uint16_t		primitive_count;		// 2
 		uint8_t			split_axis;				// 1
-#ifdef YS_DECIMAL_IS_DOUBLE						// 2 * 3 * 8 + 4 + 2 + 1 = 55 -> extra 9 bytes
-		uint8_t			padding[9];
-#else											// 2 * 3 * 4 + 4 + 2 + 1 = 31 -> extra 1 bytes
-		uint8_t			padding[1];
-#endif // !YS_DECIMAL_IS_DOUBLE
+		uint8_t			padding[1];				// 2 * 3 * 4 + 4 + 2 + 1 = 31 -> extra 1 bytes
 	};
-	static_assert(sizeof(LinearBvhNode) == 32 || sizeof(LinearBvhNode) == 64);
+	static_assert(sizeof(LinearBvhNode) == 32);
+
+	// Collapsed node, child bounds are stored in SoA form so that a single slab test covers all
+	// of them. Unused lanes hold empty bounds, which no ray can hit.
+	template <uint32_t Width>
+	struct alignas(16) WideBvhNode
+	{
+		static_assert(Width % 4u == 0u, "Wide nodes are tested by groups of 4 lanes");
+		static constexpr uint32_t	kWidth = Width;
+		static constexpr bool		kIsQuantized = false;
+		float			bounds_min[3][Width];		// rounded outwards, as LinearBvhNode::bounds
+		float			bounds_max[3][Width];
+		uint32_t		child_index[Width];			// node index, or first primitive of a leaf
+		uint16_t		primitive_count[Width];		// 0 for inner nodes and unused lanes
+	};
+
+	// Wide node with child bounds quantized on 255 steps between origin and
+	// origin + 255 * 2^scale_exponent, rounded outwards. The node does not depend on
+	// maths::Decimal: 16 + 11 * Width bytes, 64 bytes for 4 lanes and 112 bytes for 8 lanes
+	// once aligned, 16 and 14 bytes per child.
+	template <uint32_t Width>
+	struct alignas(16) QuantizedBvhNode
+	{
+		static_assert(Width % 4u == 0u, "Wide nodes are tested by groups of 4 lanes");
+		static constexpr uint32_t	kWidth = Width;
+		static constexpr bool		kIsQuantized = true;
+		static constexpr uint32_t	kStepCount = 255u;
+		float			origin[3];					// 3 * 4
+		int8_t			scale_exponent[3];			// 3, normal float exponents
+		uint8_t			child_count;				// 1, lanes past child_count are unused
+		uint8_t			bounds_min[3][Width];		// 3 * Width
+		uint8_t			bounds_max[3][Width];		// 3 * Width
+		uint32_t		child_index[Width];			// 4 * Width
+		uint8_t			primitive_count[Width];		// Width, see kMaxQuantizedLeafSize
+	};
+	static_assert(sizeof(QuantizedBvhNode<kBvh4NodeWidth>) == 64 &&
+				  sizeof(QuantizedBvhNode<kBvh8NodeWidth>) == 112);
+
+	WideNodeArray_t<kBvh4NodeWidth>			wide4_nodes_;
+	WideNodeArray_t<kBvh8NodeWidth>			wide8_nodes_;
+	QuantizedNodeArray_t<kBvh4NodeWidth>	quantized4_nodes_;
+	QuantizedNodeArray_t<kBvh8NodeWidth>	quantized8_nodes_;
 
 	// Used for the implementation of surface area heuristic partition algorithm
 	struct SahBucketDesc
 	{
 		static constexpr uint32_t kBucketCount = 12;
+		static uint32_t Index(maths::Bounds3f const &_centroids_bounds,
+							  maths::Point3f const &_centroid, uint32_t const _axis);
 		uint32_t			primitive_count = 0;
 		maths::Bounds3f		bounds{};
 	};
+	static_assert(std::tuple_size<SahBucketArray_t>::value == SahBucketDesc::kBucketCount);
+
+	struct SpatialSplit
+	{
+		maths::Decimal		cost = maths::infinity<maths::Decimal>;
+		uint32_t			axis = 0u;
+		maths::Decimal		position = 0._d;
+	};
+
+	struct MortonPrimitive
+	{
+		uint32_t			morton_code;
+		uint32_t			desc_index;
+	};
+
+	struct RangeBounds
+	{
+		maths::Bounds3f		bounds{};
+		maths::Bounds3f		centroids_bounds{};
+	};
+
+	// Cache files start with this header, followed by the reference order and the node array,
+	// each of them starting on a kCacheAlignment boundary.
+	static constexpr uint64_t	kCacheMagic = 0x3130484256425359ull;	// "YSBVBH01"
+	static constexpr uint32_t	kCacheVersion = 6u;
+	static constexpr size_t		kCacheAlignment = 64u;
+	struct CacheHeader
+	{
+		uint64_t	magic;
+		uint32_t	version;
+		uint32_t	decimal_size;
+		uint32_t	node_max_size;
+		uint32_t	node_width;
+		uint16_t	quantized_nodes;
+		uint16_t	build_method;
+		uint32_t	primitive_count;
+		uint32_t	reference_count;
+		float		duplication_budget;
+		uint64_t	node_count;
+		uint32_t	node_size;
+		float		sah_cost;
+		uint64_t	payload_hash;		// primitive order and nodes, padding excluded
+	};
+	static_assert(sizeof(CacheHeader) == kCacheAlignment);
+
+	// Untyped view of the node array in use
+	struct NodeStorage
+	{
+		void		*data;
+		size_t		node_count;
+		size_t		node_size;
+	};
+
+	// State shared by the build tasks, each task allocating its nodes from a region of its own.
+	struct BuildContext
+	{
+		core::MemoryRegion &AddRegion();
+		std::atomic<int>				node_count{ 0 };
+		std::mutex						regions_lock;
+		std::list<core::MemoryRegion>	regions;
+	};
 };
 
 
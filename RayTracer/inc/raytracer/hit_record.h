@@ -0,0 +1,60 @@
+#pragma once
+#ifndef __YS_HIT_RECORD_HPP__
+#define __YS_HIT_RECORD_HPP__
+
+#include "maths/maths.h"
+#include "maths/point.h"
+#include "raytracer/raytracer.h"
+
+
+namespace raytracer {
+
+
+// Records of the MeshInstances a hit was found through, outermost first. Paths are compared
+// exactly, self hit tests tell the instances of a primitive apart with them.
+struct InstancePath
+{
+	// MeshInstances nested deeper than this are rejected by the scene setup
+	static constexpr uint32_t	kMaxDepth = 8u;
+
+	uint32_t	depth = 0u;
+	uint32_t	indices[kMaxDepth]{};
+};
+
+inline bool
+operator==(InstancePath const &_lhs, InstancePath const &_rhs)
+{
+	if (_lhs.depth != _rhs.depth)
+		return false;
+	for (uint32_t depth = 0u; depth < _lhs.depth; ++depth)
+		if (_lhs.indices[depth] != _rhs.indices[depth])
+			return false;
+	return true;
+}
+
+inline bool
+operator!=(InstancePath const &_lhs, InstancePath const &_rhs)
+{
+	return !(_lhs == _rhs);
+}
+
+
+// Compact result of an intersection query. Candidate hits only overwrite this record, the
+// SurfaceInteraction is computed from the closest one once the query is over, through
+// Primitive::ComputeSurfaceInteraction.
+struct HitRecord
+{
+	maths::Decimal		t = maths::infinity<maths::Decimal>;
+	maths::Point2f		uv{ 0._d, 0._d };	// barycentrics of the first two vertices for triangles,
+											// surface parameters for other shapes
+	uint32_t			index = 0u;			// face of a mesh, reference of a BVH leaf
+	InstancePath		instance_path;		// the shape is in the space of its innermost record
+	Shape const			*shape = nullptr;
+	Primitive const		*primitive = nullptr;	// outermost primitive
+};
+
+
+} // namespace raytracer
+
+
+#endif // __YS_HIT_RECORD_HPP__
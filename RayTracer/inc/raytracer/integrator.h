@@ -2,6 +2,8 @@
 #ifndef __YS_INTEGRATOR_HPP__
 #define __YS_INTEGRATOR_HPP__
 
+#include <functional>
+#include <memory>
 #include <vector>
 
 #include "maths/maths.h"
@@ -10,6 +12,11 @@
 
 namespace raytracer {
 
+struct HitRecord;
+struct InstancePath;
+struct RayPacket;
+struct RayStream;
+struct Wave;
 class Camera;
 class Film;
 class Light;
@@ -21,30 +28,124 @@ class Primitive;
 class Integrator
 {
 public:
+	// Single entry point for ray queries against the scene.
+	// _aggregate is the top level acceleration structure built over every scene primitive,
+	// it is null when the scene is empty.
+	// The SurfaceInteraction overload only computes it for the closest hit, the HitRecord one
+	// is enough for queries that only need to identify what was hit.
 	struct Scene
 	{
-		std::vector<Primitive const *> const &_primitives;
+		bool Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const;
+		bool Intersect(maths::Ray &_ray, HitRecord &_hit) const;
+		// Returns the mask of the rays of _ray_mask hit, see RayPacket
+		uint32_t IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const;
+		bool Occluded(maths::Ray const &_ray) const;
+		// Batch queries, results are stored in _stream. Closest hits are traced by packets.
+		void IntersectStream(RayStream &_stream) const;
+		void OccludedStream(RayStream &_stream) const;
+		Primitive const *_aggregate;
 		std::vector<Light const *> const &_lights;
 	};
+	// Film area in pixels, max is exclusive.
+	struct Tile
+	{
+		maths::Vec2i min;
+		maths::Vec2i max;
+	};
 	using PrimitiveContainer_t = std::vector<raytracer::Primitive const*>;
 	using LightContainer_t = std::vector<raytracer::Light const*>;
+	using TileContainer_t = std::vector<Tile>;
+	using TileCostContainer_t = std::vector<uint64_t>;
+public:
+	static constexpr uint32_t kDefaultTileSize = 16u;
+	// Pixel spacing of the cost estimation pre-pass
+	static constexpr int64_t kCostEstimateStride = 4;
 public:
 	Integrator(Camera& _camera, Film& _film, Sampler& _sampler);
 	virtual ~Integrator() = default;
 	virtual void Prepare(PrimitiveContainer_t const &_primitives, LightContainer_t const &_lights) = 0;
+	// Tiles are dispatched to thread_count() workers, each owning a clone of the sampler.
+	// Samplers are reseeded on every pixel, the image doesn't depend on the thread count.
+	// Tiles are scheduled from the costs measured on the previous call, or from a sparse
+	// single sample pre-pass when the tiling changed.
 	void Integrate(Scene const &_scene, maths::Decimal _t);
+	// A thread count of 0 means one thread per hardware thread.
+	void SetThreadCount(uint32_t const _thread_count) { thread_count_ = _thread_count; }
+	void SetTileSize(uint32_t const _tile_size);
+	// A packet size of 0 traces camera rays one at a time. Otherwise the first hits of blocks
+	// of 4 (2x2), 8 (4x2) or 16 (4x4) pixels are traced as ray packets, with identical results.
+	void SetPacketSize(uint32_t const _packet_size);
+	// A batch size of 0 integrates samples depth first through Li. Otherwise tiles are
+	// integrated by waves of about _batch_size camera samples : camera rays are traced
+	// together, hits are sorted by primitive and the integrator traces its secondary rays as
+	// streams in ShadeWave_. Takes precedence over the packet size, integrators without a
+	// wavefront implementation keep integrating depth first.
+	void SetWavefrontBatchSize(uint32_t const _batch_size) { wavefront_batch_size_ = _batch_size; }
+	// Secondary ray streams of wavefront mode are sorted by batches of _batch_size rays before
+	// being traced, see RayStream::SortForTraversal. 0 traces them in spawn order.
+	void SetRaySortBatchSize(uint32_t const _batch_size) { ray_sort_batch_size_ = _batch_size; }
+	uint32_t thread_count() const { return thread_count_; }
+	uint32_t tile_size() const { return tile_size_; }
+	uint32_t packet_size() const { return packet_size_; }
+	uint32_t wavefront_batch_size() const { return wavefront_batch_size_; }
+	uint32_t ray_sort_batch_size() const { return ray_sort_batch_size_; }
 	const Camera &camera() const { return camera_; }
 	const Film &film() const { return film_; }
 protected:
 	Sampler &sampler() { return sampler_; }
+	// Wavefront implementation, see SetWavefrontBatchSize
+	virtual bool SupportsWavefront_() const { return false; }
+	// Appends the array samples of the current camera sample to _samples
+	virtual void DrawWaveSamples_(Scene const &_scene, Sampler &_sampler,
+								  std::vector<maths::Vec2f> &_samples) {}
+	// Fills the color of every path of _wave
+	virtual void ShadeWave_(Wave &_wave, Scene const &_scene) {}
+	// Orders the traversal of a secondary ray stream, see SetRaySortBatchSize
+	void SortStream_(RayStream &_stream, Scene const &_scene) const;
+private:
+	struct WorkerReport
+	{
+		double busy_time = 0.0;
+		double total_time = 0.0;
+		uint64_t tile_count = 0u;
+	};
+	using WorkerFunc_t = std::function<void(uint32_t const, Sampler &)>;
+	// One sampler per packet ray, pixels of a block sample their own sequence
+	using LaneSamplerContainer_t = std::vector<std::unique_ptr<Sampler>>;
+	// Buffers a worker reuses from tile to tile
+	struct WorkerState;
 private:
+	TileContainer_t MakeTiles_() const;
+	void EstimateTileCosts_(TileContainer_t const &_tiles, Scene const &_scene, maths::Decimal _t,
+							uint32_t const _worker_count);
+	// Runs _worker on _worker_count threads, each with its own sampler clone.
+	// A single worker runs on the calling thread with the integrator's sampler.
+	void DispatchWorkers_(uint32_t const _worker_count, WorkerFunc_t const &_worker);
+	void IntegrateTile_(Tile const &_tile, Scene const &_scene, maths::Decimal _t,
+						Sampler &_sampler, WorkerState &_state);
+	void IntegrateTileWavefront_(Tile const &_tile, Scene const &_scene, maths::Decimal _t,
+								 Sampler &_sampler, Wave &_wave);
+	// Integrates the pixels of _tile inside [_block_min, _block_min + _block_size) as a packet
+	void IntegratePixelBlock_(Tile const &_tile, maths::Vec2i const &_block_min,
+							  maths::Vec2i const &_block_size, Scene const &_scene,
+							  maths::Decimal _t, LaneSamplerContainer_t const &_lane_samplers);
+	maths::Vec3f IntegratePixel_(maths::Vec2i const &_position, Scene const &_scene,
+								 maths::Decimal _t, Sampler &_sampler,
+								 uint64_t const _sample_count);
 	virtual maths::Vec3f Li(maths::Ray const &_ray,
 							raytracer::SurfaceInteraction const &_hit,
-							Scene const &_scene) = 0;
+							Scene const &_scene,
+							Sampler &_sampler) = 0;
 private:
 	Camera &camera_;
 	Film &film_;
 	Sampler &sampler_;
+	uint32_t thread_count_;
+	uint32_t tile_size_;
+	uint32_t packet_size_;
+	uint32_t wavefront_batch_size_;
+	uint32_t ray_sort_batch_size_;
+	TileCostContainer_t tile_costs_;
 };
 
 
@@ -57,7 +158,8 @@ public:
 private:
 	maths::Vec3f Li(maths::Ray const &_ray,
 					raytracer::SurfaceInteraction const &_hit,
-					Scene const &_scene) override;
+					Scene const &_scene,
+					Sampler &_sampler) override;
 private:
 	bool remap_;
 	bool absolute_;
@@ -78,7 +180,24 @@ public:
 private:
 	maths::Vec3f Li(maths::Ray const &_ray,
 					raytracer::SurfaceInteraction const &_hit,
-					Scene const &_scene) override;
+					Scene const &_scene,
+					Sampler &_sampler) override;
+	bool SupportsWavefront_() const override { return true; }
+	void DrawWaveSamples_(Scene const &_scene, Sampler &_sampler,
+						  std::vector<maths::Vec2f> &_samples) override;
+	void ShadeWave_(Wave &_wave, Scene const &_scene) override;
+	// World space AO ray direction around _hit for _sample
+	maths::Vec3f SampleDirection_(raytracer::SurfaceInteraction const &_hit,
+								  maths::Vec2f const &_sample) const;
+	// Occlusion of a ray cast from underneath _hit that hit the outside of _ray_primitive, or
+	// of its instance _ray_instance_path for MeshInstances
+	maths::Vec3f SecondaryOcclusionFromHit_(raytracer::SurfaceInteraction const &_hit,
+											Primitive const *_ray_primitive,
+											InstancePath const &_ray_instance_path) const;
+	// Occlusion of the AO ray _ray spawned from _hit, once its closest hit _ray_hit is known
+	maths::Vec3f OcclusionFromHit_(raytracer::SurfaceInteraction const &_hit,
+								   maths::Ray const &_ray, HitRecord const &_ray_hit,
+								   bool const _fixed_shading_normal_self_hitting) const;
 private:
 	uint64_t sample_count_;
 	bool use_shading_geometry_;
@@ -11,12 +11,28 @@ namespace raytracer {
 
 class DirectLightingIntegrator : public Integrator
 {
+private:
+	static constexpr maths::Vec3f kBackgroundColor = { 0.5_d, 0.5_d, 0.5_d };
 public:
 	DirectLightingIntegrator(Camera& _camera, Film& _film, Sampler& _sampler, uint64_t const _shadow_ray_count);
 	void Prepare(PrimitiveContainer_t const &_primitives, LightContainer_t const &_lights) override;
 	maths::Vec3f Li(maths::Ray const &_ray,
 					raytracer::SurfaceInteraction const &_hit,
-					Scene const &_scene) override;
+					Scene const &_scene,
+					Sampler &_sampler) override;
+private:
+	bool SupportsWavefront_() const override { return true; }
+	void DrawWaveSamples_(Scene const &_scene, Sampler &_sampler,
+						  std::vector<maths::Vec2f> &_samples) override;
+	void ShadeWave_(Wave &_wave, Scene const &_scene) override;
+	// Shadow ray and unoccluded contribution of a light sample and of a material sample,
+	// false when the sample doesn't contribute
+	bool SampleLight_(Light const &_light, raytracer::SurfaceInteraction const &_hit,
+					  maths::Vec2f const &_ksi, maths::Decimal _time,
+					  maths::Ray &_shadow_ray, maths::Vec3f &_contribution) const;
+	bool SampleMaterial_(Light const &_light, raytracer::SurfaceInteraction const &_hit,
+						 maths::Vec2f const &_ksi, maths::Decimal _time,
+						 maths::Ray &_shadow_ray, maths::Vec3f &_contribution) const;
 private:
 	uint64_t shadow_ray_count_;
 };
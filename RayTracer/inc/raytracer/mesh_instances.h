@@ -0,0 +1,104 @@
+#pragma once
+#ifndef __YS_MESH_INSTANCES_HPP__
+#define __YS_MESH_INSTANCES_HPP__
+
+#include <vector>
+
+#include "maths/maths.h"
+#include "raytracer/bvh_accelerator.h"
+#include "raytracer/primitive.h"
+#include "raytracer/shape.h"
+
+
+namespace raytracer {
+
+
+class TriangleMeshData;
+
+
+// Mesh shared by the records of MeshInstances, in its object space. Surface interactions are
+// moved to world space by the MeshInstances that found the hit.
+// _flip_normals is the flip_normals parameter of the shape only: the record transform keeps
+// the normals of a mirrored placement facing the same side as those of a transformed mesh.
+class InstancedMesh final :
+	public Shape
+{
+public:
+	InstancedMesh(TriangleMeshData const &_data, bool _flip_normals);
+	bool Intersect(maths::Ray const &_ray, HitRecord &_hit) const override;
+	void ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+								   SurfaceInteraction &_hit_info) const override;
+	bool DoesIntersect(maths::Ray const &_ray) const override;
+	maths::Decimal	Area() const override;
+	SurfacePoint	SampleSurface(maths::Vec2f const &_ksi) const override;
+	maths::Bounds3f	ObjectBounds() const override;
+	TriangleMeshData const &data() const { return data_; }
+private:
+	TriangleMeshData const	&data_;
+};
+
+
+// Placements of shared meshes or instance groups, such as the plants of a forest or the
+// buildings of a city. Each one is a compact record rather than a shape and a primitive of its
+// own, and all of them are intersected through a single BVH over their world bounds.
+// Rays are moved to the object space of the records found in the leaves, the BVHs of the
+// targets are shared. A group target may hold MeshInstances of its own, the ray transform is
+// then pushed again at each level.
+// Hits prepend the index of their record, in the order of the records given, to
+// HitRecord::instance_path.
+class MeshInstances final :
+	public Primitive,
+	private BvhAccelerator::PrimitiveSource,
+	private BvhAccelerator::LeafIntersector
+{
+public:
+	// Affine transforms without their last row. Hits deeper than the target went through
+	// nested, the only MeshInstances of the target.
+	struct Record
+	{
+		Primitive const		*target;
+		MeshInstances const	*nested;
+		maths::Decimal		to_world[3][4];
+		maths::Decimal		to_object[3][4];
+	};
+	static Record	MakeRecord(Primitive const &_target, MeshInstances const *_nested,
+							   maths::Transform const &_to_world);
+public:
+	MeshInstances(std::vector<Record> &&_records, uint32_t _bvh_node_width);
+	bool	Intersect(maths::Ray &_ray, HitRecord &_hit) const override;
+	bool	DoesIntersect(maths::Ray const &_ray) const override;
+	uint32_t	IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const override;
+	// Follows HitRecord::instance_path down to the space of the hit shape
+	void	ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+									  SurfaceInteraction &_hit_info) const override;
+	maths::Bounds3f	WorldBounds() const override;
+	// Updates the BVH over the records once their targets moved, see BvhAccelerator::Update.
+	// Targets read their bounds from their own BVH or mesh, which must be updated first.
+	uint32_t	Update();
+	maths::Transform	instance_transform(uint32_t _instance) const;
+	size_t				instance_count() const { return records_.size(); }
+	// Levels of MeshInstances a hit goes through, this one included
+	uint32_t			instance_depth() const { return instance_depth_; }
+	BvhAccelerator const &bvh() const { return bvh_; }
+private:
+	// Records are leaves of their own, they are costly to intersect
+	static constexpr uint32_t	kBvhNodeMaxSize = 2u;
+	uint32_t		primitive_count() const override;
+	maths::Bounds3f	PrimitiveBounds(uint32_t _primitive_index) const override;
+	maths::Bounds3f	ClippedPrimitiveBounds(uint32_t _primitive_index,
+										   maths::Bounds3f const &_clip) const override;
+	bool	IntersectLeaf(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+						  HitRecord &_hit) const override;
+	bool	DoesIntersectLeaf(maths::Ray const &_ray, uint32_t _first,
+							  uint32_t _count) const override;
+private:
+	std::vector<Record>	records_;
+	uint32_t			instance_depth_;
+	BvhAccelerator		bvh_;
+};
+
+
+} // namespace raytracer
+
+
+#endif // __YS_MESH_INSTANCES_HPP__
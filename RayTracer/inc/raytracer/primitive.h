@@ -12,9 +12,19 @@ class Primitive
 {
 public:
 	virtual ~Primitive() = default;
-	virtual bool	Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const = 0;
+	// Closer hits than _ray.tMax shorten it and overwrite _hit, see HitRecord
+	virtual bool	Intersect(maths::Ray &_ray, HitRecord &_hit) const = 0;
 	virtual bool	DoesIntersect(maths::Ray const &_ray) const = 0;
+	// Intersects the rays of _ray_mask, see RayPacket. Defaults to one ray at a time.
+	virtual uint32_t	IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const;
+	// Surface attributes at the closest hit of a query, _hit.primitive being this primitive.
+	// Defaults to the hit shape, primitives that move rays to another space move them back.
+	virtual void	ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+											  SurfaceInteraction &_hit_info) const;
 	virtual maths::Bounds3f	WorldBounds() const = 0;
+	// Bounds of the part of the primitive inside _clip, empty when it doesn't cross _clip.
+	// Spatial splits of the BVH use it, the world bounds clipped to _clip are a valid fallback.
+	virtual maths::Bounds3f	ClippedWorldBounds(maths::Bounds3f const &_clip) const;
 };
 
 
@@ -23,9 +33,11 @@ class GeometryPrimitive final :
 {
 public:
 	GeometryPrimitive(Shape const &_shape);
-	bool	Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const override;
+	bool	Intersect(maths::Ray &_ray, HitRecord &_hit) const override;
 	bool	DoesIntersect(maths::Ray const &_ray) const override;
+	uint32_t	IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const override;
 	maths::Bounds3f	WorldBounds() const override;
+	maths::Bounds3f	ClippedWorldBounds(maths::Bounds3f const &_clip) const override;
 private:
 	Shape const	&shape_;
 };
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef __YS_RAY_PACKET_HPP__
+#define __YS_RAY_PACKET_HPP__
+
+#include "maths/maths.h"
+#include "maths/ray.h"
+#include "raytracer/hit_record.h"
+
+
+namespace raytracer {
+
+
+// Rays traced together, such as the camera rays of neighbouring pixels. Packet queries take a
+// mask of the rays to consider, bit i standing for rays[i], and return the mask of the rays
+// they hit. As for single rays, closer hits than tMax shorten it and overwrite the ray's record.
+struct RayPacket
+{
+	// Rays are tested by groups of kGroupSize, packets of 4, 8 and 16 rays are supported
+	static constexpr uint32_t	kGroupSize = 4u;
+	static constexpr uint32_t	kMaxSize = 16u;
+	static bool		IsValidSize(uint32_t _size)
+	{
+		return _size > 0u && _size <= kMaxSize && (_size % kGroupSize) == 0u;
+	}
+
+	uint32_t		full_mask() const { return (1u << size) - 1u; }
+
+	maths::Ray		rays[kMaxSize];
+	HitRecord		hits[kMaxSize];
+	uint32_t		size = kMaxSize;
+};
+
+
+} // namespace raytracer
+
+
+#endif // __YS_RAY_PACKET_HPP__
@@ -12,6 +12,9 @@ class Camera;
 class RenderContext;
 
 class SurfaceInteraction;
+struct HitRecord;
+struct InstancePath;
+struct RayPacket;
 
 class Shape;
 class Sphere;
@@ -2,6 +2,7 @@
 #ifndef __YS_SAMPLER_HPP__
 #define __YS_SAMPLER_HPP__
 
+#include <memory>
 #include <vector>
 
 #include "core/rng.h"
@@ -63,6 +64,13 @@ public:
 public:
 	Sampler(uint64_t const _seed,
 			uint64_t const _samples_per_pixel, uint64_t const _dimensions_per_sample);
+	virtual ~Sampler() = default;
+	// Copies the sampler configuration and reserved arrays, with a new seed.
+	// Each pixel draws from its own RNG stream, selected from its position, so a clone sharing
+	// the original seed produces the same samples for any pixel, in any order, on any thread.
+	virtual std::unique_ptr<Sampler> Clone(uint64_t const _seed) const = 0;
+protected:
+	Sampler(Sampler const &_other, uint64_t const _seed);
 public:
 	template <uint64_t PackSize> StorageType_t<PackSize> GetNext();
 	void StartPixel(maths::Vec2u const &_position);
@@ -85,6 +93,7 @@ public:
 									uint64_t const _sample_index) = 0;
 public:
 	uint64_t samples_per_pixel() const { return samples_per_pixel_; }
+	uint64_t seed() const { return seed_; }
 private:
 	virtual void OnArrayReserved_(uint64_t const _dimension_count) {};
 protected:
@@ -102,7 +111,9 @@ protected:
 	template <uint64_t PackSize> ExtensionSizeContainer_t const &extension_sizes() const;
 private:
 	template <uint64_t PackSize> StorageType_t<PackSize> overtaxed_value_();
+	static uint64_t PixelStream_(maths::Vec2u const &_position);
 private:
+	uint64_t					seed_;
 	core::RNG					rng_;
 	uint64_t const				samples_per_pixel_;
 	uint64_t const				dimensions_per_sample_;
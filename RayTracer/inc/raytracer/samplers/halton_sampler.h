@@ -3,6 +3,7 @@
 #define __YS_HALTON_SAMPLER_HPP__
 
 
+#include <mutex>
 #include <vector>
 
 
@@ -32,10 +33,18 @@ public:
 	// actually modular multiplicative inverse
 	static uint64_t ModularInverse(int64_t const _a, int64_t const _m);
 private:
+	// Primes and permutations tables are process wide. They only grow when a sampler is built or
+	// reserves arrays, which happens before rendering starts, and are read-only afterwards.
+	// Clones share them and never extend them.
 	static constexpr uint64_t kReservedPrimesCount_ = 1024u;
+	static PrimesVector_t const &primes() { return primes_(); }
+	static PermutationsVector_t const &permutations() { return permutations_(); }
+	static PermutationsVector_t const &inverse_permutations() { return inverse_permutations_(); }
 	static PrimesVector_t &primes_();
 	static PermutationsVector_t &permutations_();
 	static PermutationsVector_t &inverse_permutations_();
+	static std::mutex &tables_mutex_();
+	static void ExtendTables_(uint64_t const _primes_count);
 	static void ExtendPrimesSequence_(PrimesVector_t &_primes,
 									  uint64_t const _count);
 	static void AppendNextFaurePermutations_(PermutationsVector_t &_permutations, 
@@ -45,6 +54,8 @@ public:
 	HaltonSampler(uint64_t const _seed, 
 				  uint64_t const _samples_per_pixel, uint64_t const _dimensions_per_sample,
 				  maths::Vec2u const &_tile_resolution);
+	HaltonSampler(HaltonSampler const &_other, uint64_t const _seed);
+	std::unique_ptr<Sampler> Clone(uint64_t const _seed) const override;
 	void Fill1DPrimarySampleVector(Sample1DContainer_t &_sample_vector,
 								   uint64_t const _sample_index) override;
 	void Fill2DPrimarySampleVector(Sample2DContainer_t &_sample_vector,
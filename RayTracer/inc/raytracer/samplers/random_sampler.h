@@ -14,6 +14,8 @@ class RandomSampler final : public Sampler
 public:
 	RandomSampler(uint64_t const _seed,
 				  uint64_t const _samples_per_pixel, uint64_t const _dimensions_per_sample);
+	RandomSampler(RandomSampler const &_other, uint64_t const _seed);
+	std::unique_ptr<Sampler> Clone(uint64_t const _seed) const override;
 
 	void Fill1DSampleVector(Sample1DContainer_t &_sample_vector,
 							uint64_t const _sample_index) override;
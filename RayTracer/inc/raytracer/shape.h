@@ -24,10 +24,17 @@ public:
 	Shape(maths::Transform const &_world_transform, bool _flip_normals = false);
 	virtual ~Shape() = default;
 
-	virtual bool Intersect(maths::Ray const &_ray, 
-						   maths::Decimal &_tHit, 
-						   SurfaceInteraction &_hit_info) const = 0;
+	// Fills _hit when the shape is hit closer than _ray.tMax, _hit.shape is set to this.
+	virtual bool Intersect(maths::Ray const &_ray, HitRecord &_hit) const = 0;
+	// Surface attributes at a hit found by Intersect with the same ray, only computed once
+	// the closest hit is known.
+	virtual void ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+										   SurfaceInteraction &_hit_info) const = 0;
 	virtual bool DoesIntersect(maths::Ray const &_ray) const;
+	// Fills the records of the rays of _ray_mask hit closer than their tMax, unlike Intersect
+	// their tMax may be shortened. Returns the mask of the rays hit, see RayPacket.
+	// Defaults to one ray at a time.
+	virtual uint32_t IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const;
 	virtual maths::Decimal	Area() const = 0;
 	virtual SurfacePoint	SampleSurface(maths::Vec2f const &_ksi) const = 0;
 	virtual maths::Decimal	SurfacePdf(SurfaceInteraction const &_origin) const;
@@ -37,6 +44,8 @@ public:
 											  maths::Vec3f const &_wi) const;
 	virtual maths::Bounds3f	ObjectBounds() const = 0;
 	virtual maths::Bounds3f	WorldBounds() const;
+	// See Primitive::ClippedWorldBounds, defaults to the world bounds clipped to _clip
+	virtual maths::Bounds3f	ClippedWorldBounds(maths::Bounds3f const &_clip) const;
 public:
 	// TODO: Maybe Primitive should have a transform instead of shape
 	// (some shape impelementations might require their transform though)
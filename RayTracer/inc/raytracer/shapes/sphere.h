@@ -18,9 +18,9 @@ public:
 	Sphere(maths::Transform const &_world_transform, bool _flip_normals,
 		   maths::Decimal _radius, maths::Decimal _z_min, maths::Decimal _z_max,
 		   maths::Decimal _phi_max);
-	virtual bool Intersect(maths::Ray const &_ray,
-						   maths::Decimal &_tHit,
-						   SurfaceInteraction &_hit_info) const override;
+	virtual bool Intersect(maths::Ray const &_ray, HitRecord &_hit) const override;
+	virtual void ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+										   SurfaceInteraction &_hit_info) const override;
 	virtual bool DoesIntersect(maths::Ray const &_ray) const override;
 	virtual maths::Decimal	Area() const override;
 	virtual SurfacePoint SampleSurface(maths::Vec2f const &_ksi) const override;
@@ -29,6 +29,12 @@ public:
 	virtual maths::Decimal	VisibleSurfacePdf(SurfaceInteraction const &_origin,
 											  maths::Vec3f const &_wi) const;
 	virtual maths::Bounds3f	ObjectBounds() const override;
+private:
+	// Error bounded ray/sphere test in object space, including the clipping by z and phi.
+	bool ObjectSpaceHit_(maths::Ray const &_ray,
+						 maths::Vec3f const &_origin_error, maths::Vec3f const &_direction_error,
+						 maths::Decimal &_t_hit, maths::Point3f &_p_hit, maths::Decimal &_phi) const;
+public:
 	maths::Decimal const	radius;
 	maths::Decimal const	z_min, z_max;
 	maths::Decimal const	theta_min, theta_max, phi_max;
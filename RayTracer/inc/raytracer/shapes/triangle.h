@@ -16,15 +16,44 @@ class Triangle : public Shape
 public:
 	Triangle(maths::Transform const &_world_transform, bool _flip_normals,
 			 TriangleMeshRawData const &_mesh_data, int32_t _face_index);
-	virtual bool Intersect(maths::Ray const &_ray,
-						   maths::Decimal &_tHit,
-						   SurfaceInteraction &_hit_info) const override;
+	virtual bool Intersect(maths::Ray const &_ray, HitRecord &_hit) const override;
+	virtual void ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+										   SurfaceInteraction &_hit_info) const override;
 	virtual bool DoesIntersect(maths::Ray const &_ray) const override;
 	virtual maths::Decimal	Area() const override;
 	virtual SurfacePoint	SampleSurface(maths::Vec2f const &_ksi) const override;
 	virtual maths::Bounds3f	ObjectBounds() const override;
 	virtual maths::Bounds3f	WorldBounds() const override;
+	virtual maths::Bounds3f	ClippedWorldBounds(maths::Bounds3f const &_clip) const override;
 	maths::Point2f	uv(uint32_t _index) const;
+public:
+	// Result of the watertight test (PBR 3.6.2)
+	struct WatertightHit
+	{
+		maths::Decimal	b0, b1, b2;
+		maths::Decimal	t;
+	};
+	// Face routines shared with the triangle meshes, which don't allocate a Triangle per face.
+	// _vertex_index points to the three vertex indices of the face in _mesh_data.indices.
+	// _shape is reported by the interaction and decides whether its normals are flipped.
+	static bool				IntersectFaceWatertight(TriangleMeshRawData const &_mesh_data,
+													int32_t const *_vertex_index,
+													maths::Ray const &_ray, WatertightHit &_hit);
+	static void				ComputeFaceSurfaceInteraction(TriangleMeshRawData const &_mesh_data,
+														  int32_t const *_vertex_index,
+														  Shape const &_shape,
+														  maths::Ray const &_ray,
+														  HitRecord const &_hit,
+														  SurfaceInteraction &_hit_info);
+	static maths::Decimal	FaceArea(TriangleMeshRawData const &_mesh_data,
+									 int32_t const *_vertex_index);
+	static maths::Bounds3f	FaceBounds(TriangleMeshRawData const &_mesh_data,
+									   int32_t const *_vertex_index);
+	static maths::Bounds3f	ClippedFaceBounds(TriangleMeshRawData const &_mesh_data,
+											  int32_t const *_vertex_index,
+											  maths::Bounds3f const &_clip);
+	static maths::Point2f	FaceUv(TriangleMeshRawData const &_mesh_data,
+								   int32_t const *_vertex_index, uint32_t _index);
 private:
 	TriangleMeshRawData const	&mesh_data_;
 	int32_t const				*vertex_index_;
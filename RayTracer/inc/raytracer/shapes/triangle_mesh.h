@@ -22,8 +22,6 @@ namespace raytracer {
 template <typename InstancingPolicy>
 class TriangleMesh : public Shape
 {
-private:
-	using TriangleContainer_t = std::vector<Triangle const*>;
 public:
 	TriangleMesh(maths::Transform const &_world_transform,
 				 bool _flip_normals,
@@ -31,10 +29,11 @@ public:
 	TriangleMesh(maths::Transform const &_world_transform,
 				 bool _flip_normals,
 				 TriangleMesh const &_sibling_instance);
-	virtual bool Intersect(maths::Ray const &_ray,
-						   maths::Decimal &_tHit,
-						   SurfaceInteraction &_hit_info) const override;
+	virtual bool Intersect(maths::Ray const &_ray, HitRecord &_hit) const override;
+	virtual void ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+										   SurfaceInteraction &_hit_info) const override;
 	virtual bool DoesIntersect(maths::Ray const &_ray) const override;
+	virtual uint32_t IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const override;
 	virtual maths::Decimal	Area() const override;
 	virtual SurfacePoint	SampleSurface(maths::Vec2f const &_ksi) const override;
 	virtual maths::Bounds3f	ObjectBounds() const override;
@@ -3,6 +3,7 @@
 #define __YS_SURFACE_INTERACTION_HPP__
 
 #include "raytracer/raytracer.h"
+#include "raytracer/hit_record.h"
 #include "raytracer/shape.h"
 #include "maths/vector.h"
 #include "maths/point.h"
@@ -76,7 +77,8 @@ public:
 	maths::Point2f		uv;
 	GeometryProperties	geometry;		// True geometry properties
 	GeometryProperties	shading;		// Shading geometry
-	Primitive const		*primitive;
+	Primitive const		*primitive = nullptr;
+	InstancePath		instance_path;
 };
 
 
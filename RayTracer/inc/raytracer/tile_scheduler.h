@@ -0,0 +1,57 @@
+#pragma once
+#ifndef __YS_TILE_SCHEDULER_HPP__
+#define __YS_TILE_SCHEDULER_HPP__
+
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "core/noncopyable.h"
+#include "core/nonmovable.h"
+#include "core/spinlock.h"
+
+
+namespace raytracer {
+
+
+// Work stealing dispatch of tile indices.
+// Tiles are dealt to the workers' queues largest predicted cost first, each queue receiving the
+// next tile as long as it holds the least predicted work (LPT). A worker takes the front of its own
+// queue, and once it is empty, steals the largest tile found at the front of the other queues.
+class TileScheduler final :
+	private core::noncopyable,
+	private core::nonmovable
+{
+public:
+	using Cost_t = uint64_t;
+	using CostContainer_t = std::vector<Cost_t>;
+	static constexpr size_t kInvalidTile = std::numeric_limits<size_t>::max();
+public:
+	TileScheduler(CostContainer_t const &_tile_costs, uint32_t const _worker_count);
+	// Returns kInvalidTile once every tile has been handed out.
+	size_t NextTile(uint32_t const _worker_index);
+	uint64_t stolen_count(uint32_t const _worker_index) const;
+	uint32_t worker_count() const { return static_cast<uint32_t>(queues_.size()); }
+private:
+	struct WorkerQueue
+	{
+		core::AtomicSpinLock	lock;
+		std::deque<size_t>		tiles;
+		uint64_t				stolen_count = 0u;
+	};
+	using QueueContainer_t = std::vector<std::unique_ptr<WorkerQueue>>;
+private:
+	size_t PopFront_(WorkerQueue &_queue);
+	size_t StealLargest_(uint32_t const _thief_index);
+private:
+	CostContainer_t const	&tile_costs_;
+	QueueContainer_t		queues_;
+};
+
+
+} // namespace raytracer
+
+
+#endif // __YS_TILE_SCHEDULER_HPP__
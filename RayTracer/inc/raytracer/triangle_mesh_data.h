@@ -3,16 +3,20 @@
 #define __YS_TRIANGLE_MESH_DATA_HPP__
 
 
+#include <string>
 #include <vector>
 #include "maths/bounds.h"
 #include "maths/point.h"
 #include "maths/vector.h"
 #include "core/memory_region.h"
 #include "raytracer/bvh_accelerator.h"
+#include "raytracer/triangle_records.h"
 
 namespace raytracer {
 
-class Triangle;
+struct HitRecord;
+class Shape;
+class SurfaceInteraction;
 
 class TriangleMeshRawData
 {
@@ -52,42 +56,80 @@ struct InstancingPolicyClass
 	{};
 	struct Transformed
 	{
-		static TriangleMeshRawData const &GetRawData(TriangleMeshRawData const &_base,
-													 maths::Transform const &_world_transform,
-													 core::MemoryRegion &_mem_region);
+		static TriangleMeshRawData &GetRawData(TriangleMeshRawData const &_base,
+											   maths::Transform const &_world_transform,
+											   core::MemoryRegion &_mem_region);
+		static void TransformRawData(TriangleMeshRawData const &_base,
+									 maths::Transform const &_world_transform,
+									 TriangleMeshRawData &_target);
 	};
 };
 
+// Faces are only stored in the raw data, the BVH is built from their bounds and its leaves
+// index the triangle records. Surface interactions are computed from the face index of a hit.
 class TriangleMeshData
 {
 public:
-	using TriangleContainer_t = std::vector<Triangle const*>;
-public:
-	TriangleMeshData(maths::Transform const &_world_transform,
-					 bool _flip_normals,
-					 TriangleMeshRawData const &_mesh_raw_data,
+	TriangleMeshData(TriangleMeshRawData const &_mesh_raw_data,
+					 uint32_t _bvh_node_width,
+					 bool _bvh_quantized_nodes,
+					 BvhAccelerator::BuildMethod _bvh_build_method,
+					 float _bvh_duplication_budget,
+					 std::string const &_bvh_cache_file,
 					 InstancingPolicyClass::SharedSource const &);
 	TriangleMeshData(maths::Transform const &_world_transform,
-					 bool _flip_normals,
 					 TriangleMeshRawData const &_mesh_raw_data,
+					 uint32_t _bvh_node_width,
+					 bool _bvh_quantized_nodes,
+					 BvhAccelerator::BuildMethod _bvh_build_method,
+					 float _bvh_duplication_budget,
+					 std::string const &_bvh_cache_file,
 					 InstancingPolicyClass::Transformed const &);
 	maths::Bounds3f const &bounds() const { return data_source_.bounds; }
-	TriangleContainer_t const &triangles() const { return triangles_; }
+	// Vertices are in world space for Transformed meshes, in object space otherwise
+	TriangleMeshRawData const &raw_data() const { return data_source_; }
 	BvhAccelerator const &bvh() const { return bvh_; }
+	// Reorders the BVH nodes, see BvhAccelerator::SetNodeLayout. The records follow the
+	// references, which keep their order.
+	void SetBvhNodeLayout(BvhAccelerator::NodeLayout _layout) { bvh_.SetNodeLayout(_layout); }
+	// Leaves are intersected from the triangle records, _hit.index is set to the hit face and
+	// _ray.tMax to the hit distance. The shape of the hit is left to the caller.
+	bool Intersect(maths::Ray &_ray, HitRecord &_hit) const;
+	bool DoesIntersect(maths::Ray const &_ray) const;
+	// Packet version of Intersect, returns the mask of the rays hit, see RayPacket
+	uint32_t IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const;
+	// Interaction at a hit of Intersect in the space of raw_data(), reported for _shape
+	void ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+								   Shape const &_shape, SurfaceInteraction &_hit_info) const;
+	maths::Decimal Area() const;
+	// Moves a Transformed mesh to a new world transform, the vertices are transformed again
+	// from the source data in place and the BVH is updated.
+	// Returns the number of BVH subtrees that had to be rebuilt.
+	uint32_t SetWorldTransform(maths::Transform const &_world_transform);
 private:
 	static constexpr uint32_t kBvhNodeSize = 10u;
-	static TriangleContainer_t MakeTriangles_(
-		maths::Transform const &_world_transform,
-		bool _flip_normals,
-		TriangleMeshRawData const &_raw_data,
-		core::MemoryRegion &_mem_region);
-	static BvhAccelerator::PrimitiveArray_t MakePrimitives_(TriangleContainer_t const &_triangles,
-															core::MemoryRegion &_mem_region);
+	// Faces of the raw data as BVH primitives
+	class FaceSource final : public BvhAccelerator::PrimitiveSource
+	{
+	public:
+		FaceSource(TriangleMeshRawData const &_raw_data) : raw_data_{ _raw_data } {}
+		uint32_t		primitive_count() const override;
+		maths::Bounds3f	PrimitiveBounds(uint32_t _primitive_index) const override;
+		maths::Bounds3f	ClippedPrimitiveBounds(uint32_t _primitive_index,
+											   maths::Bounds3f const &_clip) const override;
+	private:
+		TriangleMeshRawData const	&raw_data_;
+	};
+	void BuildRecords_();
+	void LogMemoryFootprint_() const;
 private:
 	core::MemoryRegion			mem_region_;
+	TriangleMeshRawData const	*base_data_;
+	TriangleMeshRawData			*world_data_; // nullptr unless the mesh is Transformed
 	TriangleMeshRawData const	&data_source_;
-	TriangleContainer_t 		triangles_;
+	FaceSource					face_source_;
 	BvhAccelerator				bvh_;
+	TriangleRecords				records_;
 };
 
 
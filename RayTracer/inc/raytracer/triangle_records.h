@@ -0,0 +1,63 @@
+#pragma once
+#ifndef __YS_TRIANGLE_RECORDS_HPP__
+#define __YS_TRIANGLE_RECORDS_HPP__
+
+#include <vector>
+
+#include "maths/maths.h"
+#include "raytracer/bvh_accelerator.h"
+
+
+namespace raytracer {
+
+
+class TriangleMeshRawData;
+
+
+// Vertices of the triangles referenced by a mesh BVH, stored in SoA form and in the reference
+// order of the BVH so that a leaf reads contiguous memory. Leaves run the watertight test of
+// Triangle (PBR 3.6.2) on kLaneCount triangles at once, the permutation of the ray shear picks
+// the coordinate arrays and the shear is applied to every lane.
+// Vertices are stored in single precision whatever maths::Decimal is. Float builds get the
+// results of Triangle::IntersectFaceWatertight, which tests again the lanes where an edge
+// function rounds to zero. Double builds only use them to find candidate triangles, with a
+// bound on the rounding error of the edge functions, and test the candidates with
+// Triangle::IntersectFaceWatertight.
+class TriangleRecords final :
+	public BvhAccelerator::LeafIntersector
+{
+public:
+	TriangleRecords();
+	// _reference_faces holds the face index of the triangle behind each BVH reference.
+	// _raw_data must outlive the records, the scalar test reads its vertices back.
+	void	Build(TriangleMeshRawData const &_raw_data,
+				  std::vector<uint32_t> const &_reference_faces);
+	bool	IntersectLeaf(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+						  HitRecord &_hit) const override;
+	bool	DoesIntersectLeaf(maths::Ray const &_ray, uint32_t _first,
+							  uint32_t _count) const override;
+	uint32_t	face_index(uint32_t _reference_index) const { return face_indices_[_reference_index]; }
+	size_t		record_count() const { return face_indices_.size(); }
+	size_t		memory_size() const;
+private:
+	// Triangles are tested by groups of kLaneCount, the arrays are padded with null records so
+	// that the last group of a leaf can be loaded whole.
+	static constexpr uint32_t	kLaneCount = 4u;
+	// Returns one bit per hit triangle of [_first, _first + _count), _count <= kLaneCount
+	uint32_t	IntersectGroup_(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+								maths::Decimal *_t, maths::Decimal *_u, maths::Decimal *_v) const;
+	// Scalar watertight test of a record, in maths::Decimal precision
+	bool		IntersectRecord_(maths::Ray const &_ray, uint32_t _record,
+								 maths::Decimal &_t, maths::Decimal &_u, maths::Decimal &_v) const;
+private:
+	// vertices_[i][axis] holds the coordinate axis of the vertex i of each record
+	std::vector<float>			vertices_[3][3];
+	std::vector<uint32_t>		face_indices_;
+	TriangleMeshRawData const	*raw_data_;
+};
+
+
+} // namespace raytracer
+
+
+#endif // __YS_TRIANGLE_RECORDS_HPP__
@@ -0,0 +1,74 @@
+#pragma once
+#ifndef __YS_WAVEFRONT_HPP__
+#define __YS_WAVEFRONT_HPP__
+
+#include <vector>
+
+#include "maths/maths.h"
+#include "maths/bounds.h"
+#include "maths/ray.h"
+#include "maths/vector.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/surface_interaction.h"
+
+
+namespace raytracer {
+
+
+// Rays traced as a batch through Integrator::Scene, each remembering the path that spawned it.
+// Results are stored at the index of their ray whatever the traversal order.
+struct RayStream
+{
+	void	Clear()
+	{
+		rays.clear();
+		owners.clear();
+		hits.clear();
+		occluded.clear();
+		order.clear();
+	}
+	// Traverses the rays of each batch of _batch_size rays by direction octant, then along a
+	// Morton curve of their origins in _bounds, so that consecutive rays visit the same nodes.
+	// A batch size of 0 keeps the stream order.
+	void	SortForTraversal(maths::Bounds3f const &_bounds, size_t _batch_size);
+	void	Push(maths::Ray const &_ray, uint32_t _owner)
+	{
+		rays.push_back(_ray);
+		owners.push_back(_owner);
+	}
+	size_t	size() const { return rays.size(); }
+
+	std::vector<maths::Ray>		rays;
+	std::vector<uint32_t>		owners;
+	std::vector<HitRecord>		hits;		// filled by IntersectStream
+	std::vector<uint8_t>		occluded;	// filled by OccludedStream, 1 when occluded
+	std::vector<uint32_t>		order;		// traversal order, stream order when empty
+};
+
+
+// Camera sample of a wave
+struct WavefrontPath
+{
+	maths::Ray			ray;
+	HitRecord			hit;
+	SurfaceInteraction	hit_info;		// only valid when hit.primitive is set
+	maths::Vec3f		color;			// estimate of the sample, filled by the integrator
+	uint32_t			index;			// generation order, pixel major
+	uint32_t			first_sample;	// first of the array samples of the path in Wave::samples
+};
+
+
+// Camera samples integrated together. Paths are sorted by hit primitive and face before the
+// integrator shades them, their array samples are drawn in the order Li would draw them.
+struct Wave
+{
+	std::vector<WavefrontPath>	paths;
+	std::vector<maths::Vec2f>	samples;
+	RayStream					camera_rays;
+};
+
+
+} // namespace raytracer
+
+
+#endif // __YS_WAVEFRONT_HPP__
@@ -8,9 +8,11 @@
 #include "boost/filesystem.hpp"
 #include "boost/numeric/conversion/cast.hpp"
 
+#include "api/mesh_cache.h"
 #include "api/param_set.h"
 #include "api/resource_context.h"
 #include "common_macros.h"
+#include "core/hash.h"
 #include "core/logger.h"
 #include "maths/transform.h"
 #include "raytracer/camera.h"
@@ -90,6 +92,19 @@ MakeTriangleMeshRawData(api::ResourceContext &_context, api::ParamSet const &_pa
 		aiProcess_Triangulate |
 		aiProcess_PreTransformVertices |
 		aiProcess_JoinIdenticalVertices;
+
+	// Imports are cached by file content, and by import flags in case they change
+	std::string			cache_file{ "" };
+	uint64_t			file_hash{ 0u };
+	if (!_context.cache_dir().empty() && core::HashFile(path_string, file_hash))
+	{
+		cache_file = MeshCacheFile(_context.cache_dir(), core::HashValue(load_flags, file_hash),
+								   "ysmesh");
+		result = ReadCachedRawData(cache_file, _context.mem_region());
+		if (result != nullptr)
+			return result;
+	}
+
 	Assimp::Importer	importer;
 	aiScene const		*scene = importer.ReadFile(path_string.c_str(), load_flags);
 	if (scene != nullptr)
@@ -168,6 +183,8 @@ MakeTriangleMeshRawData(api::ResourceContext &_context, api::ParamSet const &_pa
 		result = new (_context.mem_region()) raytracer::TriangleMeshRawData{
 			out_triangle_count, out_indices, out_vertices,
 			(load_normals ? &out_normals : nullptr) };
+		if (!cache_file.empty())
+			WriteCachedRawData(cache_file, *result);
 	}
 	else
 	{
@@ -264,6 +281,158 @@ MakeSphere(api::ResourceContext &_context, api::ParamSet const &_params)
 		raytracer::Sphere{ world_transform, flip_normals, radius, z_min, z_max, phi_max };
 	return sphere_shape;
 }
+// Empty when caching is disabled
+std::string
+MakeBvhCacheFile_(api::ResourceContext &_context,
+				  raytracer::TriangleMeshRawData const &_raw_data,
+				  uint32_t const _bvh_node_width, bool const _bvh_quantized_nodes,
+				  raytracer::BvhAccelerator::BuildMethod const _bvh_build_method,
+				  float const _bvh_duplication_budget,
+				  maths::Transform const *const _world_transform)
+{
+	if (_context.cache_dir().empty())
+		return "";
+	uint64_t key = HashMeshGeometry(_raw_data);
+	key = core::HashValue(_bvh_node_width, key);
+	key = core::HashValue(_bvh_quantized_nodes, key);
+	key = core::HashValue(_bvh_build_method, key);
+	key = core::HashValue(_bvh_duplication_budget, key);
+	if (_world_transform != nullptr)
+		key = core::HashValue(_world_transform->m().e, key);
+	return MeshCacheFile(_context.cache_dir(), key, "ysbvh");
+}
+
+
+// Pushes the raw data descriptor of the mesh file at _path_string if it is missing.
+// Returns false when there is no such file.
+bool
+RegisterMeshRawData_(api::ResourceContext &_context, std::string const &_path_string)
+{
+	boost::filesystem::path path(_path_string);
+	if (path.is_relative())
+	{
+		boost::filesystem::path workdir(_context.workdir());
+		path = workdir / path;
+		YS_ASSERT(path.is_absolute());
+	}
+	if (!boost::filesystem::exists(path))
+	{
+		LOG_ERROR(tools::kChannelGeneral,
+				  "No file found to create a triangle mesh at path : " + path.generic_string());
+		return false;
+	}
+	if (!_context.IsUniqueIdFree(_path_string))
+	{
+		YS_ASSERT(_context.GetDesc(_path_string).type_id ==
+				  ResourceContext::ObjectType::kTriangleMeshRawData);
+	}
+	else
+	{
+		ParamSet *const params = new (_context.mem_region()) ParamSet();
+		params->PushString("path", _path_string);
+		_context.PushDescriptor(_path_string,
+								ResourceContext::ObjectType::kTriangleMeshRawData,
+								*params);
+	}
+	return true;
+}
+
+
+struct MeshBvhParams_
+{
+	uint32_t								node_width;
+	bool									quantized_nodes;
+	raytracer::BvhAccelerator::BuildMethod	build_method;
+	float									duplication_budget;
+	raytracer::BvhAccelerator::NodeLayout	node_layout;
+};
+
+
+MeshBvhParams_
+FindMeshBvhParams_(api::ParamSet const &_params)
+{
+	MeshBvhParams_ result{};
+	result.node_width = boost::numeric_cast<uint32_t>(
+		_params.FindUint("node_width", raytracer::BvhAccelerator::kBinaryNodeWidth));
+	result.quantized_nodes = _params.FindBool("quantized_nodes", false);
+	// "linear" trades trace performance for a much faster build, "spatial" spends build time
+	// and duplicate references on tighter nodes around large and thin triangles
+	std::string const bvh_builder = _params.FindString("bvh_builder", "sah");
+	result.build_method = raytracer::BvhAccelerator::kSahBuild;
+	if (bvh_builder == "linear")
+		result.build_method = raytracer::BvhAccelerator::kLinearBuild;
+	else if (bvh_builder == "spatial")
+		result.build_method = raytracer::BvhAccelerator::kSpatialSahBuild;
+	else if (bvh_builder != "sah")
+		LOG_WARNING(tools::kChannelGeneral, "Unknown bvh_builder " + bvh_builder +
+					", falling back to sah.");
+	result.duplication_budget = static_cast<float>(_params.FindFloat(
+		"duplication_budget", raytracer::BvhAccelerator::kDefaultDuplicationBudget));
+	// "treelet" and "hot_treelet" reorder the nodes once they are built or loaded from the
+	// cache, which always holds the depth first order. The layout isn't part of the cache key.
+	std::string const node_layout = _params.FindString("node_layout", "depth_first");
+	result.node_layout = raytracer::BvhAccelerator::kDepthFirstLayout;
+	if (node_layout == "treelet")
+		result.node_layout = raytracer::BvhAccelerator::kTreeletLayout;
+	else if (node_layout == "hot_treelet")
+		result.node_layout = raytracer::BvhAccelerator::kHotTreeletLayout;
+	else if (node_layout != "depth_first")
+		LOG_WARNING(tools::kChannelGeneral, "Unknown node_layout " + node_layout +
+					", falling back to depth_first.");
+	return result;
+}
+
+
+// Motion over a frame sequence : a world space translation and a rotation about the object
+// origin (angle in degrees, then axis), reached on the last frame. Returns false without motion.
+bool
+FindMeshMotion_(api::ParamSet const &_params, maths::Vec3f &o_translate, maths::Vec4f &o_rotate)
+{
+	o_translate = _params.FindFloat<3>("motion_translate", { 0._d, 0._d, 0._d });
+	o_rotate = _params.FindFloat<4>("motion_rotate", { 0._d, 0._d, 0._d, 1._d });
+	return (o_translate != maths::Vec3f{ 0._d, 0._d, 0._d }) || (o_rotate.x != 0._d);
+}
+
+
+raytracer::TriangleMeshData const *
+FetchSharedTriangleMeshData(api::ResourceContext &_context, api::ParamSet const &_params)
+{
+	std::string const path_string = _params.FindString("path", "");
+	maths::Vec3f motion_translate{};
+	maths::Vec4f motion_rotate{};
+	if (FindMeshMotion_(_params, motion_translate, motion_rotate))
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Instanced triangle mesh " + path_string +
+					" can't be animated, motion is ignored.");
+	}
+	raytracer::TriangleMeshData const *result = _context.FindSharedMeshData(path_string);
+	if (result != nullptr)
+		return result;
+	if (path_string.empty() || !RegisterMeshRawData_(_context, path_string))
+		return nullptr;
+	// The first shape loaded from the file decides the BVH parameters of all its instances
+	MeshBvhParams_ const bvh_params = FindMeshBvhParams_(_params);
+	raytracer::TriangleMeshRawData const &raw_data =
+		_context.Fetch<raytracer::TriangleMeshRawData>(path_string);
+	std::string const bvh_cache_file = MakeBvhCacheFile_(_context, raw_data,
+		bvh_params.node_width, bvh_params.quantized_nodes, bvh_params.build_method,
+		bvh_params.duplication_budget, nullptr);
+	raytracer::TriangleMeshData *const mesh_data =
+		new (_context.mem_region()) raytracer::TriangleMeshData{
+		raw_data,
+		bvh_params.node_width,
+		bvh_params.quantized_nodes,
+		bvh_params.build_method,
+		bvh_params.duplication_budget,
+		bvh_cache_file,
+		raytracer::InstancingPolicyClass::SharedSource{} };
+	mesh_data->SetBvhNodeLayout(bvh_params.node_layout);
+	_context.SetSharedMeshData(path_string, *mesh_data);
+	_context.PushMeshData(*mesh_data);
+	return mesh_data;
+}
+
+
 raytracer::Shape*
 MakeTriangleMesh(api::ResourceContext &_context, api::ParamSet const &_params)
 {
@@ -271,100 +440,70 @@ MakeTriangleMesh(api::ResourceContext &_context, api::ParamSet const &_params)
 	maths::Transform const	&world_transform = _params.FindTransform("world_transform", maths::Transform::Identity());
 	bool const				flip_normals = _params.FindBool("flip_normals", false);
 	std::string const		path_string = _params.FindString("path", "");
+	maths::Vec3f			motion_translate{};
+	maths::Vec4f			motion_rotate{};
+	bool const				is_animated = FindMeshMotion_(_params, motion_translate,
+														  motion_rotate);
 	if (path_string != "")
 	{
-		boost::filesystem::path path(path_string);
-		if (path.is_relative())
+		if (RegisterMeshRawData_(_context, path_string))
 		{
-			boost::filesystem::path workdir(_context.workdir());
-			path = workdir / path;
-			YS_ASSERT(path.is_absolute());
-		}
-
-		if (boost::filesystem::exists(path))
-		{
-			// if rawdata descriptor is missing, push it
-			if (!_context.IsUniqueIdFree(path_string))
-			{
-				YS_ASSERT(_context.GetDesc(path_string).type_id ==
-						  ResourceContext::ObjectType::kTriangleMeshRawData);
-			}
-			else
-			{
-				ParamSet *const params = new (_context.mem_region()) ParamSet();
-				params->PushString("path", path_string);
-				_context.PushDescriptor(path_string,
-										ResourceContext::ObjectType::kTriangleMeshRawData,
-										*params);
-			}
 			// pick instancing policy
 				// count trianglemeshes sharing the same path_string
 				// 1 => transform, n => instancing
-			ResourceContext::ObjectDescriptorContainer_t const shape_descs =
-				_context.GetAllDescsOfType(ResourceContext::ObjectType::kShape);
-			uint32_t const instance_count = boost::numeric_cast<uint32_t>(std::count_if(
-				shape_descs.cbegin(), shape_descs.cend(),
-				[&path_string](ResourceContext::ObjectDescriptor const *_desc) {
-					return _desc->param_set.FindString("path", "") == path_string;
-				}));
+			uint32_t const instance_count = _context.MeshPathUseCount(path_string);
 			YS_ASSERT(instance_count != 0u);
 			// switch on instancing policy class
 			// case transform
 				// fetch rawdata
 				// build TriangleMeshData, and then TriangleMesh
 			// case sharedsource
-				// try to find a preexisting TriangleMesh that shares the same rawdata
-				// if it exists
-					// build new TriangleMesh using found "sibling"'s TriangleMeshData
-				// else
-					// fallback on fetching rawdata, then building TriangleMeshData and TriangleMesh
+				// fetch the TriangleMeshData shared by the instances, built by the first one
+				// build TriangleMesh over it
 			if (instance_count == 1u) // transform
 			{
 				using InstancingPolicy = raytracer::InstancingPolicyClass::Transformed;
 				using LocalTriangleMesh = raytracer::TriangleMesh<InstancingPolicy>;
+				MeshBvhParams_ const bvh_params = FindMeshBvhParams_(_params);
 				raytracer::TriangleMeshRawData const &raw_data =
 					_context.Fetch<raytracer::TriangleMeshRawData>(path_string);
-				raytracer::TriangleMeshData const *const mesh_data =
+				// Triangles are moved to world space, the BVH depends on the transform
+				std::string const bvh_cache_file = MakeBvhCacheFile_(_context, raw_data,
+					bvh_params.node_width, bvh_params.quantized_nodes, bvh_params.build_method,
+					bvh_params.duplication_budget, &world_transform);
+				raytracer::TriangleMeshData *const mesh_data =
 					new (_context.mem_region()) raytracer::TriangleMeshData{
 					world_transform,
-					flip_normals,
 					raw_data,
+					bvh_params.node_width,
+					bvh_params.quantized_nodes,
+					bvh_params.build_method,
+					bvh_params.duplication_budget,
+					bvh_cache_file,
 					InstancingPolicy{} };
+				mesh_data->SetBvhNodeLayout(bvh_params.node_layout);
+				_context.PushMeshData(*mesh_data);
 				result = new (_context.mem_region()) LocalTriangleMesh{ world_transform,
 																		flip_normals,
 																		*mesh_data };
+				if (is_animated)
+				{
+					maths::Transform const end_transform =
+						maths::Translate(motion_translate) * world_transform *
+						maths::Rotate(motion_rotate.x, { motion_rotate.y, motion_rotate.z,
+														 motion_rotate.w });
+					_context.PushMeshAnimation({ mesh_data, maths::AnimatedTransform{
+						world_transform, 0._d, end_transform, 1._d } });
+				}
 			}
 			else // sharedsource
 			{
 				using InstancingPolicy = raytracer::InstancingPolicyClass::SharedSource;
 				using LocalTriangleMesh = raytracer::TriangleMesh<InstancingPolicy>;
-				using DescConstIt = ResourceContext::ObjectDescriptorContainer_t::const_iterator;
-				DescConstIt const odcit = std::find_if(
-					shape_descs.cbegin(), shape_descs.cend(),
-					[&path_string, &_context](ResourceContext::ObjectDescriptor const *_desc) {
-						std::string const path_param = _desc->param_set.FindString("path", "");
-						return (path_param == path_string)
-							&& (_context.HasInstance(_desc->unique_id));
-					});
-				if (odcit != shape_descs.cend())
-				{
-					ResourceContext::ObjectDescriptor const &desc = **odcit;
-					LocalTriangleMesh const &sibling = dynamic_cast<LocalTriangleMesh const &>(
-						_context.GetInstance<raytracer::Shape>(desc.unique_id));
-					result = new (_context.mem_region()) LocalTriangleMesh{ world_transform,
-																			flip_normals,
-																			sibling };
-				}
-				else
+				raytracer::TriangleMeshData const *const mesh_data =
+					FetchSharedTriangleMeshData(_context, _params);
+				if (mesh_data != nullptr)
 				{
-					raytracer::TriangleMeshRawData const &raw_data =
-						_context.Fetch<raytracer::TriangleMeshRawData>(path_string);
-					raytracer::TriangleMeshData const *const mesh_data =
-						new (_context.mem_region()) raytracer::TriangleMeshData{
-						world_transform,
-						flip_normals,
-						raw_data,
-						InstancingPolicy{} };
 					result = new (_context.mem_region()) LocalTriangleMesh{ world_transform,
 																			flip_normals,
 																			*mesh_data };
@@ -373,14 +512,9 @@ MakeTriangleMesh(api::ResourceContext &_context, api::ParamSet const &_params)
 			if (!result)
 			{
 				LOG_ERROR(tools::kChannelGeneral,
-						  "Failed to load a triangle mesh at path : " + path.generic_string());
+						  "Failed to load a triangle mesh at path : " + path_string);
 			}
 		}
-		else
-		{
-			LOG_ERROR(tools::kChannelGeneral,
-					  "No file found to create a triangle mesh at path : " + path.generic_string());
-		}
 	}
 	else
 	{
@@ -446,6 +580,21 @@ IntegratorCommonMake(api::ResourceContext &_context, api::ParamSet const &_param
 		FetchForIDOrAny<raytracer::Sampler>(sampler_id, _context);
 	return std::make_tuple(&camera, &film, &sampler);
 }
+
+void
+IntegratorCommonSetup(raytracer::Integrator &_integrator, api::ParamSet const &_params)
+{
+	uint64_t const	thread_count = _params.FindUint("thread_count", 0u);
+	uint64_t const	tile_size = _params.FindUint("tile_size", raytracer::Integrator::kDefaultTileSize);
+	uint64_t const	packet_size = _params.FindUint("packet_size", 0u);
+	uint64_t const	wavefront_batch_size = _params.FindUint("wavefront_batch_size", 0u);
+	uint64_t const	ray_sort_batch_size = _params.FindUint("ray_sort_batch_size", 0u);
+	_integrator.SetThreadCount(boost::numeric_cast<uint32_t>(thread_count));
+	_integrator.SetTileSize(boost::numeric_cast<uint32_t>(tile_size));
+	_integrator.SetPacketSize(boost::numeric_cast<uint32_t>(packet_size));
+	_integrator.SetWavefrontBatchSize(boost::numeric_cast<uint32_t>(wavefront_batch_size));
+	_integrator.SetRaySortBatchSize(boost::numeric_cast<uint32_t>(ray_sort_batch_size));
+}
 }
 
 raytracer::Integrator*
@@ -459,6 +608,7 @@ MakeNormalIntegrator(api::ResourceContext &_context, api::ParamSet const &_param
 									 *std::get<1>(integrator_base_params),
 									 *std::get<2>(integrator_base_params),
 									 remap, absolute };
+	IntegratorCommonSetup(*normal_integrator, _params);
 	return normal_integrator;
 }
 
@@ -473,6 +623,7 @@ MakeAOIntegrator(api::ResourceContext &_context, api::ParamSet const &_params)
 								 *std::get<1>(integrator_base_params),
 								 *std::get<2>(integrator_base_params),
 								 sample_count, shading_geometry };
+	IntegratorCommonSetup(*ao_integrator, _params);
 	return ao_integrator;
 }
 
@@ -486,6 +637,7 @@ MakeDirectLightingIntegrator(api::ResourceContext &_context, api::ParamSet const
 											 *std::get<1>(integrator_base_params),
 											 *std::get<2>(integrator_base_params),
 											 shadow_ray_count };
+	IntegratorCommonSetup(*direct_lighting_integrator, _params);
 	return direct_lighting_integrator;
 }
 
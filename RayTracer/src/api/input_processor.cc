@@ -35,6 +35,7 @@ enum TokenId
 	kNone,
 
 	kOutput,
+	kCacheDir,
 	kObjectId,
 	kFilm,
 	kCamera,
@@ -42,6 +43,8 @@ enum TokenId
 	kLight,
 	kSampler,
 	kIntegrator,
+	kGroup,
+	kInstance,
 	kScopeBegin,
 	kScopeEnd,
 	kParamBegin,
@@ -69,7 +72,11 @@ enum TokenId
 	kLightGroup,
 	kSamplerGroup,
 	kIntegratorGroup,
+	kGroupGroup,
+	kGroupContentGroup,
+	kInstanceGroup,
 	kOutputGroup,
+	kCacheDirGroup,
 	kSceneGroup,
 
 	kEnd,
@@ -100,6 +107,7 @@ using ProductionStack_t = std::vector<ProductionMetadata>;
 TokenTable_t const		token_table
 {
 	{ "Output", kOutput },
+	{ "CacheDir", kCacheDir },
 	{ "ID", kObjectId },
 	{ "Film", kFilm },
 	{ "Camera", kCamera },
@@ -107,6 +115,8 @@ TokenTable_t const		token_table
 	{ "Light", kLight },
 	{ "Sampler", kSampler },
 	{ "Integrator", kIntegrator },
+	{ "Group", kGroup },
+	{ "Instance", kInstance },
 	{ "{", kScopeBegin },
 	{ "}", kScopeEnd },
 	{ "[", kParamBegin }, 
@@ -132,6 +142,7 @@ ProductionRules_t const		production_rules
 		{ kScale, { kScaleGroup, kSceneGroup } },
 		{ kTransformIdentity, { kTransformIdentity, kSceneGroup } },
 		{ kOutput, { kOutputGroup, kSceneGroup } },
+		{ kCacheDir, { kCacheDirGroup, kSceneGroup } },
 
 		{ kFilm, { kFilmGroup, kSceneGroup } },
 		{ kCamera, { kCameraGroup, kSceneGroup } },
@@ -139,6 +150,8 @@ ProductionRules_t const		production_rules
 		{ kLight, { kLightGroup, kSceneGroup } },
 		{ kSampler, { kSamplerGroup, kSceneGroup } },
 		{ kIntegrator, { kIntegratorGroup, kSceneGroup } },
+		{ kGroup, { kGroupGroup, kSceneGroup } },
+		{ kInstance, { kInstanceGroup, kSceneGroup } },
 		{ kDefault, { kEnd } }
 	} },
 
@@ -146,6 +159,10 @@ ProductionRules_t const		production_rules
 		{ kDefault, { kOutput, kString } },
 	} },
 
+	{ kCacheDirGroup, {
+		{ kDefault, { kCacheDir, kString } },
+	} },
+
 	{ kTranslateGroup, {
 		{ kDefault, { kTranslate, kNumber, kNumber, kNumber } },
 	} },
@@ -183,6 +200,22 @@ ProductionRules_t const		production_rules
 		{ kDefault, { kIntegrator, kString, kScopeBegin, kAttributeGroup, kScopeEnd } },
 	} },
 
+	{ kGroupGroup, {
+		{ kDefault, { kGroup, kString, kScopeBegin, kGroupContentGroup, kScopeEnd } },
+	} },
+	{ kGroupContentGroup, {
+		{ kTranslate, { kTranslateGroup, kGroupContentGroup } },
+		{ kRotate, { kRotateGroup, kGroupContentGroup } },
+		{ kScale, { kScaleGroup, kGroupContentGroup } },
+		{ kTransformIdentity, { kTransformIdentity, kGroupContentGroup } },
+		{ kShape, { kShapeGroup, kGroupContentGroup } },
+		{ kInstance, { kInstanceGroup, kGroupContentGroup } },
+		{ kDefault, {} },
+	} },
+	{ kInstanceGroup, {
+		{ kDefault, { kInstance, kString, kScopeBegin, kAttributeGroup, kScopeEnd } },
+	} },
+
 	{ kPropertiesGroup, {
 		{ kString, { kParamGroup, kPropertiesGroup } },
 		{ kDefault, {} }
@@ -238,6 +271,9 @@ void	SamplerGroup(TranslationState &_state,
 void	IntegratorGroup(TranslationState &_state,
 						std::vector<Token>::const_iterator _production_begin,
 						std::vector<Token>::const_iterator _production_end);
+void	InstanceGroup(TranslationState &_state,
+					  std::vector<Token>::const_iterator _production_begin,
+					  std::vector<Token>::const_iterator _production_end);
 void	FilmGroup(TranslationState &_state,
 				  std::vector<Token>::const_iterator _production_begin,
 				  std::vector<Token>::const_iterator _production_end);
@@ -256,10 +292,16 @@ void	ScaleGroup(TranslationState &_state,
 void	OutputGroup(TranslationState &_state,
 					std::vector<Token>::const_iterator _production_begin,
 					std::vector<Token>::const_iterator _production_end);
+void	CacheDirGroup(TranslationState &_state,
+					  std::vector<Token>::const_iterator _production_begin,
+					  std::vector<Token>::const_iterator _production_end);
 
 void	IdentityTerminal(TranslationState &_state,
 						 std::vector<Token>::const_iterator _production_begin,
 						 std::vector<Token>::const_iterator _production_end);
+void	GroupTerminal(TranslationState &_state,
+					  std::vector<Token>::const_iterator _production_begin,
+					  std::vector<Token>::const_iterator _production_end);
 void	ScopeBeginTerminal(TranslationState &_state,
 						   std::vector<Token>::const_iterator _production_begin,
 						   std::vector<Token>::const_iterator _production_end);
@@ -274,14 +316,17 @@ TranslationTable_t	semantic_actions = {
 	{ kLightGroup, &api::LightGroup },
 	{ kSamplerGroup, &api::SamplerGroup },
 	{ kIntegratorGroup, &api::IntegratorGroup },
+	{ kInstanceGroup, &api::InstanceGroup },
 	{ kFilmGroup, &api::FilmGroup },
 	{ kCameraGroup, &api::CameraGroup },
 	{ kTranslateGroup, &api::TranslateGroup },
 	{ kRotateGroup, &api::RotateGroup },
 	{ kScaleGroup, &api::ScaleGroup },
 	{ kOutputGroup, &api::OutputGroup },
+	{ kCacheDirGroup, &api::CacheDirGroup },
 
 	{ kTransformIdentity, &api::IdentityTerminal },
+	{ kGroup, &api::GroupTerminal },
 	{ kScopeBegin, &api::ScopeBeginTerminal },
 	{ kScopeEnd, &api::ScopeEndTerminal },
 };
@@ -636,6 +681,15 @@ IntegratorGroup(TranslationState &_state,
 	_state.Integrator(integrator_type);
 }
 void
+InstanceGroup(TranslationState &_state,
+			  std::vector<Token>::const_iterator _production_begin,
+			  std::vector<Token>::const_iterator _production_end)
+{
+	LOG_INFO(tools::kChannelParsing, "Instance group ended, applying semantic action..");
+	std::string const	group_name = std::next(_production_begin, 1)->text;
+	_state.Instance(group_name);
+}
+void
 FilmGroup(TranslationState &_state,
 		  std::vector<Token>::const_iterator _production_begin,
 		  std::vector<Token>::const_iterator _production_end)
@@ -694,6 +748,15 @@ OutputGroup(TranslationState &_state,
 	std::string const &value = std::next(_production_begin)->text;
 	_state.Output(value);
 }
+void
+CacheDirGroup(TranslationState &_state,
+			  std::vector<Token>::const_iterator _production_begin,
+			  std::vector<Token>::const_iterator _production_end)
+{
+	LOG_INFO(tools::kChannelParsing, "CacheDir group ended, applying semantic action..");
+	std::string const &value = std::next(_production_begin)->text;
+	_state.CacheDir(value);
+}
 
 void
 IdentityTerminal(TranslationState &_state,
@@ -704,6 +767,16 @@ IdentityTerminal(TranslationState &_state,
 	_state.Identity();
 }
 void
+GroupTerminal(TranslationState &_state,
+			  std::vector<Token>::const_iterator _production_begin,
+			  std::vector<Token>::const_iterator _production_end)
+{
+	LOG_INFO(tools::kChannelParsing, "Group terminal found, applying semantic action..");
+	// Called once the group name is matched, before the scope of the group begins
+	std::string const	group_name = std::next(_production_begin, 1)->text;
+	_state.GroupBegin(group_name);
+}
+void
 ScopeBeginTerminal(TranslationState &_state,
 				   std::vector<Token>::const_iterator _production_begin,
 				   std::vector<Token>::const_iterator _production_end)
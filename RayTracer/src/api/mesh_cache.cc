@@ -0,0 +1,184 @@
+#include "api/mesh_cache.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "boost/filesystem.hpp"
+
+#include "common_macros.h"
+#include "core/hash.h"
+#include "core/logger.h"
+#include "raytracer/triangle_mesh_data.h"
+
+
+namespace api {
+
+
+namespace {
+
+constexpr uint64_t	kRawDataMagic = 0x31304853454d5359ull;	// "YSMESH01"
+constexpr uint32_t	kRawDataVersion = 2u;
+// The header and each array are padded to this size, so that arrays start on aligned offsets
+// and the file can be mapped as is
+constexpr size_t	kCacheAlignment = 64u;
+
+struct RawDataHeader
+{
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	decimal_size;
+	int32_t		triangle_count;
+	uint32_t	vertex_count;
+	uint32_t	normal_count;
+	uint32_t	tangent_count;
+	uint32_t	uv_count;
+	uint32_t	reserved[5];
+	uint64_t	payload_hash;		// every array in file order, padding excluded
+};
+static_assert(sizeof(RawDataHeader) == kCacheAlignment);
+
+size_t
+PaddingSize(size_t const _size)
+{
+	return (kCacheAlignment - _size % kCacheAlignment) % kCacheAlignment;
+}
+
+template <typename Container_t> uint64_t
+HashArray(Container_t const &_array, uint64_t const _hash)
+{
+	return core::HashBytes(_array.data(), _array.size() * sizeof(_array[0]), _hash);
+}
+
+template <typename Container_t> void
+ReadArray(std::ifstream &_file, Container_t &_array, size_t const _count)
+{
+	size_t const size = _count * sizeof(_array[0]);
+	_array.resize(_count);
+	_file.read(reinterpret_cast<char*>(_array.data()), size);
+	_file.ignore(static_cast<std::streamsize>(PaddingSize(size)));
+}
+
+template <typename Container_t> void
+WriteArray(std::ofstream &_file, Container_t const &_array)
+{
+	static char const	padding[kCacheAlignment]{};
+	size_t const		size = _array.size() * sizeof(_array[0]);
+	_file.write(reinterpret_cast<char const*>(_array.data()), size);
+	_file.write(padding, static_cast<std::streamsize>(PaddingSize(size)));
+}
+
+} // namespace
+
+
+std::string
+MeshCacheFile(std::string const &_cache_dir, uint64_t _key, std::string const &_extension)
+{
+	std::stringstream file_name{};
+	file_name << std::hex << std::setw(16) << std::setfill('0') << _key << '.' << _extension;
+	return (boost::filesystem::path{ _cache_dir } / file_name.str()).generic_string();
+}
+
+
+uint64_t
+HashMeshGeometry(raytracer::TriangleMeshRawData const &_raw_data)
+{
+	return HashArray(_raw_data.vertices, HashArray(_raw_data.indices, core::kHashSeed));
+}
+
+
+raytracer::TriangleMeshRawData *
+ReadCachedRawData(std::string const &_cache_file, core::MemoryRegion &_mem_region)
+{
+	std::ifstream file{ _cache_file, std::ios::binary };
+	if (!file)
+		return nullptr;
+	RawDataHeader header{};
+	file.read(reinterpret_cast<char*>(&header), sizeof(RawDataHeader));
+	if (!file || header.magic != kRawDataMagic || header.version != kRawDataVersion ||
+		header.decimal_size != sizeof(maths::Decimal) || header.triangle_count <= 0)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Ignored mesh cache file " + _cache_file +
+					", it was written by an incompatible build.");
+		return nullptr;
+	}
+
+	raytracer::TriangleMeshRawData::IndicesContainer_t	indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t	vertices{};
+	raytracer::TriangleMeshRawData::NormalsContainer_t	normals{};
+	raytracer::TriangleMeshRawData::TangentsContainer_t	tangents{};
+	raytracer::TriangleMeshRawData::UvsContainer_t		uvs{};
+	ReadArray(file, indices, 3u * static_cast<size_t>(header.triangle_count));
+	ReadArray(file, vertices, header.vertex_count);
+	ReadArray(file, normals, header.normal_count);
+	ReadArray(file, tangents, header.tangent_count);
+	ReadArray(file, uvs, header.uv_count);
+	uint64_t const payload_hash = HashArray(uvs, HashArray(tangents, HashArray(normals,
+		HashArray(vertices, HashArray(indices, core::kHashSeed)))));
+	// Faces index the vertices and their attributes, which come one per vertex if at all
+	size_t const	vertex_count = vertices.size();
+	bool			indices_are_valid = true;
+	for (int32_t const index : indices)
+		indices_are_valid = indices_are_valid && index >= 0 &&
+			static_cast<size_t>(index) < vertex_count;
+	bool const		attributes_are_valid = (normals.empty() || normals.size() == vertex_count) &&
+		(tangents.empty() || tangents.size() == vertex_count) &&
+		(uvs.empty() || uvs.size() == vertex_count);
+	if (!file || payload_hash != header.payload_hash || vertices.empty() ||
+		!indices_are_valid || !attributes_are_valid)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Ignored mesh cache file " + _cache_file +
+					", its content is corrupted.");
+		return nullptr;
+	}
+
+	LOG_INFO(tools::kChannelGeneral, "Loaded " + std::to_string(header.triangle_count) +
+			 " triangles from mesh cache file " + _cache_file);
+	return new (_mem_region) raytracer::TriangleMeshRawData{
+		header.triangle_count, indices, vertices,
+		(normals.empty() ? nullptr : &normals),
+		(tangents.empty() ? nullptr : &tangents),
+		(uvs.empty() ? nullptr : &uvs) };
+}
+
+
+void
+WriteCachedRawData(std::string const &_cache_file,
+				   raytracer::TriangleMeshRawData const &_raw_data)
+{
+	RawDataHeader const header{
+		kRawDataMagic, kRawDataVersion, sizeof(maths::Decimal),
+		_raw_data.triangle_count,
+		static_cast<uint32_t>(_raw_data.vertices.size()),
+		static_cast<uint32_t>(_raw_data.normals.size()),
+		static_cast<uint32_t>(_raw_data.tangents.size()),
+		static_cast<uint32_t>(_raw_data.uvs.size()),
+		{},
+		HashArray(_raw_data.uvs, HashArray(_raw_data.tangents, HashArray(_raw_data.normals,
+			HashArray(_raw_data.vertices, HashArray(_raw_data.indices, core::kHashSeed)))))
+	};
+
+	// Written aside first, so that an interrupted write never leaves a truncated cache file
+	std::string const	temporary_file = _cache_file + ".tmp";
+	bool				write_succeeded = false;
+	{
+		std::ofstream	file{ temporary_file, std::ios::binary | std::ios::trunc };
+		file.write(reinterpret_cast<char const*>(&header), sizeof(RawDataHeader));
+		WriteArray(file, _raw_data.indices);
+		WriteArray(file, _raw_data.vertices);
+		WriteArray(file, _raw_data.normals);
+		WriteArray(file, _raw_data.tangents);
+		WriteArray(file, _raw_data.uvs);
+		write_succeeded = static_cast<bool>(file);
+	}
+	std::remove(_cache_file.c_str());
+	if (!write_succeeded || std::rename(temporary_file.c_str(), _cache_file.c_str()) != 0)
+	{
+		std::remove(temporary_file.c_str());
+		LOG_WARNING(tools::kChannelGeneral, "Failed to write mesh cache file " + _cache_file);
+	}
+}
+
+
+} // namespace api
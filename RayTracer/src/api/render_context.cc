@@ -1,5 +1,15 @@
 #include "api/render_context.h"
 
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include "common_macros.h"
+#include "globals.h"
+#include "core/logger.h"
+
 namespace api
 {
 
@@ -7,16 +17,28 @@ namespace api
 RenderContext::RenderContext() :
 	integrator_{ nullptr },
 	primitives_{},
-	lights_{}
+	lights_{},
+	mesh_animations_{},
+	scene_bvh_{ nullptr },
+	instance_levels_{},
+	meshes_{}
 {}
 
 
 RenderContext::RenderContext(raytracer::Integrator &_integrator,
 							 PrimitiveContainer_t &_primitives,
-							 LightContainer_t &_lights) :
+							 LightContainer_t &_lights,
+							 MeshAnimationContainer_t const &_mesh_animations,
+							 raytracer::BvhAccelerator *_scene_bvh,
+							 InstanceLevelContainer_t const &_instance_levels,
+							 MeshDataContainer_t const &_meshes) :
 	integrator_{ &_integrator },
 	primitives_{ _primitives },
-	lights_{ _lights }
+	lights_{ _lights },
+	mesh_animations_{ _mesh_animations },
+	scene_bvh_{ _scene_bvh },
+	instance_levels_{ _instance_levels },
+	meshes_{ _meshes }
 {}
 
 
@@ -26,6 +48,10 @@ RenderContext::Clear()
 	integrator_ = nullptr;
 	primitives_.clear();
 	lights_.clear();
+	mesh_animations_.clear();
+	scene_bvh_ = nullptr;
+	instance_levels_.clear();
+	meshes_.clear();
 }
 
 
@@ -36,6 +62,14 @@ RenderContext::AddPrimitive(raytracer::Primitive *_prim)
 }
 
 
+void
+RenderContext::SetThreadCount(uint32_t const _thread_count)
+{
+	YS_ASSERT(integrator_);
+	integrator_->SetThreadCount(_thread_count);
+}
+
+
 bool
 RenderContext::GoodForRender() const
 {
@@ -46,9 +80,167 @@ RenderContext::GoodForRender() const
 void
 RenderContext::RenderAndWrite(std::string const &_path)
 {
+	// The scene primitives are expected to be wrapped in a single top level aggregate
+	YS_ASSERT(primitives_.size() <= 1u);
+	raytracer::Primitive const *const aggregate = primitives_.empty() ? nullptr : primitives_.front();
 	integrator_->Prepare(primitives_, lights_);
-	integrator_->Integrate({ primitives_, lights_ }, 0._d);
+	integrator_->Integrate({ aggregate, lights_ }, 0._d);
 	integrator_->camera().WriteToFile(_path);
+	WriteBvhReport_(boost::filesystem::path{ _path }.replace_extension(".bvh.json").string());
+}
+
+
+void
+RenderContext::RenderSequenceAndWrite(std::string const &_path, uint32_t _frame_count)
+{
+	YS_ASSERT(_frame_count > 0u);
+	if (mesh_animations_.empty())
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Rendering a sequence of a static scene.");
+	}
+	for (uint32_t frame_index = 0u; frame_index < _frame_count; ++frame_index)
+	{
+		maths::Decimal const time = (_frame_count > 1u) ?
+			static_cast<maths::Decimal>(frame_index) / static_cast<maths::Decimal>(_frame_count - 1u) :
+			0._d;
+		SetFrameTime_(time);
+		std::string const frame_path = FramePath_(_path, frame_index);
+		LOG_INFO(tools::kChannelGeneral, "Rendering frame " + std::to_string(frame_index) +
+				 " to " + frame_path);
+		RenderAndWrite(frame_path);
+	}
+}
+
+
+void
+RenderContext::SetFrameTime_(maths::Decimal _time)
+{
+	TIMED_SCOPE(RenderContext_SetFrameTime);
+	if (mesh_animations_.empty())
+		return;
+	// Mesh BVHs first, then the levels of instances from the innermost groups up, the scene
+	// BVH refits over the new bounds of all of them
+	uint32_t rebuilt_count = 0u;
+	for (MeshAnimation const &animation : mesh_animations_)
+	{
+		rebuilt_count +=
+			animation.mesh_data->SetWorldTransform(animation.world_transform.Interpolate(_time));
+	}
+	for (InstanceLevel const &level : instance_levels_)
+	{
+		if (level.instances != nullptr)
+			rebuilt_count += level.instances->Update();
+		if (level.bvh != nullptr)
+			rebuilt_count += level.bvh->Update();
+	}
+	if (scene_bvh_ != nullptr)
+	{
+		rebuilt_count += scene_bvh_->Update();
+	}
+	LOG_INFO(tools::kChannelGeneral, "Updated " + std::to_string(mesh_animations_.size()) +
+			 " animated meshes, " + std::to_string(rebuilt_count) + " BVH subtrees rebuilt");
+}
+
+
+std::string
+RenderContext::FramePath_(std::string const &_path, uint32_t _frame_index)
+{
+	boost::filesystem::path const path{ _path };
+	std::stringstream file_name{};
+	file_name << path.stem().string() << "_" << std::setw(4) << std::setfill('0') <<
+		_frame_index << path.extension().string();
+	return (path.parent_path() / file_name.str()).string();
+}
+
+
+void
+RenderContext::WriteBvhReport_(std::string const &_path) const
+{
+	using Statistics = raytracer::BvhAccelerator::Statistics;
+	auto const	write_histogram = [](std::ostream &_stream, std::vector<uint64_t> const &_histogram) {
+		_stream << "[";
+		for (size_t i = 0u; i < _histogram.size(); ++i)
+			_stream << ((i > 0u) ? ", " : "") << _histogram[i];
+		_stream << "]";
+	};
+	// Aggregates report the mean SAH cost of their BVHs
+	auto const	write_statistics = [&write_histogram](std::ostream &_stream, std::string const &_name,
+													  Statistics const &_statistics) {
+		_stream << "\t\"" << _name << "\": {\n" <<
+			"\t\t\"bvh_count\": " << _statistics.bvh_count << ",\n" <<
+			"\t\t\"node_count\": " << _statistics.node_count << ",\n" <<
+			"\t\t\"inner_node_count\": " << _statistics.inner_node_count << ",\n" <<
+			"\t\t\"leaf_count\": " << _statistics.leaf_count << ",\n" <<
+			"\t\t\"reference_count\": " << _statistics.reference_count << ",\n" <<
+			"\t\t\"max_depth\": " << _statistics.max_depth << ",\n" <<
+			"\t\t\"sah_cost\": " << _statistics.sah_cost /
+			static_cast<double>(maths::Max(_statistics.bvh_count, uint64_t{ 1u })) << ",\n" <<
+			"\t\t\"node_memory_size\": " << _statistics.node_memory_size << ",\n" <<
+			"\t\t\"binary_node_memory_size\": " << _statistics.binary_node_memory_size << ",\n" <<
+			"\t\t\"reference_memory_size\": " << _statistics.reference_memory_size << ",\n" <<
+			"\t\t\"leaf_size_histogram\": ";
+		write_histogram(_stream, _statistics.leaf_size_histogram);
+		_stream << ",\n\t\t\"depth_histogram\": ";
+		write_histogram(_stream, _statistics.depth_histogram);
+		_stream << "\n\t},\n";
+	};
+	std::stringstream	report{};
+	report << "{\n";
+	if (scene_bvh_ != nullptr)
+		write_statistics(report, "scene_bvh", scene_bvh_->ComputeStatistics());
+	// Mesh BVHs are the ones kBvhNodeSize tunes, each shared mesh counts once
+	Statistics	mesh_statistics{};
+	for (raytracer::TriangleMeshData const *const mesh_data : meshes_)
+		mesh_statistics.Add(mesh_data->bvh().ComputeStatistics());
+	write_statistics(report, "mesh_bvhs", mesh_statistics);
+	Statistics	instance_statistics{};
+	for (InstanceLevel const &level : instance_levels_)
+	{
+		if (level.instances != nullptr)
+			instance_statistics.Add(level.instances->bvh().ComputeStatistics());
+		if (level.bvh != nullptr)
+			instance_statistics.Add(level.bvh->ComputeStatistics());
+	}
+	write_statistics(report, "instance_bvhs", instance_statistics);
+	// Reset for the next render either way, they all read zero unless YS_BVH_TRAVERSAL_STATS
+	// is defined. Per ray figures add up the traversals of every BVH a ray goes through.
+	raytracer::BvhAccelerator::TraversalCounters const	counters =
+		raytracer::BvhAccelerator::TakeTraversalCounters();
+	double const	traversal_count = static_cast<double>(maths::Max(counters.traversal_count,
+																	  uint64_t{ 1u }));
+	double const	ray_count = static_cast<double>(maths::Max(counters.ray_count, uint64_t{ 1u }));
+	report << "\t\"traversal\": {\n" <<
+#ifdef YS_BVH_TRAVERSAL_STATS
+		"\t\t\"enabled\": true,\n" <<
+#else
+		"\t\t\"enabled\": false,\n" <<
+#endif // YS_BVH_TRAVERSAL_STATS
+		"\t\t\"ray_count\": " << counters.ray_count << ",\n" <<
+		"\t\t\"traversal_count\": " << counters.traversal_count << ",\n" <<
+		"\t\t\"node_visit_count\": " << counters.node_visit_count << ",\n" <<
+		"\t\t\"primitive_test_count\": " << counters.primitive_test_count << ",\n" <<
+		"\t\t\"hit_count\": " << counters.hit_count << ",\n" <<
+		"\t\t\"ray_hit_count\": " << counters.ray_hit_count << ",\n" <<
+		"\t\t\"nodes_per_ray\": " <<
+		static_cast<double>(counters.node_visit_count) / ray_count << ",\n" <<
+		"\t\t\"primitive_tests_per_ray\": " <<
+		static_cast<double>(counters.primitive_test_count) / ray_count << ",\n" <<
+		"\t\t\"hits_per_ray\": " <<
+		static_cast<double>(counters.ray_hit_count) / ray_count << ",\n" <<
+		"\t\t\"nodes_per_traversal\": " <<
+		static_cast<double>(counters.node_visit_count) / traversal_count << ",\n" <<
+		"\t\t\"primitive_tests_per_traversal\": " <<
+		static_cast<double>(counters.primitive_test_count) / traversal_count << ",\n" <<
+		"\t\t\"hits_per_traversal\": " <<
+		static_cast<double>(counters.hit_count) / traversal_count << "\n" <<
+		"\t}\n}\n";
+
+	std::ofstream	file{ _path, std::ios::trunc };
+	file << report.str();
+	if (!file)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Failed to write BVH report " + _path);
+	}
 }
 
 
@@ -4,7 +4,6 @@
 #include <string>
 
 #include <boost/filesystem.hpp>
-#include <boost/numeric/conversion/cast.hpp>
 
 #include "api/factory_functions.h"
 #include "raytracer/light.h"
@@ -73,13 +72,7 @@ ResourceContext::ResourceContext(std::string const &_workdir) :
 bool
 ResourceContext::IsUniqueIdFree(std::string const &_unique_id) const
 {
-	ObjectDescriptorContainer_t::const_iterator odcit = std::find_if(
-		object_descriptors_.cbegin(), object_descriptors_.cend(),
-		[&_unique_id](ObjectDescriptor const *_object_desc)
-	{
-		return _object_desc->unique_id == _unique_id;
-	});
-	return odcit == object_descriptors_.cend();
+	return descriptor_index_.count(_unique_id) == 0u;
 }
 
 
@@ -91,8 +84,12 @@ ResourceContext::PushDescriptor(std::string const &_unique_id,
 {
 	if (IsUniqueIdFree(_unique_id))
 	{
-		object_descriptors_.emplace_back(new (mem_region_)
-			ObjectDescriptor{ _unique_id, _type, _param_set, _subtype_id });
+		ObjectDescriptor const *const object_desc = new (mem_region_)
+			ObjectDescriptor{ _unique_id, _type, _param_set, _subtype_id };
+		object_descriptors_.emplace_back(object_desc);
+		descriptor_index_.emplace(object_desc->unique_id, object_desc);
+		if (_type == ObjectType::kShape)
+			mesh_path_counts_valid_ = false;
 	}
 	else
 	{
@@ -138,18 +135,13 @@ ResourceContext::GetAllDescsOfType(ObjectType const _type) const
 ResourceContext::ObjectDescriptor const &
 ResourceContext::GetDesc(std::string const &_unique_id) const
 {
-	ObjectDescriptorContainer_t::const_iterator odcit = std::find_if(
-		object_descriptors_.cbegin(), object_descriptors_.cend(),
-		[&_unique_id](ObjectDescriptor const *_object_desc)
-	{
-		return _object_desc->unique_id == _unique_id;
-	});
-	if (odcit == object_descriptors_.cend())
+	DescriptorIndex_t::const_iterator const dicit = descriptor_index_.find(_unique_id);
+	if (dicit == descriptor_index_.cend())
 	{
 		LOG_ERROR(tools::kChannelGeneral, "No descriptor found for id " + _unique_id);
 		YS_ASSERT(false);
 	}
-	return **odcit;
+	return *(dicit->second);
 }
 
 
@@ -158,29 +150,19 @@ T&
 ResourceContext::Fetch(std::string const &_unique_id)
 {
 	T* result = nullptr;
-	ObjectInstanceContainer_t::const_iterator oicit = std::find_if(
-		object_instances_.cbegin(), object_instances_.cend(),
-		[&_unique_id](ObjectInstance const &_object_instance)
-	{
-		return *(_object_instance.unique_id) == _unique_id;
-	});
+	ObjectInstanceContainer_t::const_iterator oicit = object_instances_.find(_unique_id);
 	if (oicit == object_instances_.cend())
 	{
-		ObjectDescriptorContainer_t::const_iterator odcit = std::find_if(
-			object_descriptors_.cbegin(), object_descriptors_.cend(),
-			[&_unique_id](ObjectDescriptor const *_object_desc)
+		DescriptorIndex_t::const_iterator const dicit = descriptor_index_.find(_unique_id);
+		if (dicit != descriptor_index_.cend())
 		{
-			return _object_desc->unique_id == _unique_id;
-		});
-		if (odcit != object_descriptors_.cend())
-		{
-			ObjectDescriptor const &object_desc = **odcit;
+			ObjectDescriptor const &object_desc = *(dicit->second);
 			if (GetType<T>() == object_desc.type_id)
 			{
 				result = MakeObject_<T>(object_desc);
 				if (result)
 				{
-					object_instances_.emplace_back(&(object_desc.unique_id), result);
+					object_instances_.emplace(object_desc.unique_id, result);
 				}
 				else
 				{
@@ -202,7 +184,7 @@ ResourceContext::Fetch(std::string const &_unique_id)
 	}
 	else
 	{
-		result = reinterpret_cast<T*>(oicit->instance);
+		result = reinterpret_cast<T*>(oicit->second);
 	}
 	return *result;
 }
@@ -232,26 +214,16 @@ ResourceContext::Fetch<raytracer::TriangleMeshRawData>(std::string const &_uniqu
 bool
 ResourceContext::HasInstance(std::string const &_unique_id) const
 {
-	uint32_t const count = boost::numeric_cast<uint32_t>(std::count_if(
-		object_instances_.cbegin(), object_instances_.cend(),
-		[&_unique_id](ObjectInstance const &_instance) {
-			return *(_instance.unique_id) == _unique_id;
-		}));
-	YS_ASSERT(count <= 1u);
-	return (count == 1u);
+	return (object_instances_.count(_unique_id) == 1u);
 }
 
 
 void *
 ResourceContext::GetInstanceImpl_(std::string const &_unique_id) const
 {
-	ObjectInstanceContainer_t::const_iterator const oicit =
-		std::find_if(object_instances_.cbegin(), object_instances_.cend(),
-					 [&_unique_id](ObjectInstance const &_instance) {
-						 return *(_instance.unique_id) == _unique_id;
-					 });
+	ObjectInstanceContainer_t::const_iterator const oicit = object_instances_.find(_unique_id);
 	YS_ASSERT(oicit != object_instances_.cend());
-	return oicit->instance;
+	return oicit->second;
 }
 
 
@@ -270,6 +242,29 @@ ResourceContext::workdir() const
 }
 
 
+void
+ResourceContext::SetCacheDir(std::string const &_cache_dir)
+{
+	boost::system::error_code error{};
+	boost::filesystem::create_directories(boost::filesystem::path(_cache_dir), error);
+	if (error || !boost::filesystem::is_directory(boost::filesystem::path(_cache_dir)))
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Could not create cache directory " + _cache_dir +
+					", caching is disabled.");
+		cache_dir_.clear();
+		return;
+	}
+	cache_dir_ = _cache_dir;
+}
+
+
+std::string const &
+ResourceContext::cache_dir() const
+{
+	return cache_dir_;
+}
+
+
 core::MemoryRegion &
 ResourceContext::mem_region()
 {
@@ -298,6 +293,73 @@ ResourceContext::IsShapeLight(raytracer::Shape const &_shape) const
 }
 
 
+void
+ResourceContext::PushMeshAnimation(RenderContext::MeshAnimation const &_animation)
+{
+	YS_ASSERT(_animation.mesh_data != nullptr);
+	mesh_animations_.push_back(_animation);
+}
+
+
+RenderContext::MeshAnimationContainer_t const &
+ResourceContext::mesh_animations() const
+{
+	return mesh_animations_;
+}
+
+
+void
+ResourceContext::PushMeshData(raytracer::TriangleMeshData const &_data)
+{
+	meshes_.push_back(&_data);
+}
+
+
+RenderContext::MeshDataContainer_t const &
+ResourceContext::meshes() const
+{
+	return meshes_;
+}
+
+
+uint32_t
+ResourceContext::MeshPathUseCount(std::string const &_path)
+{
+	if (!mesh_path_counts_valid_)
+	{
+		mesh_path_counts_.clear();
+		for (ObjectDescriptor const *const object_desc : object_descriptors_)
+		{
+			if (object_desc->type_id != ObjectType::kShape)
+				continue;
+			std::string const path = object_desc->param_set.FindString("path", "");
+			if (!path.empty())
+				++mesh_path_counts_[path];
+		}
+		mesh_path_counts_valid_ = true;
+	}
+	MeshPathCountContainer_t::const_iterator const mpcit = mesh_path_counts_.find(_path);
+	return (mpcit != mesh_path_counts_.cend()) ? mpcit->second : 0u;
+}
+
+
+void
+ResourceContext::SetSharedMeshData(std::string const &_path,
+								   raytracer::TriangleMeshData const &_data)
+{
+	YS_ASSERT(shared_mesh_data_.count(_path) == 0u);
+	shared_mesh_data_.emplace(_path, &_data);
+}
+
+
+raytracer::TriangleMeshData const *
+ResourceContext::FindSharedMeshData(std::string const &_path) const
+{
+	SharedMeshDataContainer_t::const_iterator const smdcit = shared_mesh_data_.find(_path);
+	return (smdcit != shared_mesh_data_.cend()) ? smdcit->second : nullptr;
+}
+
+
 template <typename T>
 T*
 ResourceContext::MakeObject_(ObjectDescriptor const &_object_desc)
@@ -1,11 +1,19 @@
 #include "api/transform_cache.h"
 
+#include "core/hash.h"
 #include "maths/transform.h"
 
 
 namespace api {
 
 
+size_t
+TransformCache::TransformHash::operator()(maths::Transform const &_t) const
+{
+	return static_cast<size_t>(core::HashValue(_t.m().e));
+}
+
+
 maths::Transform const &
 TransformCache::Lookup(maths::Transform const &_t)
 {
@@ -1,12 +1,17 @@
 #include "api/translation_state.h"
 
+#include <algorithm>
+#include <map>
 #include <sstream>
+#include <unordered_map>
 
 #include "boost/filesystem.hpp"
 
 #include "api/factory_functions.h"
 #include "api/render_context.h"
 #include "maths/transform.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/mesh_instances.h"
 
 
 namespace api {
@@ -18,7 +23,8 @@ TranslationState::TranslationState():
 	output_path_{ "" },
 	output_file_{ "image.png" },
 	scope_depth_{ 1 }, transform_stack_{ maths::Transform{} },
-	cached_object_id_{ "" }, parameters_{ nullptr }
+	cached_object_id_{ "" }, parameters_{ nullptr },
+	current_group_{ "" }, group_scope_depth_{ 0 }
 {
 	ResetResourceCounters();
 }
@@ -30,6 +36,7 @@ TranslationState::SceneBegin()
 	YS_ASSERT(scope_depth_ == 1);
 	YS_ASSERT(transform_stack_.size() == 1 && transform_stack_.back() == maths::Transform{});
 	YS_ASSERT(cached_object_id_.empty());
+	YS_ASSERT(current_group_.empty());
 }
 void
 TranslationState::SceneEnd()
@@ -40,7 +47,11 @@ void
 TranslationState::ScopeBegin()
 {
 	parameters_ = new (resource_context_.mem_region()) ParamSet();
-	transform_stack_.push_back(transform_stack_.back());
+	// The scope of a group starts from the space of the group
+	if (!current_group_.empty() && scope_depth_ == group_scope_depth_)
+		transform_stack_.push_back(maths::Transform{});
+	else
+		transform_stack_.push_back(transform_stack_.back());
 	scope_depth_++;
 }
 void
@@ -49,6 +60,8 @@ TranslationState::ScopeEnd()
 	scope_depth_--;
 	transform_stack_.pop_back();
 	cached_object_id_.clear();
+	if (!current_group_.empty() && scope_depth_ == group_scope_depth_)
+		current_group_.clear();
 }
 void
 TranslationState::Workdir(std::string const &_path)
@@ -84,6 +97,13 @@ TranslationState::Output(std::string const &_file)
 	}
 }
 void
+TranslationState::CacheDir(std::string const &_path)
+{
+	boost::filesystem::path const absolute_path =
+		boost::filesystem::absolute(_path, resource_context_.workdir());
+	resource_context_.SetCacheDir(absolute_path.generic_string());
+}
+void
 TranslationState::ObjectId(std::string const &_object_id)
 {
 	if (cached_object_id_.empty())
@@ -112,6 +132,8 @@ TranslationState::Shape(std::string const &_type)
 	maths::Transform const &transform =
 		resource_context_.transform_cache().Lookup(transform_stack_.back());
 	param_set().PushTransform("world_transform", transform);
+	if (!current_group_.empty())
+		param_set().PushString("instance_group", current_group_);
 	PushObjectDesc_(ResourceContext::ObjectType::kShape, _type);
 }
 void
@@ -130,6 +152,31 @@ TranslationState::Integrator(std::string const &_type)
 	PushObjectDesc_(ResourceContext::ObjectType::kIntegrator, _type);
 }
 void
+TranslationState::GroupBegin(std::string const &_name)
+{
+	YS_ASSERT(current_group_.empty());
+	if (std::find(group_names_.cbegin(), group_names_.cend(), _name) != group_names_.cend())
+	{
+		LOG_WARNING(tools::kChannelParsing, "Group " + _name +
+					" is defined more than once, its shapes are merged");
+	}
+	else
+		group_names_.push_back(_name);
+	current_group_ = _name;
+	group_scope_depth_ = scope_depth_;
+}
+void
+TranslationState::Instance(std::string const &_group_name)
+{
+	if (_group_name == current_group_)
+	{
+		LOG_ERROR(tools::kChannelParsing, "Group " + _group_name + " instances itself, ignored");
+		return;
+	}
+	instance_descs_.push_back(InstanceDesc_{ current_group_, _group_name,
+											 transform_stack_.back() });
+}
+void
 TranslationState::Identity()
 {
 	transform_stack_.back() = maths::Transform{};
@@ -195,38 +242,147 @@ TranslationState::SceneSetup_()
 					   return &light;
 				   });
 	//
-	ResourceContext::ObjectDescriptorContainer_t::iterator valid_shapes_end =
-		std::remove_if(shape_descs.begin(), shape_descs.end(),
-					   [this](ResourceContext::ObjectDescriptor const *_object_desc) {
-						   raytracer::Shape const &shape =
-							   resource_context_.Fetch<raytracer::Shape>(_object_desc->unique_id);
-						   return resource_context_.IsShapeLight(shape);
-					   });
-	shape_descs.erase(valid_shapes_end, shape_descs.end());
+	// Shapes and instances are bucketed by group in one pass each, the scene level being "".
+	std::unordered_map<std::string, ResourceContext::ObjectDescriptorContainer_t> level_shape_descs{};
+	for (ResourceContext::ObjectDescriptor const *const object_desc : shape_descs)
+		level_shape_descs[object_desc->param_set.FindString("instance_group", "")].push_back(object_desc);
+	std::unordered_map<std::string, InstanceDescContainer_t> level_instance_descs{};
+	for (InstanceDesc_ const &instance_desc : instance_descs_)
+		level_instance_descs[instance_desc.parent].push_back(&instance_desc);
+	//
+	// Scene primitives are whole meshes, a small leaf size keeps them from being tested in bulk.
+	constexpr uint32_t kTlasNodeMaxSize = 4;
+	//
+	// Each group gets a BVH of its own, shared by all its instances. Groups are built in
+	// definition order, the groups they instance are built by then. Animations update the
+	// levels in the same order.
+	InstancedMeshTable_t	instanced_meshes{};
+	GroupAcceleratorTable_t	groups{};
+	RenderContext::InstanceLevelContainer_t instance_levels{};
+	for (std::string const &group_name : group_names_)
+	{
+		RenderContext::PrimitiveContainer_t group_primitives{};
+		raytracer::MeshInstances *const group_instances =
+			BuildInstanceLevel_(level_shape_descs[group_name], level_instance_descs[group_name],
+								groups, instanced_meshes, group_primitives);
+		if (group_primitives.empty())
+		{
+			LOG_WARNING(tools::kChannelGeneral, "Group " + group_name + " is empty");
+			continue;
+		}
+		raytracer::BvhAccelerator *const group_bvh =
+			new (resource_context_.mem_region()) raytracer::BvhAccelerator(group_primitives,
+																		   kTlasNodeMaxSize);
+		groups[group_name] = GroupAccelerator_{ group_bvh, group_instances };
+		instance_levels.push_back({ group_instances, group_bvh });
+	}
 	RenderContext::PrimitiveContainer_t primitives{};
-	primitives.reserve(shape_descs.size());
-	std::transform(shape_descs.cbegin(), shape_descs.cend(), std::back_inserter(primitives),
-				   [this](ResourceContext::ObjectDescriptor const *_object_desc) {
-					   raytracer::Shape const &shape =
-						   resource_context_.Fetch<raytracer::Shape>(_object_desc->unique_id);
-					   return new (resource_context_.mem_region()) raytracer::GeometryPrimitive(shape);
-				   });
+	raytracer::MeshInstances *const scene_instances =
+		BuildInstanceLevel_(level_shape_descs[""], level_instance_descs[""], groups,
+							instanced_meshes, primitives);
+	if (scene_instances != nullptr)
+		instance_levels.push_back({ scene_instances, nullptr });
 	//
-	constexpr uint32_t kBvhNodeMaxSize = 20;
-	if (primitives.size() > kBvhNodeMaxSize)
+	// Top level BVH over the scene primitives, rays only ever query this one.
+	raytracer::BvhAccelerator *tlas = nullptr;
+	if (!primitives.empty())
 	{
-		LOG_INFO(tools::kChannelGeneral, "Primitive count exceeded threshold, building BVH");
-		raytracer::Primitive *const bvh =
-			new (resource_context_.mem_region()) raytracer::BvhAccelerator(primitives, 
-																		   kBvhNodeMaxSize);
+		LOG_INFO(tools::kChannelGeneral, "Building top level BVH over " +
+				 std::to_string(primitives.size()) + " primitives");
+		tlas = new (resource_context_.mem_region()) raytracer::BvhAccelerator(primitives,
+																			  kTlasNodeMaxSize);
 		primitives.clear();
-		primitives.emplace_back(bvh);
+		primitives.emplace_back(tlas);
 	}
-	else
+	//
+	// Animated meshes move their own data, the BVHs above them are updated along with them
+	render_context_ = api::RenderContext(integrator, primitives, lights,
+										 resource_context_.mesh_animations(), tlas,
+										 instance_levels, resource_context_.meshes());
+}
+
+raytracer::MeshInstances*
+TranslationState::BuildInstanceLevel_(
+	ResourceContext::ObjectDescriptorContainer_t const &_shape_descs,
+	InstanceDescContainer_t const &_instance_descs,
+	GroupAcceleratorTable_t const &_groups,
+	InstancedMeshTable_t &io_meshes,
+	RenderContext::PrimitiveContainer_t &o_primitives)
+{
+	// Triangle meshes loaded from the same file more than once become compact records, as do
+	// the instances of groups. The meshes already built, such as the shapes of lights, stay
+	// shapes of their own.
+	std::vector<raytracer::MeshInstances::Record> instance_records{};
+	o_primitives.reserve(o_primitives.size() + _shape_descs.size() + 1u);
+	for (ResourceContext::ObjectDescriptor const *const object_desc : _shape_descs)
 	{
+		ParamSet const &params = object_desc->param_set;
+		std::string const path_string = params.FindString("path", "");
+		if (object_desc->subtype_id == "triangle_mesh" && !path_string.empty() &&
+			resource_context_.MeshPathUseCount(path_string) > 1u &&
+			!resource_context_.HasInstance(object_desc->unique_id))
+		{
+			raytracer::TriangleMeshData const *const mesh_data =
+				FetchSharedTriangleMeshData(resource_context_, params);
+			if (mesh_data == nullptr)
+				continue;
+			maths::Transform const &world_transform =
+				params.FindTransform("world_transform", maths::Transform::Identity());
+			// Normals are flipped in object space, the record transforms them as any other
+			// transformed normal.
+			bool const flip_normals = params.FindBool("flip_normals", false);
+			raytracer::Primitive const *&mesh = io_meshes[{ mesh_data, flip_normals }];
+			if (mesh == nullptr)
+			{
+				raytracer::InstancedMesh const *const instanced_mesh =
+					new (resource_context_.mem_region()) raytracer::InstancedMesh(*mesh_data,
+																				  flip_normals);
+				mesh = new (resource_context_.mem_region()) raytracer::GeometryPrimitive(
+					*instanced_mesh);
+			}
+			instance_records.push_back(raytracer::MeshInstances::MakeRecord(*mesh, nullptr,
+																			world_transform));
+			continue;
+		}
+		raytracer::Shape const &shape =
+			resource_context_.Fetch<raytracer::Shape>(object_desc->unique_id);
+		if (resource_context_.IsShapeLight(shape))
+			continue;
+		o_primitives.push_back(new (resource_context_.mem_region()) raytracer::GeometryPrimitive(shape));
 	}
-	//
-	render_context_ = api::RenderContext(integrator, primitives, lights);
+	for (InstanceDesc_ const *const instance_desc : _instance_descs)
+	{
+		auto const group_it = _groups.find(instance_desc->group);
+		if (group_it == _groups.end())
+		{
+			LOG_ERROR(tools::kChannelGeneral, "Group " + instance_desc->group +
+					  " is instanced before its definition or is empty, instance ignored");
+			continue;
+		}
+		GroupAccelerator_ const &group = group_it->second;
+		uint32_t const depth =
+			1u + ((group.instances != nullptr) ? group.instances->instance_depth() : 0u);
+		if (depth > raytracer::InstancePath::kMaxDepth)
+		{
+			LOG_ERROR(tools::kChannelGeneral, "Group " + instance_desc->group + " nests more than " +
+					  std::to_string(raytracer::InstancePath::kMaxDepth) +
+					  " levels of instances, instance ignored");
+			continue;
+		}
+		instance_records.push_back(raytracer::MeshInstances::MakeRecord(*group.bvh,
+																		group.instances,
+																		instance_desc->transform));
+	}
+	if (instance_records.empty())
+		return nullptr;
+	LOG_INFO(tools::kChannelGeneral, "Grouped " + std::to_string(instance_records.size()) +
+			 " instances");
+	// Binary nodes, so that packets traverse the instances together
+	raytracer::MeshInstances *const instances =
+		new (resource_context_.mem_region()) raytracer::MeshInstances(
+			std::move(instance_records), raytracer::BvhAccelerator::kBinaryNodeWidth);
+	o_primitives.push_back(instances);
+	return instances;
 }
 
 void
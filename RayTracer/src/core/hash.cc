@@ -0,0 +1,40 @@
+#include "core/hash.h"
+
+#include <fstream>
+#include <vector>
+
+
+namespace core {
+
+
+uint64_t
+HashBytes(void const *const _data, size_t const _size, uint64_t const _hash)
+{
+	constexpr uint64_t kPrime = 0x100000001b3ull;
+	uint8_t const *const bytes = static_cast<uint8_t const*>(_data);
+	uint64_t result = _hash;
+	for (size_t i = 0u; i < _size; ++i)
+		result = (result ^ bytes[i]) * kPrime;
+	return result;
+}
+
+
+bool
+HashFile(std::string const &_path, uint64_t &_hash)
+{
+	constexpr size_t kChunkSize = 1024u * 1024u;
+	std::ifstream file{ _path, std::ios::binary };
+	if (!file)
+		return false;
+	std::vector<char> chunk(kChunkSize);
+	_hash = kHashSeed;
+	while (file)
+	{
+		file.read(chunk.data(), kChunkSize);
+		_hash = HashBytes(chunk.data(), static_cast<size_t>(file.gcount()), _hash);
+	}
+	return file.eof();
+}
+
+
+} // namespace core
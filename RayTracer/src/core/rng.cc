@@ -61,9 +61,26 @@ uint32_t RNG::rxs_m_xs::Inverse(uint32_t _output)
 
 
 RNG::RNG(uint64_t _seed) :
-	state_{ (_seed + kIncrement_) * kMultiplier_ + kIncrement_ },
+	increment_{ kIncrement_ },
+	state_{ 0u },
 	extension_{}
 {
+	Seed_(_seed);
+}
+
+
+RNG::RNG(uint64_t _seed, uint64_t _stream) :
+	increment_{ (_stream << 1u) | 1u },
+	state_{ 0u },
+	extension_{}
+{
+	Seed_(_seed);
+}
+
+
+void RNG::Seed_(uint64_t _seed)
+{
+	state_ = (_seed + increment_) * kMultiplier_ + increment_;
 	uint32_t xdiff = GeneratorValue_() - GeneratorValue_();
 	for (size_t extension_index = 0; extension_index < kDimensionCount_; ++extension_index)
 	{
@@ -142,7 +159,7 @@ double RNG::GetDouble()
 uint32_t RNG::GeneratorValue_()
 {
 	const uint64_t current_state = state_;
-	state_ = state_ * kMultiplier_ + kIncrement_;
+	state_ = state_ * kMultiplier_ + increment_;
 	return xsh_rr::Apply(current_state);
 }
 
@@ -50,6 +50,25 @@ float NextDecimalDown(float _v, uint32_t _delta)
 	return mapper.value;
 }
 
+float RoundDownToFloat(double _v)
+{
+	if (_v > static_cast<double>(highest_value<float>))
+		return highest_value<float>;
+	if (_v < static_cast<double>(lowest_value<float>))
+		return -infinity<float>;
+	float const	result = static_cast<float>(_v);
+	return (static_cast<double>(result) > _v) ? NextDecimalDown(result) : result;
+}
+float RoundUpToFloat(double _v)
+{
+	if (_v < static_cast<double>(lowest_value<float>))
+		return lowest_value<float>;
+	if (_v > static_cast<double>(highest_value<float>))
+		return infinity<float>;
+	float const	result = static_cast<float>(_v);
+	return (static_cast<double>(result) < _v) ? NextDecimalUp(result) : result;
+}
+
 
 bool Quadratic(Decimal _a, Decimal _b, Decimal _c, Decimal &_t0, Decimal &_t1)
 {
@@ -66,6 +85,23 @@ bool Quadratic(Decimal _a, Decimal _b, Decimal _c, Decimal &_t0, Decimal &_t1)
 	return true;
 }
 
+
+// Spreads the 10 low bits of _value so that two zero bits separate each of them
+static uint32_t SpreadBits3(uint32_t _value)
+{
+	_value &= 0x3ffu;
+	_value = (_value | (_value << 16u)) & 0x030000ffu;
+	_value = (_value | (_value << 8u)) & 0x0300f00fu;
+	_value = (_value | (_value << 4u)) & 0x030c30c3u;
+	_value = (_value | (_value << 2u)) & 0x09249249u;
+	return _value;
+}
+
+uint32_t EncodeMorton3(uint32_t _x, uint32_t _y, uint32_t _z)
+{
+	return (SpreadBits3(_z) << 2u) | (SpreadBits3(_y) << 1u) | SpreadBits3(_x);
+}
+
 } // namespace maths
 
 
@@ -1,5 +1,7 @@
 #include "maths/transform.h"
 
+#include "maths/bounds.h"
+#include "maths/quaternion.h"
 #include "maths/vector.h"
 #include "raytracer/surface_interaction.h"
 
@@ -52,6 +54,8 @@ Transform::operator()(raytracer::SurfaceInteraction const &_v, OpDirection _dir)
 	result.shading.SetDpdv((*this)(_v.shading.dpdv_quick(), _dir));
 	result.shading.SetDndu((*this)(_v.shading.dndu_quick(), _dir));
 	result.shading.SetDndv((*this)(_v.shading.dndv_quick(), _dir));
+	result.primitive = _v.primitive;
+	result.instance_path = _v.instance_path;
 	return result;
 }
 
@@ -147,4 +151,86 @@ LookAt(Vec3f const &_position, Vec3f const &_target, Vec3f const &_up)
 	return Transform{ Inverse(camera_to_world), camera_to_world };
 }
 
+namespace
+{
+Quaternion
+ToQuaternion(Vec4f const &_v)
+{
+	return Quaternion{ Vec3f{ _v.x, _v.y, _v.z }, _v.w };
+}
+} // namespace
+
+
+AnimatedTransform::AnimatedTransform(Transform const &_start_transform, Decimal _start_time,
+									 Transform const &_end_transform, Decimal _end_time) :
+	start_transform_{ _start_transform }, end_transform_{ _end_transform },
+	start_time_{ _start_time }, end_time_{ _end_time },
+	animated_{ _start_transform != _end_transform && _start_time < _end_time },
+	translations_{}, rotations_{}, scales_{}
+{
+	YS_ASSERT(_start_time <= _end_time);
+	Decompose_(start_transform_.m(), translations_[0], rotations_[0], scales_[0]);
+	Decompose_(end_transform_.m(), translations_[1], rotations_[1], scales_[1]);
+	// Interpolate along the shortest arc
+	Decimal const cos_theta = Dot(ToQuaternion(rotations_[0]), ToQuaternion(rotations_[1]));
+	if (cos_theta < 0._d)
+		rotations_[1] = -rotations_[1];
+}
+
+
+Transform
+AnimatedTransform::Interpolate(Decimal _t) const
+{
+	if (!animated_ || _t <= start_time_)
+		return start_transform_;
+	if (_t >= end_time_)
+		return end_transform_;
+	Decimal const dt = (_t - start_time_) / (end_time_ - start_time_);
+	Vec3f const translation = Lerp(translations_[0], translations_[1], dt);
+	Quaternion const rotation =
+		Slerp(ToQuaternion(rotations_[0]), ToQuaternion(rotations_[1]), dt);
+	Mat4x4f scale{};
+	for (uint32_t i = 0; i < 3; ++i)
+		for (uint32_t j = 0; j < 3; ++j)
+			scale[i][j] = Lerp(scales_[0][i][j], scales_[1][i][j], dt);
+	return Translate(translation) * static_cast<Transform>(rotation) * Transform{ scale };
+}
+
+
+void
+AnimatedTransform::Decompose_(Mat4x4f const &_m,
+							  Vec3f &_translation, Vec4f &_rotation, Mat4x4f &_scale)
+{
+	// Polar decomposition as implemented in pbrt (Pharr)
+	_translation = Vec3f{ _m[0][3], _m[1][3], _m[2][3] };
+	Mat4x4f m{ _m };
+	for (uint32_t i = 0; i < 3; ++i)
+		m[i][3] = m[3][i] = 0._d;
+	m[3][3] = 1._d;
+	Mat4x4f r{ m };
+	constexpr uint32_t kMaxIterationCount = 100u;
+	for (uint32_t iteration = 0; iteration < kMaxIterationCount; ++iteration)
+	{
+		Mat4x4f const r_inverse_transpose = Inverse(Transpose(r));
+		Decimal norm = 0._d;
+		Mat4x4f r_next{};
+		for (uint32_t i = 0; i < 3; ++i)
+		{
+			Decimal row_norm = 0._d;
+			for (uint32_t j = 0; j < 3; ++j)
+			{
+				r_next[i][j] = .5_d * (r[i][j] + r_inverse_transpose[i][j]);
+				row_norm += std::abs(r[i][j] - r_next[i][j]);
+			}
+			norm = Max(norm, row_norm);
+		}
+		r = r_next;
+		if (norm <= .0001_d)
+			break;
+	}
+	Quaternion const rotation{ Transform{ r } };
+	_rotation = Vec4f{ rotation.v.x, rotation.v.y, rotation.v.z, rotation.w };
+	_scale = Inverse(r) * m;
+}
+
 } // namespace maths
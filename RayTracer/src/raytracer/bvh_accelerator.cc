@@ -4,315 +4,3044 @@
 #include "core/logger.h"
 #include "core/memory_region.h"
 #include "core/alloc.h"
+#include "core/hash.h"
+#include "core/spinlock.h"
 
 #include "maths/ray.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/ray_packet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <thread>
+#ifndef YS_DECIMAL_IS_DOUBLE
+#include <emmintrin.h>
+#endif // !YS_DECIMAL_IS_DOUBLE
 
 namespace raytracer {
 
 
-BvhAccelerator::BvhAccelerator() :
-	primitives_{},
-	nodes_{ nullptr },
-	node_max_size_{ 0u }
-{}
+namespace {
 
-BvhAccelerator::BvhAccelerator(BvhAccelerator::PrimitiveArray_t const &_primitives,
-							   uint32_t _node_max_size) :
-	primitives_{ _primitives },
-	nodes_{ nullptr },
-	node_max_size_{ _node_max_size }
+thread_local BvhAccelerator::TraversalCounters	thread_counters{};
+BvhAccelerator::TraversalCounters				traversal_counters_aggregate{};
+core::AtomicSpinLock							traversal_counters_lock{};
+
+#ifdef YS_BVH_TRAVERSAL_STATS
+// Traversals started from the leaves of another one run nested in it, the outermost one traces
+// the ray
+thread_local uint32_t	thread_traversal_depth = 0u;
+struct TraversalScope
 {
-	YS_ASSERT(primitives_.size() <= maths::highest_value<uint32_t>);
-	YS_ASSERT(_node_max_size <= maths::highest_value<uint16_t>);
-	if (primitives_.size() == 0)
-	{
-		LOG_WARNING(tools::kChannelGeneral, "Requested the construction of a BVH using an empty list of primitives.");
-		return;
-	}
+	TraversalScope() { ++thread_traversal_depth; }
+	~TraversalScope() { --thread_traversal_depth; }
+	TraversalScope(TraversalScope const &) = delete;
+	TraversalScope &operator=(TraversalScope const &) = delete;
+	bool	is_ray() const { return thread_traversal_depth == 1u; }
+};
+#define BVH_COUNT(counter, value) (thread_counters.counter += (value))
+#define BVH_TRAVERSAL_SCOPE() TraversalScope const traversal_scope{}
+#define BVH_COUNT_RAY(counter, value) \
+	(traversal_scope.is_ray() ? (thread_counters.counter += (value)) : 0u)
+#else
+#define BVH_COUNT(counter, value) ((void)0)
+#define BVH_TRAVERSAL_SCOPE() ((void)0)
+#define BVH_COUNT_RAY(counter, value) ((void)0)
+#endif // YS_BVH_TRAVERSAL_STATS
 
-	std::vector<BvhPrimitiveDesc>	primitive_desc;
-	primitive_desc.reserve(primitives_.size());
-	for (size_t i = 0; i < primitives_.size(); ++i)
-		primitive_desc.emplace_back(static_cast<uint32_t>(i), primitives_[i]->WorldBounds());
+// Records a leaf of _reference_count references at _depth
+void
+AddLeafStatistics(BvhAccelerator::Statistics &_statistics, uint32_t const _reference_count,
+				  uint32_t const _depth)
+{
+	++_statistics.leaf_count;
+	if (_statistics.leaf_size_histogram.size() <= _reference_count)
+		_statistics.leaf_size_histogram.resize(_reference_count + 1u, 0u);
+	++_statistics.leaf_size_histogram[_reference_count];
+	if (_statistics.depth_histogram.size() <= _depth)
+		_statistics.depth_histogram.resize(_depth + 1u, 0u);
+	++_statistics.depth_histogram[_depth];
+	_statistics.max_depth = maths::Max(_statistics.max_depth, _depth);
+}
 
-	core::MemoryRegion					allocator{ 1024 * 1024 };
-	int									node_count = 0;
-	BvhAccelerator::PrimitiveArray_t	ordered_primitives;
-	BvhNode								*root;
-	root = BuildRecursive(allocator, primitive_desc,
-						  0u, uint32_t(primitives_.size()), node_count,
-						  ordered_primitives);
-	primitives_.swap(ordered_primitives);
+// Ranges of primitives are reduced on several threads, in chunks of at least this many primitives
+constexpr uint32_t kParallelReduceChunkSize = 256u * 1024u;
 
-	nodes_ = core::AllocAligned<LinearBvhNode>(node_count);
-	uint32_t	offset = 0u;
-	FlattenBvhRecursive_(*root, offset);
+uint32_t
+ParallelChunkCount(uint32_t const _count)
+{
+	if (_count < 2u * kParallelReduceChunkSize)
+		return 1u;
+	static uint32_t const hardware_thread_count =
+		maths::Max(std::thread::hardware_concurrency(), 1u);
+	return maths::Max(maths::Min(hardware_thread_count, _count / kParallelReduceChunkSize), 1u);
 }
-BvhAccelerator::~BvhAccelerator()
+
+// Calls _func(chunk_index, chunk_first, chunk_last) for each of the _chunk_count chunks of
+// [0, _count), the first one on the calling thread and the others on tasks of their own.
+template <typename Func_t> void
+ParallelForChunks(uint32_t const _count, uint32_t const _chunk_count, Func_t const &_func)
 {
-	if (nodes_ != nullptr)
-		core::FreeAligned(nodes_);
+	uint32_t const chunk_size = (_count + _chunk_count - 1u) / _chunk_count;
+	std::vector<std::future<void>> chunks{};
+	chunks.reserve(_chunk_count - 1u);
+	for (uint32_t chunk_index = 1u; chunk_index < _chunk_count; ++chunk_index)
+	{
+		uint32_t const chunk_first = maths::Min(chunk_index * chunk_size, _count);
+		uint32_t const chunk_last = maths::Min(chunk_first + chunk_size, _count);
+		chunks.emplace_back(std::async(std::launch::async,
+			[&_func, chunk_index, chunk_first, chunk_last]() {
+			_func(chunk_index, chunk_first, chunk_last);
+		}));
+	}
+	_func(0u, 0u, maths::Min(chunk_size, _count));
+	for (std::future<void> &chunk : chunks)
+		chunk.get();
 }
 
-BvhAccelerator::BvhNode	*
-BvhAccelerator::BuildRecursive(core::MemoryRegion &_region,
-							   std::vector<BvhPrimitiveDesc> &_primitive_desc,
-							   uint32_t _first, uint32_t _last, int &_node_count,
-							   PrimitiveArray_t &_ordered_primitives)
+// Maps each chunk of [_first, _last) with _map on a task of its own, and reduces the results in
+// order. Reductions used by the build are exact, the result doesn't depend on the chunk count.
+template <typename Result_t, typename Map_t, typename Reduce_t> Result_t
+ParallelReduce(uint32_t const _first, uint32_t const _last,
+			   Map_t const &_map, Reduce_t const &_reduce)
 {
-	TIMED_SCOPE(BvhAccelerator_BuildRecursive);
+	uint32_t const count = _last - _first;
+	uint32_t const chunk_count = ParallelChunkCount(count);
+	if (chunk_count <= 1u)
+		return _map(_first, _last);
+	uint32_t const chunk_size = (count + chunk_count - 1u) / chunk_count;
+	std::vector<std::future<Result_t>> chunks{};
+	chunks.reserve(chunk_count - 1u);
+	for (uint32_t chunk_index = 1u; chunk_index < chunk_count; ++chunk_index)
+	{
+		uint32_t const chunk_first = _first + chunk_index * chunk_size;
+		uint32_t const chunk_last = maths::Min(chunk_first + chunk_size, _last);
+		chunks.emplace_back(std::async(std::launch::async, [&_map, chunk_first, chunk_last]() {
+			return _map(chunk_first, chunk_last);
+		}));
+	}
+	Result_t result = _map(_first, _first + chunk_size);
+	for (std::future<Result_t> &chunk : chunks)
+		result = _reduce(result, chunk.get());
+	return result;
+}
 
-	using raytracer::BvhAccelerator;
-	YS_ASSERT(_first < _last);
-	YS_ASSERT(_ordered_primitives.size() <= maths::highest_value<uint32_t>);
+// Stable LSD radix sort on the morton codes, by digits of kRadixBits bits. Each pass counts the
+// digits of each chunk in parallel, then each chunk scatters its values to the offsets reserved
+// for it, in order.
+template <typename Value_t> void
+RadixSort(std::vector<Value_t> &_values, uint32_t const _key_bit_count)
+{
+	constexpr uint32_t	kRadixBits = 10u;
+	constexpr uint32_t	kBucketCount = 1u << kRadixBits;
+	constexpr uint32_t	kDigitMask = kBucketCount - 1u;
+	using Histogram_t = std::array<uint32_t, kBucketCount>;
+	uint32_t const				count = static_cast<uint32_t>(_values.size());
+	uint32_t const				chunk_count = ParallelChunkCount(count);
+	std::vector<Value_t>		sorted(_values.size());
+	std::vector<Histogram_t>	chunk_offsets(chunk_count);
+	for (uint32_t shift = 0u; shift < _key_bit_count; shift += kRadixBits)
+	{
+		ParallelForChunks(count, chunk_count, [&_values, &chunk_offsets, shift](
+			uint32_t const _chunk_index, uint32_t const _first, uint32_t const _last) {
+			Histogram_t &histogram = chunk_offsets[_chunk_index];
+			histogram.fill(0u);
+			for (uint32_t i = _first; i < _last; ++i)
+				++histogram[(_values[i].morton_code >> shift) & kDigitMask];
+		});
+		uint32_t offset = 0u;
+		for (uint32_t bucket = 0u; bucket < kBucketCount; ++bucket)
+			for (Histogram_t &histogram : chunk_offsets)
+			{
+				uint32_t const bucket_count = histogram[bucket];
+				histogram[bucket] = offset;
+				offset += bucket_count;
+			}
+		ParallelForChunks(count, chunk_count, [&_values, &sorted, &chunk_offsets, shift](
+			uint32_t const _chunk_index, uint32_t const _first, uint32_t const _last) {
+			Histogram_t &offsets = chunk_offsets[_chunk_index];
+			for (uint32_t i = _first; i < _last; ++i)
+				sorted[offsets[(_values[i].morton_code >> shift) & kDigitMask]++] = _values[i];
+		});
+		_values.swap(sorted);
+	}
+}
 
-	BvhNode				*node = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
-	++_node_count;
+constexpr size_t
+AlignUp(size_t const _size, size_t const _alignment)
+{
+	return (_size + _alignment - 1u) / _alignment * _alignment;
+}
 
-	maths::Bounds3f		bounds{};
-	for (size_t i = _first; i < _last; ++i)
-		bounds = maths::Union(bounds, _primitive_desc[i].bounds);
+// Ray values shared by every slab test of a wide traversal
+struct TraversalRay
+{
+	TraversalRay(maths::Ray const &_ray) :
+		origin{ _ray.origin.x, _ray.origin.y, _ray.origin.z },
+		inverse_direction{ _ray.inverse_direction.x, _ray.inverse_direction.y, _ray.inverse_direction.z },
+		is_negative{ _ray.is_negative.x != 0, _ray.is_negative.y != 0, _ray.is_negative.z != 0 }
+	{}
+	maths::Decimal	origin[3];
+	maths::Decimal	inverse_direction[3];
+	bool			is_negative[3];
+};
 
-	uint32_t			primitive_count = _last - _first;
-	if (primitive_count <= node_max_size_)
+// Tests the ray against every lane of a wide node, returns one bit per lane hit and writes the
+// distance at which the ray enters each lane's bounds to _t_near. Bounds are either stored
+// floats or dequantized Decimals, they are widened to Decimal before any operation.
+template <uint32_t Width, typename Bound_t> uint32_t
+WideSlabTest(Bound_t const (&_bounds_min)[3][Width],
+			 Bound_t const (&_bounds_max)[3][Width],
+			 TraversalRay const &_ray, maths::Decimal const _t_max, maths::Decimal *const _t_near)
+{
+	// NOTE: as in Ray::DoesIntersect, far distances are pushed back to account for rounding
+	//		 errors, and the min/max operand order discards the NaNs coming from 0 * inf.
+	maths::Decimal const error_bound_factor = 1._d + 2._d * maths::gamma(3u);
+	uint32_t hit_mask = 0u;
+#ifndef YS_DECIMAL_IS_DOUBLE
+	__m128 const error_factor = _mm_set1_ps(error_bound_factor);
+	for (uint32_t group = 0u; group < Width; group += 4u)
 	{
-		BuildLeafNode_(node, bounds, _primitive_desc, _ordered_primitives,
-					   _first, _last, primitive_count);
-		return node;
+		__m128 t_min = _mm_setzero_ps();
+		__m128 t_max = _mm_set1_ps(_t_max);
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			Bound_t const *const near_plane =
+				(_ray.is_negative[axis] ? _bounds_max : _bounds_min)[axis] + group;
+			Bound_t const *const far_plane =
+				(_ray.is_negative[axis] ? _bounds_min : _bounds_max)[axis] + group;
+			__m128 const origin = _mm_set1_ps(_ray.origin[axis]);
+			__m128 const inverse_direction = _mm_set1_ps(_ray.inverse_direction[axis]);
+			__m128 const t_near_axis =
+				_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane), origin), inverse_direction);
+			__m128 const t_far_axis = _mm_mul_ps(_mm_mul_ps(
+				_mm_sub_ps(_mm_load_ps(far_plane), origin), inverse_direction), error_factor);
+			t_min = _mm_max_ps(t_near_axis, t_min);
+			t_max = _mm_min_ps(t_far_axis, t_max);
+		}
+		_mm_store_ps(_t_near + group, t_min);
+		hit_mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_min, t_max))) << group;
 	}
-	else
+#else
+	for (uint32_t lane = 0u; lane < Width; ++lane)
 	{
-		maths::Bounds3f	centroids_bounds{};
-		for (uint32_t i = _first; i < _last; ++i)
-			centroids_bounds = maths::Union(centroids_bounds, _primitive_desc[i].centroid);
-		uint32_t		axis = centroids_bounds.MaximumExtent();
-		uint32_t		middle = (_last + _first) / 2;
-		if (centroids_bounds.max[axis] == centroids_bounds.min[axis])
+		maths::Decimal t_min = 0._d;
+		maths::Decimal t_max = _t_max;
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
 		{
-			BuildLeafNode_(node, bounds, _primitive_desc, _ordered_primitives,
-						   _first, _last, primitive_count);
-			return node;
+			maths::Decimal const near_plane =
+				(_ray.is_negative[axis] ? _bounds_max : _bounds_min)[axis][lane];
+			maths::Decimal const far_plane =
+				(_ray.is_negative[axis] ? _bounds_min : _bounds_max)[axis][lane];
+			maths::Decimal const t_near_axis =
+				(near_plane - _ray.origin[axis]) * _ray.inverse_direction[axis];
+			maths::Decimal const t_far_axis =
+				(far_plane - _ray.origin[axis]) * _ray.inverse_direction[axis] * error_bound_factor;
+			t_min = (t_near_axis > t_min) ? t_near_axis : t_min;
+			t_max = (t_far_axis < t_max) ? t_far_axis : t_max;
 		}
-		else
-		{
-			SahBucketDesc	buckets[SahBucketDesc::kBucketCount];
-			for (uint32_t i = _first; i < _last; ++i)
-			{
-				uint32_t bucket_index = uint32_t(SahBucketDesc::kBucketCount *
-					centroids_bounds.Offset(_primitive_desc[i].centroid)[axis]);
-				if (bucket_index == SahBucketDesc::kBucketCount)
-					bucket_index = SahBucketDesc::kBucketCount - 1;
-				buckets[bucket_index].primitive_count++;
-				buckets[bucket_index].bounds = maths::Union(buckets[bucket_index].bounds,
-															_primitive_desc[i].bounds);
-			}
-
-			maths::Decimal	lowest_cost = maths::infinity<maths::Decimal>;
-			uint32_t		lowest_cost_index = maths::highest_value<uint32_t>;
-			for (uint32_t i = 0; i < SahBucketDesc::kBucketCount - 1; ++i)
-			{
-				maths::Bounds3f		b0, b1;
-				uint32_t			count0{ 0u }, count1{ 0u };
-				for (uint32_t j = 0; j <= i; ++j)
-				{
-					b0 = maths::Union(b0, buckets[j].bounds);
-					count0 += buckets[j].primitive_count;
-				}
-				for (uint32_t j = i + 1; j < SahBucketDesc::kBucketCount; ++j)
-				{
-					b1 = maths::Union(b1, buckets[j].bounds);
-					count1 += buckets[j].primitive_count;
-				}
-				maths::Decimal	cost = .125_d + 
-					(count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / bounds.SurfaceArea();
-
-				if (cost < lowest_cost)
-				{
-					lowest_cost = cost;
-					lowest_cost_index = i;
-				}
-			}
+		_t_near[lane] = t_min;
+		hit_mask |= static_cast<uint32_t>(t_min <= t_max) << lane;
+	}
+#endif // !YS_DECIMAL_IS_DOUBLE
+	return hit_mask;
+}
 
-			maths::Decimal	leaf_cost{ static_cast<maths::Decimal>(primitive_count) };
-			if (primitive_count > node_max_size_ || lowest_cost < leaf_cost)
-			{
-				BvhPrimitiveDesc	*pivot_primitive = 
-					std::partition(&_primitive_desc[_first], &_primitive_desc[_last - 1] + 1,
-								   [=](BvhPrimitiveDesc const &desc)
-				{
-					maths::Decimal const	desc_offset = centroids_bounds.Offset(desc.centroid)[axis];
-					uint32_t bucket = uint32_t(SahBucketDesc::kBucketCount * desc_offset);
-					if (bucket == SahBucketDesc::kBucketCount)
-						bucket = SahBucketDesc::kBucketCount - 1;
-					return bucket <= lowest_cost_index;
-				});
-
-				middle = static_cast<uint32_t>(pivot_primitive - _primitive_desc.data());
-			}
-			else
+// Ray values of a packet laid out for the packet slab tests. Rays out of the traversal mask get
+// a negative tMax, no bounds can be hit by them.
+struct TraversalPacket
+{
+	TraversalPacket(RayPacket const &_packet, uint32_t const _ray_mask)
+	{
+		for (uint32_t i = 0u; i < RayPacket::kMaxSize; ++i)
+		{
+			bool const	is_traced = (i < _packet.size) && (_ray_mask & (1u << i)) != 0u;
+			for (uint32_t axis = 0u; axis < 3u; ++axis)
 			{
-				BuildLeafNode_(node, bounds, _primitive_desc, _ordered_primitives,
-							   _first, _last, primitive_count);
-				return node;
+				origin[axis][i] = is_traced ? _packet.rays[i].origin[axis] : 0._d;
+				inverse_direction[axis][i] = is_traced ? _packet.rays[i].inverse_direction[axis] : 0._d;
+				is_negative[axis][i] = (is_traced && _packet.rays[i].is_negative[axis] != 0) ? ~0u : 0u;
 			}
+			t_max[i] = is_traced ? _packet.rays[i].tMax : -1._d;
+		}
+	}
+	// Reads back the tMax of the rays of _ray_mask, after hits shortened them
+	void	UpdateTMax(RayPacket const &_packet, uint32_t const _ray_mask)
+	{
+		for (uint32_t i = 0u; i < _packet.size; ++i)
+			if ((_ray_mask & (1u << i)) != 0u)
+				t_max[i] = _packet.rays[i].tMax;
+	}
+	alignas(16) maths::Decimal	origin[3][RayPacket::kMaxSize];
+	alignas(16) maths::Decimal	inverse_direction[3][RayPacket::kMaxSize];
+	alignas(16) uint32_t		is_negative[3][RayPacket::kMaxSize];	// all bits set when negative
+	alignas(16) maths::Decimal	t_max[RayPacket::kMaxSize];
+};
 
-			BvhNode	*left = BuildRecursive(_region, _primitive_desc, _first, middle,
-										   _node_count, _ordered_primitives);
-			BvhNode *right = BuildRecursive(_region, _primitive_desc, middle, _last,
-											_node_count, _ordered_primitives);
-			new (node) BvhNode(axis, *left, *right);
-			return node;
+// Tests the rays of _ray_mask against _bounds, returns one bit per ray hit. Same operations as
+// WideSlabTest, with the rays in the lanes instead of the bounds.
+uint32_t
+PacketSlabTest(maths::Bounds3s const &_bounds, TraversalPacket const &_packet,
+			   uint32_t const _ray_mask)
+{
+	maths::Decimal const error_bound_factor = 1._d + 2._d * maths::gamma(3u);
+	uint32_t hit_mask = 0u;
+#ifndef YS_DECIMAL_IS_DOUBLE
+	__m128 const error_factor = _mm_set1_ps(error_bound_factor);
+	for (uint32_t group = 0u; group < RayPacket::kMaxSize; group += RayPacket::kGroupSize)
+	{
+		if (((_ray_mask >> group) & ((1u << RayPacket::kGroupSize) - 1u)) == 0u)
+			continue;
+		__m128 t_min = _mm_setzero_ps();
+		__m128 t_max = _mm_load_ps(_packet.t_max + group);
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			__m128 const is_negative = _mm_castsi128_ps(_mm_load_si128(
+				reinterpret_cast<__m128i const *>(_packet.is_negative[axis] + group)));
+			__m128 const bounds_min = _mm_set1_ps(_bounds.min[axis]);
+			__m128 const bounds_max = _mm_set1_ps(_bounds.max[axis]);
+			__m128 const near_plane = _mm_or_ps(_mm_and_ps(is_negative, bounds_max),
+												_mm_andnot_ps(is_negative, bounds_min));
+			__m128 const far_plane = _mm_or_ps(_mm_and_ps(is_negative, bounds_min),
+											   _mm_andnot_ps(is_negative, bounds_max));
+			__m128 const origin = _mm_load_ps(_packet.origin[axis] + group);
+			__m128 const inverse_direction = _mm_load_ps(_packet.inverse_direction[axis] + group);
+			__m128 const t_near_axis = _mm_mul_ps(_mm_sub_ps(near_plane, origin), inverse_direction);
+			__m128 const t_far_axis = _mm_mul_ps(_mm_mul_ps(
+				_mm_sub_ps(far_plane, origin), inverse_direction), error_factor);
+			t_min = _mm_max_ps(t_near_axis, t_min);
+			t_max = _mm_min_ps(t_far_axis, t_max);
+		}
+		hit_mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_min, t_max))) << group;
+	}
+#else
+	for (uint32_t lane = 0u; lane < RayPacket::kMaxSize; ++lane)
+	{
+		if ((_ray_mask & (1u << lane)) == 0u)
+			continue;
+		maths::Decimal t_min = 0._d;
+		maths::Decimal t_max = _packet.t_max[lane];
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			bool const is_negative = _packet.is_negative[axis][lane] != 0u;
+			maths::Decimal const near_plane = is_negative ? _bounds.max[axis] : _bounds.min[axis];
+			maths::Decimal const far_plane = is_negative ? _bounds.min[axis] : _bounds.max[axis];
+			maths::Decimal const t_near_axis =
+				(near_plane - _packet.origin[axis][lane]) * _packet.inverse_direction[axis][lane];
+			maths::Decimal const t_far_axis = (far_plane - _packet.origin[axis][lane]) *
+				_packet.inverse_direction[axis][lane] * error_bound_factor;
+			t_min = (t_near_axis > t_min) ? t_near_axis : t_min;
+			t_max = (t_far_axis < t_max) ? t_far_axis : t_max;
 		}
+		hit_mask |= static_cast<uint32_t>(t_min <= t_max) << lane;
 	}
+#endif // !YS_DECIMAL_IS_DOUBLE
+	return hit_mask & _ray_mask;
+}
 
-	YS_ASSERT(false);
-	LOG_ERROR(tools::kChannelGeneral, "An error occured while building a BVH. BuildRecursive returned nullptr.");
-	return nullptr;
+uint32_t
+MaskRayCount(uint32_t _ray_mask)
+{
+	uint32_t count = 0u;
+	for (; _ray_mask != 0u; _ray_mask &= _ray_mask - 1u)
+		++count;
+	return count;
 }
 
-bool
-BvhAccelerator::Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const
+uint32_t
+MaskFirstRay(uint32_t const _ray_mask)
 {
-	TIMED_SCOPE(BvhAccelerator_Intersect);
+	YS_ASSERT(_ray_mask != 0u);
+	uint32_t index = 0u;
+	while ((_ray_mask & (1u << index)) == 0u)
+		++index;
+	return index;
+}
 
-	bool	hit = false;
-	maths::Vec3f	direction_inverse = maths::one<maths::Vec3f> / _ray.direction;
-	// We will use these values as indices in Ray::DoesIntersect, which is why they are int.
-	maths::Vector<int, 3>	is_negative{
-		direction_inverse.x < 0._d, direction_inverse.y < 0._d, direction_inverse.z < 0._d
-	};
-	
-	uint32_t	to_visit_offset{ 0 }, current_node_index{ 0 };
-	uint32_t	nodes_to_visit[64];
-	for (;;)
+maths::Decimal
+Dequantize(maths::Decimal const _origin, maths::Decimal const _scale, uint32_t const _step)
+{
+	return _origin + static_cast<maths::Decimal>(_step) * _scale;
+}
+
+// Quantization scales are powers of two with a normal float exponent
+constexpr int32_t kMinScaleExponent = -126;
+constexpr int32_t kMaxScaleExponent = 127;
+
+float
+QuantizedScale(int32_t const _exponent)
+{
+	YS_ASSERT(_exponent >= kMinScaleExponent && _exponent <= kMaxScaleExponent);
+	uint32_t const	bits = static_cast<uint32_t>(_exponent + 127) << 23;
+	float			scale;
+	std::memcpy(&scale, &bits, sizeof(float));
+	return scale;
+}
+
+// Expands the 8 bit bounds of a quantized node, using the same operations as Dequantize so that
+// the build can check the decoded bounds.
+template <uint32_t Width, typename Node_t> void
+DequantizeBounds(Node_t const &_node,
+				 maths::Decimal (&_bounds_min)[3][Width], maths::Decimal (&_bounds_max)[3][Width])
+{
+#ifndef YS_DECIMAL_IS_DOUBLE
+	__m128i const zero = _mm_setzero_si128();
+	for (uint32_t axis = 0u; axis < 3u; ++axis)
 	{
-		LinearBvhNode const &node = nodes_[current_node_index];
-		if (_ray.DoesIntersect(node.bounds, direction_inverse, is_negative))
+		__m128 const origin = _mm_set1_ps(_node.origin[axis]);
+		__m128 const scale = _mm_set1_ps(QuantizedScale(_node.scale_exponent[axis]));
+		for (uint32_t group = 0u; group < Width; group += 4u)
 		{
-			if (node.primitive_count > 0)
-			{
-				for (uint16_t i = 0; i < node.primitive_count; ++i)
-					hit |= primitives_[node.first_primitive_index + i]->Intersect(_ray, _hit_info);
-				if (to_visit_offset == 0) break;
-				current_node_index = nodes_to_visit[--to_visit_offset];
-			}
-			else
-			{
-				if (is_negative[node.split_axis])
-				{
-					nodes_to_visit[to_visit_offset++] = current_node_index + 1;
-					current_node_index = node.right_child_offset;
-				}
-				else
-				{
-					nodes_to_visit[to_visit_offset++] = node.right_child_offset;
-					current_node_index = current_node_index + 1;
-				}
-			}
+			int32_t packed_min, packed_max;
+			std::memcpy(&packed_min, _node.bounds_min[axis] + group, sizeof(int32_t));
+			std::memcpy(&packed_max, _node.bounds_max[axis] + group, sizeof(int32_t));
+			__m128 const steps_min = _mm_cvtepi32_ps(_mm_unpacklo_epi16(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_min), zero), zero));
+			__m128 const steps_max = _mm_cvtepi32_ps(_mm_unpacklo_epi16(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_max), zero), zero));
+			_mm_store_ps(_bounds_min[axis] + group, _mm_add_ps(origin, _mm_mul_ps(steps_min, scale)));
+			_mm_store_ps(_bounds_max[axis] + group, _mm_add_ps(origin, _mm_mul_ps(steps_max, scale)));
 		}
-		else
+	}
+#else
+	for (uint32_t axis = 0u; axis < 3u; ++axis)
+	{
+		maths::Decimal const scale = QuantizedScale(_node.scale_exponent[axis]);
+		for (uint32_t lane = 0u; lane < Width; ++lane)
 		{
-			if (to_visit_offset == 0) break;
-			current_node_index = nodes_to_visit[--to_visit_offset];
+			_bounds_min[axis][lane] =
+				Dequantize(_node.origin[axis], scale, _node.bounds_min[axis][lane]);
+			_bounds_max[axis][lane] =
+				Dequantize(_node.origin[axis], scale, _node.bounds_max[axis][lane]);
 		}
 	}
+#endif // !YS_DECIMAL_IS_DOUBLE
+}
 
-	return hit;
+// Widens the single precision bounds of a wide node to Decimal, unused lanes included
+template <uint32_t Width, typename Node_t> void
+WidenBounds(Node_t const &_node,
+			maths::Decimal (&_bounds_min)[3][Width], maths::Decimal (&_bounds_max)[3][Width])
+{
+	for (uint32_t axis = 0u; axis < 3u; ++axis)
+		for (uint32_t lane = 0u; lane < Width; ++lane)
+		{
+			_bounds_min[axis][lane] = _node.bounds_min[axis][lane];
+			_bounds_max[axis][lane] = _node.bounds_max[axis][lane];
+		}
 }
 
-bool
-BvhAccelerator::DoesIntersect(maths::Ray const &_ray) const
+// Lanes past the children of a wide node are unused, they hold empty bounds
+template <typename Node_t> bool
+IsUsedLane(Node_t const &_node, uint32_t const _lane)
 {
-	maths::Vec3f	direction_inverse = maths::one<maths::Vec3f> / _ray.direction;
-	// We will use these values as indices in Ray::DoesIntersect, which is why they are int.
-	maths::Vector<int, 3>	is_negative{
-		direction_inverse.x < 0._d, direction_inverse.y < 0._d, direction_inverse.z < 0._d
-	};
+	if constexpr (Node_t::kIsQuantized)
+		return _lane < _node.child_count;
+	else
+		return _node.bounds_min[0][_lane] <= _node.bounds_max[0][_lane];
+}
 
-	uint32_t	to_visit_offset{ 0 }, current_node_index{ 0 };
-	uint32_t	nodes_to_visit[64];
-	for (;;)
+// Stored node as seen by the layout pass
+struct LayoutNode
+{
+	uint32_t	children[BvhAccelerator::kBvh8NodeWidth];		// inner children, leaves of binary nodes
+	uint32_t	child_count;
+	float		area;
+};
+
+// Returns the position of each node in _layout. Treelets are grown from their root by adding
+// the nodes of largest surface area, the most likely to be visited by a ray that reached the
+// root, until they reach the end of the block they started in. Nodes are placed depth first
+// within a treelet, and treelets depth first after their parent treelet, so children always
+// follow their parent. With _left_child_adjacent, the first child of a node is placed right
+// after it: a node is added with the chain of its first children down to a leaf.
+std::vector<uint32_t>
+LayoutOrder(std::vector<LayoutNode> const &_nodes, BvhAccelerator::NodeLayout const _layout,
+			size_t const _node_size, bool const _left_child_adjacent)
+{
+	uint32_t const			node_count = static_cast<uint32_t>(_nodes.size());
+	uint32_t const			block_capacity = (_layout == BvhAccelerator::kDepthFirstLayout) ?
+		node_count :
+		static_cast<uint32_t>(maths::Max(BvhAccelerator::kLayoutBlockSize / _node_size, size_t{ 1u }));
+	uint32_t const			hot_capacity = (_layout == BvhAccelerator::kHotTreeletLayout) ?
+		static_cast<uint32_t>(maths::Max(BvhAccelerator::kHotTreeletSize / _node_size, size_t{ 1u })) :
+		block_capacity;
+	uint32_t constexpr		kUnplaced = maths::highest_value<uint32_t>;
+	std::vector<uint32_t>	order(node_count, kUnplaced);
+	std::vector<bool>		is_member(node_count, false);
+	uint32_t				position = 0u;
+
+	using Candidate_t = std::pair<float, uint32_t>;
+	std::vector<uint32_t>	treelet_roots{ 0u };
+	std::vector<uint32_t>	members{};
+	std::vector<uint32_t>	placement_stack{};
+	std::vector<Candidate_t>	frontier{};
+	while (!treelet_roots.empty())
 	{
-		LinearBvhNode const &node = nodes_[current_node_index];
-		if (_ray.DoesIntersect(node.bounds, direction_inverse, is_negative))
+		uint32_t const	root = treelet_roots.back();
+		treelet_roots.pop_back();
+		uint32_t const	capacity = (position == 0u) ? hot_capacity :
+			block_capacity - position % block_capacity;
+
+		// Grows the treelet
+		members.clear();
+		frontier.assign(1u, Candidate_t{ _nodes[root].area, root });
+		while (!frontier.empty())
 		{
-			if (node.primitive_count > 0)
-			{
-				for (uint16_t i = 0; i < node.primitive_count; ++i)
-					if (primitives_[node.first_primitive_index + i]->DoesIntersect(_ray))
-						return true;
-				if (to_visit_offset == 0) break;
-				current_node_index = nodes_to_visit[--to_visit_offset];
-			}
-			else
+			uint32_t	added_count = 1u;
+			if (_left_child_adjacent)
+				for (uint32_t node = frontier.front().second; _nodes[node].child_count > 0u;
+					 node = _nodes[node].children[0])
+					++added_count;
+			if (!members.empty() && members.size() + added_count > capacity)
+				break;
+			std::pop_heap(frontier.begin(), frontier.end());
+			uint32_t	node = frontier.back().second;
+			frontier.pop_back();
+			for (uint32_t i = 0u; i < added_count; ++i)
 			{
-				if (is_negative[node.split_axis])
-				{
-					nodes_to_visit[to_visit_offset++] = current_node_index + 1;
-					current_node_index = node.right_child_offset;
-				}
-				else
+				members.push_back(node);
+				is_member[node] = true;
+				LayoutNode const	&layout_node = _nodes[node];
+				for (uint32_t child = (_left_child_adjacent ? 1u : 0u); child < layout_node.child_count; ++child)
 				{
-					nodes_to_visit[to_visit_offset++] = node.right_child_offset;
-					current_node_index = current_node_index + 1;
+					frontier.emplace_back(_nodes[layout_node.children[child]].area,
+										  layout_node.children[child]);
+					std::push_heap(frontier.begin(), frontier.end());
 				}
+				if (layout_node.child_count > 0u)
+					node = layout_node.children[0];
 			}
 		}
-		else
+
+		// Places it, then the treelets below it with the largest ones first
+		placement_stack.assign(1u, root);
+		while (!placement_stack.empty())
 		{
-			if (to_visit_offset == 0) break;
-			current_node_index = nodes_to_visit[--to_visit_offset];
+			uint32_t const		node = placement_stack.back();
+			placement_stack.pop_back();
+			order[node] = position++;
+			LayoutNode const	&layout_node = _nodes[node];
+			for (uint32_t child = layout_node.child_count; child-- > 0u;)
+				if (is_member[layout_node.children[child]])
+					placement_stack.push_back(layout_node.children[child]);
 		}
+		std::sort(frontier.begin(), frontier.end());
+		for (Candidate_t const &candidate : frontier)
+			treelet_roots.push_back(candidate.second);
 	}
+	YS_ASSERT(position == node_count);
+	return order;
+}
 
-	return false;
+maths::Bounds3f
+UnionRange(std::vector<maths::Bounds3f> const &_bounds, uint32_t const _first, uint32_t const _count)
+{
+	maths::Bounds3f result{};
+	for (uint32_t i = _first; i < _first + _count; ++i)
+		result = maths::Union(result, _bounds[i]);
+	return result;
 }
 
+} // namespace
 
-maths::Bounds3f
-BvhAccelerator::WorldBounds() const
+
+template <> BvhAccelerator::WideNodeArray_t<BvhAccelerator::kBvh4NodeWidth> const &
+BvhAccelerator::node_array_<BvhAccelerator::WideBvhNode<BvhAccelerator::kBvh4NodeWidth>>() const
 {
-	maths::Bounds3f		world_bounds{};
-	for (auto &&primitive : primitives_)
-		world_bounds = maths::Union(world_bounds, primitive->WorldBounds());
-	return world_bounds;
+	return wide4_nodes_;
+}
+
+
+template <> BvhAccelerator::WideNodeArray_t<BvhAccelerator::kBvh8NodeWidth> const &
+BvhAccelerator::node_array_<BvhAccelerator::WideBvhNode<BvhAccelerator::kBvh8NodeWidth>>() const
+{
+	return wide8_nodes_;
+}
+
+
+template <> BvhAccelerator::QuantizedNodeArray_t<BvhAccelerator::kBvh4NodeWidth> const &
+BvhAccelerator::node_array_<BvhAccelerator::QuantizedBvhNode<BvhAccelerator::kBvh4NodeWidth>>() const
+{
+	return quantized4_nodes_;
+}
+
+
+template <> BvhAccelerator::QuantizedNodeArray_t<BvhAccelerator::kBvh8NodeWidth> const &
+BvhAccelerator::node_array_<BvhAccelerator::QuantizedBvhNode<BvhAccelerator::kBvh8NodeWidth>>() const
+{
+	return quantized8_nodes_;
+}
+
+
+template <typename Node_t> std::vector<Node_t> &
+BvhAccelerator::node_array_()
+{
+	return const_cast<std::vector<Node_t> &>(
+		const_cast<BvhAccelerator const *>(this)->node_array_<Node_t>()
+	);
+}
+
+
+BvhAccelerator::BvhAccelerator() :
+	primitives_{},
+	source_{ nullptr },
+	primitive_count_{ 0u },
+	nodes_{ nullptr },
+	node_max_size_{ 0u },
+	quantized_nodes_{ false },
+	node_width_{ kBinaryNodeWidth },
+	build_method_{ kSahBuild },
+	duplication_budget_{ 0.f },
+	short_stack_traversal_{ false },
+	node_layout_{ kDepthFirstLayout },
+	node_memory_size_{ 0u },
+	build_milliseconds_{ 0. },
+	sah_cost_{ 0. },
+	subtree_costs_{},
+	built_sah_cost_{ 0. },
+	primitive_indices_{},
+	wide4_nodes_{},
+	wide8_nodes_{},
+	quantized4_nodes_{},
+	quantized8_nodes_{}
+{}
+
+BvhAccelerator::BvhAccelerator(BvhAccelerator::PrimitiveArray_t const &_primitives,
+							   uint32_t _node_max_size,
+							   uint32_t _node_width,
+							   bool _quantized_nodes,
+							   BuildMethod _build_method,
+							   float _duplication_budget,
+							   std::string const &_cache_file) :
+	primitives_{ _primitives },
+	source_{ nullptr },
+	primitive_count_{ static_cast<uint32_t>(_primitives.size()) },
+	nodes_{ nullptr },
+	node_max_size_{ _node_max_size },
+	quantized_nodes_{ ValidQuantizedNodes_(_quantized_nodes, _node_max_size) },
+	node_width_{ ValidNodeWidth_(_node_width, quantized_nodes_) },
+	build_method_{ _build_method },
+	duplication_budget_{ maths::Max(_duplication_budget, 0.f) },
+	short_stack_traversal_{ false },
+	node_layout_{ kDepthFirstLayout },
+	node_memory_size_{ 0u },
+	build_milliseconds_{ 0. },
+	sah_cost_{ 0. },
+	subtree_costs_{},
+	built_sah_cost_{ 0. },
+	primitive_indices_{},
+	wide4_nodes_{},
+	wide8_nodes_{},
+	quantized4_nodes_{},
+	quantized8_nodes_{}
+{
+	YS_ASSERT(_primitives.size() <= maths::highest_value<uint32_t>);
+	BuildOrLoad_(_cache_file);
+}
+
+BvhAccelerator::BvhAccelerator(BvhAccelerator::PrimitiveSource const &_source,
+							   uint32_t _node_max_size,
+							   uint32_t _node_width,
+							   bool _quantized_nodes,
+							   BuildMethod _build_method,
+							   float _duplication_budget,
+							   std::string const &_cache_file) :
+	primitives_{},
+	source_{ &_source },
+	primitive_count_{ _source.primitive_count() },
+	nodes_{ nullptr },
+	node_max_size_{ _node_max_size },
+	quantized_nodes_{ ValidQuantizedNodes_(_quantized_nodes, _node_max_size) },
+	node_width_{ ValidNodeWidth_(_node_width, quantized_nodes_) },
+	build_method_{ _build_method },
+	duplication_budget_{ maths::Max(_duplication_budget, 0.f) },
+	short_stack_traversal_{ false },
+	node_layout_{ kDepthFirstLayout },
+	node_memory_size_{ 0u },
+	build_milliseconds_{ 0. },
+	sah_cost_{ 0. },
+	subtree_costs_{},
+	built_sah_cost_{ 0. },
+	primitive_indices_{},
+	wide4_nodes_{},
+	wide8_nodes_{},
+	quantized4_nodes_{},
+	quantized8_nodes_{}
+{
+	BuildOrLoad_(_cache_file);
+}
+BvhAccelerator::~BvhAccelerator()
+{
+	ReleaseNodeStorage_();
 }
 
 
 void
-BvhAccelerator::BuildLeafNode_(BvhNode *_node,
-							   maths::Bounds3f const &_bounds,
-							   std::vector<BvhPrimitiveDesc> &_primitive_desc,
-							   PrimitiveArray_t &_ordered_primitives,
-							   uint32_t _first, uint32_t _last, uint32_t _primitive_count) const
+BvhAccelerator::BuildOrLoad_(std::string const &_cache_file)
 {
-	uint32_t	first_primitive_index = static_cast<uint32_t>(_ordered_primitives.size());
-	for (uint32_t i = _first; i < _last; ++i)
+	TIMED_SCOPE(BvhAccelerator_Build);
+	YS_ASSERT(node_max_size_ <= maths::highest_value<uint16_t>);
+	if (primitive_count_ == 0u)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Requested the construction of a BVH using an empty list of primitives.");
+		return;
+	}
+
+	std::chrono::high_resolution_clock::time_point const start =
+		std::chrono::high_resolution_clock::now();
+	if (!_cache_file.empty() && ReadCache_(_cache_file))
 	{
-		uint32_t	primitive_index = _primitive_desc[i].primitive_index;
-		_ordered_primitives.push_back(primitives_[primitive_index]);
+		build_milliseconds_ = std::chrono::duration<double, std::milli>(
+			std::chrono::high_resolution_clock::now() - start).count();
+		LOG_INFO(tools::kChannelGeneral, "Loaded BVH from cache file " + _cache_file);
+		return;
 	}
-	new (_node) BvhNode(first_primitive_index, _primitive_count, _bounds);
+	primitive_indices_ = Build_();
+	build_milliseconds_ = std::chrono::duration<double, std::milli>(
+		std::chrono::high_resolution_clock::now() - start).count();
+	std::string const				builder_name = (build_method_ == kLinearBuild) ? "linear" :
+		(build_method_ == kSpatialSahBuild) ? "spatial SAH" : "SAH";
+	LOG_INFO(tools::kChannelGeneral, "Built BVH over " + std::to_string(primitive_count_) +
+			 " primitives (" + std::to_string(primitive_indices_.size()) + " references) with the " +
+			 builder_name + " builder in " + std::to_string(build_milliseconds_) + "ms, SAH cost " +
+			 std::to_string(sah_cost_));
+	if (!_cache_file.empty())
+		WriteCache_(_cache_file, primitive_count_, primitive_indices_);
 }
 
-uint32_t
-BvhAccelerator::FlattenBvhRecursive_(BvhNode const &_node, uint32_t &_offset)
+
+std::vector<uint32_t>
+BvhAccelerator::Build_()
 {
-	LinearBvhNode &linear_node = nodes_[_offset];
-	linear_node.bounds = _node.bounds;
-	linear_node.primitive_count = _node.primitive_count;
-	
-	uint32_t	self_offset = _offset++;
-	if (_node.primitive_count > 0)
-		linear_node.first_primitive_index = _node.first_primitive_index;
+	uint32_t const					primitive_count = primitive_count_;
+	std::vector<BvhPrimitiveDesc>	primitive_desc(primitive_count);
+	ParallelReduce<bool>(0u, primitive_count,
+						 [this, &primitive_desc](uint32_t const _first, uint32_t const _last) {
+		for (uint32_t i = _first; i < _last; ++i)
+			primitive_desc[i] = BvhPrimitiveDesc(i, PrimitiveBounds_(i));
+		return true;
+	}, [](bool const _lhs, bool const _rhs) { return _lhs && _rhs; });
+
+	BuildContext						context{};
+	core::MemoryRegion					allocator{ kNodeRegionBlockSize };
+	BvhNode								*root;
+	if (build_method_ == kLinearBuild)
+		root = BuildLinear_(context, allocator, primitive_desc);
+	else if (build_method_ == kSpatialSahBuild)
+	{
+		maths::Bounds3f const			bounds = ParallelReduce<maths::Bounds3f>(0u, primitive_count,
+			[&primitive_desc](uint32_t const _first, uint32_t const _last) {
+			maths::Bounds3f result{};
+			for (uint32_t i = _first; i < _last; ++i)
+				result = maths::Union(result, primitive_desc[i].bounds);
+			return result;
+		}, [](maths::Bounds3f const &_lhs, maths::Bounds3f const &_rhs) {
+			return maths::Union(_lhs, _rhs);
+		});
+		SpatialBuildState				state{
+			{}, static_cast<uint32_t>(duplication_budget_ * static_cast<float>(primitive_count)),
+			kSpatialSplitOverlapRatio * bounds.SurfaceArea()
+		};
+		state.leaf_references.reserve(primitive_count + state.remaining_duplicates);
+		root = BuildSpatialRecursive_(context, allocator, state, primitive_desc);
+		primitive_desc.swap(state.leaf_references);
+	}
 	else
+		root = BuildRecursive_(context, allocator, primitive_desc, 0u, primitive_count);
+	LimitDepth_(*root);
+	maths::Decimal const				root_area = root->bounds.SurfaceArea();
+	sah_cost_ = (root_area > 0._d) ? SahCostRecursive_(*root) / root_area : 0.;
+
+	// Leaves index ranges of primitive_desc, which the build partitioned in place
+	uint32_t const						reference_count = static_cast<uint32_t>(primitive_desc.size());
+	std::vector<uint32_t>				primitive_order(reference_count);
+	for (uint32_t i = 0u; i < reference_count; ++i)
+		primitive_order[i] = primitive_desc[i].primitive_index;
+
+	EmitNodes_(*root, context.node_count);
+	return primitive_order;
+}
+
+
+bool
+BvhAccelerator::ReadCache_(std::string const &_cache_file)
+{
+	std::ifstream	file{ _cache_file, std::ios::binary };
+	if (!file)
+		return false;
+
+	uint32_t const		primitive_count = primitive_count_;
+	CacheHeader			header{};
+	file.read(reinterpret_cast<char*>(&header), sizeof(CacheHeader));
+	bool const			header_is_valid = file &&
+		header.magic == kCacheMagic && header.version == kCacheVersion &&
+		header.decimal_size == sizeof(maths::Decimal) &&
+		header.node_max_size == node_max_size_ && header.node_width == node_width_ &&
+		header.quantized_nodes == (quantized_nodes_ ? 1u : 0u) &&
+		header.build_method == static_cast<uint16_t>(build_method_) &&
+		header.duplication_budget == duplication_budget_ &&
+		header.primitive_count == primitive_count &&
+		header.reference_count >= primitive_count &&
+		(header.reference_count == primitive_count || build_method_ == kSpatialSahBuild) &&
+		header.node_size == node_storage_().node_size &&
+		header.node_count > 0u &&
+		header.node_count < 2u * static_cast<uint64_t>(header.reference_count);
+	if (!header_is_valid)
 	{
-		linear_node.split_axis = _node.split_axis;
-		FlattenBvhRecursive_(*_node.children[0], _offset);
-		linear_node.right_child_offset = FlattenBvhRecursive_(*_node.children[1], _offset);
+		LOG_WARNING(tools::kChannelGeneral, "Ignored BVH cache file " + _cache_file +
+					", it was written with different parameters.");
+		return false;
 	}
 
-	return self_offset;
+	uint32_t const			reference_count = header.reference_count;
+	size_t const			order_size = reference_count * sizeof(uint32_t);
+	std::vector<uint32_t>	primitive_order(reference_count);
+	file.read(reinterpret_cast<char*>(primitive_order.data()), order_size);
+	file.seekg(AlignUp(sizeof(CacheHeader) + order_size, kCacheAlignment));
+	NodeStorage const		storage = AllocateNodeStorage_(static_cast<size_t>(header.node_count));
+	size_t const			node_bytes = storage.node_count * storage.node_size;
+	file.read(reinterpret_cast<char*>(storage.data), node_bytes);
+
+	uint64_t const			payload_hash = core::HashBytes(storage.data, node_bytes,
+		core::HashBytes(primitive_order.data(), order_size));
+	// Every primitive is referenced, only once unless spatial splits duplicated it
+	std::vector<bool>		is_referenced(primitive_count, false);
+	uint32_t				referenced_count = 0u;
+	bool					order_is_valid = true;
+	for (uint32_t const primitive_index : primitive_order)
+	{
+		order_is_valid = order_is_valid && primitive_index < primitive_count &&
+			(build_method_ == kSpatialSahBuild || !is_referenced[primitive_index]);
+		if (order_is_valid && !is_referenced[primitive_index])
+		{
+			is_referenced[primitive_index] = true;
+			++referenced_count;
+		}
+	}
+	order_is_valid = order_is_valid && referenced_count == primitive_count;
+	if (!file || payload_hash != header.payload_hash || !order_is_valid)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Ignored BVH cache file " + _cache_file +
+					", its content is corrupted.");
+		ReleaseNodeStorage_();
+		return false;
+	}
+
+	primitive_indices_.swap(primitive_order);
+	sah_cost_ = header.sah_cost;
+	return true;
+}
+
+
+void
+BvhAccelerator::WriteCache_(std::string const &_cache_file,
+							uint32_t _primitive_count,
+							std::vector<uint32_t> const &_primitive_order) const
+{
+	NodeStorage const	storage = node_storage_();
+	size_t const		order_size = _primitive_order.size() * sizeof(uint32_t);
+	size_t const		node_bytes = storage.node_count * storage.node_size;
+	size_t const		nodes_offset = AlignUp(sizeof(CacheHeader) + order_size, kCacheAlignment);
+	CacheHeader const	header{
+		kCacheMagic, kCacheVersion, sizeof(maths::Decimal),
+		node_max_size_, node_width_,
+		static_cast<uint16_t>(quantized_nodes_ ? 1u : 0u), static_cast<uint16_t>(build_method_),
+		_primitive_count, static_cast<uint32_t>(_primitive_order.size()), duplication_budget_,
+		storage.node_count, static_cast<uint32_t>(storage.node_size), static_cast<float>(sah_cost_),
+		core::HashBytes(storage.data, node_bytes,
+						core::HashBytes(_primitive_order.data(), order_size))
+	};
+	std::vector<char> const	padding(nodes_offset - sizeof(CacheHeader) - order_size, 0);
+
+	// Written aside first, so that an interrupted write never leaves a truncated cache file
+	std::string const	temporary_file = _cache_file + ".tmp";
+	bool				write_succeeded = false;
+	{
+		std::ofstream	file{ temporary_file, std::ios::binary | std::ios::trunc };
+		file.write(reinterpret_cast<char const*>(&header), sizeof(CacheHeader));
+		file.write(reinterpret_cast<char const*>(_primitive_order.data()), order_size);
+		file.write(padding.data(), padding.size());
+		file.write(reinterpret_cast<char const*>(storage.data), node_bytes);
+		write_succeeded = static_cast<bool>(file);
+	}
+	std::remove(_cache_file.c_str());
+	if (!write_succeeded || std::rename(temporary_file.c_str(), _cache_file.c_str()) != 0)
+	{
+		std::remove(temporary_file.c_str());
+		LOG_WARNING(tools::kChannelGeneral, "Failed to write BVH cache file " + _cache_file);
+	}
+}
+
+
+BvhAccelerator::NodeStorage
+BvhAccelerator::node_storage_() const
+{
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		if (quantized_nodes_)
+			return NodeStorage{ const_cast<QuantizedBvhNode<kBvh4NodeWidth>*>(quantized4_nodes_.data()),
+								quantized4_nodes_.size(), sizeof(QuantizedBvhNode<kBvh4NodeWidth>) };
+		return NodeStorage{ const_cast<WideBvhNode<kBvh4NodeWidth>*>(wide4_nodes_.data()),
+							wide4_nodes_.size(), sizeof(WideBvhNode<kBvh4NodeWidth>) };
+	case kBvh8NodeWidth:
+		if (quantized_nodes_)
+			return NodeStorage{ const_cast<QuantizedBvhNode<kBvh8NodeWidth>*>(quantized8_nodes_.data()),
+								quantized8_nodes_.size(), sizeof(QuantizedBvhNode<kBvh8NodeWidth>) };
+		return NodeStorage{ const_cast<WideBvhNode<kBvh8NodeWidth>*>(wide8_nodes_.data()),
+							wide8_nodes_.size(), sizeof(WideBvhNode<kBvh8NodeWidth>) };
+	default:
+		return NodeStorage{ nodes_, node_memory_size_ / sizeof(LinearBvhNode), sizeof(LinearBvhNode) };
+	}
+}
+
+
+BvhAccelerator::NodeStorage
+BvhAccelerator::AllocateNodeStorage_(size_t _node_count)
+{
+	YS_ASSERT(node_memory_size_ == 0u);
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		if (quantized_nodes_)
+			quantized4_nodes_.resize(_node_count);
+		else
+			wide4_nodes_.resize(_node_count);
+		break;
+	case kBvh8NodeWidth:
+		if (quantized_nodes_)
+			quantized8_nodes_.resize(_node_count);
+		else
+			wide8_nodes_.resize(_node_count);
+		break;
+	default:
+		nodes_ = core::AllocAligned<LinearBvhNode>(_node_count);
+		break;
+	}
+	node_memory_size_ = _node_count * node_storage_().node_size;
+	return node_storage_();
+}
+
+
+void
+BvhAccelerator::ReleaseNodeStorage_()
+{
+	if (nodes_ != nullptr)
+		core::FreeAligned(nodes_);
+	nodes_ = nullptr;
+	WideNodeArray_t<kBvh4NodeWidth>{}.swap(wide4_nodes_);
+	WideNodeArray_t<kBvh8NodeWidth>{}.swap(wide8_nodes_);
+	QuantizedNodeArray_t<kBvh4NodeWidth>{}.swap(quantized4_nodes_);
+	QuantizedNodeArray_t<kBvh8NodeWidth>{}.swap(quantized8_nodes_);
+	node_memory_size_ = 0u;
+}
+
+BvhAccelerator::BvhNode	*
+BvhAccelerator::BuildRecursive_(BuildContext &_context,
+								core::MemoryRegion &_region,
+								std::vector<BvhPrimitiveDesc> &_primitive_desc,
+								uint32_t _first, uint32_t _last)
+{
+	using raytracer::BvhAccelerator;
+	YS_ASSERT(_first < _last);
+
+	BvhNode				*node = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+	++_context.node_count;
+
+	RangeBounds const	range_bounds = ParallelReduce<RangeBounds>(_first, _last,
+		[&_primitive_desc](uint32_t const _range_first, uint32_t const _range_last) {
+		RangeBounds result{};
+		for (uint32_t i = _range_first; i < _range_last; ++i)
+		{
+			result.bounds = maths::Union(result.bounds, _primitive_desc[i].bounds);
+			result.centroids_bounds = maths::Union(result.centroids_bounds,
+												   _primitive_desc[i].centroid);
+		}
+		return result;
+	}, [](RangeBounds const &_lhs, RangeBounds const &_rhs) {
+		return RangeBounds{ maths::Union(_lhs.bounds, _rhs.bounds),
+							maths::Union(_lhs.centroids_bounds, _rhs.centroids_bounds) };
+	});
+	maths::Bounds3f const	&bounds = range_bounds.bounds;
+	maths::Bounds3f const	&centroids_bounds = range_bounds.centroids_bounds;
+
+	// NOTE: node_max_size_ only bounds the leaf size, below it the surface area heuristic
+	//		 decides whether splitting beats intersecting every primitive of the node.
+	uint32_t			primitive_count = _last - _first;
+	if (primitive_count == 1)
+	{
+		BuildLeafNode_(node, bounds, _first, _last);
+		return node;
+	}
+
+	uint32_t			axis = centroids_bounds.MaximumExtent();
+	uint32_t			middle = (_last + _first) / 2;
+	if (centroids_bounds.max[axis] == centroids_bounds.min[axis])
+	{
+		// Every centroid is at the same position, no split can separate them.
+		// Any partition is as good as the other when the leaf would be too large.
+		if (primitive_count <= node_max_size_)
+		{
+			BuildLeafNode_(node, bounds, _first, _last);
+			return node;
+		}
+	}
+	else
+	{
+		SahBucketArray_t const	buckets = ParallelReduce<SahBucketArray_t>(_first, _last,
+			[&_primitive_desc, &centroids_bounds, axis](uint32_t const _range_first,
+														uint32_t const _range_last) {
+			SahBucketArray_t result{};
+			for (uint32_t i = _range_first; i < _range_last; ++i)
+			{
+				SahBucketDesc &bucket =
+					result[SahBucketDesc::Index(centroids_bounds, _primitive_desc[i].centroid, axis)];
+				bucket.primitive_count++;
+				bucket.bounds = maths::Union(bucket.bounds, _primitive_desc[i].bounds);
+			}
+			return result;
+		}, [](SahBucketArray_t const &_lhs, SahBucketArray_t const &_rhs) {
+			SahBucketArray_t result{};
+			for (uint32_t i = 0; i < SahBucketDesc::kBucketCount; ++i)
+			{
+				result[i].primitive_count = _lhs[i].primitive_count + _rhs[i].primitive_count;
+				result[i].bounds = maths::Union(_lhs[i].bounds, _rhs[i].bounds);
+			}
+			return result;
+		});
+
+		maths::Decimal	lowest_cost = maths::infinity<maths::Decimal>;
+		uint32_t const	lowest_cost_index = LowestCostSplit_(buckets, bounds, lowest_cost);
+
+		maths::Decimal	leaf_cost{ static_cast<maths::Decimal>(primitive_count) };
+		if (primitive_count > node_max_size_ || lowest_cost < leaf_cost)
+		{
+			BvhPrimitiveDesc	*pivot_primitive =
+				std::partition(&_primitive_desc[_first], &_primitive_desc[_last - 1] + 1,
+							   [&centroids_bounds, axis, lowest_cost_index](BvhPrimitiveDesc const &desc)
+			{
+				return SahBucketDesc::Index(centroids_bounds, desc.centroid, axis) <= lowest_cost_index;
+			});
+
+			middle = static_cast<uint32_t>(pivot_primitive - _primitive_desc.data());
+		}
+		else
+		{
+			BuildLeafNode_(node, bounds, _first, _last);
+			return node;
+		}
+	}
+
+	BvhNode	*left = nullptr;
+	BvhNode *right = nullptr;
+	if (primitive_count > kParallelBuildThreshold)
+	{
+		// The left subtree is built on a task of its own, in a region of its own
+		core::MemoryRegion &task_region = _context.AddRegion();
+		std::future<BvhNode*> left_task = std::async(std::launch::async,
+			[this, &_context, &task_region, &_primitive_desc, _first, middle]() {
+			return BuildRecursive_(_context, task_region, _primitive_desc, _first, middle);
+		});
+		right = BuildRecursive_(_context, _region, _primitive_desc, middle, _last);
+		left = left_task.get();
+	}
+	else
+	{
+		left = BuildRecursive_(_context, _region, _primitive_desc, _first, middle);
+		right = BuildRecursive_(_context, _region, _primitive_desc, middle, _last);
+	}
+	new (node) BvhNode(axis, *left, *right);
+	return node;
+}
+
+
+uint32_t
+BvhAccelerator::LowestCostSplit_(SahBucketArray_t const &_buckets,
+								 maths::Bounds3f const &_bounds,
+								 maths::Decimal &_lowest_cost)
+{
+	// above[i] gathers the buckets past i, split costs come from this suffix sweep followed
+	// by a prefix sweep over the buckets below the split
+	SahBucketArray_t above{};
+	above[SahBucketDesc::kBucketCount - 2] = _buckets[SahBucketDesc::kBucketCount - 1];
+	for (uint32_t i = SahBucketDesc::kBucketCount - 2; i > 0; --i)
+	{
+		above[i - 1].primitive_count = above[i].primitive_count + _buckets[i].primitive_count;
+		above[i - 1].bounds = maths::Union(above[i].bounds, _buckets[i].bounds);
+	}
+	_lowest_cost = maths::infinity<maths::Decimal>;
+	uint32_t		lowest_cost_index = maths::highest_value<uint32_t>;
+	SahBucketDesc	below{};
+	for (uint32_t i = 0; i < SahBucketDesc::kBucketCount - 1; ++i)
+	{
+		below.primitive_count += _buckets[i].primitive_count;
+		below.bounds = maths::Union(below.bounds, _buckets[i].bounds);
+		maths::Decimal	cost = kSahTraversalCost +
+			(below.primitive_count * below.bounds.SurfaceArea() +
+			 above[i].primitive_count * above[i].bounds.SurfaceArea()) / _bounds.SurfaceArea();
+
+		if (cost < _lowest_cost)
+		{
+			_lowest_cost = cost;
+			lowest_cost_index = i;
+		}
+	}
+	return lowest_cost_index;
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::BuildSpatialRecursive_(BuildContext &_context,
+									   core::MemoryRegion &_region,
+									   SpatialBuildState &_state,
+									   std::vector<BvhPrimitiveDesc> &_references)
+{
+	YS_ASSERT(!_references.empty());
+	BvhNode				*node = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+	++_context.node_count;
+
+	maths::Bounds3f		bounds{};
+	maths::Bounds3f		centroids_bounds{};
+	for (BvhPrimitiveDesc const &reference : _references)
+	{
+		bounds = maths::Union(bounds, reference.bounds);
+		centroids_bounds = maths::Union(centroids_bounds, reference.centroid);
+	}
+	uint32_t const		reference_count = static_cast<uint32_t>(_references.size());
+	auto const			build_leaf = [this, &_state, &_references, node, &bounds]() {
+		uint32_t const first = static_cast<uint32_t>(_state.leaf_references.size());
+		_state.leaf_references.insert(_state.leaf_references.end(),
+									  _references.begin(), _references.end());
+		BuildLeafNode_(node, bounds, first, static_cast<uint32_t>(_state.leaf_references.size()));
+		return node;
+	};
+	if (reference_count == 1u)
+		return build_leaf();
+
+	// Object split, as in BuildRecursive_
+	uint32_t const		object_axis = centroids_bounds.MaximumExtent();
+	maths::Decimal		object_cost = maths::infinity<maths::Decimal>;
+	uint32_t			object_split = maths::highest_value<uint32_t>;
+	maths::Decimal		overlap_area = bounds.SurfaceArea();
+	if (centroids_bounds.max[object_axis] != centroids_bounds.min[object_axis])
+	{
+		SahBucketArray_t	buckets{};
+		for (BvhPrimitiveDesc const &reference : _references)
+		{
+			SahBucketDesc &bucket =
+				buckets[SahBucketDesc::Index(centroids_bounds, reference.centroid, object_axis)];
+			bucket.primitive_count++;
+			bucket.bounds = maths::Union(bucket.bounds, reference.bounds);
+		}
+		object_split = LowestCostSplit_(buckets, bounds, object_cost);
+		maths::Bounds3f		left_bounds{}, right_bounds{};
+		for (uint32_t i = 0u; i < SahBucketDesc::kBucketCount; ++i)
+			if (i <= object_split)
+				left_bounds = maths::Union(left_bounds, buckets[i].bounds);
+			else
+				right_bounds = maths::Union(right_bounds, buckets[i].bounds);
+		overlap_area = maths::Overlap(left_bounds, right_bounds) ?
+			maths::Intersect(left_bounds, right_bounds).SurfaceArea() : 0._d;
+	}
+
+	// Spatial splits are only worth their duplicates when the object split children overlap
+	SpatialSplit		spatial_split{};
+	if (_state.remaining_duplicates > 0u && overlap_area > _state.min_overlap_area)
+		spatial_split = FindSpatialSplit_(_references, bounds);
+
+	maths::Decimal const	leaf_cost{ static_cast<maths::Decimal>(reference_count) };
+	maths::Decimal const	lowest_cost = maths::Min(object_cost, spatial_split.cost);
+	if (reference_count <= node_max_size_ && !(lowest_cost < leaf_cost))
+		return build_leaf();
+
+	std::vector<BvhPrimitiveDesc>	left_references{}, right_references{};
+	uint32_t						axis = object_axis;
+	if (spatial_split.cost < object_cost)
+	{
+		// References crossing the plane are clipped on both sides, the split is dropped when
+		// it exceeds the budget or fails to separate the references.
+		uint32_t	duplicate_count = 0u;
+		for (BvhPrimitiveDesc const &reference : _references)
+		{
+			maths::Decimal const	reference_min = reference.bounds.min[spatial_split.axis];
+			maths::Decimal const	reference_max = reference.bounds.max[spatial_split.axis];
+			if (reference_max <= spatial_split.position)
+				left_references.push_back(reference);
+			else if (reference_min >= spatial_split.position)
+				right_references.push_back(reference);
+			else
+			{
+				BvhPrimitiveDesc const	left = ClipReference_(reference, spatial_split.axis,
+															  reference_min, spatial_split.position);
+				BvhPrimitiveDesc const	right = ClipReference_(reference, spatial_split.axis,
+															   spatial_split.position, reference_max);
+				bool const				left_is_empty = left.bounds.min.x > left.bounds.max.x;
+				bool const				right_is_empty = right.bounds.min.x > right.bounds.max.x;
+				if (!left_is_empty)
+					left_references.push_back(left);
+				if (!right_is_empty)
+					right_references.push_back(right);
+				if (!left_is_empty && !right_is_empty)
+					++duplicate_count;
+				else if (left_is_empty && right_is_empty)
+					left_references.push_back(reference);
+			}
+		}
+		if (duplicate_count <= _state.remaining_duplicates &&
+			!left_references.empty() && left_references.size() < reference_count &&
+			!right_references.empty() && right_references.size() < reference_count)
+		{
+			_state.remaining_duplicates -= duplicate_count;
+			axis = spatial_split.axis;
+		}
+		else
+		{
+			left_references.clear();
+			right_references.clear();
+		}
+	}
+	if (left_references.empty())
+	{
+		BvhPrimitiveDesc	*pivot_reference = _references.data() + reference_count / 2u;
+		if (object_split != maths::highest_value<uint32_t>)
+			pivot_reference = std::partition(_references.data(), _references.data() + reference_count,
+				[&centroids_bounds, object_axis, object_split](BvhPrimitiveDesc const &desc)
+			{
+				return SahBucketDesc::Index(centroids_bounds, desc.centroid, object_axis) <= object_split;
+			});
+		// Every centroid is at the same position, the references are cut in half
+		if (pivot_reference == _references.data() ||
+			pivot_reference == _references.data() + reference_count)
+			pivot_reference = _references.data() + reference_count / 2u;
+		left_references.assign(_references.data(), pivot_reference);
+		right_references.assign(pivot_reference, _references.data() + reference_count);
+	}
+	std::vector<BvhPrimitiveDesc>{}.swap(_references);
+
+	BvhNode	*left = BuildSpatialRecursive_(_context, _region, _state, left_references);
+	BvhNode	*right = BuildSpatialRecursive_(_context, _region, _state, right_references);
+	new (node) BvhNode(axis, *left, *right);
+	return node;
+}
+
+
+BvhAccelerator::SpatialSplit
+BvhAccelerator::FindSpatialSplit_(std::vector<BvhPrimitiveDesc> const &_references,
+								  maths::Bounds3f const &_bounds) const
+{
+	struct SpatialBin
+	{
+		maths::Bounds3f		bounds{};
+		uint32_t			entry_count = 0u;
+		uint32_t			exit_count = 0u;
+	};
+	using SpatialBinArray_t = std::array<SpatialBin, kSpatialBinCount>;
+
+	SpatialSplit			result{};
+	maths::Decimal const	area = _bounds.SurfaceArea();
+	for (uint32_t axis = 0u; axis < 3u; ++axis)
+	{
+		maths::Decimal const	origin = _bounds.min[axis];
+		maths::Decimal const	bin_size = (_bounds.max[axis] - origin) / kSpatialBinCount;
+		if (!(bin_size > 0._d))
+			continue;
+		auto const				bin_index = [origin, bin_size](maths::Decimal const _position) {
+			return maths::Min(static_cast<uint32_t>(maths::Max((_position - origin) / bin_size, 0._d)),
+							  kSpatialBinCount - 1u);
+		};
+		auto const				bin_plane = [&_bounds, axis, origin, bin_size](uint32_t const _index) {
+			return (_index == kSpatialBinCount) ? _bounds.max[axis] : origin + _index * bin_size;
+		};
+
+		// Each reference enters its first bin and exits its last one, the bins in between get
+		// the bounds of the part of the primitive they hold.
+		SpatialBinArray_t		bins{};
+		for (BvhPrimitiveDesc const &reference : _references)
+		{
+			uint32_t const	first_bin = bin_index(reference.bounds.min[axis]);
+			uint32_t const	last_bin = bin_index(reference.bounds.max[axis]);
+			bins[first_bin].entry_count++;
+			bins[last_bin].exit_count++;
+			if (first_bin == last_bin)
+			{
+				bins[first_bin].bounds = maths::Union(bins[first_bin].bounds, reference.bounds);
+				continue;
+			}
+			for (uint32_t bin = first_bin; bin <= last_bin; ++bin)
+			{
+				BvhPrimitiveDesc const	clipped = ClipReference_(reference, axis,
+					maths::Max(bin_plane(bin), reference.bounds.min[axis]),
+					maths::Min(bin_plane(bin + 1u), reference.bounds.max[axis]));
+				if (clipped.bounds.min.x <= clipped.bounds.max.x)
+					bins[bin].bounds = maths::Union(bins[bin].bounds, clipped.bounds);
+			}
+		}
+
+		SpatialBinArray_t		above{};
+		above[kSpatialBinCount - 1u] = bins[kSpatialBinCount - 1u];
+		for (uint32_t i = kSpatialBinCount - 1u; i > 0u; --i)
+		{
+			above[i - 1u].bounds = maths::Union(above[i].bounds, bins[i - 1u].bounds);
+			above[i - 1u].exit_count = above[i].exit_count + bins[i - 1u].exit_count;
+		}
+		SpatialBin				below{};
+		for (uint32_t i = 0u; i < kSpatialBinCount - 1u; ++i)
+		{
+			below.bounds = maths::Union(below.bounds, bins[i].bounds);
+			below.entry_count += bins[i].entry_count;
+			SpatialBin const	&right = above[i + 1u];
+			if (below.entry_count == 0u || right.exit_count == 0u)
+				continue;
+			maths::Decimal const	cost = kSahTraversalCost +
+				(below.entry_count * below.bounds.SurfaceArea() +
+				 right.exit_count * right.bounds.SurfaceArea()) / area;
+			if (cost < result.cost)
+			{
+				result.cost = cost;
+				result.axis = axis;
+				result.position = bin_plane(i + 1u);
+			}
+		}
+	}
+	return result;
+}
+
+
+BvhAccelerator::BvhPrimitiveDesc
+BvhAccelerator::ClipReference_(BvhPrimitiveDesc const &_reference, uint32_t _axis,
+							   maths::Decimal _min, maths::Decimal _max) const
+{
+	maths::Bounds3f		clip{ _reference.bounds };
+	clip.min[_axis] = _min;
+	clip.max[_axis] = _max;
+	maths::Bounds3f const	clipped = ClippedPrimitiveBounds_(_reference.primitive_index, clip);
+	if (clipped.min.x > clipped.max.x || !maths::Overlap(clipped, clip))
+		return BvhPrimitiveDesc(_reference.primitive_index, maths::Bounds3f{});
+	return BvhPrimitiveDesc(_reference.primitive_index, maths::Intersect(clipped, clip));
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::BuildLinear_(BuildContext &_context,
+							 core::MemoryRegion &_region,
+							 std::vector<BvhPrimitiveDesc> &_primitive_desc)
+{
+	uint32_t const			primitive_count = static_cast<uint32_t>(_primitive_desc.size());
+	maths::Bounds3f const	centroids_bounds = ParallelReduce<maths::Bounds3f>(0u, primitive_count,
+		[&_primitive_desc](uint32_t const _first, uint32_t const _last) {
+		maths::Bounds3f result{};
+		for (uint32_t i = _first; i < _last; ++i)
+			result = maths::Union(result, _primitive_desc[i].centroid);
+		return result;
+	}, [](maths::Bounds3f const &_lhs, maths::Bounds3f const &_rhs) {
+		return maths::Union(_lhs, _rhs);
+	});
+
+	MortonArray_t			morton_primitives(primitive_count);
+	ParallelReduce<bool>(0u, primitive_count,
+		[&_primitive_desc, &centroids_bounds, &morton_primitives](uint32_t const _first,
+																   uint32_t const _last) {
+		constexpr maths::Decimal kCellCount = static_cast<maths::Decimal>(1u << kMortonBitsPerAxis);
+		for (uint32_t i = _first; i < _last; ++i)
+		{
+			maths::Vec3f const	offset = centroids_bounds.Offset(_primitive_desc[i].centroid);
+			uint32_t			cell[3];
+			for (uint32_t axis = 0u; axis < 3u; ++axis)
+				cell[axis] = static_cast<uint32_t>(
+					maths::Clamp(offset[axis] * kCellCount, 0._d, kCellCount - 1._d));
+			morton_primitives[i] = MortonPrimitive{ maths::EncodeMorton3(cell[0], cell[1], cell[2]), i };
+		}
+		return true;
+	}, [](bool const _lhs, bool const _rhs) { return _lhs && _rhs; });
+	RadixSort(morton_primitives, kMortonBitCount);
+
+	// Primitive descs are moved to the curve order, leaves index ranges of it
+	std::vector<BvhPrimitiveDesc>	sorted_desc(primitive_count);
+	ParallelReduce<bool>(0u, primitive_count,
+		[&_primitive_desc, &morton_primitives, &sorted_desc](uint32_t const _first,
+															  uint32_t const _last) {
+		for (uint32_t i = _first; i < _last; ++i)
+			sorted_desc[i] = _primitive_desc[morton_primitives[i].desc_index];
+		return true;
+	}, [](bool const _lhs, bool const _rhs) { return _lhs && _rhs; });
+	_primitive_desc.swap(sorted_desc);
+
+	constexpr uint32_t		kTreeletMask =
+		((1u << kTreeletBits) - 1u) << (kMortonBitCount - kTreeletBits);
+	std::vector<uint32_t>	treelet_firsts{};
+	for (uint32_t i = 0u; i < primitive_count; ++i)
+		if (i == 0u || (morton_primitives[i].morton_code & kTreeletMask) !=
+			(morton_primitives[i - 1u].morton_code & kTreeletMask))
+			treelet_firsts.push_back(i);
+	uint32_t const			treelet_count = static_cast<uint32_t>(treelet_firsts.size());
+	treelet_firsts.push_back(primitive_count);
+
+	// Each task builds the treelets starting in its chunk of primitives, in a region of its own
+	std::vector<BvhNode*>	treelets(treelet_count);
+	ParallelForChunks(primitive_count, ParallelChunkCount(primitive_count),
+		[this, &_context, &_region, &_primitive_desc, &morton_primitives, &treelet_firsts,
+		 &treelets, treelet_count](uint32_t const _chunk_index,
+								   uint32_t const _first, uint32_t const _last) {
+		std::vector<uint32_t>::const_iterator const treelets_begin = treelet_firsts.cbegin();
+		std::vector<uint32_t>::const_iterator const treelets_end = std::next(treelets_begin, treelet_count);
+		uint32_t const first_treelet = static_cast<uint32_t>(std::distance(treelets_begin,
+			std::lower_bound(treelets_begin, treelets_end, _first)));
+		uint32_t const last_treelet = static_cast<uint32_t>(std::distance(treelets_begin,
+			std::lower_bound(treelets_begin, treelets_end, _last)));
+		if (first_treelet == last_treelet)
+			return;
+		core::MemoryRegion &region = (_chunk_index == 0u) ? _region : _context.AddRegion();
+		for (uint32_t treelet = first_treelet; treelet < last_treelet; ++treelet)
+			treelets[treelet] = EmitLinearTreelet_(_context, region, _primitive_desc,
+				morton_primitives, treelet_firsts[treelet], treelet_firsts[treelet + 1u],
+				kMortonBitCount - kTreeletBits);
+	});
+
+	return BuildUpperSah_(_context, _region, treelets, 0u, treelet_count);
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::EmitLinearTreelet_(BuildContext &_context,
+								   core::MemoryRegion &_region,
+								   std::vector<BvhPrimitiveDesc> const &_primitive_desc,
+								   MortonArray_t const &_morton_primitives,
+								   uint32_t _first, uint32_t _last, uint32_t _bit_count)
+{
+	YS_ASSERT(_first < _last);
+	BvhNode				*node = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+	++_context.node_count;
+
+	// Codes of the range share their bits from _bit_count up, they are sorted so the first code
+	// with the next bit set splits the range.
+	MortonPrimitive const	*const range_begin = _morton_primitives.data() + _first;
+	MortonPrimitive const	*const range_end = _morton_primitives.data() + _last;
+	uint32_t				split_bit = _bit_count;
+	uint32_t				middle = _first;
+	while (split_bit > 0u && (middle == _first || middle == _last))
+	{
+		uint32_t const		bit_mask = 1u << --split_bit;
+		middle = static_cast<uint32_t>(std::partition_point(range_begin, range_end,
+			[bit_mask](MortonPrimitive const &_primitive) {
+			return (_primitive.morton_code & bit_mask) == 0u;
+		}) - _morton_primitives.data());
+	}
+	uint32_t				axis = split_bit % 3u;
+	// Every code is the same, the range is cut in half until the leaves are small enough
+	if (middle == _first || middle == _last)
+	{
+		middle = (_first + _last) / 2u;
+		axis = 0u;
+	}
+
+	// Small ranges become leaves unless the surface area heuristic favours the split
+	uint32_t const			primitive_count = _last - _first;
+	if (primitive_count <= node_max_size_)
+	{
+		maths::Bounds3f		left_bounds{}, right_bounds{};
+		for (uint32_t i = _first; i < middle; ++i)
+			left_bounds = maths::Union(left_bounds, _primitive_desc[i].bounds);
+		for (uint32_t i = middle; i < _last; ++i)
+			right_bounds = maths::Union(right_bounds, _primitive_desc[i].bounds);
+		maths::Bounds3f const	bounds = maths::Union(left_bounds, right_bounds);
+		maths::Decimal const	split_cost = kSahTraversalCost +
+			((middle - _first) * left_bounds.SurfaceArea() +
+			 (_last - middle) * right_bounds.SurfaceArea()) / bounds.SurfaceArea();
+		if (primitive_count == 1u || !(split_cost < static_cast<maths::Decimal>(primitive_count)))
+		{
+			BuildLeafNode_(node, bounds, _first, _last);
+			return node;
+		}
+	}
+
+	BvhNode	*left = EmitLinearTreelet_(_context, _region, _primitive_desc, _morton_primitives,
+									   _first, middle, split_bit);
+	BvhNode	*right = EmitLinearTreelet_(_context, _region, _primitive_desc, _morton_primitives,
+										middle, _last, split_bit);
+	new (node) BvhNode(axis, *left, *right);
+	return node;
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::BuildUpperSah_(BuildContext &_context,
+							   core::MemoryRegion &_region,
+							   std::vector<BvhNode*> &_treelets,
+							   uint32_t _first, uint32_t _last)
+{
+	YS_ASSERT(_first < _last);
+	if (_last - _first == 1u)
+		return _treelets[_first];
+
+	BvhNode				*node = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+	++_context.node_count;
+
+	auto const			centroid = [](BvhNode const *_treelet) {
+		return maths::Blend<maths::Point3f>::Do({
+			{ _treelet->bounds.min, 0.5_d }, { _treelet->bounds.max, 0.5_d }
+		});
+	};
+	maths::Bounds3f		bounds{};
+	maths::Bounds3f		centroids_bounds{};
+	for (uint32_t i = _first; i < _last; ++i)
+	{
+		bounds = maths::Union(bounds, _treelets[i]->bounds);
+		centroids_bounds = maths::Union(centroids_bounds, centroid(_treelets[i]));
+	}
+
+	// Treelet roots are few, they are always split to keep the leaves they hold intact
+	uint32_t const		axis = centroids_bounds.MaximumExtent();
+	uint32_t			middle = (_first + _last) / 2u;
+	if (centroids_bounds.max[axis] != centroids_bounds.min[axis])
+	{
+		SahBucketArray_t	buckets{};
+		for (uint32_t i = _first; i < _last; ++i)
+		{
+			SahBucketDesc &bucket =
+				buckets[SahBucketDesc::Index(centroids_bounds, centroid(_treelets[i]), axis)];
+			bucket.primitive_count++;
+			bucket.bounds = maths::Union(bucket.bounds, _treelets[i]->bounds);
+		}
+		maths::Decimal		lowest_cost = maths::infinity<maths::Decimal>;
+		uint32_t const		lowest_cost_index = LowestCostSplit_(buckets, bounds, lowest_cost);
+		BvhNode				**pivot_treelet =
+			std::partition(&_treelets[_first], &_treelets[_last - 1] + 1,
+						   [&centroids_bounds, &centroid, axis, lowest_cost_index](BvhNode const *_treelet)
+		{
+			return SahBucketDesc::Index(centroids_bounds, centroid(_treelet), axis) <= lowest_cost_index;
+		});
+		uint32_t const		pivot = static_cast<uint32_t>(pivot_treelet - _treelets.data());
+		if (pivot != _first && pivot != _last)
+			middle = pivot;
+	}
+
+	BvhNode	*left = BuildUpperSah_(_context, _region, _treelets, _first, middle);
+	BvhNode	*right = BuildUpperSah_(_context, _region, _treelets, middle, _last);
+	new (node) BvhNode(axis, *left, *right);
+	return node;
+}
+
+bool
+BvhAccelerator::Intersect(maths::Ray &_ray, HitRecord &_hit) const
+{
+	TIMED_SCOPE(BvhAccelerator_Intersect);
+	YS_ASSERT(source_ == nullptr);
+	auto const intersect_leaf = [this, &_ray, &_hit](uint32_t const _first,
+													 uint16_t const _count) {
+		bool hit = false;
+		for (uint16_t i = 0; i < _count; ++i)
+			hit |= primitives_[primitive_indices_[_first + i]]->Intersect(_ray, _hit);
+		return hit;
+	};
+	return Traverse_<false>(_ray, intersect_leaf);
+}
+
+bool
+BvhAccelerator::DoesIntersect(maths::Ray const &_ray) const
+{
+	YS_ASSERT(source_ == nullptr);
+	auto const intersect_leaf = [this, &_ray](uint32_t const _first, uint16_t const _count) {
+		for (uint16_t i = 0; i < _count; ++i)
+			if (primitives_[primitive_indices_[_first + i]]->DoesIntersect(_ray))
+				return true;
+		return false;
+	};
+	return Traverse_<true>(_ray, intersect_leaf);
+}
+
+
+bool
+BvhAccelerator::Intersect(maths::Ray &_ray, LeafIntersector const &_leaf_intersector,
+						  HitRecord &_hit) const
+{
+	TIMED_SCOPE(BvhAccelerator_IntersectLeaves);
+	auto const intersect_leaf = [&_ray, &_leaf_intersector, &_hit](uint32_t const _first,
+																	uint16_t const _count) {
+		return _leaf_intersector.IntersectLeaf(_ray, _first, _count, _hit);
+	};
+	return Traverse_<false>(_ray, intersect_leaf);
+}
+
+
+bool
+BvhAccelerator::DoesIntersect(maths::Ray const &_ray, LeafIntersector const &_leaf_intersector) const
+{
+	auto const intersect_leaf = [&_ray, &_leaf_intersector](uint32_t const _first,
+															uint16_t const _count) {
+		return _leaf_intersector.DoesIntersectLeaf(_ray, _first, _count);
+	};
+	return Traverse_<true>(_ray, intersect_leaf);
+}
+
+
+uint32_t
+BvhAccelerator::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	TIMED_SCOPE(BvhAccelerator_IntersectPacket);
+	YS_ASSERT(source_ == nullptr);
+	auto const intersect_leaf = [this, &_packet](uint32_t const _first, uint16_t const _count,
+												 uint32_t const _leaf_mask) {
+		uint32_t hit_mask = 0u;
+		for (uint16_t i = 0; i < _count; ++i)
+			hit_mask |= primitives_[primitive_indices_[_first + i]]->IntersectPacket(_packet,
+																					  _leaf_mask);
+		return hit_mask;
+	};
+	return TraversePacket_(_packet, _ray_mask, intersect_leaf);
+}
+
+
+uint32_t
+BvhAccelerator::IntersectPacket(RayPacket &_packet, LeafIntersector const &_leaf_intersector,
+								uint32_t _ray_mask) const
+{
+	TIMED_SCOPE(BvhAccelerator_IntersectPacketLeaves);
+	auto const intersect_leaf = [&_packet, &_leaf_intersector](uint32_t const _first,
+															   uint16_t const _count,
+															   uint32_t const _leaf_mask) {
+		uint32_t hit_mask = 0u;
+		for (uint32_t i = 0u; i < _packet.size; ++i)
+		{
+			if ((_leaf_mask & (1u << i)) != 0u &&
+				_leaf_intersector.IntersectLeaf(_packet.rays[i], _first, _count, _packet.hits[i]))
+				hit_mask |= 1u << i;
+		}
+		return hit_mask;
+	};
+	return TraversePacket_(_packet, _ray_mask, intersect_leaf);
+}
+
+
+template <typename LeafFunc_t>
+uint32_t
+BvhAccelerator::TraversePacket_(RayPacket &_packet, uint32_t _ray_mask,
+								LeafFunc_t const &_intersect_leaf) const
+{
+	YS_ASSERT(RayPacket::IsValidSize(_packet.size));
+	_ray_mask &= _packet.full_mask();
+	if (primitive_indices_.empty() || _ray_mask == 0u)
+		return 0u;
+	BVH_TRAVERSAL_SCOPE();
+	BVH_COUNT(traversal_count, MaskRayCount(_ray_mask));
+	BVH_COUNT_RAY(ray_count, MaskRayCount(_ray_mask));
+
+	uint32_t	hit_mask = 0u;
+	// Traces the rays of _rays one at a time, from the node at _root_index
+	auto const	trace_rays = [this, &_packet, &_intersect_leaf, &hit_mask](uint32_t const _rays,
+																			uint32_t const _root_index) {
+		for (uint32_t i = 0u; i < _packet.size; ++i)
+		{
+			uint32_t const	ray_bit = 1u << i;
+			if ((_rays & ray_bit) == 0u)
+				continue;
+			auto const		intersect_leaf = [&_intersect_leaf, ray_bit](uint32_t const _first,
+																		 uint16_t const _count) {
+				return _intersect_leaf(_first, _count, ray_bit) != 0u;
+			};
+			bool			hit = false;
+			if (node_width_ != kBinaryNodeWidth)
+				hit = TraverseWide_<false>(_packet.rays[i], intersect_leaf);
+			else if (short_stack_traversal_)
+				hit = TraverseShortStack_<false>(_packet.rays[i], _root_index, intersect_leaf);
+			else
+				hit = TraverseBinary_<false>(_packet.rays[i], _root_index, intersect_leaf);
+			if (hit)
+				hit_mask |= ray_bit;
+		}
+	};
+	if (node_width_ != kBinaryNodeWidth)
+	{
+		trace_rays(_ray_mask, 0u);
+		BVH_COUNT(hit_count, MaskRayCount(hit_mask));
+		BVH_COUNT_RAY(ray_hit_count, MaskRayCount(hit_mask));
+		return hit_mask;
+	}
+
+	struct StackEntry
+	{
+		uint32_t	node_index;
+		uint32_t	ray_mask;		// rays that hit the parent node
+	};
+	// A node leaves at most its far child on the stack, only the deepest inner node leaves both
+	constexpr uint32_t	kStackSize = kMaxTraversalDepth;
+	TraversalPacket		traversal_packet{ _packet, _ray_mask };
+	StackEntry			stack[kStackSize];
+	uint32_t			stack_size = 0u;
+	stack[stack_size++] = StackEntry{ 0u, _ray_mask };
+	while (stack_size > 0u)
+	{
+		StackEntry const		entry = stack[--stack_size];
+		LinearBvhNode const		&node = nodes_[entry.node_index];
+		BVH_COUNT(node_visit_count, 1u);
+		uint32_t const			active_mask = PacketSlabTest(node.bounds, traversal_packet,
+															 entry.ray_mask);
+		if (active_mask == 0u)
+			continue;
+		if (node.primitive_count > 0)
+		{
+			BVH_COUNT(primitive_test_count, node.primitive_count * MaskRayCount(active_mask));
+			uint32_t const	leaf_hit_mask = _intersect_leaf(node.first_primitive_index,
+															node.primitive_count, active_mask);
+			hit_mask |= leaf_hit_mask;
+			traversal_packet.UpdateTMax(_packet, leaf_hit_mask);
+		}
+		else if (MaskRayCount(active_mask) <= kPacketFallbackRayCount)
+		{ // the packet diverged, the remaining rays don't share enough nodes any more
+			trace_rays(active_mask, entry.node_index);
+			traversal_packet.UpdateTMax(_packet, active_mask);
+		}
+		else
+		{ // coherent rays share their direction signs, the first one orders the children
+			uint32_t const	first_ray = MaskFirstRay(active_mask);
+			bool const		is_negative = traversal_packet.is_negative[node.split_axis][first_ray] != 0u;
+			uint32_t const	near_child = is_negative ? node.right_child_offset : entry.node_index + 1u;
+			uint32_t const	far_child = is_negative ? entry.node_index + 1u : node.right_child_offset;
+			YS_ASSERT(stack_size + 2u <= kStackSize);
+			stack[stack_size++] = StackEntry{ far_child, active_mask };
+			stack[stack_size++] = StackEntry{ near_child, active_mask };
+		}
+	}
+	BVH_COUNT(hit_count, MaskRayCount(hit_mask));
+	BVH_COUNT_RAY(ray_hit_count, MaskRayCount(hit_mask));
+	return hit_mask;
+}
+
+
+template <bool AnyHit, typename LeafFunc_t>
+bool
+BvhAccelerator::Traverse_(maths::Ray const &_ray, LeafFunc_t const &_intersect_leaf) const
+{
+	if (primitive_indices_.empty())
+		return false;
+	BVH_TRAVERSAL_SCOPE();
+	BVH_COUNT(traversal_count, 1u);
+	BVH_COUNT_RAY(ray_count, 1u);
+	bool		hit = false;
+	if (node_width_ != kBinaryNodeWidth)
+		hit = TraverseWide_<AnyHit>(_ray, _intersect_leaf);
+	else if (short_stack_traversal_)
+		hit = TraverseShortStack_<AnyHit>(_ray, 0u, _intersect_leaf);
+	else
+		hit = TraverseBinary_<AnyHit>(_ray, 0u, _intersect_leaf);
+	BVH_COUNT(hit_count, hit ? 1u : 0u);
+	BVH_COUNT_RAY(ray_hit_count, hit ? 1u : 0u);
+	return hit;
+}
+
+
+template <bool AnyHit, typename LeafFunc_t>
+bool
+BvhAccelerator::TraverseBinary_(maths::Ray const &_ray, uint32_t _root_index,
+								LeafFunc_t const &_intersect_leaf) const
+{
+	bool	hit = false;
+	// Each inner node on the path to the current one leaves at most one child on the stack
+	uint32_t	to_visit_offset{ 0 }, current_node_index{ _root_index };
+	uint32_t	nodes_to_visit[kMaxTraversalDepth];
+	for (;;)
+	{
+		LinearBvhNode const &node = nodes_[current_node_index];
+		BVH_COUNT(node_visit_count, 1u);
+		if (_ray.DoesIntersect(node.bounds))
+		{
+			if (node.primitive_count > 0)
+			{
+				BVH_COUNT(primitive_test_count, node.primitive_count);
+				if (_intersect_leaf(node.first_primitive_index, node.primitive_count))
+				{
+					hit = true;
+					if (AnyHit)
+						break;
+				}
+				if (to_visit_offset == 0) break;
+				current_node_index = nodes_to_visit[--to_visit_offset];
+			}
+			else
+			{
+				YS_ASSERT(to_visit_offset < kMaxTraversalDepth);
+				if (_ray.is_negative[node.split_axis])
+				{
+					nodes_to_visit[to_visit_offset++] = current_node_index + 1;
+					current_node_index = node.right_child_offset;
+				}
+				else
+				{
+					nodes_to_visit[to_visit_offset++] = node.right_child_offset;
+					current_node_index = current_node_index + 1;
+				}
+			}
+		}
+		else
+		{
+			if (to_visit_offset == 0) break;
+			current_node_index = nodes_to_visit[--to_visit_offset];
+		}
+	}
+
+	return hit;
+}
+
+
+template <bool AnyHit, typename LeafFunc_t>
+bool
+BvhAccelerator::TraverseShortStack_(maths::Ray const &_ray, uint32_t _root_index,
+									LeafFunc_t const &_intersect_leaf) const
+{
+	// Levels are bits of the trail, the root being the highest one. The bit of a level is set
+	// once the traversal reached the last child it has to visit below the node of that level.
+	static_assert(kMaxTraversalDepth <= 64u, "The restart trail holds a bit per level");
+	constexpr uint64_t	kRootLevel = uint64_t{ 1u } << 63u;
+	struct StackEntry
+	{
+		uint32_t	node_index;
+		uint64_t	level;
+	};
+	// The oldest entries are overwritten when the stack is full, they are found again through
+	// the trail
+	StackEntry			stack[kShortStackSize];
+	uint32_t			stack_top = 0u, stack_size = 0u;
+	uint64_t			trail = 0u;
+	uint64_t			level = kRootLevel;
+	uint32_t			current_node_index = _root_index;
+
+	bool	hit = false;
+	BVH_COUNT(node_visit_count, 1u);
+	bool	is_done = !_ray.DoesIntersect(nodes_[_root_index].bounds);
+	while (!is_done)
+	{
+		LinearBvhNode const &node = nodes_[current_node_index];
+		if (node.primitive_count > 0)
+		{
+			BVH_COUNT(primitive_test_count, node.primitive_count);
+			if (_intersect_leaf(node.first_primitive_index, node.primitive_count))
+			{
+				hit = true;
+				if (AnyHit)
+					break;
+			}
+		}
+		else
+		{
+			bool const		is_negative = _ray.is_negative[node.split_axis] != 0;
+			uint32_t const	near_child = is_negative ? node.right_child_offset : current_node_index + 1u;
+			uint32_t const	far_child = is_negative ? current_node_index + 1u : node.right_child_offset;
+			bool const		near_hit = _ray.DoesIntersect(nodes_[near_child].bounds);
+			bool const		far_hit = _ray.DoesIntersect(nodes_[far_child].bounds);
+			uint64_t const	child_level = level >> 1u;
+			BVH_COUNT(node_visit_count, 2u);
+			YS_ASSERT(child_level != 0u);
+			uint32_t		next_node_index = current_node_index;
+			if ((trail & level) == 0u)
+			{
+				if (near_hit && far_hit)
+				{
+					stack[stack_top] = StackEntry{ far_child, child_level };
+					stack_top = (stack_top + 1u) % kShortStackSize;
+					stack_size = maths::Min(stack_size + 1u, kShortStackSize);
+					next_node_index = near_child;
+				}
+				else if (near_hit || far_hit)
+				{ // the only child to visit is also the last one
+					trail |= level;
+					next_node_index = near_hit ? near_child : far_child;
+				}
+			}
+			else if (near_hit && far_hit)
+				next_node_index = far_child;
+			else if ((near_hit || far_hit) && (trail & (level - 1u)) != 0u)
+			{ // after a restart, the levels below lead through the only child hit
+				next_node_index = near_hit ? near_child : far_child;
+			}
+			if (next_node_index != current_node_index)
+			{
+				current_node_index = next_node_index;
+				level = child_level;
+				continue;
+			}
+		}
+
+		// The subtree of the current level is done. The trail moves on to the deepest level
+		// that still has a child to visit, the carry skipping the levels that are done.
+		for (;;)
+		{
+			trail &= ~((level << 1u) - 1u);
+			trail += level << 1u;
+			if (trail == 0u)
+			{ // the carry went past the root
+				is_done = true;
+				break;
+			}
+			level = trail & (~trail + 1u);
+			if (stack_size == 0u)
+			{ // restart from the root, following the trail
+				current_node_index = _root_index;
+				level = kRootLevel;
+				break;
+			}
+			stack_top = (stack_top + kShortStackSize - 1u) % kShortStackSize;
+			--stack_size;
+			StackEntry const	&entry = stack[stack_top];
+			YS_ASSERT(entry.level == (level >> 1u));
+			current_node_index = entry.node_index;
+			level = entry.level;
+			// Hits found since the push may have moved tMax before the far child
+			BVH_COUNT(node_visit_count, 1u);
+			if (_ray.DoesIntersect(nodes_[current_node_index].bounds))
+				break;
+		}
+	}
+
+	return hit;
+}
+
+
+void
+BvhAccelerator::TraversalCounters::Add(TraversalCounters const &_other)
+{
+	traversal_count += _other.traversal_count;
+	node_visit_count += _other.node_visit_count;
+	primitive_test_count += _other.primitive_test_count;
+	hit_count += _other.hit_count;
+	ray_count += _other.ray_count;
+	ray_hit_count += _other.ray_hit_count;
+}
+
+
+BvhAccelerator::TraversalCounters const &
+BvhAccelerator::thread_traversal_counters()
+{
+	return thread_counters;
+}
+
+
+void
+BvhAccelerator::GrabTraversalCounters()
+{
+	traversal_counters_lock.Acquire();
+	traversal_counters_aggregate.Add(thread_counters);
+	traversal_counters_lock.Release();
+	thread_counters = TraversalCounters{};
+}
+
+
+BvhAccelerator::TraversalCounters
+BvhAccelerator::TakeTraversalCounters()
+{
+	traversal_counters_lock.Acquire();
+	TraversalCounters const	counters = traversal_counters_aggregate;
+	traversal_counters_aggregate = TraversalCounters{};
+	traversal_counters_lock.Release();
+	return counters;
+}
+
+
+BvhAccelerator::Statistics
+BvhAccelerator::ComputeStatistics() const
+{
+	Statistics	statistics{};
+	statistics.bvh_count = 1u;
+	statistics.reference_count = primitive_indices_.size();
+	statistics.sah_cost = sah_cost_;
+	statistics.node_memory_size = node_memory_size_;
+	statistics.reference_memory_size = primitive_indices_.size() * sizeof(uint32_t);
+	if (primitive_indices_.empty())
+		return statistics;
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		if (quantized_nodes_)
+			AddWideStatistics_<QuantizedBvhNode<kBvh4NodeWidth>>(statistics);
+		else
+			AddWideStatistics_<WideBvhNode<kBvh4NodeWidth>>(statistics);
+		break;
+	case kBvh8NodeWidth:
+		if (quantized_nodes_)
+			AddWideStatistics_<QuantizedBvhNode<kBvh8NodeWidth>>(statistics);
+		else
+			AddWideStatistics_<WideBvhNode<kBvh8NodeWidth>>(statistics);
+		break;
+	default:
+		AddBinaryStatistics_(statistics);
+		break;
+	}
+	// Collapsing keeps the leaves of the binary tree, which has one inner node less than leaves
+	statistics.binary_node_memory_size =
+		static_cast<size_t>(2u * statistics.leaf_count - 1u) * sizeof(LinearBvhNode);
+	return statistics;
+}
+
+
+void
+BvhAccelerator::Statistics::Add(Statistics const &_other)
+{
+	auto const	add_histogram = [](std::vector<uint64_t> &_histogram,
+								   std::vector<uint64_t> const &_other_histogram) {
+		if (_histogram.size() < _other_histogram.size())
+			_histogram.resize(_other_histogram.size(), 0u);
+		for (size_t i = 0u; i < _other_histogram.size(); ++i)
+			_histogram[i] += _other_histogram[i];
+	};
+	bvh_count += _other.bvh_count;
+	node_count += _other.node_count;
+	inner_node_count += _other.inner_node_count;
+	leaf_count += _other.leaf_count;
+	reference_count += _other.reference_count;
+	max_depth = maths::Max(max_depth, _other.max_depth);
+	sah_cost += _other.sah_cost;
+	node_memory_size += _other.node_memory_size;
+	reference_memory_size += _other.reference_memory_size;
+	binary_node_memory_size += _other.binary_node_memory_size;
+	add_histogram(leaf_size_histogram, _other.leaf_size_histogram);
+	add_histogram(depth_histogram, _other.depth_histogram);
+}
+
+
+void
+BvhAccelerator::AddBinaryStatistics_(Statistics &_statistics) const
+{
+	uint32_t const			node_count = static_cast<uint32_t>(node_memory_size_ / sizeof(LinearBvhNode));
+	std::vector<uint32_t>	depths(node_count, 0u);
+	_statistics.node_count = node_count;
+	for (uint32_t i = 0u; i < node_count; ++i)
+	{
+		LinearBvhNode const &node = nodes_[i];
+		if (node.primitive_count > 0)
+			AddLeafStatistics(_statistics, node.primitive_count, depths[i]);
+		else
+		{
+			++_statistics.inner_node_count;
+			depths[i + 1u] = depths[i] + 1u;
+			depths[node.right_child_offset] = depths[i] + 1u;
+		}
+	}
+}
+
+
+template <typename Node_t>
+void
+BvhAccelerator::AddWideStatistics_(Statistics &_statistics) const
+{
+	constexpr uint32_t		Width = Node_t::kWidth;
+	std::vector<Node_t> const	&nodes = node_array_<Node_t>();
+	std::vector<uint32_t>	depths(nodes.size(), 0u);
+	_statistics.node_count = nodes.size();
+	_statistics.inner_node_count = nodes.size();
+	for (size_t i = 0u; i < nodes.size(); ++i)
+	{
+		Node_t const &node = nodes[i];
+		for (uint32_t lane = 0u; lane < Width; ++lane)
+		{
+			bool is_used = false;
+			if constexpr (Node_t::kIsQuantized)
+				is_used = lane < node.child_count;
+			else
+				is_used = node.bounds_min[0][lane] <= node.bounds_max[0][lane];
+			if (!is_used)
+				break;
+			if (node.primitive_count[lane] > 0)
+				AddLeafStatistics(_statistics, node.primitive_count[lane], depths[i] + 1u);
+			else
+				depths[node.child_index[lane]] = depths[i] + 1u;
+		}
+	}
+}
+
+
+maths::Bounds3f
+BvhAccelerator::WorldBounds() const
+{
+	maths::Bounds3f		world_bounds{};
+	for (uint32_t i = 0u; i < primitive_count_; ++i)
+		world_bounds = maths::Union(world_bounds, PrimitiveBounds_(i));
+	return world_bounds;
+}
+
+
+maths::Bounds3f
+BvhAccelerator::PrimitiveBounds_(uint32_t _primitive_index) const
+{
+	if (source_ != nullptr)
+		return source_->PrimitiveBounds(_primitive_index);
+	return primitives_[_primitive_index]->WorldBounds();
+}
+
+
+maths::Bounds3f
+BvhAccelerator::ClippedPrimitiveBounds_(uint32_t _primitive_index,
+										maths::Bounds3f const &_clip) const
+{
+	if (source_ != nullptr)
+		return source_->ClippedPrimitiveBounds(_primitive_index, _clip);
+	return primitives_[_primitive_index]->ClippedWorldBounds(_clip);
+}
+
+
+void
+BvhAccelerator::Refit()
+{
+	TIMED_SCOPE(BvhAccelerator_Refit);
+	if (primitive_indices_.empty())
+		return;
+	if (subtree_costs_.empty())
+		RecordSubtreeCosts_();
+	RefitNodes_(ReferenceBounds_());
+}
+
+
+uint32_t
+BvhAccelerator::Update(double _rebuild_threshold)
+{
+	TIMED_SCOPE(BvhAccelerator_Update);
+	if (primitive_indices_.empty())
+		return 0u;
+	if (subtree_costs_.empty())
+		RecordSubtreeCosts_();
+
+	BuildContext		context{};
+	core::MemoryRegion	region{ kNodeRegionBlockSize };
+	RefitState			state{ ReferenceBounds_(), {}, {}, {}, _rebuild_threshold, 0u, 0u };
+	BvhNode				*root = ExpandNodes_(context, region, &state.reference_bounds);
+	state.subtree_costs.reserve(subtree_costs_.size());
+	SubtreeCostsRecursive_(*root, state.subtree_costs);
+	YS_ASSERT(state.subtree_costs.size() == subtree_costs_.size());
+	state.is_degraded.resize(subtree_costs_.size(), false);
+	FindDegradedRecursive_(state, *root);
+	state.node_index = 0u;
+	root = RebuildDegradedRecursive_(context, region, state, *root);
+
+	if (state.rebuilt_count == 0u)
+	{
+		// The view of wide nodes is not the tree they were collapsed from, only its cost
+		// growth is measured
+		if (subtree_costs_.front() > 0.f)
+			sah_cost_ = built_sah_cost_ * static_cast<double>(state.subtree_costs.front()) /
+				static_cast<double>(subtree_costs_.front());
+		RefitNodes_(state.reference_bounds);
+	}
+	else
+	{
+		LimitDepth_(*root);
+		maths::Decimal const	root_area = root->bounds.SurfaceArea();
+		sah_cost_ = (root_area > 0._d) ? SahCostRecursive_(*root) / root_area : 0.;
+		uint32_t				first, last;
+		ReleaseNodeStorage_();
+		EmitNodes_(*root, SubtreeExtent_(*root, first, last));
+		RecordSubtreeCosts_();
+		LOG_INFO(tools::kChannelGeneral, "Rebuilt " + std::to_string(state.rebuilt_count) +
+				 " BVH subtrees, SAH cost " + std::to_string(sah_cost_));
+	}
+	return state.rebuilt_count;
+}
+
+
+void
+BvhAccelerator::BuildLeafNode_(BvhNode *_node,
+							   maths::Bounds3f const &_bounds,
+							   uint32_t _first, uint32_t _last) const
+{
+	new (_node) BvhNode(_first, _last - _first, _bounds);
+}
+
+double
+BvhAccelerator::SahCostRecursive_(BvhNode const &_node)
+{
+	double const	area = static_cast<double>(_node.bounds.SurfaceArea());
+	if (_node.primitive_count > 0)
+		return area * static_cast<double>(_node.primitive_count);
+	return area * static_cast<double>(kSahTraversalCost) +
+		SahCostRecursive_(*_node.children[0]) + SahCostRecursive_(*_node.children[1]);
+}
+
+
+bool
+BvhAccelerator::ValidQuantizedNodes_(bool _quantized_nodes, uint32_t _node_max_size)
+{
+	if (_quantized_nodes && _node_max_size > kMaxQuantizedLeafSize)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Quantized BVH nodes hold leaves of at most " +
+					std::to_string(kMaxQuantizedLeafSize) + " primitives, falling back to "
+					"unquantized nodes.");
+		return false;
+	}
+	return _quantized_nodes;
+}
+
+
+uint32_t
+BvhAccelerator::ValidNodeWidth_(uint32_t _node_width, bool _quantized_nodes)
+{
+	uint32_t const fallback_width = _quantized_nodes ? kBvh4NodeWidth : kBinaryNodeWidth;
+	if (_node_width != kBinaryNodeWidth &&
+		_node_width != kBvh4NodeWidth &&
+		_node_width != kBvh8NodeWidth)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Unsupported BVH node width " +
+					std::to_string(_node_width) + ", falling back to a width of " +
+					std::to_string(fallback_width) + ".");
+		return fallback_width;
+	}
+	if (_quantized_nodes && _node_width == kBinaryNodeWidth)
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Quantized BVH nodes require a node width of 4 or 8, "
+					"falling back to a width of 4.");
+		return fallback_width;
+	}
+	return _node_width;
+}
+
+
+template <uint32_t Width>
+void
+BvhAccelerator::BuildWideNodes_(BvhNode const &_root, uint32_t _binary_node_count)
+{
+	WideNodeArray_t<Width> wide_nodes{};
+	wide_nodes.reserve(_binary_node_count / (Width / 2u));
+	CollapseBvhRecursive_(_root, wide_nodes);
+	wide_nodes.shrink_to_fit();
+	if (quantized_nodes_)
+	{
+		QuantizedNodeArray_t<Width> &quantized_nodes = node_array_<QuantizedBvhNode<Width>>();
+		quantized_nodes.reserve(wide_nodes.size());
+		for (WideBvhNode<Width> const &node : wide_nodes)
+			quantized_nodes.push_back(QuantizeNode_(node));
+		node_memory_size_ = quantized_nodes.size() * sizeof(QuantizedBvhNode<Width>);
+	}
+	else
+	{
+		node_memory_size_ = wide_nodes.size() * sizeof(WideBvhNode<Width>);
+		node_array_<WideBvhNode<Width>>().swap(wide_nodes);
+	}
+}
+
+
+template <uint32_t Width>
+uint32_t
+BvhAccelerator::CollapseBvhRecursive_(BvhNode const &_node, WideNodeArray_t<Width> &_nodes) const
+{
+	// The inner children with the largest surface area are opened until the node is full
+	BvhNode const	*children[Width];
+	uint32_t		child_count = 0u;
+	if (_node.primitive_count > 0)
+		children[child_count++] = &_node;
+	else
+	{
+		children[child_count++] = _node.children[0];
+		children[child_count++] = _node.children[1];
+		while (child_count < Width)
+		{
+			uint32_t		opened_index = Width;
+			maths::Decimal	largest_area = -maths::infinity<maths::Decimal>;
+			for (uint32_t i = 0u; i < child_count; ++i)
+			{
+				maths::Decimal const area = children[i]->bounds.SurfaceArea();
+				if (children[i]->primitive_count == 0 && area > largest_area)
+				{
+					opened_index = i;
+					largest_area = area;
+				}
+			}
+			if (opened_index == Width)
+				break;
+			BvhNode const	*opened = children[opened_index];
+			children[opened_index] = opened->children[0];
+			children[child_count++] = opened->children[1];
+		}
+	}
+
+	uint32_t const		node_index = static_cast<uint32_t>(_nodes.size());
+	_nodes.emplace_back();
+	ClearLanes_(_nodes[node_index]);
+	for (uint32_t lane = 0u; lane < child_count; ++lane)
+	{
+		BvhNode const &child = *children[lane];
+		// NOTE: the recursion grows _nodes, the node is only referenced once it returned
+		uint32_t const child_index = (child.primitive_count > 0) ?
+			child.first_primitive_index :
+			CollapseBvhRecursive_(child, _nodes);
+		WideBvhNode<Width> &node = _nodes[node_index];
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			node.bounds_min[axis][lane] = maths::RoundDownToFloat(child.bounds.min[axis]);
+			node.bounds_max[axis][lane] = maths::RoundUpToFloat(child.bounds.max[axis]);
+		}
+		node.child_index[lane] = child_index;
+		node.primitive_count[lane] = static_cast<uint16_t>(child.primitive_count);
+	}
+	return node_index;
+}
+
+
+template <uint32_t Width>
+BvhAccelerator::QuantizedBvhNode<Width>
+BvhAccelerator::QuantizeNode_(WideBvhNode<Width> const &_node)
+{
+	using QuantizedNode_t = QuantizedBvhNode<Width>;
+	QuantizedNode_t	result{};
+	// Unused lanes hold empty bounds and come after the used ones
+	uint32_t		child_count = 0u;
+	while (child_count < Width && _node.bounds_min[0][child_count] <= _node.bounds_max[0][child_count])
+		++child_count;
+	result.child_count = static_cast<uint8_t>(child_count);
+
+	for (uint32_t axis = 0u; axis < 3u; ++axis)
+	{
+		maths::Decimal node_min = maths::infinity<maths::Decimal>;
+		maths::Decimal node_max = -maths::infinity<maths::Decimal>;
+		for (uint32_t lane = 0u; lane < child_count; ++lane)
+		{
+			node_min = maths::Min(node_min, static_cast<maths::Decimal>(_node.bounds_min[axis][lane]));
+			node_max = maths::Max(node_max, static_cast<maths::Decimal>(_node.bounds_max[axis][lane]));
+		}
+		if (child_count == 0u)
+			node_min = node_max = 0._d;
+		// The origin is a single precision child bound, stored as is. The scale is the smallest
+		// power of two whose last step reaches the node bounds.
+		maths::Decimal const origin = node_min;
+		int32_t exponent = kMinScaleExponent;
+		if (node_max > node_min)
+			exponent = maths::Max(std::ilogb(node_max - node_min) - 8, kMinScaleExponent);
+		// NOTE: rounding may leave the last step short of the node bounds
+		while (exponent < kMaxScaleExponent &&
+			   Dequantize(origin, QuantizedScale(exponent), QuantizedNode_t::kStepCount) < node_max)
+			++exponent;
+		maths::Decimal const scale = QuantizedScale(exponent);
+		YS_ASSERT(Dequantize(origin, scale, QuantizedNode_t::kStepCount) >= node_max);
+		result.origin[axis] = static_cast<float>(origin);
+		result.scale_exponent[axis] = static_cast<int8_t>(exponent);
+
+		// Steps are rounded outwards, then moved until the decoded bounds contain the child
+		for (uint32_t lane = 0u; lane < child_count; ++lane)
+		{
+			maths::Decimal const child_min = _node.bounds_min[axis][lane];
+			maths::Decimal const child_max = _node.bounds_max[axis][lane];
+			uint32_t step_min = 0u, step_max = 0u;
+			if (scale > 0._d)
+			{
+				step_min = static_cast<uint32_t>(maths::Clamp(std::floor((child_min - origin) / scale),
+					0._d, static_cast<maths::Decimal>(QuantizedNode_t::kStepCount)));
+				step_max = static_cast<uint32_t>(maths::Clamp(std::ceil((child_max - origin) / scale),
+					0._d, static_cast<maths::Decimal>(QuantizedNode_t::kStepCount)));
+			}
+			while (step_min > 0u && Dequantize(origin, scale, step_min) > child_min)
+				--step_min;
+			while (step_max < QuantizedNode_t::kStepCount &&
+				   Dequantize(origin, scale, step_max) < child_max)
+				++step_max;
+			YS_ASSERT(Dequantize(origin, scale, step_min) <= child_min);
+			YS_ASSERT(Dequantize(origin, scale, step_max) >= child_max);
+			result.bounds_min[axis][lane] = static_cast<uint8_t>(step_min);
+			result.bounds_max[axis][lane] = static_cast<uint8_t>(step_max);
+		}
+	}
+	for (uint32_t lane = 0u; lane < Width; ++lane)
+	{
+		YS_ASSERT(_node.primitive_count[lane] <= kMaxQuantizedLeafSize);
+		result.child_index[lane] = _node.child_index[lane];
+		result.primitive_count[lane] = static_cast<uint8_t>(_node.primitive_count[lane]);
+	}
+	return result;
+}
+
+
+template <uint32_t Width>
+void
+BvhAccelerator::ClearLanes_(WideBvhNode<Width> &_node)
+{
+	for (uint32_t lane = 0u; lane < Width; ++lane)
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			_node.bounds_min[axis][lane] = maths::infinity<float>;
+			_node.bounds_max[axis][lane] = -maths::infinity<float>;
+		}
+		_node.child_index[lane] = 0u;
+		_node.primitive_count[lane] = 0u;
+	}
+}
+
+
+template <bool AnyHit, typename LeafFunc_t>
+bool
+BvhAccelerator::TraverseWide_(maths::Ray const &_ray, LeafFunc_t const &_intersect_leaf) const
+{
+	if (quantized_nodes_)
+		return (node_width_ == kBvh4NodeWidth) ?
+			TraverseWide_<QuantizedBvhNode<kBvh4NodeWidth>, AnyHit>(_ray, _intersect_leaf) :
+			TraverseWide_<QuantizedBvhNode<kBvh8NodeWidth>, AnyHit>(_ray, _intersect_leaf);
+	return (node_width_ == kBvh4NodeWidth) ?
+		TraverseWide_<WideBvhNode<kBvh4NodeWidth>, AnyHit>(_ray, _intersect_leaf) :
+		TraverseWide_<WideBvhNode<kBvh8NodeWidth>, AnyHit>(_ray, _intersect_leaf);
+}
+
+
+template <typename Node_t, bool AnyHit, typename LeafFunc_t>
+bool
+BvhAccelerator::TraverseWide_(maths::Ray const &_ray, LeafFunc_t const &_intersect_leaf) const
+{
+	constexpr uint32_t Width = Node_t::kWidth;
+	struct StackEntry
+	{
+		uint32_t		index;
+		uint16_t		primitive_count;
+		maths::Decimal	t_near;
+	};
+	std::vector<Node_t> const		&nodes = node_array_<Node_t>();
+	TraversalRay const				traversal_ray{ _ray };
+	StackEntry						stack[kWideStackSize];
+	uint32_t						stack_size = 0u;
+	stack[stack_size++] = StackEntry{ 0u, 0u, 0._d };
+
+	bool		hit = false;
+	while (stack_size > 0u)
+	{
+		StackEntry const entry = stack[--stack_size];
+		// tMax shrinks as hits are found, entries pushed before that may lie behind the hit
+		if (entry.t_near > _ray.tMax)
+			continue;
+		if (entry.primitive_count > 0)
+		{
+			BVH_COUNT(primitive_test_count, entry.primitive_count);
+			if (_intersect_leaf(entry.index, entry.primitive_count))
+			{
+				hit = true;
+				if (AnyHit)
+					break;
+			}
+			continue;
+		}
+		BVH_COUNT(node_visit_count, 1u);
+
+		Node_t const				&node = nodes[entry.index];
+		alignas(16) maths::Decimal	t_near[Width];
+		uint32_t					hit_mask = 0u;
+		if constexpr (Node_t::kIsQuantized)
+		{
+			alignas(16) maths::Decimal	bounds_min[3][Width];
+			alignas(16) maths::Decimal	bounds_max[3][Width];
+			DequantizeBounds(node, bounds_min, bounds_max);
+			hit_mask = WideSlabTest<Width>(bounds_min, bounds_max, traversal_ray, _ray.tMax, t_near) &
+				((1u << node.child_count) - 1u);
+		}
+		else
+			hit_mask = WideSlabTest<Width>(node.bounds_min, node.bounds_max, traversal_ray,
+										   _ray.tMax, t_near);
+		// Hit children are sorted by decreasing distance, the nearest one is popped first
+		uint32_t const				first_child = stack_size;
+		for (uint32_t lane = 0u; lane < Width; ++lane)
+		{
+			if ((hit_mask & (1u << lane)) == 0u)
+				continue;
+			YS_ASSERT(stack_size < kWideStackSize);
+			StackEntry const	child{ node.child_index[lane], node.primitive_count[lane],
+									   t_near[lane] };
+			uint32_t			position = stack_size++;
+			while (position > first_child && stack[position - 1].t_near < child.t_near)
+			{
+				stack[position] = stack[position - 1];
+				--position;
+			}
+			stack[position] = child;
+		}
+	}
+	return hit;
+}
+
+
+void
+BvhAccelerator::LimitDepth_(BvhNode &_root)
+{
+	uint32_t const	height = SubtreeHeight_(_root);
+	if (height <= kMaxTraversalDepth)
+		return;
+	LOG_WARNING(tools::kChannelGeneral, "BVH of " + std::to_string(height) +
+				" levels, rebalancing the subtrees deeper than " +
+				std::to_string(kMaxTraversalDepth) + " levels.");
+	LimitDepthRecursive_(_root, 0u);
+}
+
+
+void
+BvhAccelerator::LimitDepthRecursive_(BvhNode &_node, uint32_t _depth)
+{
+	uint32_t const	level_budget = kMaxTraversalDepth - _depth;
+	if (_node.primitive_count > 0 || SubtreeHeight_(_node) <= level_budget)
+		return;
+	// A child can be left to rebalance itself when a balanced tree over its leaves fits in the
+	// levels left below this node. Otherwise this node is rebalanced, which the parent checked
+	// was possible.
+	auto const		fits_below = [level_budget](BvhNode const &_child) {
+		uint32_t	first, last;
+		uint32_t	leaf_count = (SubtreeExtent_(_child, first, last) + 1u) / 2u;
+		uint32_t	balanced_height = 1u;
+		for (; leaf_count > 1u; leaf_count = (leaf_count + 1u) / 2u)
+			++balanced_height;
+		return balanced_height < level_budget;
+	};
+	if (fits_below(*_node.children[0]) && fits_below(*_node.children[1]))
+	{
+		LimitDepthRecursive_(*_node.children[0], _depth + 1u);
+		LimitDepthRecursive_(*_node.children[1], _depth + 1u);
+	}
+	else
+		BalanceSubtree_(_node);
+}
+
+
+uint32_t
+BvhAccelerator::SubtreeHeight_(BvhNode const &_node)
+{
+	if (_node.primitive_count > 0)
+		return 1u;
+	return 1u + maths::Max(SubtreeHeight_(*_node.children[0]), SubtreeHeight_(*_node.children[1]));
+}
+
+
+void
+BvhAccelerator::BalanceSubtree_(BvhNode &_node)
+{
+	// The inner nodes of the subtree are reused for the balanced one, a binary tree over the
+	// same leaves having as many of them. _node stays the root.
+	std::vector<BvhNode*>	leaves{};
+	std::vector<BvhNode*>	inner_nodes{};
+	std::vector<BvhNode*>	to_visit{ &_node };
+	while (!to_visit.empty())
+	{
+		BvhNode *const	node = to_visit.back();
+		to_visit.pop_back();
+		if (node->primitive_count > 0)
+		{
+			leaves.push_back(node);
+			continue;
+		}
+		inner_nodes.push_back(node);
+		to_visit.push_back(node->children[1]);
+		to_visit.push_back(node->children[0]);
+	}
+	YS_ASSERT(inner_nodes.size() + 1u == leaves.size());
+
+	size_t	next_inner_node = 0u;
+	auto const	balance = [&leaves, &inner_nodes, &next_inner_node](auto const &_self,
+																	size_t const _first,
+																	size_t const _last) -> BvhNode* {
+		if (_last - _first == 1u)
+			return leaves[_first];
+		BvhNode *const	node = inner_nodes[next_inner_node++];
+		size_t const	middle = (_first + _last) / 2u;
+		BvhNode *const	left = _self(_self, _first, middle);
+		BvhNode *const	right = _self(_self, middle, _last);
+		uint32_t const	axis = maths::Union(left->bounds, right->bounds).MaximumExtent();
+		new (node) BvhNode(axis, *left, *right);
+		return node;
+	};
+	balance(balance, 0u, leaves.size());
+}
+
+
+uint32_t
+BvhAccelerator::FlattenBvhRecursive_(BvhNode const &_node, uint32_t _depth, uint32_t &_offset)
+{
+	// LimitDepth_ ran on every tree emitted, the traversal stacks rely on it
+	YS_ASSERT(_depth < kMaxTraversalDepth);
+	LinearBvhNode &linear_node = nodes_[_offset];
+	linear_node.bounds = maths::ToSingleBounds(_node.bounds);
+	linear_node.primitive_count = _node.primitive_count;
+	
+	uint32_t	self_offset = _offset++;
+	if (_node.primitive_count > 0)
+		linear_node.first_primitive_index = _node.first_primitive_index;
+	else
+	{
+		linear_node.split_axis = _node.split_axis;
+		FlattenBvhRecursive_(*_node.children[0], _depth + 1u, _offset);
+		linear_node.right_child_offset = FlattenBvhRecursive_(*_node.children[1], _depth + 1u,
+															  _offset);
+	}
+
+	return self_offset;
+}
+
+
+void
+BvhAccelerator::EmitNodes_(BvhNode const &_root, uint32_t _node_count)
+{
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		BuildWideNodes_<kBvh4NodeWidth>(_root, _node_count);
+		break;
+	case kBvh8NodeWidth:
+		BuildWideNodes_<kBvh8NodeWidth>(_root, _node_count);
+		break;
+	default:
+	{
+		AllocateNodeStorage_(_node_count);
+		uint32_t	offset = 0u;
+		FlattenBvhRecursive_(_root, 0u, offset);
+	} break;
+	}
+	if (node_layout_ != kDepthFirstLayout)
+		ApplyNodeLayout_();
+}
+
+
+void
+BvhAccelerator::SetNodeLayout(NodeLayout _layout)
+{
+	TIMED_SCOPE(BvhAccelerator_SetNodeLayout);
+	if (_layout == node_layout_)
+		return;
+	node_layout_ = _layout;
+	if (!primitive_indices_.empty())
+		ApplyNodeLayout_();
+}
+
+
+void
+BvhAccelerator::ApplyNodeLayout_()
+{
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		if (quantized_nodes_)
+			ApplyWideNodeLayout_<QuantizedBvhNode<kBvh4NodeWidth>>();
+		else
+			ApplyWideNodeLayout_<WideBvhNode<kBvh4NodeWidth>>();
+		break;
+	case kBvh8NodeWidth:
+		if (quantized_nodes_)
+			ApplyWideNodeLayout_<QuantizedBvhNode<kBvh8NodeWidth>>();
+		else
+			ApplyWideNodeLayout_<WideBvhNode<kBvh8NodeWidth>>();
+		break;
+	default:
+	{
+		uint32_t const				node_count = static_cast<uint32_t>(node_memory_size_ / sizeof(LinearBvhNode));
+		std::vector<LayoutNode>		layout_nodes(node_count);
+		for (uint32_t i = 0u; i < node_count; ++i)
+		{
+			LinearBvhNode const	&node = nodes_[i];
+			LayoutNode			&layout_node = layout_nodes[i];
+			layout_node.area = static_cast<float>(node.bounds.SurfaceArea());
+			layout_node.child_count = 0u;
+			if (node.primitive_count == 0)
+			{
+				layout_node.children[layout_node.child_count++] = i + 1u;
+				layout_node.children[layout_node.child_count++] = node.right_child_offset;
+			}
+		}
+		std::vector<uint32_t> const	order = LayoutOrder(layout_nodes, node_layout_,
+														sizeof(LinearBvhNode), true);
+		// Aligned on a block, so that treelets fill whole pages and node pairs whole lines
+		LinearBvhNode				*nodes = core::AllocAligned<LinearBvhNode>(node_count,
+																			   kLayoutBlockSize);
+		for (uint32_t i = 0u; i < node_count; ++i)
+		{
+			LinearBvhNode	node = nodes_[i];
+			if (node.primitive_count == 0)
+			{
+				YS_ASSERT(order[i + 1u] == order[i] + 1u);
+				node.right_child_offset = order[node.right_child_offset];
+			}
+			nodes[order[i]] = node;
+		}
+		core::FreeAligned(nodes_);
+		nodes_ = nodes;
+	} break;
+	}
+}
+
+
+template <typename Node_t>
+void
+BvhAccelerator::ApplyWideNodeLayout_()
+{
+	constexpr uint32_t			Width = Node_t::kWidth;
+	std::vector<Node_t>			&nodes = node_array_<Node_t>();
+	std::vector<LayoutNode>		layout_nodes(nodes.size());
+	for (size_t i = 0u; i < nodes.size(); ++i)
+	{
+		Node_t const				&node = nodes[i];
+		alignas(16) maths::Decimal	bounds_min[3][Width];
+		alignas(16) maths::Decimal	bounds_max[3][Width];
+		if constexpr (Node_t::kIsQuantized)
+			DequantizeBounds(node, bounds_min, bounds_max);
+		else
+			WidenBounds(node, bounds_min, bounds_max);
+		LayoutNode					&layout_node = layout_nodes[i];
+		layout_node.child_count = 0u;
+		for (uint32_t lane = 0u; lane < Width && IsUsedLane(node, lane); ++lane)
+		{
+			if (node.primitive_count[lane] > 0)
+				continue;
+			// Wide nodes don't store their own bounds, the parent lane has them
+			uint32_t const	child_index = node.child_index[lane];
+			layout_nodes[child_index].area = static_cast<float>(maths::Bounds3f{
+				maths::Point3f{ bounds_min[0][lane], bounds_min[1][lane], bounds_min[2][lane] },
+				maths::Point3f{ bounds_max[0][lane], bounds_max[1][lane], bounds_max[2][lane] }
+			}.SurfaceArea());
+			layout_node.children[layout_node.child_count++] = child_index;
+		}
+	}
+	std::vector<uint32_t> const	order = LayoutOrder(layout_nodes, node_layout_, sizeof(Node_t), false);
+	std::vector<Node_t>			reordered(nodes.size());
+	for (size_t i = 0u; i < nodes.size(); ++i)
+	{
+		Node_t	node = nodes[i];
+		for (uint32_t lane = 0u; lane < Width && IsUsedLane(node, lane); ++lane)
+		{
+			if (node.primitive_count[lane] == 0)
+				node.child_index[lane] = order[node.child_index[lane]];
+		}
+		reordered[order[i]] = node;
+	}
+	nodes.swap(reordered);
+}
+
+
+std::vector<maths::Bounds3f>
+BvhAccelerator::ReferenceBounds_() const
+{
+	uint32_t const					reference_count = static_cast<uint32_t>(primitive_indices_.size());
+	std::vector<maths::Bounds3f>	result(reference_count);
+	ParallelReduce<bool>(0u, reference_count,
+						 [this, &result](uint32_t const _first, uint32_t const _last) {
+		for (uint32_t i = _first; i < _last; ++i)
+			result[i] = PrimitiveBounds_(primitive_indices_[i]);
+		return true;
+	}, [](bool const _lhs, bool const _rhs) { return _lhs && _rhs; });
+	return result;
+}
+
+
+void
+BvhAccelerator::RefitNodes_(std::vector<maths::Bounds3f> const &_reference_bounds)
+{
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		if (quantized_nodes_)
+			RefitWideNodes_<QuantizedBvhNode<kBvh4NodeWidth>>(_reference_bounds);
+		else
+			RefitWideNodes_<WideBvhNode<kBvh4NodeWidth>>(_reference_bounds);
+		break;
+	case kBvh8NodeWidth:
+		if (quantized_nodes_)
+			RefitWideNodes_<QuantizedBvhNode<kBvh8NodeWidth>>(_reference_bounds);
+		else
+			RefitWideNodes_<WideBvhNode<kBvh8NodeWidth>>(_reference_bounds);
+		break;
+	default:
+	{
+		// Children are stored after their parent
+		uint32_t const	node_count = static_cast<uint32_t>(node_memory_size_ / sizeof(LinearBvhNode));
+		for (uint32_t i = node_count; i-- > 0u;)
+		{
+			LinearBvhNode &node = nodes_[i];
+			if (node.primitive_count > 0)
+				node.bounds = maths::ToSingleBounds(UnionRange(_reference_bounds,
+																node.first_primitive_index,
+																node.primitive_count));
+			else
+				node.bounds = maths::Union(nodes_[i + 1].bounds, nodes_[node.right_child_offset].bounds);
+		}
+	} break;
+	}
+}
+
+
+template <typename Node_t>
+void
+BvhAccelerator::RefitWideNodes_(std::vector<maths::Bounds3f> const &_reference_bounds)
+{
+	constexpr uint32_t				Width = Node_t::kWidth;
+	std::vector<Node_t>				&nodes = node_array_<Node_t>();
+	// Quantized nodes only store approximate bounds, the exact ones are kept aside for the
+	// parent nodes. Children are stored after their parent.
+	std::vector<maths::Bounds3f>	node_bounds(nodes.size());
+	for (size_t i = nodes.size(); i-- > 0u;)
+	{
+		Node_t				&node = nodes[i];
+		WideBvhNode<Width>	refitted;
+		ClearLanes_(refitted);
+		for (uint32_t lane = 0u; lane < Width; ++lane)
+		{
+			bool is_used = false;
+			if constexpr (Node_t::kIsQuantized)
+				is_used = lane < node.child_count;
+			else
+				is_used = node.bounds_min[0][lane] <= node.bounds_max[0][lane];
+			if (!is_used)
+				break;
+			maths::Bounds3f const	child_bounds = (node.primitive_count[lane] > 0) ?
+				UnionRange(_reference_bounds, node.child_index[lane], node.primitive_count[lane]) :
+				node_bounds[node.child_index[lane]];
+			for (uint32_t axis = 0u; axis < 3u; ++axis)
+			{
+				refitted.bounds_min[axis][lane] = maths::RoundDownToFloat(child_bounds.min[axis]);
+				refitted.bounds_max[axis][lane] = maths::RoundUpToFloat(child_bounds.max[axis]);
+			}
+			refitted.child_index[lane] = node.child_index[lane];
+			refitted.primitive_count[lane] = node.primitive_count[lane];
+			node_bounds[i] = maths::Union(node_bounds[i], child_bounds);
+		}
+		if constexpr (Node_t::kIsQuantized)
+			node = QuantizeNode_(refitted);
+		else
+			node = refitted;
+	}
+}
+
+
+void
+BvhAccelerator::RecordSubtreeCosts_()
+{
+	BuildContext		context{};
+	core::MemoryRegion	region{ kNodeRegionBlockSize };
+	BvhNode const		*root = ExpandNodes_(context, region, nullptr);
+	std::vector<float>{}.swap(subtree_costs_);
+	subtree_costs_.reserve(context.node_count);
+	SubtreeCostsRecursive_(*root, subtree_costs_);
+	built_sah_cost_ = sah_cost_;
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::ExpandNodes_(BuildContext &_context, core::MemoryRegion &_region,
+							 std::vector<maths::Bounds3f> const *_reference_bounds) const
+{
+	switch (node_width_)
+	{
+	case kBvh4NodeWidth:
+		if (quantized_nodes_)
+			return ExpandWideRecursive_<QuantizedBvhNode<kBvh4NodeWidth>>(_context, _region,
+																		  _reference_bounds, 0u);
+		return ExpandWideRecursive_<WideBvhNode<kBvh4NodeWidth>>(_context, _region,
+																 _reference_bounds, 0u);
+	case kBvh8NodeWidth:
+		if (quantized_nodes_)
+			return ExpandWideRecursive_<QuantizedBvhNode<kBvh8NodeWidth>>(_context, _region,
+																		  _reference_bounds, 0u);
+		return ExpandWideRecursive_<WideBvhNode<kBvh8NodeWidth>>(_context, _region,
+																 _reference_bounds, 0u);
+	default:
+		return ExpandBinaryRecursive_(_context, _region, _reference_bounds, 0u);
+	}
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::ExpandBinaryRecursive_(BuildContext &_context, core::MemoryRegion &_region,
+									   std::vector<maths::Bounds3f> const *_reference_bounds,
+									   uint32_t _node_index) const
+{
+	LinearBvhNode const	&linear_node = nodes_[_node_index];
+	BvhNode				*node = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+	++_context.node_count;
+	if (linear_node.primitive_count > 0)
+	{
+		maths::Bounds3f const	bounds = (_reference_bounds != nullptr) ?
+			UnionRange(*_reference_bounds, linear_node.first_primitive_index,
+					   linear_node.primitive_count) :
+			maths::ToDecimalBounds(linear_node.bounds);
+		BuildLeafNode_(node, bounds, linear_node.first_primitive_index,
+					   linear_node.first_primitive_index + linear_node.primitive_count);
+		return node;
+	}
+	BvhNode *const		left = ExpandBinaryRecursive_(_context, _region, _reference_bounds,
+													  _node_index + 1u);
+	BvhNode *const		right = ExpandBinaryRecursive_(_context, _region, _reference_bounds,
+													   linear_node.right_child_offset);
+	new (node) BvhNode(linear_node.split_axis, *left, *right);
+	return node;
+}
+
+
+template <typename Node_t>
+BvhAccelerator::BvhNode *
+BvhAccelerator::ExpandWideRecursive_(BuildContext &_context, core::MemoryRegion &_region,
+									 std::vector<maths::Bounds3f> const *_reference_bounds,
+									 uint32_t _node_index) const
+{
+	constexpr uint32_t			Width = Node_t::kWidth;
+	Node_t const				&node = node_array_<Node_t>()[_node_index];
+	alignas(16) maths::Decimal	bounds_min[3][Width];
+	alignas(16) maths::Decimal	bounds_max[3][Width];
+	uint32_t					child_count = 0u;
+	if constexpr (Node_t::kIsQuantized)
+	{
+		DequantizeBounds(node, bounds_min, bounds_max);
+		child_count = node.child_count;
+	}
+	else
+	{
+		WidenBounds(node, bounds_min, bounds_max);
+		while (child_count < Width && bounds_min[0][child_count] <= bounds_max[0][child_count])
+			++child_count;
+	}
+
+	BvhNode						*children[Width];
+	for (uint32_t lane = 0u; lane < child_count; ++lane)
+	{
+		uint32_t const	child_index = node.child_index[lane];
+		uint32_t const	primitive_count = node.primitive_count[lane];
+		if (primitive_count > 0)
+		{
+			maths::Bounds3f const	bounds = (_reference_bounds != nullptr) ?
+				UnionRange(*_reference_bounds, child_index, primitive_count) :
+				maths::Bounds3f{
+					maths::Point3f{ bounds_min[0][lane], bounds_min[1][lane], bounds_min[2][lane] },
+					maths::Point3f{ bounds_max[0][lane], bounds_max[1][lane], bounds_max[2][lane] } };
+			children[lane] = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+			++_context.node_count;
+			BuildLeafNode_(children[lane], bounds, child_index, child_index + primitive_count);
+		}
+		else
+			children[lane] = ExpandWideRecursive_<Node_t>(_context, _region, _reference_bounds,
+														  child_index);
+	}
+
+	// Lanes are paired in order, the view must not depend on bounds that the refits change
+	while (child_count > 1u)
+	{
+		uint32_t	paired_count = 0u;
+		for (uint32_t lane = 0u; lane < child_count; lane += 2u)
+		{
+			if (lane + 1u == child_count)
+			{
+				children[paired_count++] = children[lane];
+				break;
+			}
+			BvhNode *const	parent = reinterpret_cast<BvhNode*>(_region.Alloc(sizeof(BvhNode)));
+			++_context.node_count;
+			BvhNode			&left = *children[lane];
+			BvhNode			&right = *children[lane + 1u];
+			new (parent) BvhNode(maths::Union(left.bounds, right.bounds).MaximumExtent(), left, right);
+			children[paired_count++] = parent;
+		}
+		child_count = paired_count;
+	}
+	YS_ASSERT(child_count == 1u);
+	return children[0];
+}
+
+
+double
+BvhAccelerator::FindDegradedRecursive_(RefitState &_state, BvhNode const &_node) const
+{
+	uint32_t const	node_index = _state.node_index++;
+	double const	built_cost = static_cast<double>(subtree_costs_[node_index]);
+	double const	growth = (built_cost > 0.) ?
+		static_cast<double>(_state.subtree_costs[node_index]) / built_cost : 1.;
+	if (_node.primitive_count == 0)
+	{
+		double const	children_growth = maths::Max(FindDegradedRecursive_(_state, *_node.children[0]),
+													 FindDegradedRecursive_(_state, *_node.children[1]));
+		// A subtree grows at least as much as its parent when the damage lies below the parent
+		_state.is_degraded[node_index] = growth > _state.rebuild_threshold && growth > children_growth;
+	}
+	return growth;
+}
+
+
+BvhAccelerator::BvhNode *
+BvhAccelerator::RebuildDegradedRecursive_(BuildContext &_context, core::MemoryRegion &_region,
+										  RefitState &_state, BvhNode &_node)
+{
+	uint32_t const	node_index = _state.node_index;
+	if (_node.primitive_count > 0)
+	{
+		++_state.node_index;
+		return &_node;
+	}
+	if (!_state.is_degraded[node_index])
+	{
+		++_state.node_index;
+		BvhNode *const	left = RebuildDegradedRecursive_(_context, _region, _state, *_node.children[0]);
+		BvhNode *const	right = RebuildDegradedRecursive_(_context, _region, _state, *_node.children[1]);
+		new (&_node) BvhNode(_node.split_axis, *left, *right);
+		return &_node;
+	}
+
+	// The references of a subtree are contiguous, the rebuild reorders them in place
+	uint32_t			first, last;
+	_state.node_index += SubtreeExtent_(_node, first, last);
+	if (_state.primitive_desc.empty())
+		_state.primitive_desc.resize(primitive_indices_.size());
+	for (uint32_t i = first; i < last; ++i)
+		_state.primitive_desc[i] = BvhPrimitiveDesc(i, _state.reference_bounds[i]);
+	BvhNode *const		rebuilt = BuildRecursive_(_context, _region, _state.primitive_desc, first, last);
+	std::vector<uint32_t> ordered_indices(last - first);
+	std::vector<maths::Bounds3f> ordered_bounds(last - first);
+	for (uint32_t i = first; i < last; ++i)
+	{
+		uint32_t const reference_index = _state.primitive_desc[i].primitive_index;
+		ordered_indices[i - first] = primitive_indices_[reference_index];
+		ordered_bounds[i - first] = _state.reference_bounds[reference_index];
+	}
+	std::copy(ordered_indices.cbegin(), ordered_indices.cend(), primitive_indices_.begin() + first);
+	std::copy(ordered_bounds.cbegin(), ordered_bounds.cend(),
+			  _state.reference_bounds.begin() + first);
+	++_state.rebuilt_count;
+	return rebuilt;
+}
+
+
+double
+BvhAccelerator::SubtreeCostsRecursive_(BvhNode const &_node, std::vector<float> &_costs)
+{
+	size_t const	index = _costs.size();
+	_costs.push_back(0.f);
+	double const	area = static_cast<double>(_node.bounds.SurfaceArea());
+	double			cost = area * static_cast<double>(_node.primitive_count);
+	if (_node.primitive_count == 0)
+		cost = area * static_cast<double>(kSahTraversalCost) +
+			SubtreeCostsRecursive_(*_node.children[0], _costs) +
+			SubtreeCostsRecursive_(*_node.children[1], _costs);
+	_costs[index] = (area > 0.) ? static_cast<float>(cost / area) : 0.f;
+	return cost;
+}
+
+
+uint32_t
+BvhAccelerator::SubtreeExtent_(BvhNode const &_node, uint32_t &_first, uint32_t &_last)
+{
+	if (_node.primitive_count > 0)
+	{
+		_first = _node.first_primitive_index;
+		_last = _node.first_primitive_index + _node.primitive_count;
+		return 1u;
+	}
+	uint32_t		right_first, right_last;
+	uint32_t const	node_count = 1u + SubtreeExtent_(*_node.children[0], _first, _last) +
+		SubtreeExtent_(*_node.children[1], right_first, right_last);
+	_first = maths::Min(_first, right_first);
+	_last = maths::Max(_last, right_last);
+	return node_count;
+}
+
+
+core::MemoryRegion &
+BvhAccelerator::BuildContext::AddRegion()
+{
+	std::lock_guard<std::mutex> const lock{ regions_lock };
+	regions.emplace_back(kNodeRegionBlockSize);
+	return regions.back();
+}
+
+
+uint32_t
+BvhAccelerator::SahBucketDesc::Index(maths::Bounds3f const &_centroids_bounds,
+									 maths::Point3f const &_centroid, uint32_t const _axis)
+{
+	uint32_t const index = uint32_t(SahBucketDesc::kBucketCount *
+									_centroids_bounds.Offset(_centroid)[_axis]);
+	return maths::Min(index, SahBucketDesc::kBucketCount - 1);
 }
 
 
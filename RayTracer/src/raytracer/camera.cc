@@ -4,7 +4,9 @@
 #include "maths/ray.h"
 #include "core/logger.h"
 #include "core/profiler.h"
+#include "raytracer/hit_record.h"
 #include "raytracer/primitive.h"
+#include "raytracer/shape.h"
 #include "raytracer/surface_interaction.h"
 
 #include <iostream>
@@ -77,6 +79,7 @@ Camera::Expose(Scene const &_scene, maths::Decimal _t)
 			maths::Decimal	u{ x / maths::Decimal(film.resolution().w - 1) };
 			maths::Decimal	v{ y / maths::Decimal(film.resolution().h - 1) };
 
+			raytracer::HitRecord			closest_hit;
 			raytracer::SurfaceInteraction	closest_hit_info;
 			maths::Ray	ray = Ray(u, v, _t);
 
@@ -84,10 +87,13 @@ Camera::Expose(Scene const &_scene, maths::Decimal _t)
 			maths::Vec3f const	up_color{ 0._d, 0._d, 1._d }, down_color{ 0._d, 1._d, 0._d };
 
 			for (raytracer::Primitive const *primitive : _scene)
-				primitive->Intersect(ray, closest_hit_info);
+				primitive->Intersect(ray, closest_hit);
 
-			if (closest_hit_info.primitive != nullptr)
+			if (closest_hit.primitive != nullptr)
+			{
+				closest_hit.primitive->ComputeSurfaceInteraction(ray, closest_hit, closest_hit_info);
 				color = (maths::Vec3f)closest_hit_info.shading.normal() * 0.5_d + maths::Vec3f(0.5_d);
+			}
 			else
 				color = maths::Lerp(down_color, up_color, .5_d * maths::Normalized(ray.direction).z + .5_d);
 
@@ -2,29 +2,141 @@
 #include "raytracer/integrator.h"
 
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iomanip>
+#include <memory>
 #include <sstream>
+#include <thread>
+
+#include "boost/numeric/conversion/cast.hpp"
 
 
 #include "core/logger.h"
+#include "core/profiler.h"
 #include "maths/matrix.h"
 #include "maths/ray.h"
 #include "maths/transform.h"
+#include "raytracer/bvh_accelerator.h"
 #include "raytracer/camera.h"
 #include "raytracer/film.h"
+#include "raytracer/hit_record.h"
 #include "raytracer/primitive.h"
+#include "raytracer/ray_packet.h"
 #include "raytracer/sampler.h"
+#include "raytracer/shape.h"
 #include "raytracer/surface_interaction.h"
+#include "raytracer/tile_scheduler.h"
+#include "raytracer/wavefront.h"
 #include "globals.h"
 
 
 namespace raytracer {
 
 
+bool
+Integrator::Scene::Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const
+{
+	HitRecord	hit;
+	if (!Intersect(_ray, hit))
+		return false;
+	hit.primitive->ComputeSurfaceInteraction(_ray, hit, _hit_info);
+	_hit_info.primitive = hit.primitive;
+	_hit_info.instance_path = hit.instance_path;
+	return true;
+}
+
+
+bool
+Integrator::Scene::Intersect(maths::Ray &_ray, HitRecord &_hit) const
+{
+	return (_aggregate != nullptr) && _aggregate->Intersect(_ray, _hit);
+}
+
+
+uint32_t
+Integrator::Scene::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	TIMED_SCOPE(Integrator_SceneIntersectPacket);
+	return (_aggregate != nullptr) ? _aggregate->IntersectPacket(_packet, _ray_mask) : 0u;
+}
+
+
+bool
+Integrator::Scene::Occluded(maths::Ray const &_ray) const
+{
+	TIMED_SCOPE(Integrator_SceneOccluded);
+	return (_aggregate != nullptr) && _aggregate->DoesIntersect(_ray);
+}
+
+
+void
+Integrator::Scene::IntersectStream(RayStream &_stream) const
+{
+	TIMED_SCOPE(Integrator_SceneIntersectStream);
+	YS_ASSERT(_stream.order.empty() || _stream.order.size() == _stream.size());
+	_stream.hits.assign(_stream.size(), HitRecord{});
+	if (_aggregate == nullptr)
+		return;
+	bool const is_sorted = !_stream.order.empty();
+	RayPacket packet;
+	uint32_t ray_indices[RayPacket::kMaxSize];
+	for (size_t first = 0u; first < _stream.size(); first += RayPacket::kMaxSize)
+	{
+		uint32_t const count = static_cast<uint32_t>(
+			maths::Min<size_t>(RayPacket::kMaxSize, _stream.size() - first));
+		for (uint32_t i = 0u; i < count; ++i)
+		{
+			ray_indices[i] = is_sorted ? _stream.order[first + i] : static_cast<uint32_t>(first + i);
+			packet.rays[i] = _stream.rays[ray_indices[i]];
+			packet.hits[i] = HitRecord{};
+		}
+		uint32_t const hit_mask = _aggregate->IntersectPacket(packet, (1u << count) - 1u);
+		for (uint32_t i = 0u; i < count; ++i)
+		{
+			if ((hit_mask & (1u << i)) == 0u)
+				continue;
+			_stream.rays[ray_indices[i]].tMax = packet.rays[i].tMax;
+			_stream.hits[ray_indices[i]] = packet.hits[i];
+		}
+	}
+}
+
+
+void
+Integrator::Scene::OccludedStream(RayStream &_stream) const
+{
+	TIMED_SCOPE(Integrator_SceneOccludedStream);
+	YS_ASSERT(_stream.order.empty() || _stream.order.size() == _stream.size());
+	_stream.occluded.resize(_stream.size());
+	bool const is_sorted = !_stream.order.empty();
+	for (size_t i = 0u; i < _stream.size(); ++i)
+	{
+		size_t const ray_index = is_sorted ? _stream.order[i] : i;
+		_stream.occluded[ray_index] =
+			((_aggregate != nullptr) && _aggregate->DoesIntersect(_stream.rays[ray_index])) ? 1u : 0u;
+	}
+}
+
+
+struct Integrator::WorkerState
+{
+	LaneSamplerContainer_t	lane_samplers;
+	Wave					wave;
+};
+
+
 Integrator::Integrator(Camera& _camera, Film& _film, Sampler& _sampler) :
 	camera_{ _camera },
 	film_{ _film },
-	sampler_{ _sampler }
+	sampler_{ _sampler },
+	thread_count_{ 0u },
+	tile_size_{ kDefaultTileSize },
+	packet_size_{ 0u },
+	wavefront_batch_size_{ 0u },
+	ray_sort_batch_size_{ 0u },
+	tile_costs_{}
 {}
 
 
@@ -39,42 +151,407 @@ Integrator::Integrate(Scene const &_scene, maths::Decimal _t)
 	//		 This process is deferred to the film through the image_is_flipped bool.
 	film_.image_is_flipped = true;
 
-	maths::Vec2f const inv_resolution = { 1._d / film_.resolution().w, 1._d / film_.resolution().h };
-	for (int64_t y = 0; y < film_.resolution().h; ++y)
+	TileContainer_t const tiles = MakeTiles_();
+	uint32_t const hardware_thread_count = maths::Max(std::thread::hardware_concurrency(), 1u);
+	uint32_t const requested_thread_count =
+		(thread_count_ == 0u) ? hardware_thread_count : thread_count_;
+	uint32_t const worker_count = maths::Min(requested_thread_count,
+											 boost::numeric_cast<uint32_t>(tiles.size()));
+	LOG_INFO(tools::kChannelGeneral, "Integrating " + std::to_string(tiles.size()) + " tiles on " +
+			 std::to_string(worker_count) + " threads");
+	// Costs measured on the previous frame are reused as long as the tiling didn't change
+	if (tile_costs_.size() != tiles.size())
 	{
-		std::cout << "row " << y << std::endl;
-		for (int64_t x = 0; x < film_.resolution().w; ++x)
+		EstimateTileCosts_(tiles, _scene, _t, worker_count);
+	}
+	//
+	TileScheduler scheduler{ tile_costs_, worker_count };
+	TileScheduler::CostContainer_t measured_costs(tiles.size(), 0u);
+	std::vector<WorkerReport> reports(worker_count);
+	DispatchWorkers_(worker_count,
+					 [this, &tiles, &_scene, _t, &scheduler, &measured_costs, &reports]
+					 (uint32_t const _worker_index, Sampler &_sampler)
+	{
+		tools::Timer worker_timer{ "Integrator_Worker" };
+		tools::Timer busy_timer{ "Integrator_WorkerBusy" };
+		WorkerState state{};
+		for (uint32_t lane = 0u; lane < packet_size_; ++lane)
+			state.lane_samplers.push_back(_sampler.Clone(_sampler.seed()));
 		{
-			sampler_.StartPixel({ static_cast<uint64_t>(x), static_cast<uint64_t>(y) });
-			maths::Vec2f const pixel_origin =
-				{ static_cast<maths::Decimal>(x), static_cast<maths::Decimal>(y) };
-			maths::Vec3f color_accumulator{ maths::zero<maths::Vec3f> };
-			for (uint32_t sample_index = 0;
-				 sample_index < sampler_.samples_per_pixel();
-				 ++sample_index, sampler_.StartNextSample())
+			tools::TimeProbe const worker_probe{ worker_timer };
+			for (size_t tile_index = scheduler.NextTile(_worker_index);
+				 tile_index != TileScheduler::kInvalidTile;
+				 tile_index = scheduler.NextTile(_worker_index))
 			{
-				maths::Vec2f const film_sample = sampler_.GetNext<2u>();
-				maths::Vec2f const sample_position = pixel_origin + film_sample;
-				maths::Vec2f const uv = sample_position * inv_resolution;
-				maths::Ray ray = camera_.Ray(uv.u, uv.v, _t);
-				raytracer::SurfaceInteraction closest_hit_info;
-				bool intersected = false;
-				for (raytracer::Primitive const *primitive : _scene._primitives)
+				tools::Timer tile_timer{ "Integrator_Tile" };
 				{
-					bool const ret_intersect = primitive->Intersect(ray, closest_hit_info);
-					intersected = ret_intersect || intersected;
+					tools::TimeProbe const tile_probe{ tile_timer };
+					IntegrateTile_(tiles[tile_index], _scene, _t, _sampler, state);
 				}
-				maths::Vec3f const color = Li(ray, closest_hit_info, _scene);
-				color_accumulator += color;
+				measured_costs[tile_index] = boost::numeric_cast<TileScheduler::Cost_t>(
+					tile_timer.total_ticks());
+				busy_timer.Add(tile_timer);
 			}
-			maths::Vec3f const	final_color =
-				color_accumulator / static_cast<maths::Decimal>(sampler_.samples_per_pixel());
+		}
+		WorkerReport &report = reports[_worker_index];
+		report.busy_time = busy_timer.total_time();
+		report.total_time = worker_timer.total_time();
+		report.tile_count = busy_timer.call_count();
+		// one entry per worker, best and worst times give the spread between threads
+		globals::profiler.GetTimer("Integrator_WorkerBusy").Add(busy_timer.total_ticks(),
+																 busy_timer.total_cycles());
+		globals::profiler.GetTimer("Integrator_WorkerIdle").Add(
+			worker_timer.total_ticks() - busy_timer.total_ticks(),
+			worker_timer.total_cycles() - busy_timer.total_cycles());
+	});
+	tile_costs_ = std::move(measured_costs);
+	//
+	for (uint32_t worker_index = 0u; worker_index < worker_count; ++worker_index)
+	{
+		WorkerReport const &report = reports[worker_index];
+		double const utilisation = (report.total_time > 0.0) ?
+			(100.0 * report.busy_time / report.total_time) : 100.0;
+		std::ostringstream report_stream;
+		report_stream << "Integrator worker " << worker_index << " : " <<
+			report.tile_count << " tiles (" << scheduler.stolen_count(worker_index) << " stolen), " <<
+			"busy " << report.busy_time << "s / " << report.total_time << "s, " <<
+			std::setprecision(3) << utilisation << "% utilisation";
+		LOG_INFO(tools::kChannelProfiling, report_stream.str());
+	}
+}
+
+
+void
+Integrator::SetTileSize(uint32_t const _tile_size)
+{
+	YS_ASSERT(_tile_size > 0u);
+	tile_size_ = maths::Max(_tile_size, 1u);
+}
+
+
+void
+Integrator::SetPacketSize(uint32_t const _packet_size)
+{
+	if (_packet_size != 0u && !RayPacket::IsValidSize(_packet_size))
+	{
+		LOG_WARNING(tools::kChannelGeneral, "Unsupported packet size " +
+					std::to_string(_packet_size) + ", camera rays are traced one at a time");
+		packet_size_ = 0u;
+		return;
+	}
+	packet_size_ = _packet_size;
+}
+
+
+Integrator::TileContainer_t
+Integrator::MakeTiles_() const
+{
+	maths::Vec2i const &resolution = film_.resolution();
+	int64_t const tile_size = static_cast<int64_t>(tile_size_);
+	maths::Vec2i const tile_count{
+		(resolution.w + tile_size - 1) / tile_size,
+		(resolution.h + tile_size - 1) / tile_size
+	};
+	TileContainer_t result{};
+	result.reserve(static_cast<size_t>(tile_count.x * tile_count.y));
+	for (int64_t tile_y = 0; tile_y < tile_count.y; ++tile_y)
+	{
+		for (int64_t tile_x = 0; tile_x < tile_count.x; ++tile_x)
+		{
+			maths::Vec2i const min{ tile_x * tile_size, tile_y * tile_size };
+			maths::Vec2i const max{
+				maths::Min(min.x + tile_size, resolution.w),
+				maths::Min(min.y + tile_size, resolution.h)
+			};
+			result.push_back(Tile{ min, max });
+		}
+	}
+	return result;
+}
+
+
+void
+Integrator::EstimateTileCosts_(TileContainer_t const &_tiles, Scene const &_scene,
+							   maths::Decimal _t, uint32_t const _worker_count)
+{
+	TIMED_SCOPE(Integrator_EstimateTileCosts);
+	// Low sample count pre-pass : a single sample on a sparse grid of pixels in every tile.
+	// The result is discarded, the pixel seeding keeps the final image unaffected.
+	tile_costs_.assign(_tiles.size(), 0u);
+	std::atomic<size_t> next_tile_index{ 0u };
+	DispatchWorkers_(_worker_count,
+					 [this, &_tiles, &_scene, _t, &next_tile_index]
+					 (uint32_t const, Sampler &_sampler)
+	{
+		for (size_t tile_index = next_tile_index++;
+			 tile_index < _tiles.size();
+			 tile_index = next_tile_index++)
+		{
+			Tile const &tile = _tiles[tile_index];
+			tools::Timer tile_timer{ "Integrator_EstimateTile" };
+			{
+				tools::TimeProbe const tile_probe{ tile_timer };
+				for (int64_t y = tile.min.y; y < tile.max.y; y += kCostEstimateStride)
+				{
+					for (int64_t x = tile.min.x; x < tile.max.x; x += kCostEstimateStride)
+					{
+						IntegratePixel_({ x, y }, _scene, _t, _sampler, 1u);
+					}
+				}
+			}
+			tile_costs_[tile_index] = boost::numeric_cast<TileScheduler::Cost_t>(
+				tile_timer.total_ticks());
+		}
+	});
+}
+
+
+void
+Integrator::DispatchWorkers_(uint32_t const _worker_count, WorkerFunc_t const &_worker)
+{
+	if (_worker_count <= 1u)
+	{
+		_worker(0u, sampler_);
+		BvhAccelerator::GrabTraversalCounters();
+	}
+	else
+	{
+		globals::logger.AllowMultipleThreads(_worker_count);
+		std::vector<std::thread> workers{};
+		workers.reserve(_worker_count);
+		for (uint32_t worker_index = 0u; worker_index < _worker_count; ++worker_index)
+		{
+			workers.emplace_back([this, &_worker, worker_index]() {
+				globals::logger.thread_index = worker_index;
+				std::unique_ptr<Sampler> const sampler = sampler_.Clone(sampler_.seed());
+				_worker(worker_index, *sampler);
+				globals::profiler_aggregate.GrabTimers(globals::profiler);
+				BvhAccelerator::GrabTraversalCounters();
+			});
+		}
+		for (std::thread &thread : workers)
+		{
+			thread.join();
+		}
+	}
+}
+
+
+void
+Integrator::IntegrateTile_(Tile const &_tile, Scene const &_scene, maths::Decimal _t,
+						   Sampler &_sampler, WorkerState &_state)
+{
+	TIMED_SCOPE(Integrator_IntegrateTile);
+	if (wavefront_batch_size_ != 0u && SupportsWavefront_())
+	{
+		IntegrateTileWavefront_(_tile, _scene, _t, _sampler, _state.wave);
+		return;
+	}
+	if (packet_size_ != 0u)
+	{
+		YS_ASSERT(_state.lane_samplers.size() == packet_size_);
+		maths::Vec2i const block_size{ (packet_size_ == 4u) ? 2 : 4, (packet_size_ == 16u) ? 4 : 2 };
+		for (int64_t y = _tile.min.y; y < _tile.max.y; y += block_size.h)
+			for (int64_t x = _tile.min.x; x < _tile.max.x; x += block_size.w)
+				IntegratePixelBlock_(_tile, { x, y }, block_size, _scene, _t, _state.lane_samplers);
+		return;
+	}
+	for (int64_t y = _tile.min.y; y < _tile.max.y; ++y)
+	{
+		for (int64_t x = _tile.min.x; x < _tile.max.x; ++x)
+		{
+			maths::Vec3f const final_color =
+				IntegratePixel_({ x, y }, _scene, _t, _sampler, _sampler.samples_per_pixel());
 			film_.SetPixel(final_color, { x, y });
 		}
 	}
 }
 
 
+maths::Vec3f
+Integrator::IntegratePixel_(maths::Vec2i const &_position, Scene const &_scene, maths::Decimal _t,
+							Sampler &_sampler, uint64_t const _sample_count)
+{
+	YS_ASSERT(_sample_count <= _sampler.samples_per_pixel());
+	maths::Vec2f const inv_resolution = { 1._d / film_.resolution().w, 1._d / film_.resolution().h };
+	_sampler.StartPixel({ static_cast<uint64_t>(_position.x), static_cast<uint64_t>(_position.y) });
+	maths::Vec2f const pixel_origin =
+		{ static_cast<maths::Decimal>(_position.x), static_cast<maths::Decimal>(_position.y) };
+	maths::Vec3f color_accumulator{ maths::zero<maths::Vec3f> };
+	for (uint64_t sample_index = 0;
+		 sample_index < _sample_count;
+		 ++sample_index, _sampler.StartNextSample())
+	{
+		maths::Vec2f const film_sample = _sampler.GetNext<2u>();
+		maths::Vec2f const sample_position = pixel_origin + film_sample;
+		maths::Vec2f const uv = sample_position * inv_resolution;
+		maths::Ray ray = camera_.Ray(uv.u, uv.v, _t);
+		raytracer::SurfaceInteraction closest_hit_info{};
+		_scene.Intersect(ray, closest_hit_info);
+		maths::Vec3f const color = Li(ray, closest_hit_info, _scene, _sampler);
+		color_accumulator += color;
+	}
+	return color_accumulator / static_cast<maths::Decimal>(_sample_count);
+}
+
+
+void
+Integrator::IntegrateTileWavefront_(Tile const &_tile, Scene const &_scene, maths::Decimal _t,
+									Sampler &_sampler, Wave &_wave)
+{
+	TIMED_SCOPE(Integrator_IntegrateTileWavefront);
+	maths::Vec2f const inv_resolution = { 1._d / film_.resolution().w, 1._d / film_.resolution().h };
+	uint64_t const sample_count = _sampler.samples_per_pixel();
+	int64_t const tile_width = _tile.max.x - _tile.min.x;
+	int64_t const tile_pixel_count = tile_width * (_tile.max.y - _tile.min.y);
+	// Waves hold whole pixels, at least one
+	int64_t const wave_pixel_count =
+		maths::Max(static_cast<int64_t>(wavefront_batch_size_ / sample_count), int64_t{ 1 });
+	std::vector<maths::Vec3f> sample_colors{};
+	for (int64_t first_pixel = 0; first_pixel < tile_pixel_count; first_pixel += wave_pixel_count)
+	{
+		int64_t const pixel_count = maths::Min(wave_pixel_count, tile_pixel_count - first_pixel);
+		auto const pixel_position = [&_tile, tile_width, first_pixel](int64_t const _pixel) {
+			return maths::Vec2i{ _tile.min.x + (first_pixel + _pixel) % tile_width,
+								 _tile.min.y + (first_pixel + _pixel) / tile_width };
+		};
+		// Camera rays, and the array samples the integrator will need for each of them
+		_wave.paths.clear();
+		_wave.samples.clear();
+		_wave.camera_rays.Clear();
+		for (int64_t pixel = 0; pixel < pixel_count; ++pixel)
+		{
+			maths::Vec2i const position = pixel_position(pixel);
+			_sampler.StartPixel({ static_cast<uint64_t>(position.x), static_cast<uint64_t>(position.y) });
+			maths::Vec2f const pixel_origin =
+				{ static_cast<maths::Decimal>(position.x), static_cast<maths::Decimal>(position.y) };
+			for (uint64_t sample_index = 0;
+				 sample_index < sample_count;
+				 ++sample_index, _sampler.StartNextSample())
+			{
+				maths::Vec2f const film_sample = _sampler.GetNext<2u>();
+				maths::Vec2f const uv = (pixel_origin + film_sample) * inv_resolution;
+				uint32_t const path_index = static_cast<uint32_t>(_wave.paths.size());
+				_wave.camera_rays.Push(camera_.Ray(uv.u, uv.v, _t), path_index);
+				_wave.paths.emplace_back();
+				_wave.paths.back().index = path_index;
+				_wave.paths.back().first_sample = static_cast<uint32_t>(_wave.samples.size());
+				DrawWaveSamples_(_scene, _sampler, _wave.samples);
+			}
+		}
+		_scene.IntersectStream(_wave.camera_rays);
+		for (size_t i = 0u; i < _wave.paths.size(); ++i)
+		{
+			_wave.paths[i].ray = _wave.camera_rays.rays[i];
+			_wave.paths[i].hit = _wave.camera_rays.hits[i];
+		}
+		// Hits on the same primitive and face are shaded together
+		std::sort(_wave.paths.begin(), _wave.paths.end(),
+				  [](WavefrontPath const &_lhs, WavefrontPath const &_rhs) {
+			if (_lhs.hit.primitive != _rhs.hit.primitive)
+				return std::less<Primitive const *>{}(_lhs.hit.primitive, _rhs.hit.primitive);
+			if (_lhs.hit.index != _rhs.hit.index)
+				return _lhs.hit.index < _rhs.hit.index;
+			return _lhs.index < _rhs.index;
+		});
+		for (WavefrontPath &path : _wave.paths)
+		{
+			path.hit_info = SurfaceInteraction{};
+			if (path.hit.primitive == nullptr)
+				continue;
+			path.hit.primitive->ComputeSurfaceInteraction(path.ray, path.hit, path.hit_info);
+			path.hit_info.primitive = path.hit.primitive;
+			path.hit_info.instance_path = path.hit.instance_path;
+		}
+		ShadeWave_(_wave, _scene);
+		// Samples are accumulated in generation order, as depth first
+		sample_colors.resize(_wave.paths.size());
+		for (WavefrontPath const &path : _wave.paths)
+			sample_colors[path.index] = path.color;
+		for (int64_t pixel = 0; pixel < pixel_count; ++pixel)
+		{
+			maths::Vec3f color_accumulator{ maths::zero<maths::Vec3f> };
+			for (uint64_t sample_index = 0; sample_index < sample_count; ++sample_index)
+				color_accumulator += sample_colors[static_cast<size_t>(pixel) * sample_count + sample_index];
+			film_.SetPixel(color_accumulator / static_cast<maths::Decimal>(sample_count),
+						   pixel_position(pixel));
+		}
+	}
+}
+
+
+void
+Integrator::SortStream_(RayStream &_stream, Scene const &_scene) const
+{
+	if (_scene._aggregate != nullptr)
+		_stream.SortForTraversal(_scene._aggregate->WorldBounds(), ray_sort_batch_size_);
+}
+
+
+void
+Integrator::IntegratePixelBlock_(Tile const &_tile, maths::Vec2i const &_block_min,
+								 maths::Vec2i const &_block_size, Scene const &_scene,
+								 maths::Decimal _t, LaneSamplerContainer_t const &_lane_samplers)
+{
+	// Same sampling as IntegratePixel_, lane i follows the pixel of ray i of the packet
+	maths::Vec2f const inv_resolution = { 1._d / film_.resolution().w, 1._d / film_.resolution().h };
+	uint64_t const sample_count = _lane_samplers[0]->samples_per_pixel();
+	RayPacket packet;
+	packet.size = packet_size_;
+	maths::Vec2i lane_positions[RayPacket::kMaxSize];
+	maths::Vec3f color_accumulators[RayPacket::kMaxSize];
+	uint32_t lane_mask = 0u;
+	for (uint32_t lane = 0u; lane < packet_size_; ++lane)
+	{
+		maths::Vec2i const position{ _block_min.x + static_cast<int64_t>(lane) % _block_size.w,
+									 _block_min.y + static_cast<int64_t>(lane) / _block_size.w };
+		if (position.x >= _tile.max.x || position.y >= _tile.max.y)
+			continue;
+		lane_mask |= 1u << lane;
+		lane_positions[lane] = position;
+		_lane_samplers[lane]->StartPixel({ static_cast<uint64_t>(position.x),
+										   static_cast<uint64_t>(position.y) });
+	}
+	for (uint64_t sample_index = 0; sample_index < sample_count; ++sample_index)
+	{
+		for (uint32_t lane = 0u; lane < packet_size_; ++lane)
+		{
+			if ((lane_mask & (1u << lane)) == 0u)
+				continue;
+			maths::Vec2f const pixel_origin = { static_cast<maths::Decimal>(lane_positions[lane].x),
+												static_cast<maths::Decimal>(lane_positions[lane].y) };
+			maths::Vec2f const film_sample = _lane_samplers[lane]->GetNext<2u>();
+			maths::Vec2f const uv = (pixel_origin + film_sample) * inv_resolution;
+			packet.rays[lane] = camera_.Ray(uv.u, uv.v, _t);
+			packet.hits[lane] = HitRecord{};
+		}
+		uint32_t const hit_mask = _scene.IntersectPacket(packet, lane_mask);
+		for (uint32_t lane = 0u; lane < packet_size_; ++lane)
+		{
+			if ((lane_mask & (1u << lane)) == 0u)
+				continue;
+			raytracer::SurfaceInteraction closest_hit_info{};
+			if ((hit_mask & (1u << lane)) != 0u)
+			{
+				HitRecord const &hit = packet.hits[lane];
+				hit.primitive->ComputeSurfaceInteraction(packet.rays[lane], hit, closest_hit_info);
+				closest_hit_info.primitive = hit.primitive;
+				closest_hit_info.instance_path = hit.instance_path;
+			}
+			color_accumulators[lane] += Li(packet.rays[lane], closest_hit_info, _scene,
+										   *_lane_samplers[lane]);
+			_lane_samplers[lane]->StartNextSample();
+		}
+	}
+	for (uint32_t lane = 0u; lane < packet_size_; ++lane)
+	{
+		if ((lane_mask & (1u << lane)) != 0u)
+			film_.SetPixel(color_accumulators[lane] / static_cast<maths::Decimal>(sample_count),
+						   lane_positions[lane]);
+	}
+}
+
+
 NormalIntegrator::NormalIntegrator(Camera& _camera, Film& _film, Sampler& _sampler, bool const _remap, bool const _absolute) :
 	Integrator{ _camera, _film, _sampler },
 	remap_{ _remap }, absolute_{ _absolute }
@@ -90,7 +567,8 @@ NormalIntegrator::Prepare(PrimitiveContainer_t const &_primitives, LightContaine
 maths::Vec3f
 NormalIntegrator::Li(maths::Ray const &_ray,
 					 raytracer::SurfaceInteraction const &_hit,
-					 Scene const &_scene)
+					 Scene const &_scene,
+					 Sampler &_sampler)
 {
 	static maths::Vec3f const up_color{ 0._d, 0._d, 1._d }, down_color{ 0._d, 1._d, 0._d };
 	maths::Vec3f result(0._d);
@@ -131,29 +609,18 @@ AOIntegrator::Prepare(PrimitiveContainer_t const &_primitives, LightContainer_t
 maths::Vec3f
 AOIntegrator::Li(maths::Ray const &_ray,
 				 raytracer::SurfaceInteraction const &_hit,
-				 Scene const &_scene)
+				 Scene const &_scene,
+				 Sampler &_sampler)
 {
 	TIMED_SCOPE(AOIntegrator_Li);
 	if (_hit.primitive != nullptr)
 	{
 		maths::Vec3f occlusion{ maths::zero<maths::Vec3f> };
-		Sampler::Sample2DContainer_t const &samples = sampler().GetArray<2u>(sample_count_);
+		Sampler::Sample2DContainer_t const &samples = _sampler.GetArray<2u>(sample_count_);
 		for (Sampler::Sample2DContainer_t::const_iterator scit = samples.cbegin();
 			 scit != samples.cend(); ++scit)
 		{
-			int64_t const index = std::distance(samples.cbegin(), scit);
-			maths::Vec2f const &sample = *scit;
-			maths::Vec3f const sampled_direction = HemisphereMapping(sample);
-			raytracer::SurfaceInteraction::GeometryProperties const &geometry =
-				(!use_shading_geometry_) ? _hit.geometry : _hit.shading;
-			maths::Vec3f const normal{ geometry.normal() };
-			maths::Vec3f const dpdu{ geometry.dpdu() };
-			maths::Vec3f const dpdv{ geometry.dpdv() };
-			maths::Vec3f const wi =
-				dpdu * sampled_direction.x +
-				dpdv * sampled_direction.y +
-				normal * sampled_direction.z;
-			YS_ASSERT(maths::Dot(wi, normal) > 0._d);
+			maths::Vec3f const wi = SampleDirection_(_hit, *scit);
 			//
 			maths::Point3f origin{ maths::zero<maths::Point3f> };
 			bool cast_primary_ray = false;
@@ -179,13 +646,8 @@ AOIntegrator::Li(maths::Ray const &_ray,
 																		_hit.position_error);
 					maths::Ray secondary_ray{ secondary_ray_origin, wi,
 						maths::infinity<maths::Decimal>, _ray.time };
-					raytracer::SurfaceInteraction hit_info;
-					bool intersected = false;
-					for (raytracer::Primitive const *primitive : _scene._primitives)
-					{
-						bool const ret_intersect = primitive->Intersect(secondary_ray, hit_info);
-						intersected = ret_intersect || intersected;
-					}
+					raytracer::SurfaceInteraction hit_info{};
+					bool const intersected = _scene.Intersect(secondary_ray, hit_info);
 					if (hit_info.primitive != nullptr && intersected)
 					{ // found something, we might be on its inside or its outside
 						maths::Vec3f const hit_geometry_normal{ hit_info.geometry.normal() };
@@ -199,15 +661,8 @@ AOIntegrator::Li(maths::Ray const &_ray,
 						}
 						else
 						{ // outside case, this is a valid AO result
-							if (hit_info.primitive != _hit.primitive)
-							{
-								occlusion += kOccludedColor;
-							}
-							else
-							{ // this is an error
-								occlusion += kSecondaryRaySelfHitColor;
-								LOG_WARNING(tools::kChannelGeneral, "Secondary ray self-hit");
-							}
+							occlusion += SecondaryOcclusionFromHit_(_hit, hit_info.primitive,
+																	hit_info.instance_path);
 						}
 					}
 					else
@@ -220,64 +675,23 @@ AOIntegrator::Li(maths::Ray const &_ray,
 			{ // shading geometry is disabled, no risk of getting a self-hit
 				cast_primary_ray = true;
 				origin = SurfaceInteraction::OffsetOriginFromErrorBounds(
-					_hit.position, normal, _hit.position_error);
+					_hit.position, maths::Vec3f{ _hit.geometry.normal() }, _hit.position_error);
 			}
 			//
 			if (cast_primary_ray)
 			{
 				maths::Ray ray{ origin, wi, maths::infinity<maths::Decimal>, _ray.time };
-				raytracer::SurfaceInteraction closest_hit_info;
-				bool intersected = false;
-				for (raytracer::Primitive const *primitive : _scene._primitives)
-				{
-					bool const ret_intersect = primitive->Intersect(ray, closest_hit_info);
-					intersected = ret_intersect || intersected;
-				}
-				if (closest_hit_info.primitive == nullptr || !intersected)
-				{
-					occlusion += kUnoccludedColor;
+				if (!use_shading_geometry_)
+				{ // self-hits can't happen without shading geometry, any hit is enough
+					occlusion += _scene.Occluded(ray) ? kOccludedColor : kUnoccludedColor;
 				}
 				else
 				{
-					if (closest_hit_info.primitive != _hit.primitive)
-					{
-						occlusion += kOccludedColor;
-					}
-					else
-					{ // this is an error
-						occlusion += kPrimaryRaySelfHitColor;
-						if (!fixed_shading_normal_self_hitting)
-						{
-							LOG_WARNING(tools::kChannelGeneral, "Primary ray self-hit");
-							LOG_INFO(tools::kChannelGeneral, "	wi.normal : " +
-									 std::to_string(maths::Dot(wi, normal)));
-							LOG_INFO(tools::kChannelGeneral, "	wi.geometry_normal : " + 
-									 std::to_string(maths::Dot(wi, _hit.geometry.normal())));
-							auto const precision = std::setprecision(std::numeric_limits<double>::digits10 + 1);
-							std::ostringstream camera_hit_position_stream;
-							camera_hit_position_stream << "	" << precision <<
-								_hit.position.x << "; " <<
-								_hit.position.y << "; " <<
-								_hit.position.z;
-							LOG_INFO(tools::kChannelGeneral, camera_hit_position_stream.str());
-							std::ostringstream origin_position_stream;
-							origin_position_stream << "	" << precision <<
-								origin.x << "; " <<
-								origin.y << "; " <<
-								origin.z;
-							LOG_INFO(tools::kChannelGeneral, origin_position_stream.str());
-							std::ostringstream hit_position_stream;
-							hit_position_stream << "	" << precision <<
-								closest_hit_info.position.x << "; " <<
-								closest_hit_info.position.y << "; " <<
-								closest_hit_info.position.z;
-							LOG_INFO(tools::kChannelGeneral, hit_position_stream.str());
-						}
-						else
-						{
-							LOG_ERROR(tools::kChannelGeneral, "Fixed shading normal but still self-hit");
-						}
-					}
+					// only the identity of the hit primitive matters here
+					raytracer::HitRecord closest_hit{};
+					_scene.Intersect(ray, closest_hit);
+					occlusion += OcclusionFromHit_(_hit, ray, closest_hit,
+												   fixed_shading_normal_self_hitting);
 				}
 			}
 		}
@@ -290,4 +704,185 @@ AOIntegrator::Li(maths::Ray const &_ray,
 }
 
 
+void
+AOIntegrator::DrawWaveSamples_(Scene const &_scene, Sampler &_sampler,
+							   std::vector<maths::Vec2f> &_samples)
+{
+	Sampler::Sample2DContainer_t const &samples = _sampler.GetArray<2u>(sample_count_);
+	_samples.insert(_samples.end(), samples.cbegin(), samples.cend());
+}
+
+
+void
+AOIntegrator::ShadeWave_(Wave &_wave, Scene const &_scene)
+{
+	TIMED_SCOPE(AOIntegrator_ShadeWave);
+	// Same rays as Li, grouped by kind : rays leaving the surface, and with shading geometry
+	// rays cast from underneath it first when the sampled direction points below it
+	RayStream ao_rays{}, below_rays{};
+	std::vector<uint8_t> fixed_shading_normal_self_hitting{};
+	for (uint32_t path_index = 0u; path_index < _wave.paths.size(); ++path_index)
+	{
+		WavefrontPath &path = _wave.paths[path_index];
+		if (path.hit.primitive == nullptr)
+		{
+			path.color = kUnoccludedColor;
+			continue;
+		}
+		path.color = maths::zero<maths::Vec3f>;
+		SurfaceInteraction const &hit = path.hit_info;
+		maths::Vec3f const geometry_normal{ hit.geometry.normal() };
+		for (uint64_t sample_index = 0u; sample_index < sample_count_; ++sample_index)
+		{
+			maths::Vec3f const wi = SampleDirection_(hit, _wave.samples[path.first_sample + sample_index]);
+			bool const is_below = use_shading_geometry_ && maths::Dot(wi, geometry_normal) < 0._d;
+			maths::Point3f const origin = SurfaceInteraction::OffsetOriginFromErrorBounds(
+				hit.position, is_below ? -geometry_normal : geometry_normal, hit.position_error);
+			maths::Ray const ray{ origin, wi, maths::infinity<maths::Decimal>, path.ray.time };
+			if (is_below)
+			{
+				below_rays.Push(ray, path_index);
+			}
+			else
+			{
+				ao_rays.Push(ray, path_index);
+				fixed_shading_normal_self_hitting.push_back(0u);
+			}
+		}
+	}
+	if (!use_shading_geometry_)
+	{
+		SortStream_(ao_rays, _scene);
+		_scene.OccludedStream(ao_rays);
+		for (size_t i = 0u; i < ao_rays.size(); ++i)
+			_wave.paths[ao_rays.owners[i]].color +=
+				(ao_rays.occluded[i] != 0u) ? kOccludedColor : kUnoccludedColor;
+	}
+	else
+	{
+		SortStream_(below_rays, _scene);
+		_scene.IntersectStream(below_rays);
+		for (size_t i = 0u; i < below_rays.size(); ++i)
+		{
+			WavefrontPath &path = _wave.paths[below_rays.owners[i]];
+			HitRecord const &below_hit = below_rays.hits[i];
+			if (below_hit.primitive == nullptr)
+			{
+				path.color += kUnoccludedColor;
+				continue;
+			}
+			raytracer::SurfaceInteraction hit_info{};
+			below_hit.primitive->ComputeSurfaceInteraction(below_rays.rays[i], below_hit,
+														   hit_info);
+			maths::Vec3f const wi = below_rays.rays[i].direction;
+			if (maths::Dot(maths::Vec3f{ hit_info.geometry.normal() }, wi) > 0._d)
+			{ // inside case, the AO ray starts from the hit
+				maths::Point3f const origin = SurfaceInteraction::OffsetOriginFromErrorBounds(
+					hit_info.position, maths::Vec3f{ hit_info.shading.normal() },
+					hit_info.position_error);
+				ao_rays.Push(maths::Ray{ origin, wi, maths::infinity<maths::Decimal>, path.ray.time },
+							 below_rays.owners[i]);
+				fixed_shading_normal_self_hitting.push_back(1u);
+			}
+			else
+			{
+				path.color += SecondaryOcclusionFromHit_(path.hit_info, below_hit.primitive,
+														 below_hit.instance_path);
+			}
+		}
+		SortStream_(ao_rays, _scene);
+		_scene.IntersectStream(ao_rays);
+		for (size_t i = 0u; i < ao_rays.size(); ++i)
+		{
+			WavefrontPath &path = _wave.paths[ao_rays.owners[i]];
+			path.color += OcclusionFromHit_(path.hit_info, ao_rays.rays[i], ao_rays.hits[i],
+											fixed_shading_normal_self_hitting[i] != 0u);
+		}
+	}
+	for (WavefrontPath &path : _wave.paths)
+		if (path.hit.primitive != nullptr)
+			path.color /= static_cast<maths::Decimal>(sample_count_);
+}
+
+
+maths::Vec3f
+AOIntegrator::SampleDirection_(raytracer::SurfaceInteraction const &_hit,
+							   maths::Vec2f const &_sample) const
+{
+	maths::Vec3f const sampled_direction = HemisphereMapping(_sample);
+	raytracer::SurfaceInteraction::GeometryProperties const &geometry =
+		(!use_shading_geometry_) ? _hit.geometry : _hit.shading;
+	maths::Vec3f const normal{ geometry.normal() };
+	maths::Vec3f const dpdu{ geometry.dpdu() };
+	maths::Vec3f const dpdv{ geometry.dpdv() };
+	maths::Vec3f const wi =
+		dpdu * sampled_direction.x +
+		dpdv * sampled_direction.y +
+		normal * sampled_direction.z;
+	YS_ASSERT(maths::Dot(wi, normal) > 0._d);
+	return wi;
+}
+
+
+maths::Vec3f
+AOIntegrator::SecondaryOcclusionFromHit_(raytracer::SurfaceInteraction const &_hit,
+										 Primitive const *_ray_primitive,
+										 InstancePath const &_ray_instance_path) const
+{
+	if (_ray_primitive != _hit.primitive || _ray_instance_path != _hit.instance_path)
+		return kOccludedColor;
+	// this is an error
+	LOG_WARNING(tools::kChannelGeneral, "Secondary ray self-hit");
+	return kSecondaryRaySelfHitColor;
+}
+
+
+maths::Vec3f
+AOIntegrator::OcclusionFromHit_(raytracer::SurfaceInteraction const &_hit,
+								maths::Ray const &_ray, HitRecord const &_ray_hit,
+								bool const _fixed_shading_normal_self_hitting) const
+{
+	if (_ray_hit.primitive == nullptr)
+		return kUnoccludedColor;
+	if (_ray_hit.primitive != _hit.primitive || _ray_hit.instance_path != _hit.instance_path)
+		return kOccludedColor;
+	// this is an error
+	if (!_fixed_shading_normal_self_hitting)
+	{
+		maths::Vec3f const &wi = _ray.direction;
+		maths::Point3f const &origin = _ray.origin;
+		LOG_WARNING(tools::kChannelGeneral, "Primary ray self-hit");
+		LOG_INFO(tools::kChannelGeneral, "	wi.normal : " +
+				 std::to_string(maths::Dot(wi, maths::Vec3f{ _hit.shading.normal() })));
+		LOG_INFO(tools::kChannelGeneral, "	wi.geometry_normal : " + 
+				 std::to_string(maths::Dot(wi, _hit.geometry.normal())));
+		auto const precision = std::setprecision(std::numeric_limits<double>::digits10 + 1);
+		std::ostringstream camera_hit_position_stream;
+		camera_hit_position_stream << "	" << precision <<
+			_hit.position.x << "; " <<
+			_hit.position.y << "; " <<
+			_hit.position.z;
+		LOG_INFO(tools::kChannelGeneral, camera_hit_position_stream.str());
+		std::ostringstream origin_position_stream;
+		origin_position_stream << "	" << precision <<
+			origin.x << "; " <<
+			origin.y << "; " <<
+			origin.z;
+		LOG_INFO(tools::kChannelGeneral, origin_position_stream.str());
+		maths::Point3f const hit_position = _ray(_ray_hit.t);
+		std::ostringstream hit_position_stream;
+		hit_position_stream << "	" << precision <<
+			hit_position.x << "; " <<
+			hit_position.y << "; " <<
+			hit_position.z;
+		LOG_INFO(tools::kChannelGeneral, hit_position_stream.str());
+	}
+	else
+	{
+		LOG_ERROR(tools::kChannelGeneral, "Fixed shading normal but still self-hit");
+	}
+	return kPrimaryRaySelfHitColor;
+}
+
+
 } // namespace raytracer
@@ -7,6 +7,7 @@
 #include "raytracer/primitive.h"
 #include "raytracer/sampler.h"
 #include "raytracer/surface_interaction.h"
+#include "raytracer/wavefront.h"
 
 #include "common_macros.h"
 #include "core/logger.h"
@@ -49,86 +50,33 @@ DirectLightingIntegrator::Prepare(PrimitiveContainer_t const &_primitives,
 maths::Vec3f
 DirectLightingIntegrator::Li(maths::Ray const &_ray,
 							 raytracer::SurfaceInteraction const &_hit,
-							 Scene const &_scene)
+							 Scene const &_scene,
+							 Sampler &_sampler)
 {
 	TIMED_SCOPE(DirectLightingIntegrator_Li);
-	// hardcoded perfect diffuse material
-	constexpr maths::Decimal material_pdf = 1._d / (2._d * maths::pi<maths::Decimal>);
-
 	if (_hit.primitive == nullptr)
-		return maths::Vec3f{ 0.5_d, 0.5_d, 0.5_d };
+		return kBackgroundColor;
 
 	maths::Vec3f Li(0._d);
 	for (Light const *light : _scene._lights)
 	{
+		Sampler::Sample2DContainer_t const &light_samples = _sampler.GetArray<2u>(shadow_ray_count_);
+		for (maths::Vec2f const &light_sample_ksi : light_samples)
 		{
-			Sampler::Sample2DContainer_t const &samples = sampler().GetArray<2u>(shadow_ray_count_);
-			Sampler::Sample2DContainer_t::const_iterator current_sample = samples.cbegin();
-			while(current_sample != samples.cend())
-			{
-				maths::Vec2f const light_sample_ksi = *(current_sample++);
-				Light::LiSample const light_sample = light->Sample(_hit, light_sample_ksi);
-				maths::Vec3f const light_wi = light_sample.wi();
-				maths::Point3f const origin = _hit.OffsetOriginFromErrorBounds(light_wi);
-				raytracer::SurfaceInteraction shadow_hit_info{};
-				maths::Ray shadow_ray{ origin, light_wi, maths::infinity<maths::Decimal>, _ray.time };
-				for (Primitive const *primitive : _scene._primitives)
-				{
-					primitive->Intersect(shadow_ray, shadow_hit_info);
-				}
-				if (!shadow_hit_info.primitive)
-				{
-					maths::Decimal const weight = PowerHeuristic(1u, light_sample.probability,
-																 1u, material_pdf);
-					maths::Decimal const cos_theta =
-						maths::Abs(maths::Dot(light_wi, _hit.shading.normal()));
-					maths::Vec3f const contribution = light_sample.li *
-						material_pdf * cos_theta * weight / light_sample.probability;
-					Li += contribution;
-				}
-				else
-				{ // shadowed light, no contribution
-				}
-			}
+			maths::Ray shadow_ray{};
+			maths::Vec3f contribution{};
+			if (SampleLight_(*light, _hit, light_sample_ksi, _ray.time, shadow_ray, contribution) &&
+				!_scene.Occluded(shadow_ray))
+				Li += contribution;
 		}
-		
+		Sampler::Sample2DContainer_t const &material_samples = _sampler.GetArray<2u>(shadow_ray_count_);
+		for (maths::Vec2f const &material_sample_ksi : material_samples)
 		{
-			Sampler::Sample2DContainer_t const &samples = sampler().GetArray<2u>(shadow_ray_count_);
-			Sampler::Sample2DContainer_t::const_iterator current_sample = samples.cbegin();
-			while (current_sample != samples.cend())
-			{
-				maths::Vec2f const material_sample_ksi = *(current_sample++);
-				// hardcoded perfect diffuse material
-				maths::Vec3f const material_wi = HemisphereMapping(material_sample_ksi);
-				maths::Decimal const light_pdf = light->Pdf(_hit, material_wi);
-				if (light_pdf > 0._d)
-				{
-					maths::Point3f const origin = _hit.OffsetOriginFromErrorBounds(material_wi);
-					raytracer::SurfaceInteraction shadow_hit_info{};
-					maths::Ray shadow_ray{ origin, material_wi,
-										   maths::infinity<maths::Decimal>, _ray.time };
-					for (Primitive const *primitive : _scene._primitives)
-					{
-						primitive->Intersect(shadow_ray, shadow_hit_info);
-					}
-					if (!shadow_hit_info.primitive)
-					{
-						maths::Decimal const weight = PowerHeuristic(1u, material_pdf,
-																	 1u, light_pdf);
-						maths::Decimal const cos_theta =
-							maths::Abs(maths::Dot(material_wi, _hit.shading.normal()));
-						maths::Vec3f const contribution = light->Le() *
-							light_pdf * cos_theta * weight / material_pdf;
-						Li += contribution;
-					}
-					else
-					{ // shadowed light, no contribution
-					}
-				}
-				else
-				{ // sampled a direction for which the light doesn't contribute
-				}
-			}
+			maths::Ray shadow_ray{};
+			maths::Vec3f contribution{};
+			if (SampleMaterial_(*light, _hit, material_sample_ksi, _ray.time, shadow_ray, contribution) &&
+				!_scene.Occluded(shadow_ray))
+				Li += contribution;
 		}
 	}
 	Li /= boost::numeric_cast<maths::Decimal>(shadow_ray_count_);
@@ -136,4 +84,108 @@ DirectLightingIntegrator::Li(maths::Ray const &_ray,
 }
 
 
+void
+DirectLightingIntegrator::DrawWaveSamples_(Scene const &_scene, Sampler &_sampler,
+										   std::vector<maths::Vec2f> &_samples)
+{
+	for (size_t light_index = 0u; light_index < _scene._lights.size(); ++light_index)
+	{
+		Sampler::Sample2DContainer_t const &light_samples = _sampler.GetArray<2u>(shadow_ray_count_);
+		_samples.insert(_samples.end(), light_samples.cbegin(), light_samples.cend());
+		Sampler::Sample2DContainer_t const &material_samples = _sampler.GetArray<2u>(shadow_ray_count_);
+		_samples.insert(_samples.end(), material_samples.cbegin(), material_samples.cend());
+	}
+}
+
+
+void
+DirectLightingIntegrator::ShadeWave_(Wave &_wave, Scene const &_scene)
+{
+	TIMED_SCOPE(DirectLightingIntegrator_ShadeWave);
+	// Every shadow ray of the wave is traced in one stream, with the contribution it carries
+	RayStream shadow_rays{};
+	std::vector<maths::Vec3f> contributions{};
+	for (uint32_t path_index = 0u; path_index < _wave.paths.size(); ++path_index)
+	{
+		WavefrontPath &path = _wave.paths[path_index];
+		if (path.hit.primitive == nullptr)
+		{
+			path.color = kBackgroundColor;
+			continue;
+		}
+		path.color = maths::zero<maths::Vec3f>;
+		maths::Vec2f const *samples = &_wave.samples[path.first_sample];
+		for (Light const *light : _scene._lights)
+		{
+			for (uint64_t i = 0u; i < 2u * shadow_ray_count_; ++i, ++samples)
+			{
+				maths::Ray shadow_ray{};
+				maths::Vec3f contribution{};
+				bool const contributes = (i < shadow_ray_count_) ?
+					SampleLight_(*light, path.hit_info, *samples, path.ray.time, shadow_ray, contribution) :
+					SampleMaterial_(*light, path.hit_info, *samples, path.ray.time, shadow_ray, contribution);
+				if (!contributes)
+					continue;
+				shadow_rays.Push(shadow_ray, path_index);
+				contributions.push_back(contribution);
+			}
+		}
+	}
+	SortStream_(shadow_rays, _scene);
+	_scene.OccludedStream(shadow_rays);
+	for (size_t i = 0u; i < shadow_rays.size(); ++i)
+		if (shadow_rays.occluded[i] == 0u)
+			_wave.paths[shadow_rays.owners[i]].color += contributions[i];
+	for (WavefrontPath &path : _wave.paths)
+		if (path.hit.primitive != nullptr)
+			path.color /= boost::numeric_cast<maths::Decimal>(shadow_ray_count_);
+}
+
+
+bool
+DirectLightingIntegrator::SampleLight_(Light const &_light, raytracer::SurfaceInteraction const &_hit,
+									   maths::Vec2f const &_ksi, maths::Decimal _time,
+									   maths::Ray &_shadow_ray, maths::Vec3f &_contribution) const
+{
+	// hardcoded perfect diffuse material
+	constexpr maths::Decimal material_pdf = 1._d / (2._d * maths::pi<maths::Decimal>);
+	Light::LiSample const light_sample = _light.Sample(_hit, _ksi);
+	maths::Vec3f const light_wi = light_sample.wi();
+	maths::Point3f const origin = _hit.OffsetOriginFromErrorBounds(light_wi);
+	_shadow_ray = maths::Ray{ origin, light_wi, maths::infinity<maths::Decimal>, _time };
+	maths::Decimal const weight = PowerHeuristic(1u, light_sample.probability,
+												 1u, material_pdf);
+	maths::Decimal const cos_theta =
+		maths::Abs(maths::Dot(light_wi, _hit.shading.normal()));
+	_contribution = light_sample.li *
+		material_pdf * cos_theta * weight / light_sample.probability;
+	return true;
+}
+
+
+bool
+DirectLightingIntegrator::SampleMaterial_(Light const &_light, raytracer::SurfaceInteraction const &_hit,
+										  maths::Vec2f const &_ksi, maths::Decimal _time,
+										  maths::Ray &_shadow_ray, maths::Vec3f &_contribution) const
+{
+	// hardcoded perfect diffuse material
+	constexpr maths::Decimal material_pdf = 1._d / (2._d * maths::pi<maths::Decimal>);
+	maths::Vec3f const material_wi = HemisphereMapping(_ksi);
+	maths::Decimal const light_pdf = _light.Pdf(_hit, material_wi);
+	if (!(light_pdf > 0._d))
+	{ // sampled a direction for which the light doesn't contribute
+		return false;
+	}
+	maths::Point3f const origin = _hit.OffsetOriginFromErrorBounds(material_wi);
+	_shadow_ray = maths::Ray{ origin, material_wi, maths::infinity<maths::Decimal>, _time };
+	maths::Decimal const weight = PowerHeuristic(1u, material_pdf,
+												 1u, light_pdf);
+	maths::Decimal const cos_theta =
+		maths::Abs(maths::Dot(material_wi, _hit.shading.normal()));
+	_contribution = _light.Le() *
+		light_pdf * cos_theta * weight / material_pdf;
+	return true;
+}
+
+
 } // namespace raytracer
@@ -0,0 +1,295 @@
+#include "raytracer/mesh_instances.h"
+
+#include "globals.h"
+#include "core/logger.h"
+#include "maths/bounds.h"
+#include "maths/ray.h"
+#include "maths/transform.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/ray_packet.h"
+#include "raytracer/surface_interaction.h"
+#include "raytracer/triangle_mesh_data.h"
+
+
+namespace raytracer {
+
+
+namespace {
+
+// Same as maths::Transform applied to a ray, from the rows of an affine transform. The origin
+// is pushed along the direction past its rounding error, tMax is shortened accordingly.
+maths::Ray
+TransformRay(maths::Decimal const (&_rows)[3][4], maths::Ray const &_ray)
+{
+	maths::Point3f const	&o = _ray.origin;
+	maths::Vec3f const		&d = _ray.direction;
+	maths::Point3f	origin{};
+	maths::Vec3f	direction{}, origin_error{};
+	for (uint32_t i = 0u; i < 3u; ++i)
+	{
+		maths::Decimal const *const row = _rows[i];
+		origin[i] = row[0] * o.x + row[1] * o.y + row[2] * o.z + row[3];
+		direction[i] = row[0] * d.x + row[1] * d.y + row[2] * d.z;
+		origin_error[i] = maths::gamma(3u) * (std::abs(row[0] * o.x) + std::abs(row[1] * o.y) +
+											  std::abs(row[2] * o.z) + std::abs(row[3]));
+	}
+	maths::Decimal tMax = _ray.tMax;
+	maths::Decimal const sqr_length = maths::SqrLength(direction);
+	if (sqr_length > 0._d)
+	{
+		maths::Decimal const dt = maths::Dot(maths::Abs(direction), origin_error) / sqr_length;
+		origin += direction * dt;
+		tMax -= dt;
+	}
+	return maths::Ray{ origin, direction, tMax, _ray.time };
+}
+
+void
+CopyRows(maths::Mat4x4f const &_m, maths::Decimal (&_rows)[3][4])
+{
+	for (uint32_t i = 0u; i < 3u; ++i)
+		for (uint32_t j = 0u; j < 4u; ++j)
+			_rows[i][j] = _m[i][j];
+}
+
+maths::Mat4x4f
+MakeMatrix(maths::Decimal const (&_rows)[3][4])
+{
+	return maths::Mat4x4f{
+		_rows[0][0], _rows[0][1], _rows[0][2], _rows[0][3],
+		_rows[1][0], _rows[1][1], _rows[1][2], _rows[1][3],
+		_rows[2][0], _rows[2][1], _rows[2][2], _rows[2][3],
+		0._d, 0._d, 0._d, 1._d };
+}
+
+} // namespace
+
+
+InstancedMesh::InstancedMesh(TriangleMeshData const &_data, bool _flip_normals) :
+	Shape(maths::Transform::Identity(), _flip_normals),
+	data_{ _data }
+{}
+
+
+bool
+InstancedMesh::Intersect(maths::Ray const &_ray, HitRecord &_hit) const
+{
+	maths::Ray bvh_ray{ _ray };
+	if (!data_.Intersect(bvh_ray, _hit))
+		return false;
+	_hit.shape = this;
+	return true;
+}
+
+
+void
+InstancedMesh::ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+										 SurfaceInteraction &_hit_info) const
+{
+	data_.ComputeSurfaceInteraction(_ray, _hit, *this, _hit_info);
+}
+
+
+bool
+InstancedMesh::DoesIntersect(maths::Ray const &_ray) const
+{
+	return data_.DoesIntersect(_ray);
+}
+
+
+maths::Decimal
+InstancedMesh::Area() const
+{
+	return data_.Area();
+}
+
+
+Shape::SurfacePoint
+InstancedMesh::SampleSurface(maths::Vec2f const &_ksi) const
+{
+	YS_ASSERT(false);
+	return Shape::SurfacePoint();
+}
+
+
+maths::Bounds3f
+InstancedMesh::ObjectBounds() const
+{
+	return data_.bounds();
+}
+
+
+MeshInstances::Record
+MeshInstances::MakeRecord(Primitive const &_target, MeshInstances const *_nested,
+						  maths::Transform const &_to_world)
+{
+	Record result{};
+	result.target = &_target;
+	result.nested = _nested;
+	CopyRows(_to_world.m(), result.to_world);
+	CopyRows(_to_world.mInv(), result.to_object);
+	return result;
+}
+
+
+MeshInstances::MeshInstances(std::vector<Record> &&_records, uint32_t _bvh_node_width) :
+	records_{ std::move(_records) },
+	instance_depth_{ 1u },
+	bvh_{ static_cast<BvhAccelerator::PrimitiveSource const &>(*this), kBvhNodeMaxSize,
+		  _bvh_node_width }
+{
+	for (Record const &record : records_)
+		if (record.nested != nullptr)
+			instance_depth_ = maths::Max(instance_depth_, 1u + record.nested->instance_depth());
+	YS_ASSERT(instance_depth_ <= InstancePath::kMaxDepth);
+	LOG_INFO(tools::kChannelGeneral, "Built the BVH of " + std::to_string(records_.size()) +
+			 " mesh instances in " + std::to_string(bvh_.build_milliseconds()) + " ms");
+}
+
+
+bool
+MeshInstances::Intersect(maths::Ray &_ray, HitRecord &_hit) const
+{
+	if (!bvh_.Intersect(_ray, static_cast<BvhAccelerator::LeafIntersector const &>(*this), _hit))
+		return false;
+	_hit.primitive = this;
+	return true;
+}
+
+
+bool
+MeshInstances::DoesIntersect(maths::Ray const &_ray) const
+{
+	return bvh_.DoesIntersect(_ray, static_cast<BvhAccelerator::LeafIntersector const &>(*this));
+}
+
+
+uint32_t
+MeshInstances::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	uint32_t const hit_mask = bvh_.IntersectPacket(
+		_packet, static_cast<BvhAccelerator::LeafIntersector const &>(*this), _ray_mask);
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+		if ((hit_mask & (1u << i)) != 0u)
+			_packet.hits[i].primitive = this;
+	return hit_mask;
+}
+
+
+void
+MeshInstances::ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+										 SurfaceInteraction &_hit_info) const
+{
+	InstancePath const &path = _hit.instance_path;
+	YS_ASSERT(path.depth > 0u && path.depth <= instance_depth_);
+	maths::Transform to_world{ maths::Transform::Identity() };
+	MeshInstances const *level = this;
+	for (uint32_t depth = 0u; depth < path.depth; ++depth)
+	{
+		YS_ASSERT(level != nullptr);
+		to_world = to_world * level->instance_transform(path.indices[depth]);
+		level = level->records_[path.indices[depth]].nested;
+	}
+	// As for shared source triangle meshes, the object space ray isn't normalized again
+	maths::Ray const object_ray{ to_world(_ray, maths::Transform::kInverse) };
+	_hit.shape->ComputeSurfaceInteraction(object_ray, _hit, _hit_info);
+	_hit_info = to_world(_hit_info, maths::Transform::kForward);
+}
+
+
+maths::Bounds3f
+MeshInstances::WorldBounds() const
+{
+	return bvh_.WorldBounds();
+}
+
+
+uint32_t
+MeshInstances::Update()
+{
+	TIMED_SCOPE(MeshInstances_Update);
+	return bvh_.Update();
+}
+
+
+maths::Transform
+MeshInstances::instance_transform(uint32_t _instance) const
+{
+	YS_ASSERT(_instance < records_.size());
+	Record const &record = records_[_instance];
+	return maths::Transform{ MakeMatrix(record.to_world), MakeMatrix(record.to_object) };
+}
+
+
+uint32_t
+MeshInstances::primitive_count() const
+{
+	return static_cast<uint32_t>(records_.size());
+}
+
+
+maths::Bounds3f
+MeshInstances::PrimitiveBounds(uint32_t _primitive_index) const
+{
+	return instance_transform(_primitive_index)(records_[_primitive_index].target->WorldBounds(),
+												maths::Transform::kForward);
+}
+
+
+maths::Bounds3f
+MeshInstances::ClippedPrimitiveBounds(uint32_t _primitive_index,
+									  maths::Bounds3f const &_clip) const
+{
+	maths::Bounds3f const	bounds = PrimitiveBounds(_primitive_index);
+	if (!maths::Overlap(bounds, _clip))
+		return maths::Bounds3f{};
+	return maths::Intersect(bounds, _clip);
+}
+
+
+bool
+MeshInstances::IntersectLeaf(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+							 HitRecord &_hit) const
+{
+	std::vector<uint32_t> const &reference_records = bvh_.reference_primitive_indices();
+	bool	hit = false;
+	for (uint32_t reference = _first; reference < _first + _count; ++reference)
+	{
+		uint32_t const	instance = reference_records[reference];
+		Record const	&record = records_[instance];
+		// The target shortens the object space ray, hit distances are the same along both.
+		// Its hit starts from an empty instance path, this record is pushed in front of it.
+		maths::Ray	object_ray{ TransformRay(record.to_object, _ray) };
+		HitRecord	record_hit{};
+		if (!record.target->Intersect(object_ray, record_hit))
+			continue;
+		InstancePath	&path = record_hit.instance_path;
+		YS_ASSERT(path.depth < InstancePath::kMaxDepth);
+		for (uint32_t depth = path.depth; depth > 0u; --depth)
+			path.indices[depth] = path.indices[depth - 1u];
+		path.indices[0] = instance;
+		++path.depth;
+		_hit = record_hit;
+		_ray.tMax = _hit.t;
+		hit = true;
+	}
+	return hit;
+}
+
+
+bool
+MeshInstances::DoesIntersectLeaf(maths::Ray const &_ray, uint32_t _first,
+								 uint32_t _count) const
+{
+	std::vector<uint32_t> const &reference_records = bvh_.reference_primitive_indices();
+	for (uint32_t reference = _first; reference < _first + _count; ++reference)
+	{
+		Record const &record = records_[reference_records[reference]];
+		if (record.target->DoesIntersect(TransformRay(record.to_object, _ray)))
+			return true;
+	}
+	return false;
+}
+
+
+} // namespace raytracer
@@ -1,30 +1,57 @@
 #include "raytracer/primitive.h"
 
+#include "maths/bounds.h"
 #include "maths/ray.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/ray_packet.h"
 #include "raytracer/shape.h"
 #include "raytracer/surface_interaction.h"
 
 namespace raytracer {
 
 
+maths::Bounds3f
+Primitive::ClippedWorldBounds(maths::Bounds3f const &_clip) const
+{
+	maths::Bounds3f const	bounds = WorldBounds();
+	if (!maths::Overlap(bounds, _clip))
+		return maths::Bounds3f{};
+	return maths::Intersect(bounds, _clip);
+}
+
+
+uint32_t
+Primitive::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	uint32_t	hit_mask = 0u;
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+		if ((_ray_mask & (1u << i)) != 0u && Intersect(_packet.rays[i], _packet.hits[i]))
+			hit_mask |= 1u << i;
+	return hit_mask;
+}
+
+
+void
+Primitive::ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+									 SurfaceInteraction &_hit_info) const
+{
+	YS_ASSERT(_hit.shape != nullptr);
+	_hit.shape->ComputeSurfaceInteraction(_ray, _hit, _hit_info);
+}
+
+
 GeometryPrimitive::GeometryPrimitive(Shape const &_shape) :
 	shape_{ _shape }
 {}
 
 bool
-GeometryPrimitive::Intersect(maths::Ray &_ray, SurfaceInteraction &_hit_info) const
+GeometryPrimitive::Intersect(maths::Ray &_ray, HitRecord &_hit) const
 {
-	maths::Decimal	t_hit = maths::infinity<maths::Decimal>;
-
-	if (!shape_.Intersect(_ray, t_hit, _hit_info))
+	if (!shape_.Intersect(_ray, _hit))
 		return false;
 
-	_ray.tMax = t_hit;
-	if (_hit_info.primitive == nullptr)
-	{
-		_hit_info.primitive = this;
-	}
-
+	_ray.tMax = _hit.t;
+	_hit.primitive = this;
 	return true;
 }
 
@@ -34,12 +61,32 @@ GeometryPrimitive::DoesIntersect(maths::Ray const &_ray) const
 	return shape_.DoesIntersect(_ray);
 }
 
+uint32_t
+GeometryPrimitive::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	uint32_t const	hit_mask = shape_.IntersectPacket(_packet, _ray_mask);
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+	{
+		if ((hit_mask & (1u << i)) == 0u)
+			continue;
+		_packet.rays[i].tMax = _packet.hits[i].t;
+		_packet.hits[i].primitive = this;
+	}
+	return hit_mask;
+}
+
 maths::Bounds3f
 GeometryPrimitive::WorldBounds() const
 {
 	return shape_.WorldBounds();
 }
 
+maths::Bounds3f
+GeometryPrimitive::ClippedWorldBounds(maths::Bounds3f const &_clip) const
+{
+	return shape_.ClippedWorldBounds(_clip);
+}
+
 
 } // namespace raytracer
 
@@ -24,6 +24,7 @@ HemisphereMapping(maths::Vec2f const &_uv)
 
 Sampler::Sampler(uint64_t const _seed, 
 				 uint64_t const _samples_per_pixel, uint64_t const _dimensions_per_sample) :
+	seed_{ _seed },
 	rng_{ _seed },
 	samples_per_pixel_{ _samples_per_pixel },
 	dimensions_per_sample_{ _dimensions_per_sample },
@@ -42,6 +43,14 @@ Sampler::Sampler(uint64_t const _seed,
 }
 
 
+Sampler::Sampler(Sampler const &_other, uint64_t const _seed) :
+	Sampler(_other)
+{
+	seed_ = _seed;
+	rng_ = core::RNG{ _seed };
+}
+
+
 template <uint64_t PackSize> Sampler::StorageType_t<PackSize>
 Sampler::GetNext()
 {
@@ -70,6 +79,9 @@ void
 Sampler::StartPixel(maths::Vec2u const &_position)
 {
 	TIMED_SCOPE(Sampler_StartPixel);
+	// NOTE: The generator is restarted on a stream picked from the pixel position so that
+	//		 a pixel's samples do not depend on which pixels were processed before it.
+	rng_ = core::RNG{ seed_, PixelStream_(_position) };
 	current_pixel_ = _position;
 	current_sample_ = 0u;
 	current_dimension_1D_ = current_dimension_2D_ = 0u;
@@ -239,6 +251,16 @@ Sampler::extension_sizes<2u>() const
 }
 
 
+uint64_t
+Sampler::PixelStream_(maths::Vec2u const &_position)
+{
+	// 31 bits per coordinate, RNG streams are 63 bits wide
+	constexpr uint64_t kCoordinateMask = (1ull << 31u) - 1u;
+	YS_ASSERT(_position.x <= kCoordinateMask && _position.y <= kCoordinateMask);
+	return ((_position.y & kCoordinateMask) << 31u) | (_position.x & kCoordinateMask);
+}
+
+
 template <> Sampler::Storage1D_t
 Sampler::overtaxed_value_<1u>()
 {
@@ -24,7 +24,7 @@ HaltonSampler::InverseRadicalInverse(uint64_t const _base,
 	{
 		uint64_t const digit = remainder % _base;
 		remainder /= _base;
-		result = result * _base + inverse_permutations_()[_base - 1u][digit];
+		result = result * _base + inverse_permutations()[_base - 1u][digit];
 	}
 	return result;
 }
@@ -42,7 +42,7 @@ HaltonSampler::RadicalInverse(uint64_t const _base, uint64_t const _value)
 	{
 		uint64_t const next = working_value / _base;
 		uint64_t const digit = working_value - next * _base;
-		reversed_digits = reversed_digits * _base + permutations_()[_base - 1u][digit];
+		reversed_digits = reversed_digits * _base + permutations()[_base - 1u][digit];
 		inv_base_n *= inv_base;
 		working_value = next;
 		++count;
@@ -104,6 +104,28 @@ HaltonSampler::inverse_permutations_()
 }
 
 
+std::mutex &
+HaltonSampler::tables_mutex_()
+{
+	static std::mutex result{};
+	return result;
+}
+
+
+void
+HaltonSampler::ExtendTables_(uint64_t const _primes_count)
+{
+	std::lock_guard<std::mutex> const lock{ tables_mutex_() };
+	PrimesVector_t &primes = primes_();
+	if (boost::numeric_cast<uint64_t>(primes.capacity()) < kReservedPrimesCount_)
+	{
+		primes.reserve(kReservedPrimesCount_);
+	}
+	ExtendPrimesSequence_(primes, _primes_count);
+	AppendNextFaurePermutations_(permutations_(), inverse_permutations_(), primes.back());
+}
+
+
 void
 HaltonSampler::ExtendPrimesSequence_(PrimesVector_t &_primes,
 									 uint64_t const _count)
@@ -206,13 +228,7 @@ HaltonSampler::HaltonSampler(uint64_t const _seed,
 	mj_{ 0u, 0u },
 	mj_modular_inverses_{ 0u, 0u }
 {
-	std::vector<uint64_t> &primes = primes_();
-	if (boost::numeric_cast<uint64_t>(primes.capacity()) < kReservedPrimesCount_)
-	{
-		primes.reserve(kReservedPrimesCount_);
-	}
-	ExtendPrimesSequence_(primes, _dimensions_per_sample * 2u);
-	AppendNextFaurePermutations_(permutations_(), inverse_permutations_(), primes_().back());
+	ExtendTables_(_dimensions_per_sample * 2u);
 	//
 	// precomputed values for Gruenschloss enumeration method
 	while (tile_resolution_.x > boost::numeric_cast<uint64_t>(std::pow(2u, enum_exponents_.x)))
@@ -240,6 +256,23 @@ HaltonSampler::HaltonSampler(uint64_t const _seed,
 }
 
 
+HaltonSampler::HaltonSampler(HaltonSampler const &_other, uint64_t const _seed) :
+	Sampler(_other, _seed),
+	tile_resolution_{ _other.tile_resolution_ },
+	enum_exponents_{ _other.enum_exponents_ },
+	sample_stride_{ _other.sample_stride_ },
+	mj_{ _other.mj_ },
+	mj_modular_inverses_{ _other.mj_modular_inverses_ }
+{}
+
+
+std::unique_ptr<Sampler>
+HaltonSampler::Clone(uint64_t const _seed) const
+{
+	return std::make_unique<HaltonSampler>(*this, _seed);
+}
+
+
 void
 HaltonSampler::Fill1DPrimarySampleVector(Sample1DContainer_t &_sample_vector,
 										 uint64_t const _sample_index)
@@ -305,8 +338,7 @@ void
 HaltonSampler::OnArrayReserved_(uint64_t const _dimension_count)
 {
 	LOG_INFO(tools::kChannelGeneral, "Requested primes sequence extension to " + std::to_string(_dimension_count) + " primes");
-	ExtendPrimesSequence_(primes_(), _dimension_count);
-	AppendNextFaurePermutations_(permutations_(), inverse_permutations_(), primes_().back());
+	ExtendTables_(_dimension_count);
 }
 
 
@@ -346,7 +378,7 @@ HaltonSampler::SampleCurrentPixel_(uint64_t const _sample_index) const
 maths::Decimal
 HaltonSampler::SampleDimension_(uint64_t const _sample_index, uint64_t const _dimension) const
 {
-	static std::vector<uint64_t> &primes = primes_();
+	PrimesVector_t const &primes = HaltonSampler::primes();
 	maths::Decimal result = maths::infinity<maths::Decimal>;
 	YS_ASSERT(primes.size() >= _dimension);
 	uint64_t const prime_base = primes[_dimension];
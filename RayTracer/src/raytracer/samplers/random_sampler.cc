@@ -12,6 +12,18 @@ RandomSampler::RandomSampler(uint64_t const _seed,
 {}
 
 
+RandomSampler::RandomSampler(RandomSampler const &_other, uint64_t const _seed) :
+	Sampler(_other, _seed)
+{}
+
+
+std::unique_ptr<Sampler>
+RandomSampler::Clone(uint64_t const _seed) const
+{
+	return std::make_unique<RandomSampler>(*this, _seed);
+}
+
+
 void
 RandomSampler::Fill1DSampleVector(Sample1DContainer_t &_sample_vector, uint64_t const)
 {
@@ -2,6 +2,8 @@
 
 #include "maths/transform.h"
 #include "maths/bounds.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/ray_packet.h"
 #include "raytracer/surface_interaction.h"
 
 namespace raytracer
@@ -18,9 +20,19 @@ Shape::Shape(maths::Transform const &_world_transform, bool _flip_normals) :
 bool
 Shape::DoesIntersect(maths::Ray const &_ray) const
 {
-	maths::Decimal		t;
-	SurfaceInteraction	hit_info;
-	return Intersect(_ray, t, hit_info);
+	HitRecord	hit;
+	return Intersect(_ray, hit);
+}
+
+
+uint32_t
+Shape::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	uint32_t	hit_mask = 0u;
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+		if ((_ray_mask & (1u << i)) != 0u && Intersect(_packet.rays[i], _packet.hits[i]))
+			hit_mask |= 1u << i;
+	return hit_mask;
 }
 
 
@@ -43,10 +55,11 @@ Shape::VisibleSurfacePdf(SurfaceInteraction const &_origin, maths::Vec3f const &
 {
 	maths::Decimal result = 0._d;
 	maths::Ray const visibility_ray = _origin.SpawnRay(_wi);
-	maths::Decimal _t;
-	SurfaceInteraction hit_info;
-	if (Intersect(visibility_ray, _t, hit_info))
+	HitRecord hit;
+	if (Intersect(visibility_ray, hit))
 	{
+		SurfaceInteraction hit_info;
+		ComputeSurfaceInteraction(visibility_ray, hit, hit_info);
 		maths::Decimal const r_sqr = maths::SqrDistance(_origin.position, hit_info.position);
 		maths::Decimal const cos_theta = maths::Abs(maths::Dot(hit_info.geometry.normal(), -_wi));
 		maths::Decimal const dA = Area();
@@ -63,4 +76,14 @@ Shape::WorldBounds() const
 }
 
 
+maths::Bounds3f
+Shape::ClippedWorldBounds(maths::Bounds3f const &_clip) const
+{
+	maths::Bounds3f const	bounds = WorldBounds();
+	if (!maths::Overlap(bounds, _clip))
+		return maths::Bounds3f{};
+	return maths::Intersect(bounds, _clip);
+}
+
+
 } // namespace raytracer
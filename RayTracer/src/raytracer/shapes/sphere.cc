@@ -5,6 +5,7 @@
 #include "maths/bounds.h"
 #include "maths/transform.h"
 #include "maths/redecimal.h"
+#include "raytracer/hit_record.h"
 #include "raytracer/surface_interaction.h"
 #include "core/profiler.h"
 
@@ -26,27 +27,158 @@ Sphere::Sphere(maths::Transform const &_world_transform, bool _flip_normals,
 
 
 bool
-Sphere::Intersect(maths::Ray const &_ray,
-				  maths::Decimal &_tHit,
-				  SurfaceInteraction &_hit_info) const
+Sphere::Intersect(maths::Ray const &_ray, HitRecord &_hit) const
 {
 	TIMED_SCOPE(Sphere_Intersect);
 
 	maths::Vec3f origin_error{ maths::zero<maths::Vec3f> }, direction_error{ maths::zero<maths::Vec3f> };
-	maths::Ray ray = world_transform(_ray,
-									 origin_error, direction_error,
-									 maths::Transform::kInverse);
+	maths::Ray const ray = world_transform(_ray,
+										   origin_error, direction_error,
+										   maths::Transform::kInverse);
+
+	maths::Decimal		tHit;
+	maths::Point3f		pHit;
+	maths::Decimal		phi;
+	if (!ObjectSpaceHit_(ray, origin_error, direction_error, tHit, pHit, phi))
+		return false;
+
+	_hit.t = tHit;
+	_hit.uv = maths::Point2f{ phi / phi_max,
+		(std::acos(maths::Clamp(pHit.z / radius, -1._d, 1._d)) - theta_min) / (theta_max - theta_min) };
+	_hit.shape = this;
+	return true;
+}
+
+
+void
+Sphere::ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+								  SurfaceInteraction &_hit_info) const
+{
+	TIMED_SCOPE(Sphere_ComputeSurfaceInteraction);
+
+	// The hit point is refined from the object space ray as ObjectSpaceHit_ did
+	maths::Ray const	ray = world_transform(_ray, maths::Transform::kInverse);
+	maths::Point3f		pHit{ ray(_hit.t) };
+	pHit *= radius / maths::Distance(pHit, maths::zero<maths::Point3f>);
+	if (pHit.x == 0._d && pHit.y == 0._d)
+		pHit.x = 1e-5f * radius;
+
+	maths::Decimal const theta_delta = theta_max - theta_min;
+	maths::Decimal const u = _hit.uv.x;
+	maths::Decimal const theta = std::acos(maths::Clamp(pHit.z / radius, -1._d, 1._d));
+	maths::Decimal const v = _hit.uv.y;
+
+	maths::Decimal const z_radius = std::sqrt(pHit.x * pHit.x + pHit.y * pHit.y);
+	maths::Decimal const inv_z_radius = 1._d / z_radius;
+	maths::Decimal const cos_phi = pHit.x * inv_z_radius;
+	maths::Decimal const sin_phi = pHit.y * inv_z_radius;
+	maths::Vec3f const dpdu(-phi_max * pHit.y, phi_max * pHit.x, 0._d);
+	maths::Vec3f const dpdv{
+		theta_delta *
+		maths::Vec3f{ pHit.z * cos_phi, pHit.z * sin_phi, -radius * std::sin(theta) }
+	};
+
+	maths::Vec3f const error_bounds = maths::gamma(5) * maths::Abs(maths::Vec3f(pHit));
+
+	// NOTE: Using differential geometry first fundamental form to compute dndu and dndv
+	//		 see Gray(1991) for a reference on differential geometry.
+	maths::Vec3f const d2pduu = -phi_max * phi_max * maths::Vec3f{ pHit.x, pHit.y, 0._d };
+	maths::Vec3f const d2pduv =
+		theta_delta * pHit.z * phi_max * maths::Vec3f{ -sin_phi, cos_phi, 0._d };
+	maths::Vec3f const d2pdvv = -theta_delta * theta_delta * (maths::Vec3f)pHit;
+
+	maths::Decimal const E = Dot(dpdu, dpdu);
+	maths::Decimal const F = Dot(dpdu, dpdv);
+	maths::Decimal const G = Dot(dpdv, dpdv);
+	maths::Vec3f const N = maths::Normalized(maths::Cross(dpdu, dpdv));
+	maths::Decimal const e = Dot(N, d2pduu);
+	maths::Decimal const f = Dot(N, d2pduv);
+	maths::Decimal const g = Dot(N, d2pdvv);
+
+	maths::Decimal const inv_EGF2 = 1._d / (E * G - F * F);
+	maths::Norm3f const dndu = maths::Norm3f{
+		(f * F - e * G) * inv_EGF2 * dpdu + (e * F - f * E) * inv_EGF2 * dpdv
+	};
+	maths::Norm3f const dndv = maths::Norm3f{
+		(g * F - f * G) * inv_EGF2 * dpdu + (f * F - g * E) * inv_EGF2 * dpdv
+	};
+
+	_hit_info = world_transform(SurfaceInteraction(
+		pHit, error_bounds, ray.time, -ray.direction, this, maths::Point2f(u, v), dpdu, dpdv, dndu, dndv
+	), maths::Transform::kForward);
+}
+bool
+Sphere::DoesIntersect(maths::Ray const &_ray) const
+{
+	TIMED_SCOPE(Sphere_DoesIntersect);
+
+	maths::Vec3f origin_error{ maths::zero<maths::Vec3f> }, direction_error{ maths::zero<maths::Vec3f> };
+	maths::Ray const ray = world_transform(_ray,
+										   origin_error, direction_error,
+										   maths::Transform::kInverse);
+
+	// Plain floating point roots settle most occlusion queries : rays that clearly miss, and rays
+	// that clearly hit a full sphere within their extent. Anything closer to the decision
+	// boundaries than the rounding errors goes through the running error test.
+	maths::Vec3f const		o{ ray.origin };
+	maths::Vec3f const		&d = ray.direction;
+	maths::Decimal const	a = maths::SqrLength(d);
+	maths::Decimal const	b = 2._d * maths::Dot(o, d);
+	maths::Decimal const	c = maths::SqrLength(o) - radius * radius;
+	double const			b_sqr = double(b) * double(b);
+	double const			four_ac = 4.0 * double(a) * double(c);
+	double const			discriminant_error = double(maths::gamma(5u)) * (b_sqr + std::abs(four_ac));
+	double const			discriminant = b_sqr - four_ac;
+	if (discriminant < -discriminant_error)
+		return false;
+
+	bool const is_full_sphere = (z_min <= -radius && z_max >= radius &&
+								 phi_max >= 2._d * maths::pi<maths::Decimal>);
+	maths::Decimal t0, t1;
+	if (discriminant > discriminant_error && maths::Quadratic(a, b, c, t0, t1))
+	{
+		maths::Decimal const inv_direction_length = 1._d / std::sqrt(a);
+		maths::Decimal const origin_distance = maths::Length(o) * inv_direction_length;
+		auto const root_error = [&](maths::Decimal const _t) {
+			return maths::gamma(16u) * (maths::Abs(_t) + origin_distance) +
+				(maths::Length(origin_error) + maths::Abs(_t) * maths::Length(direction_error)) *
+				inv_direction_length;
+		};
+		maths::Decimal const t0_error = root_error(t0);
+		maths::Decimal const t1_error = root_error(t1);
+		if (t1 + t1_error < 0._d || t0 - t0_error > ray.tMax)
+			return false;
+		if (is_full_sphere)
+		{
+			if (t0 - t0_error > 0._d && t0 + t0_error < ray.tMax)
+				return true;
+			if (t0 + t0_error < 0._d && t1 - t1_error > 0._d && t1 + t1_error < ray.tMax)
+				return true;
+		}
+	}
+
+	maths::Decimal		t_hit;
+	maths::Point3f		p_hit;
+	maths::Decimal		phi;
+	return ObjectSpaceHit_(ray, origin_error, direction_error, t_hit, p_hit, phi);
+}
 
+
+bool
+Sphere::ObjectSpaceHit_(maths::Ray const &_ray,
+						maths::Vec3f const &_origin_error, maths::Vec3f const &_direction_error,
+						maths::Decimal &_t_hit, maths::Point3f &_p_hit, maths::Decimal &_phi) const
+{
 	// xx + yy + zz - rr = 0
 	// (ox + tdx)^2 + (oy + tdy)^2 + (oz + tdz)^2 = rr
 	// oxox + 2oxdxt + dxdxt^2 + oyoy + 2oydyt + dydyt^2 + ozoz + 2ozdzt + dzdzt^2 = rr
 	// (dxdx + dydy + dzdz)t^2 + 2(oxdx + oydy + ozdz)t + (oxox + oyoy + ozoz - rr) = 0
-	maths::REDecimal const	ox{ ray.origin.x, origin_error.x },
-							oy{ ray.origin.y, origin_error.y },
-							oz{ ray.origin.z, origin_error.z };
-	maths::REDecimal const	dx{ ray.direction.x, direction_error.x },
-							dy{ ray.direction.y, direction_error.y },
-							dz{ ray.direction.z, direction_error.z };
+	maths::REDecimal const	ox{ _ray.origin.x, _origin_error.x },
+							oy{ _ray.origin.y, _origin_error.y },
+							oz{ _ray.origin.z, _origin_error.z };
+	maths::REDecimal const	dx{ _ray.direction.x, _direction_error.x },
+							dy{ _ray.direction.y, _direction_error.y },
+							dz{ _ray.direction.z, _direction_error.z };
 	maths::REDecimal const A = dx * dx + dy * dy + dz * dz;
 	maths::REDecimal const B = maths::REDecimal(2._d) * (ox * dx + oy * dy + oz * dz);
 	maths::REDecimal const re_radius = maths::REDecimal(radius);
@@ -55,7 +187,7 @@ Sphere::Intersect(maths::Ray const &_ray,
 	if (!maths::Quadratic(A, B, C, t0, t1))
 		return false;
 
-	if (t0.UpperBound() > ray.tMax || t1.LowerBound() <= 0._d)
+	if (t0.UpperBound() > _ray.tMax || t1.LowerBound() <= 0._d)
 		return false;
 	
 	// NOTE: The way this is done feels weird to me. We want to test if t0 is valid, then t1, but
@@ -66,11 +198,11 @@ Sphere::Intersect(maths::Ray const &_ray,
 	if (tHit.LowerBound() <= 0._d)
 	{
 		tHit = t1;
-		if (tHit.UpperBound() > ray.tMax)
+		if (tHit.UpperBound() > _ray.tMax)
 			return false;
 	}
 
-	maths::Point3f		pHit{ ray(tHit.value) };
+	maths::Point3f		pHit{ _ray(tHit.value) };
 	pHit *= radius / maths::Distance(pHit, maths::zero<maths::Point3f>);
 	if (pHit.x == 0._d && pHit.y == 0._d)
 		pHit.x = 1e-5f * radius;
@@ -83,10 +215,10 @@ Sphere::Intersect(maths::Ray const &_ray,
 		phi > phi_max)
 	{
 		if (tHit == t1) return false;
-		if (t1.UpperBound() > ray.tMax) return false;
+		if (t1.UpperBound() > _ray.tMax) return false;
 		tHit = t1;
 
-		pHit = ray(tHit.value);
+		pHit = _ray(tHit.value);
 		pHit *= radius / maths::Distance(pHit, maths::zero<maths::Point3f>);
 		if (pHit.x == 0._d && pHit.y == 0._d)
 			pHit.x = 1e-5f * radius;
@@ -100,61 +232,11 @@ Sphere::Intersect(maths::Ray const &_ray,
 			return false;
 	}
 
-	maths::Decimal const theta_delta = theta_max - theta_min;
-	maths::Decimal const u = phi / phi_max;
-	maths::Decimal const theta = std::acos(maths::Clamp(pHit.z / radius, -1._d, 1._d));
-	maths::Decimal const v = (theta - theta_min) / theta_delta;
-
-	maths::Decimal const z_radius = std::sqrt(pHit.x * pHit.x + pHit.y * pHit.y);
-	maths::Decimal const inv_z_radius = 1._d / z_radius;
-	maths::Decimal const cos_phi = pHit.x * inv_z_radius;
-	maths::Decimal const sin_phi = pHit.y * inv_z_radius;
-	maths::Vec3f const dpdu(-phi_max * pHit.y, phi_max * pHit.x, 0._d);
-	maths::Vec3f const dpdv{
-		theta_delta *
-		maths::Vec3f{ pHit.z * cos_phi, pHit.z * sin_phi, -radius * std::sin(theta) }
-	};
-
-	maths::Vec3f const error_bounds = maths::gamma(5) * maths::Abs(maths::Vec3f(pHit));
-
-	// NOTE: Using differential geometry first fundamental form to compute dndu and dndv
-	//		 see Gray(1991) for a reference on differential geometry.
-	maths::Vec3f const d2pduu = -phi_max * phi_max * maths::Vec3f{ pHit.x, pHit.y, 0._d };
-	maths::Vec3f const d2pduv =
-		theta_delta * pHit.z * phi_max * maths::Vec3f{ -sin_phi, cos_phi, 0._d };
-	maths::Vec3f const d2pdvv = -theta_delta * theta_delta * (maths::Vec3f)pHit;
-
-	maths::Decimal const E = Dot(dpdu, dpdu);
-	maths::Decimal const F = Dot(dpdu, dpdv);
-	maths::Decimal const G = Dot(dpdv, dpdv);
-	maths::Vec3f const N = maths::Normalized(maths::Cross(dpdu, dpdv));
-	maths::Decimal const e = Dot(N, d2pduu);
-	maths::Decimal const f = Dot(N, d2pduv);
-	maths::Decimal const g = Dot(N, d2pdvv);
-
-	maths::Decimal const inv_EGF2 = 1._d / (E * G - F * F);
-	maths::Norm3f const dndu = maths::Norm3f{
-		(f * F - e * G) * inv_EGF2 * dpdu + (e * F - f * E) * inv_EGF2 * dpdv
-	};
-	maths::Norm3f const dndv = maths::Norm3f{
-		(g * F - f * G) * inv_EGF2 * dpdu + (f * F - g * E) * inv_EGF2 * dpdv
-	};
-
-	_hit_info = world_transform(SurfaceInteraction(
-		pHit, error_bounds, ray.time, -ray.direction, this, maths::Point2f(u, v), dpdu, dpdv, dndu, dndv
-	), maths::Transform::kForward);
-
-	_tHit = tHit.value;
-
+	_t_hit = tHit.value;
+	_p_hit = pHit;
+	_phi = phi;
 	return true;
 }
-bool
-Sphere::DoesIntersect(maths::Ray const &_ray) const
-{
-	LOG_ERROR(tools::kChannelGeneral, "Call to unimplemented Triangle::DoesIntersect. Returning false.");
-	YS_ASSERT(false);
-	return false;
-}
 
 
 maths::Decimal
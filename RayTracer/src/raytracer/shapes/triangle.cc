@@ -7,6 +7,7 @@
 #include "maths/bounds.h"
 #include "maths/transform.h"
 #include "maths/vector.h"
+#include "raytracer/hit_record.h"
 #include "raytracer/triangle_mesh_data.h"
 #include "raytracer/surface_interaction.h"
 
@@ -22,110 +23,61 @@ Triangle::Triangle(maths::Transform const &_world_transform, bool _flip_normals,
 }
 
 bool
-Triangle::Intersect(maths::Ray const &_ray,
-					maths::Decimal &_tHit,
-					SurfaceInteraction &_hit_info) const
+Triangle::Intersect(maths::Ray const &_ray, HitRecord &_hit) const
 {
 	TIMED_SCOPE(Triangle_Intersect);
 
-	maths::Point3f const	&v0 = mesh_data_.vertices[vertex_index_[0]];
-	maths::Point3f const	&v1 = mesh_data_.vertices[vertex_index_[1]];
-	maths::Point3f const	&v2 = mesh_data_.vertices[vertex_index_[2]];
-
-	maths::Point3f	p0 = v0;
-	maths::Point3f	p1 = v1;
-	maths::Point3f	p2 = v2;
-
-	/*	This is fun to read, but it's probably less efficient than an unrolled loop.
-	maths::Vector<maths::Vec3f, 3>	vertices{ maths::Vec3f(p0), maths::Vec3f(p1), maths::Vec3f(p2) };
-	vertices -= maths::Vec3f(_ray.origin);
-	*/
+	WatertightHit hit;
+	if (!IntersectFaceWatertight(mesh_data_, vertex_index_, _ray, hit))
+		return false;
 
-	maths::Vec3f const	ro = maths::Vec3f(_ray.origin);
-	p0 -= ro; p1 -= ro; p2 -= ro;
+	_hit.t = hit.t;
+	_hit.uv = maths::Point2f{ hit.b0, hit.b1 };
+	_hit.shape = this;
+	return true;
+}
 
-	uint32_t const		kz = maths::MaximumDimension(maths::Abs(_ray.direction));
-	uint32_t const		kx = kz + 1 == 3 ? 0 : kz + 1;
-	uint32_t const		ky = kx + 1 == 3 ? 0 : kx + 1;
-	maths::Vec3f const	rd = maths::Swizzle(_ray.direction, kx, ky, kz);
-	p0 = maths::Swizzle(p0, kx, ky, kz);
-	p1 = maths::Swizzle(p1, kx, ky, kz);
-	p2 = maths::Swizzle(p2, kx, ky, kz);
-
-	maths::Decimal const	sx = -rd.x / rd.z;
-	maths::Decimal const	sy = -rd.y / rd.z;
-	maths::Decimal const	sz = 1._d / rd.z;
-	maths::Vec3f const		shear{ sx, sy, 0._d };
-	p0 += shear * p0.z;
-	p1 += shear * p1.z;
-	p2 += shear * p2.z;
 
-	// Edge function : e(p, p0, p1) = (p1.x - p0.x)(p.y - p0.y) - (p.x - p0.x)(p1.y - p0.y)
-	// Returns a positive value if p is on the left side of line p0p1 and a negative value if it's
-	// on the right side
-	// Thanks to the earlier coordinate system change, p = (0, 0)
-	// (p1.x - p0.x)(-p0.y) - (-p0.x)(p1.y - p0.y)
-	// p0.y*p0.x - p1.x*p0.y - (p0.y*p0.x - p0.x*p1.y)
-	// p0.x*p1.y - p1.x*p0.y
-	maths::Decimal	e0 = p1.x*p2.y - p2.x*p1.y;
-	maths::Decimal	e1 = p2.x*p0.y - p0.x*p2.y;
-	maths::Decimal	e2 = p0.x*p1.y - p1.x*p0.y;
-	// NOTE: If any of these is zero, we don't know for sure whether we hit the triangle or not.
-	if (e0 == 0._d || e1 == 0._d || e2 == 0._d)
-		return false;
-
-	if ((e0 > 0._d || e1 > 0._d || e2 > 0._d) && (e0 < 0._d || e1 < 0._d || e2 < 0._d))
-		return false;
-	maths::Decimal const	e_sum = e0 + e1 + e2;
-	if (e_sum == 0._d)
-		return false;
+void
+Triangle::ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+									SurfaceInteraction &_hit_info) const
+{
+	ComputeFaceSurfaceInteraction(mesh_data_, vertex_index_, *this, _ray, _hit, _hit_info);
+}
 
-	p0.z *= sz; p1.z *= sz; p2.z *= sz;
-	maths::Decimal const	t_scaled = e0*p0.z + e1*p1.z + e2*p2.z;
-	if (e_sum < 0._d && (t_scaled >= 0._d || t_scaled < _ray.tMax * e_sum))
-		return false;
-	if (e_sum > 0._d && (t_scaled <= 0._d || t_scaled > _ray.tMax * e_sum))
-		return false;
 
-	maths::Decimal const	e_sum_inverse = 1._d / e_sum;
-	maths::Decimal const	b0 = e0 * e_sum_inverse;
-	maths::Decimal const	b1 = e1 * e_sum_inverse;
-	maths::Decimal const	b2 = e2 * e_sum_inverse;
-	maths::Decimal const	t = t_scaled * e_sum_inverse;
+void
+Triangle::ComputeFaceSurfaceInteraction(TriangleMeshRawData const &_mesh_data,
+										int32_t const *_vertex_index,
+										Shape const &_shape,
+										maths::Ray const &_ray,
+										HitRecord const &_hit,
+										SurfaceInteraction &_hit_info)
+{
+	TIMED_SCOPE(Triangle_ComputeSurfaceInteraction);
 
-	// Should definitely investigate more on this. 
-	// Reference is PBR, 3.9.6, Pharr et al
-	maths::Decimal const	maxXt = maths::MaximumComponent(maths::Abs(
-		maths::Vec3f{ p0.x, p1.x, p2.x }));
-	maths::Decimal const	maxYt = maths::MaximumComponent(maths::Abs(
-		maths::Vec3f{ p0.y, p1.y, p2.y }));
-	maths::Decimal const	maxZt = maths::MaximumComponent(maths::Abs(
-		maths::Vec3f{ p0.z, p1.z, p2.z }));
-	maths::Decimal const	deltaX = maths::gamma(5u) * (maxXt + maxZt);
-	maths::Decimal const	deltaY = maths::gamma(5u) * (maxYt + maxZt);
-	maths::Decimal const	deltaZ = maths::gamma(3u) * maxZt;
-	maths::Decimal const	deltaE = 2._d * (maths::gamma(2u) * maxXt * maxYt +
-											 deltaY * maxXt +
-											 deltaX * maxYt);
-	maths::Decimal const	maxE = maths::MaximumComponent(maths::Abs(
-		maths::Vec3f{ e0, e1, e2 }));
-	maths::Decimal const	deltaT = 3._d * (maths::gamma(3u) * maxE * maxZt +
-											 deltaE * maxZt +
-											 deltaZ * maxE) * maths::Abs(e_sum_inverse);
-	if (t <= deltaT)
-		return false;
+	maths::Point3f const	&v0 = _mesh_data.vertices[_vertex_index[0]];
+	maths::Point3f const	&v1 = _mesh_data.vertices[_vertex_index[1]];
+	maths::Point3f const	&v2 = _mesh_data.vertices[_vertex_index[2]];
+	maths::Decimal const	b0 = _hit.uv.x;
+	maths::Decimal const	b1 = _hit.uv.y;
+	maths::Decimal const	b2 = 1._d - b0 - b1;
+	maths::Decimal const	t = _hit.t;
 
 	maths::Vec3f			dpdu, dpdv;
-	maths::Point2f const	uv0{ uv(0) }, uv1{ uv(1) }, uv2{ uv(2) };
+	maths::Point2f const	uv0{ FaceUv(_mesh_data, _vertex_index, 0u) },
+							uv1{ FaceUv(_mesh_data, _vertex_index, 1u) },
+							uv2{ FaceUv(_mesh_data, _vertex_index, 2u) };
 	maths::Vec2f const		duv02 = uv0 - uv2, duv12 = uv1 - uv2;
 	maths::Vec3f const		dp02 = v0 - v2, dp12 = v1 - v2;
 
+	// Bounds the error of the barycentric interpolation of the hit point (PBR 3.9.6)
 	maths::Decimal const	x_abs_sum =
-		maths::Abs(b0 * p0.x) + maths::Abs(b1 * p1.x) + maths::Abs(b2 * p2.x);
+		maths::Abs(b0 * v0.x) + maths::Abs(b1 * v1.x) + maths::Abs(b2 * v2.x);
 	maths::Decimal const	y_abs_sum =
-		maths::Abs(b0 * p0.y) + maths::Abs(b1 * p1.y) + maths::Abs(b2 * p2.y);
+		maths::Abs(b0 * v0.y) + maths::Abs(b1 * v1.y) + maths::Abs(b2 * v2.y);
 	maths::Decimal const	z_abs_sum =
-		maths::Abs(b0 * p0.z) + maths::Abs(b1 * p1.z) + maths::Abs(b2 * p2.z);
+		maths::Abs(b0 * v0.z) + maths::Abs(b1 * v1.z) + maths::Abs(b2 * v2.z);
 	maths::Vec3f const error_bounds =
 		maths::gamma(7) * maths::Vec3f{ x_abs_sum, y_abs_sum, z_abs_sum };
 
@@ -148,16 +100,16 @@ Triangle::Intersect(maths::Ray const &_ray,
 		maths::Normalized(dpdu), maths::Normalized(dpdv), maths::Norm3f(0._d), maths::Norm3f(0._d)
 	};
 
-	bool const	mesh_has_normals = mesh_data_.has_normals();
-	bool const	mesh_has_tangents = mesh_data_.has_tangents();
+	bool const	mesh_has_normals = _mesh_data.has_normals();
+	bool const	mesh_has_tangents = _mesh_data.has_tangents();
 	if (mesh_has_normals || mesh_has_tangents)
 	{
 		//
 		if (mesh_has_normals)
 		{
-			maths::Norm3f const		&n0 = mesh_data_.normals[vertex_index_[0]];
-			maths::Norm3f const		&n1 = mesh_data_.normals[vertex_index_[1]];
-			maths::Norm3f const		&n2 = mesh_data_.normals[vertex_index_[2]];
+			maths::Norm3f const		&n0 = _mesh_data.normals[_vertex_index[0]];
+			maths::Norm3f const		&n1 = _mesh_data.normals[_vertex_index[1]];
+			maths::Norm3f const		&n2 = _mesh_data.normals[_vertex_index[2]];
 			shading.SetNormal(maths::Normalized(b0 * n0 + b1 * n1 + b2 * n2));
 			//
 			if (matrix_determinant != 0._d)
@@ -172,9 +124,9 @@ Triangle::Intersect(maths::Ray const &_ray,
 		if (mesh_has_tangents)
 		{
 			shading.SetDpdu(maths::Normalized(
-				b0 * mesh_data_.tangents[vertex_index_[0]] +
-				b1 * mesh_data_.tangents[vertex_index_[1]] +
-				b2 * mesh_data_.tangents[vertex_index_[2]]));
+				b0 * _mesh_data.tangents[_vertex_index[0]] +
+				b1 * _mesh_data.tangents[_vertex_index[1]] +
+				b2 * _mesh_data.tangents[_vertex_index[2]]));
 		}
 		// NOTE: I suppose this line can be moved inside the condition, but still have to check
 		shading.SetDpdv(maths::Cross(shading.normal_quick(), shading.dpdu_quick()));
@@ -195,33 +147,134 @@ Triangle::Intersect(maths::Ray const &_ray,
 		}
 		geometry_normal = maths::FaceForward(flat_normal, shading.normal_quick());
 	} // (mesh_has_normals || mesh_has_tangents)
-	else if (flip_normals ^ swaps_handedness)
+	else if (_shape.flip_normals ^ _shape.swaps_handedness)
 	{
 		geometry_normal = -geometry_normal;
 		shading.SetNormal(geometry_normal);
 	}
 
-	_tHit = t;
-
 	SurfaceInteraction::GeometryProperties const geometry{
 		geometry_normal, dpdu, dpdv, maths::Norm3f(0._d), maths::Norm3f(0._d)
 	};
 	_hit_info = SurfaceInteraction{
-		hit_point, error_bounds, t, -_ray.direction, this, hit_uv, geometry, shading
+		hit_point, error_bounds, t, -_ray.direction, &_shape, hit_uv, geometry, shading
 	};
 	//if (maths::Dot(_ray.direction, _hit_info.shading.normal) > 0._d)
 	//	return false;
-
-	return true;
 }
 
 
 bool
 Triangle::DoesIntersect(maths::Ray const &_ray) const
 {
-	LOG_ERROR(tools::kChannelGeneral, "Call to unimplemented Triangle::DoesIntersect. Returning false.");
-	YS_ASSERT(false);
-	return false;
+	TIMED_SCOPE(Triangle_DoesIntersect);
+	// Occlusion only needs the hit to exist, the surface properties are never computed.
+	WatertightHit hit;
+	return IntersectFaceWatertight(mesh_data_, vertex_index_, _ray, hit);
+}
+
+
+bool
+Triangle::IntersectFaceWatertight(TriangleMeshRawData const &_mesh_data,
+								  int32_t const *_vertex_index,
+								  maths::Ray const &_ray, WatertightHit &_hit)
+{
+	maths::Point3f const	&v0 = _mesh_data.vertices[_vertex_index[0]];
+	maths::Point3f const	&v1 = _mesh_data.vertices[_vertex_index[1]];
+	maths::Point3f const	&v2 = _mesh_data.vertices[_vertex_index[2]];
+
+	maths::Point3f	p0 = v0;
+	maths::Point3f	p1 = v1;
+	maths::Point3f	p2 = v2;
+
+	/*	This is fun to read, but it's probably less efficient than an unrolled loop.
+	maths::Vector<maths::Vec3f, 3>	vertices{ maths::Vec3f(p0), maths::Vec3f(p1), maths::Vec3f(p2) };
+	vertices -= maths::Vec3f(_ray.origin);
+	*/
+
+	maths::Vec3f const	ro = maths::Vec3f(_ray.origin);
+	p0 -= ro; p1 -= ro; p2 -= ro;
+
+	// The permutation and shear only depend on the ray, they are computed with it
+	maths::Ray::Shear const	&ray_shear = _ray.shear;
+	p0 = maths::Swizzle(p0, ray_shear.kx, ray_shear.ky, ray_shear.kz);
+	p1 = maths::Swizzle(p1, ray_shear.kx, ray_shear.ky, ray_shear.kz);
+	p2 = maths::Swizzle(p2, ray_shear.kx, ray_shear.ky, ray_shear.kz);
+
+	maths::Decimal const	sz = ray_shear.sz;
+	maths::Vec3f const		shear{ ray_shear.sx, ray_shear.sy, 0._d };
+	p0 += shear * p0.z;
+	p1 += shear * p1.z;
+	p2 += shear * p2.z;
+
+	// Edge function : e(p, p0, p1) = (p1.x - p0.x)(p.y - p0.y) - (p.x - p0.x)(p1.y - p0.y)
+	// Returns a positive value if p is on the left side of line p0p1 and a negative value if it's
+	// on the right side
+	// Thanks to the earlier coordinate system change, p = (0, 0)
+	// (p1.x - p0.x)(-p0.y) - (-p0.x)(p1.y - p0.y)
+	// p0.y*p0.x - p1.x*p0.y - (p0.y*p0.x - p0.x*p1.y)
+	// p0.x*p1.y - p1.x*p0.y
+	maths::Decimal	e0 = p1.x*p2.y - p2.x*p1.y;
+	maths::Decimal	e1 = p2.x*p0.y - p0.x*p2.y;
+	maths::Decimal	e2 = p0.x*p1.y - p1.x*p0.y;
+#ifndef YS_DECIMAL_IS_DOUBLE
+	// A zero edge function may only be a rounded small value, its sign is computed again in
+	// double precision where the products are exact. Rays through a shared edge or vertex then
+	// hit at least one of the faces around it.
+	if (e0 == 0._d || e1 == 0._d || e2 == 0._d)
+	{
+		e0 = static_cast<maths::Decimal>(static_cast<double>(p1.x) * static_cast<double>(p2.y) -
+										  static_cast<double>(p2.x) * static_cast<double>(p1.y));
+		e1 = static_cast<maths::Decimal>(static_cast<double>(p2.x) * static_cast<double>(p0.y) -
+										  static_cast<double>(p0.x) * static_cast<double>(p2.y));
+		e2 = static_cast<maths::Decimal>(static_cast<double>(p0.x) * static_cast<double>(p1.y) -
+										  static_cast<double>(p1.x) * static_cast<double>(p0.y));
+	}
+#endif // !YS_DECIMAL_IS_DOUBLE
+
+	if ((e0 > 0._d || e1 > 0._d || e2 > 0._d) && (e0 < 0._d || e1 < 0._d || e2 < 0._d))
+		return false;
+	maths::Decimal const	e_sum = e0 + e1 + e2;
+	if (e_sum == 0._d)
+		return false;
+
+	p0.z *= sz; p1.z *= sz; p2.z *= sz;
+	maths::Decimal const	t_scaled = e0*p0.z + e1*p1.z + e2*p2.z;
+	if (e_sum < 0._d && (t_scaled >= 0._d || t_scaled < _ray.tMax * e_sum))
+		return false;
+	if (e_sum > 0._d && (t_scaled <= 0._d || t_scaled > _ray.tMax * e_sum))
+		return false;
+
+	maths::Decimal const	e_sum_inverse = 1._d / e_sum;
+	maths::Decimal const	t = t_scaled * e_sum_inverse;
+
+	// Should definitely investigate more on this. 
+	// Reference is PBR, 3.9.6, Pharr et al
+	maths::Decimal const	maxXt = maths::MaximumComponent(maths::Abs(
+		maths::Vec3f{ p0.x, p1.x, p2.x }));
+	maths::Decimal const	maxYt = maths::MaximumComponent(maths::Abs(
+		maths::Vec3f{ p0.y, p1.y, p2.y }));
+	maths::Decimal const	maxZt = maths::MaximumComponent(maths::Abs(
+		maths::Vec3f{ p0.z, p1.z, p2.z }));
+	maths::Decimal const	deltaX = maths::gamma(5u) * (maxXt + maxZt);
+	maths::Decimal const	deltaY = maths::gamma(5u) * (maxYt + maxZt);
+	maths::Decimal const	deltaZ = maths::gamma(3u) * maxZt;
+	maths::Decimal const	deltaE = 2._d * (maths::gamma(2u) * maxXt * maxYt +
+											 deltaY * maxXt +
+											 deltaX * maxYt);
+	maths::Decimal const	maxE = maths::MaximumComponent(maths::Abs(
+		maths::Vec3f{ e0, e1, e2 }));
+	maths::Decimal const	deltaT = 3._d * (maths::gamma(3u) * maxE * maxZt +
+											 deltaE * maxZt +
+											 deltaZ * maxE) * maths::Abs(e_sum_inverse);
+	if (t <= deltaT)
+		return false;
+
+	_hit.b0 = e0 * e_sum_inverse;
+	_hit.b1 = e1 * e_sum_inverse;
+	_hit.b2 = e2 * e_sum_inverse;
+	_hit.t = t;
+	return true;
 }
 
 
@@ -270,9 +323,16 @@ Triangle::SampleSurface(maths::Vec2f const &_ksi) const
 maths::Decimal
 Triangle::Area() const
 {
-	maths::Point3f const	&p0 = mesh_data_.vertices[vertex_index_[0]];
-	maths::Point3f const	&p1 = mesh_data_.vertices[vertex_index_[1]];
-	maths::Point3f const	&p2 = mesh_data_.vertices[vertex_index_[2]];
+	return FaceArea(mesh_data_, vertex_index_);
+}
+
+
+maths::Decimal
+Triangle::FaceArea(TriangleMeshRawData const &_mesh_data, int32_t const *_vertex_index)
+{
+	maths::Point3f const	&p0 = _mesh_data.vertices[_vertex_index[0]];
+	maths::Point3f const	&p1 = _mesh_data.vertices[_vertex_index[1]];
+	maths::Point3f const	&p2 = _mesh_data.vertices[_vertex_index[2]];
 	return .5_d * maths::Length(maths::Cross(p1 - p0, p2 - p0));
 }
 
@@ -289,22 +349,95 @@ Triangle::ObjectBounds() const
 }
 maths::Bounds3f
 Triangle::WorldBounds() const
+{
+	return FaceBounds(mesh_data_, vertex_index_);
+}
+
+
+maths::Bounds3f
+Triangle::FaceBounds(TriangleMeshRawData const &_mesh_data, int32_t const *_vertex_index)
 {
 	return maths::Union(
 		maths::Bounds3f{
-			mesh_data_.vertices[vertex_index_[0]],
-			mesh_data_.vertices[vertex_index_[1]]
+			_mesh_data.vertices[_vertex_index[0]],
+			_mesh_data.vertices[_vertex_index[1]]
 		},
-		mesh_data_.vertices[vertex_index_[2]]
+		_mesh_data.vertices[_vertex_index[2]]
 	);
 }
 
+
+maths::Bounds3f
+Triangle::ClippedWorldBounds(maths::Bounds3f const &_clip) const
+{
+	return ClippedFaceBounds(mesh_data_, vertex_index_, _clip);
+}
+
+
+maths::Bounds3f
+Triangle::ClippedFaceBounds(TriangleMeshRawData const &_mesh_data, int32_t const *_vertex_index,
+							maths::Bounds3f const &_clip)
+{
+	// Sutherland-Hodgman clipping against the six planes of _clip, each of them adds one vertex
+	// to the polygon at most.
+	constexpr uint32_t	kMaxVertexCount = 9u;
+	maths::Point3f		polygons[2][kMaxVertexCount];
+	uint32_t			vertex_count = 3u;
+	uint32_t			current = 0u;
+	for (uint32_t i = 0u; i < 3u; ++i)
+		polygons[current][i] = _mesh_data.vertices[_vertex_index[i]];
+	for (uint32_t plane = 0u; plane < 6u && vertex_count > 0u; ++plane)
+	{
+		uint32_t const			axis = plane / 2u;
+		bool const				is_max_plane = (plane % 2u) == 1u;
+		maths::Decimal const	position = is_max_plane ? _clip.max[axis] : _clip.min[axis];
+		auto const				is_inside = [axis, is_max_plane, position](maths::Point3f const &_p) {
+			return is_max_plane ? (_p[axis] <= position) : (_p[axis] >= position);
+		};
+		maths::Point3f const	*const input = polygons[current];
+		maths::Point3f			*const output = polygons[current ^ 1u];
+		uint32_t				output_count = 0u;
+		for (uint32_t i = 0u; i < vertex_count; ++i)
+		{
+			maths::Point3f const	&previous = input[(i + vertex_count - 1u) % vertex_count];
+			maths::Point3f const	&vertex = input[i];
+			if (is_inside(vertex) != is_inside(previous))
+			{
+				maths::Decimal const	t = (position - previous[axis]) / (vertex[axis] - previous[axis]);
+				maths::Point3f			crossing = previous + (vertex - previous) * t;
+				crossing[axis] = position;
+				output[output_count++] = crossing;
+			}
+			if (is_inside(vertex))
+				output[output_count++] = vertex;
+		}
+		YS_ASSERT(output_count <= kMaxVertexCount);
+		vertex_count = output_count;
+		current ^= 1u;
+	}
+	if (vertex_count == 0u)
+		return maths::Bounds3f{};
+	maths::Bounds3f		result{ polygons[current][0] };
+	for (uint32_t i = 1u; i < vertex_count; ++i)
+		result = maths::Union(result, polygons[current][i]);
+	// Crossings are rounded, they may land slightly outside of the other planes
+	return maths::Intersect(result, _clip);
+}
+
 maths::Point2f
 Triangle::uv(uint32_t _index) const
+{
+	return FaceUv(mesh_data_, vertex_index_, _index);
+}
+
+
+maths::Point2f
+Triangle::FaceUv(TriangleMeshRawData const &_mesh_data, int32_t const *_vertex_index,
+				 uint32_t _index)
 {
 	YS_ASSERT(_index < 3u);
-	if (mesh_data_.has_uvs())
-		return mesh_data_.uvs[vertex_index_[_index]];
+	if (_mesh_data.has_uvs())
+		return _mesh_data.uvs[_vertex_index[_index]];
 	else
 		return maths::Point2f(_index < 1u ? 0._d : 1._d, _index < 2u ? 0._d : 1._d);
 }
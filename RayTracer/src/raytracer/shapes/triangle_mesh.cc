@@ -1,14 +1,13 @@
 #include "raytracer/shapes/triangle_mesh.h"
 
-#include <numeric>
-
 #include "assimp/Importer.hpp"
 #include "assimp/postprocess.h"
 #include "assimp/scene.h"
 
 #include "maths/ray.h"
 #include "maths/transform.h"
-#include "raytracer/shapes/triangle.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/ray_packet.h"
 #include "raytracer/surface_interaction.h"
 
 
@@ -41,29 +40,45 @@ TriangleMesh<InstancingPolicy>::TriangleMesh(
 template <>
 bool
 TriangleMesh<InstancingPolicyClass::Transformed>::Intersect(maths::Ray const &_ray,
-															maths::Decimal &_tHit,
-															SurfaceInteraction &_hit_info) const
+															HitRecord &_hit) const
 {
 	maths::Ray bvh_ray{ _ray };
-	bool const result = data_.bvh().Intersect(bvh_ray, _hit_info);
-	_tHit = (result) ? bvh_ray.tMax : _tHit;
-	return result;
+	if (!data_.Intersect(bvh_ray, _hit))
+		return false;
+	_hit.shape = this;
+	return true;
 }
 
 template <>
 bool
 TriangleMesh<InstancingPolicyClass::SharedSource>::Intersect(maths::Ray const &_ray,
-															 maths::Decimal &_tHit,
-															 SurfaceInteraction &_hit_info) const
+															 HitRecord &_hit) const
 {
 	maths::Ray bvh_ray{ world_transform(_ray, maths::Transform::kInverse) };
-	bool const result = data_.bvh().Intersect(bvh_ray, _hit_info);
-	if (result)
-	{
-		_tHit = bvh_ray.tMax;
-		_hit_info = world_transform(_hit_info, maths::Transform::kForward);
-	}
-	return result;
+	if (!data_.Intersect(bvh_ray, _hit))
+		return false;
+	_hit.shape = this;
+	return true;
+}
+
+
+template <>
+void
+TriangleMesh<InstancingPolicyClass::Transformed>::ComputeSurfaceInteraction(
+	maths::Ray const &_ray, HitRecord const &_hit, SurfaceInteraction &_hit_info) const
+{
+	data_.ComputeSurfaceInteraction(_ray, _hit, *this, _hit_info);
+}
+
+template <>
+void
+TriangleMesh<InstancingPolicyClass::SharedSource>::ComputeSurfaceInteraction(
+	maths::Ray const &_ray, HitRecord const &_hit, SurfaceInteraction &_hit_info) const
+{
+	// The hit distance is the same along the object space ray, which isn't normalized again
+	maths::Ray const object_ray{ world_transform(_ray, maths::Transform::kInverse) };
+	data_.ComputeSurfaceInteraction(object_ray, _hit, *this, _hit_info);
+	_hit_info = world_transform(_hit_info, maths::Transform::kForward);
 }
 
 
@@ -71,14 +86,50 @@ template <>
 bool
 TriangleMesh<InstancingPolicyClass::Transformed>::DoesIntersect(maths::Ray const &_ray) const
 {
-	return data_.bvh().DoesIntersect(_ray);
+	return data_.DoesIntersect(_ray);
 }
 
 template <>
 bool
 TriangleMesh<InstancingPolicyClass::SharedSource>::DoesIntersect(maths::Ray const &_ray) const
 {
-	return data_.bvh().DoesIntersect(world_transform(_ray, maths::Transform::kInverse));
+	return data_.DoesIntersect(world_transform(_ray, maths::Transform::kInverse));
+}
+
+
+template <>
+uint32_t
+TriangleMesh<InstancingPolicyClass::Transformed>::IntersectPacket(RayPacket &_packet,
+																  uint32_t _ray_mask) const
+{
+	uint32_t const hit_mask = data_.IntersectPacket(_packet, _ray_mask);
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+		if ((hit_mask & (1u << i)) != 0u)
+			_packet.hits[i].shape = this;
+	return hit_mask;
+}
+
+template <>
+uint32_t
+TriangleMesh<InstancingPolicyClass::SharedSource>::IntersectPacket(RayPacket &_packet,
+																   uint32_t _ray_mask) const
+{
+	// Hits are found along the object space rays, they only replace the records they beat
+	RayPacket object_packet;
+	object_packet.size = _packet.size;
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+		if ((_ray_mask & (1u << i)) != 0u)
+			object_packet.rays[i] = world_transform(_packet.rays[i], maths::Transform::kInverse);
+	uint32_t const hit_mask = data_.IntersectPacket(object_packet, _ray_mask);
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+	{
+		if ((hit_mask & (1u << i)) == 0u)
+			continue;
+		_packet.rays[i].tMax = object_packet.rays[i].tMax;
+		_packet.hits[i] = object_packet.hits[i];
+		_packet.hits[i].shape = this;
+	}
+	return hit_mask;
 }
 
 
@@ -86,11 +137,7 @@ template <typename InstancingPolicy>
 maths::Decimal
 TriangleMesh<InstancingPolicy>::Area() const
 {
-	TriangleMeshData::TriangleContainer_t const &triangles = data_.triangles();
-	return std::accumulate(triangles.cbegin(), triangles.cend(), 0._d,
-						   [](maths::Decimal const &_acc, Triangle const* const _triangle) {
-		return _acc + _triangle->Area();
-	});
+	return data_.Area();
 }
 
 
@@ -0,0 +1,131 @@
+#include "raytracer/tile_scheduler.h"
+
+#include <algorithm>
+#include <numeric>
+
+#include "boost/numeric/conversion/cast.hpp"
+
+#include "common_macros.h"
+#include "core/profiler.h"
+#include "maths/maths.h"
+#include "globals.h"
+
+
+namespace raytracer {
+
+
+TileScheduler::TileScheduler(CostContainer_t const &_tile_costs, uint32_t const _worker_count) :
+	tile_costs_{ _tile_costs },
+	queues_{}
+{
+	YS_ASSERT(_worker_count > 0u);
+	queues_.reserve(_worker_count);
+	for (uint32_t worker_index = 0u; worker_index < _worker_count; ++worker_index)
+	{
+		queues_.emplace_back(std::make_unique<WorkerQueue>());
+	}
+	//
+	std::vector<size_t> sorted_tiles(tile_costs_.size());
+	std::iota(sorted_tiles.begin(), sorted_tiles.end(), size_t{ 0u });
+	std::stable_sort(sorted_tiles.begin(), sorted_tiles.end(),
+					 [this](size_t const _lhs, size_t const _rhs) {
+						 return tile_costs_[_lhs] > tile_costs_[_rhs];
+					 });
+	CostContainer_t queue_costs(_worker_count, Cost_t{ 0u });
+	for (size_t const tile_index : sorted_tiles)
+	{
+		CostContainer_t::iterator const cheapest_queue =
+			std::min_element(queue_costs.begin(), queue_costs.end());
+		size_t const queue_index = boost::numeric_cast<size_t>(
+			std::distance(queue_costs.begin(), cheapest_queue));
+		// NOTE: a zero cost still counts as one unit, or every unmeasured tile would pile up
+		//		 in the first queue
+		*cheapest_queue += maths::Max(tile_costs_[tile_index], Cost_t{ 1u });
+		queues_[queue_index]->tiles.push_back(tile_index);
+	}
+}
+
+
+size_t
+TileScheduler::NextTile(uint32_t const _worker_index)
+{
+	YS_ASSERT(_worker_index < queues_.size());
+	size_t result = PopFront_(*queues_[_worker_index]);
+	if (result == kInvalidTile)
+	{
+		result = StealLargest_(_worker_index);
+	}
+	return result;
+}
+
+
+uint64_t
+TileScheduler::stolen_count(uint32_t const _worker_index) const
+{
+	YS_ASSERT(_worker_index < queues_.size());
+	return queues_[_worker_index]->stolen_count;
+}
+
+
+size_t
+TileScheduler::PopFront_(WorkerQueue &_queue)
+{
+	size_t result = kInvalidTile;
+	_queue.lock.Acquire();
+	if (!_queue.tiles.empty())
+	{
+		result = _queue.tiles.front();
+		_queue.tiles.pop_front();
+	}
+	_queue.lock.Release();
+	return result;
+}
+
+
+size_t
+TileScheduler::StealLargest_(uint32_t const _thief_index)
+{
+	TIMED_SCOPE(TileScheduler_StealLargest);
+	// Queues are never refilled, a scan that only finds empty queues means the frame is done.
+	// A victim may be emptied between the scan and the pop, in which case we scan again.
+	size_t result = kInvalidTile;
+	bool found_work = true;
+	while (result == kInvalidTile && found_work)
+	{
+		found_work = false;
+		Cost_t largest_cost = 0u;
+		size_t victim_index = 0u;
+		for (size_t queue_index = 0u; queue_index < queues_.size(); ++queue_index)
+		{
+			if (queue_index == _thief_index)
+			{
+				continue;
+			}
+			WorkerQueue &queue = *queues_[queue_index];
+			queue.lock.Acquire();
+			if (!queue.tiles.empty())
+			{
+				Cost_t const front_cost = tile_costs_[queue.tiles.front()];
+				if (!found_work || front_cost > largest_cost)
+				{
+					largest_cost = front_cost;
+					victim_index = queue_index;
+				}
+				found_work = true;
+			}
+			queue.lock.Release();
+		}
+		if (found_work)
+		{
+			result = PopFront_(*queues_[victim_index]);
+		}
+	}
+	if (result != kInvalidTile)
+	{
+		++(queues_[_thief_index]->stolen_count);
+	}
+	return result;
+}
+
+
+} // namespace raytracer
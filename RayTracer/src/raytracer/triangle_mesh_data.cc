@@ -4,8 +4,12 @@
 #include <numeric>
 #include <sstream>
 
+#include "globals.h"
+#include "core/logger.h"
 #include "maths/transform.h"
+#include "raytracer/hit_record.h"
 #include "raytracer/primitive.h"
+#include "raytracer/ray_packet.h"
 #include "raytracer/shapes/triangle.h"
 
 
@@ -44,102 +48,241 @@ TriangleMeshRawData::TriangleMeshRawData(int32_t _triangle_count,
 }
 
 
-TriangleMeshRawData const &
+TriangleMeshRawData &
 InstancingPolicyClass::Transformed::GetRawData(TriangleMeshRawData const &_base,
 											   maths::Transform const &_world_transform,
 											   core::MemoryRegion &_mem_region)
 {
-	TriangleMeshRawData::VerticesContainer_t transformed_vertices{};
-	TriangleMeshRawData::NormalsContainer_t transformed_normals{};
-	TriangleMeshRawData::TangentsContainer_t transformed_tangents{};
-	TriangleMeshRawData::UvsContainer_t transformed_uvs{};
+	// TODO: uvs are not transformed by this operation, they shouldn't be copied but shared
+	TriangleMeshRawData *const transformed_data =
+		new (_mem_region) TriangleMeshRawData{ _base.triangle_count,
+											   _base.indices,
+											   _base.vertices,
+											   &_base.normals,
+											   &_base.tangents,
+											   &_base.uvs };
+	TransformRawData(_base, _world_transform, *transformed_data);
+	return *transformed_data;
+}
 
-	transformed_vertices.reserve(_base.vertices.size());
+
+void
+InstancingPolicyClass::Transformed::TransformRawData(TriangleMeshRawData const &_base,
+													 maths::Transform const &_world_transform,
+													 TriangleMeshRawData &_target)
+{
+	YS_ASSERT(_target.vertices.size() == _base.vertices.size());
+	YS_ASSERT(_target.normals.size() == _base.normals.size());
+	YS_ASSERT(_target.tangents.size() == _base.tangents.size());
 	std::transform(_base.vertices.cbegin(), _base.vertices.cend(),
-				   std::back_inserter(transformed_vertices), [&_world_transform]
+				   _target.vertices.begin(), [&_world_transform]
 				   (maths::Point3f const &_vertex) {
 					   return _world_transform(_vertex);
 				   });
 	std::transform(_base.normals.cbegin(), _base.normals.cend(),
-				   std::back_inserter(transformed_normals), [&_world_transform]
+				   _target.normals.begin(), [&_world_transform]
 				   (maths::Norm3f const &_normal) {
 					   return _world_transform(_normal);
 				   });
 	std::transform(_base.tangents.cbegin(), _base.tangents.cend(),
-				   std::back_inserter(transformed_tangents), [&_world_transform]
+				   _target.tangents.begin(), [&_world_transform]
 				   (maths::Vec3f const &_tangent) {
 					   return _world_transform(_tangent);
 				   });
-
-	// TODO: uvs are not transformed by this operation, they shouldn't be copied but shared
-	TriangleMeshRawData const* const transformed_data =
-		new (_mem_region) TriangleMeshRawData{ _base.triangle_count,
-											   _base.indices,
-											   transformed_vertices,
-											   &transformed_normals,
-											   &transformed_tangents,
-											   &_base.uvs };
-
-	return *transformed_data;
+	_target.bounds = std::accumulate(_target.vertices.cbegin(), _target.vertices.cend(),
+									 maths::Bounds3f{},
+									 [](maths::Bounds3f const &_acc, maths::Point3f const &_vertex) {
+										 return maths::Union(_acc, _vertex);
+									 });
 }
 
 
-TriangleMeshData::TriangleMeshData(maths::Transform const &_world_transform,
-								   bool _flip_normals,
-								   TriangleMeshRawData const &_mesh_raw_data,
+TriangleMeshData::TriangleMeshData(TriangleMeshRawData const &_mesh_raw_data,
+								   uint32_t _bvh_node_width,
+								   bool _bvh_quantized_nodes,
+								   BvhAccelerator::BuildMethod _bvh_build_method,
+								   float _bvh_duplication_budget,
+								   std::string const &_bvh_cache_file,
 								   InstancingPolicyClass::SharedSource const &) :
 	mem_region_{},
+	base_data_{ &_mesh_raw_data },
+	world_data_{ nullptr },
 	data_source_{ _mesh_raw_data },
-	triangles_{ MakeTriangles_(_world_transform, _flip_normals, data_source_, mem_region_) },
-	bvh_{ MakePrimitives_(triangles_, mem_region_), kBvhNodeSize }
-{}
+	face_source_{ data_source_ },
+	bvh_{ face_source_, kBvhNodeSize,
+		  _bvh_node_width, _bvh_quantized_nodes, _bvh_build_method, _bvh_duplication_budget,
+		  _bvh_cache_file },
+	records_{}
+{
+	BuildRecords_();
+	LogMemoryFootprint_();
+}
 
 
 TriangleMeshData::TriangleMeshData(maths::Transform const &_world_transform,
-								   bool _flip_normals,
 								   TriangleMeshRawData const &_mesh_raw_data,
+								   uint32_t _bvh_node_width,
+								   bool _bvh_quantized_nodes,
+								   BvhAccelerator::BuildMethod _bvh_build_method,
+								   float _bvh_duplication_budget,
+								   std::string const &_bvh_cache_file,
 								   InstancingPolicyClass::Transformed const &) :
 	mem_region_{},
-	data_source_{ InstancingPolicyClass::Transformed::GetRawData(_mesh_raw_data,
+	base_data_{ &_mesh_raw_data },
+	world_data_{ &InstancingPolicyClass::Transformed::GetRawData(_mesh_raw_data,
 																 _world_transform,
 																 mem_region_) },
-	triangles_{ MakeTriangles_(_world_transform, _flip_normals, data_source_, mem_region_) },
-	bvh_{ MakePrimitives_(triangles_, mem_region_), kBvhNodeSize }
-{}
+	data_source_{ *world_data_ },
+	face_source_{ data_source_ },
+	bvh_{ face_source_, kBvhNodeSize,
+		  _bvh_node_width, _bvh_quantized_nodes, _bvh_build_method, _bvh_duplication_budget,
+		  _bvh_cache_file },
+	records_{}
+{
+	BuildRecords_();
+	LogMemoryFootprint_();
+}
 
 
-TriangleMeshData::TriangleContainer_t
-TriangleMeshData::MakeTriangles_(maths::Transform const &_world_transform,
-								 bool _flip_normals,
-								 TriangleMeshRawData const &_raw_data,
-								 core::MemoryRegion &_mem_region)
+uint32_t
+TriangleMeshData::SetWorldTransform(maths::Transform const &_world_transform)
 {
-	TriangleContainer_t result{};
-	result.reserve(_raw_data.triangle_count);
-	for (int32_t face_index = 0; face_index < _raw_data.triangle_count; ++face_index)
+	TIMED_SCOPE(TriangleMeshData_SetWorldTransform);
+	// Shared sources are placed by their TriangleMesh, only a pre-transformed mesh can move
+	if (world_data_ == nullptr)
 	{
-		result.emplace_back(new (_mem_region)
-							raytracer::Triangle(_world_transform,
-												_flip_normals,
-												_raw_data,
-												face_index));
+		LOG_ERROR(tools::kChannelGeneral, "Only single instance triangle meshes can be moved.");
+		return 0u;
 	}
-	return result;
+	// The BVH reads the face bounds from world_data_, moving its vertices moves them as well
+	InstancingPolicyClass::Transformed::TransformRawData(*base_data_, _world_transform,
+														 *world_data_);
+	uint32_t const rebuilt_count = bvh_.Update();
+	BuildRecords_();
+	return rebuilt_count;
+}
+
+
+bool
+TriangleMeshData::Intersect(maths::Ray &_ray, HitRecord &_hit) const
+{
+	if (!bvh_.Intersect(_ray, records_, _hit))
+		return false;
+	_hit.index = records_.face_index(_hit.index);
+	return true;
+}
+
+
+bool
+TriangleMeshData::DoesIntersect(maths::Ray const &_ray) const
+{
+	return bvh_.DoesIntersect(_ray, records_);
+}
+
+
+uint32_t
+TriangleMeshData::IntersectPacket(RayPacket &_packet, uint32_t _ray_mask) const
+{
+	uint32_t const hit_mask = bvh_.IntersectPacket(_packet, records_, _ray_mask);
+	for (uint32_t i = 0u; i < _packet.size; ++i)
+		if ((hit_mask & (1u << i)) != 0u)
+			_packet.hits[i].index = records_.face_index(_packet.hits[i].index);
+	return hit_mask;
 }
 
 
-BvhAccelerator::PrimitiveArray_t
-TriangleMeshData::MakePrimitives_(TriangleContainer_t const &_triangles,
-								  core::MemoryRegion &_mem_region)
+void
+TriangleMeshData::ComputeSurfaceInteraction(maths::Ray const &_ray, HitRecord const &_hit,
+											Shape const &_shape,
+											SurfaceInteraction &_hit_info) const
 {
-	BvhAccelerator::PrimitiveArray_t result{};
-	result.reserve(_triangles.size());
-	std::transform(_triangles.cbegin(), _triangles.cend(),
-				   std::back_inserter(result), [&_mem_region] (Triangle const* const _triangle) {
-		return new (_mem_region) GeometryPrimitive(*static_cast<Shape const*>(_triangle));
-	});
+	YS_ASSERT(_hit.index < static_cast<uint32_t>(data_source_.triangle_count));
+	int32_t const *const vertex_index = &data_source_.indices[
+		TriangleMeshRawData::IndexOffset(static_cast<int32_t>(_hit.index))];
+	Triangle::ComputeFaceSurfaceInteraction(data_source_, vertex_index, _shape, _ray, _hit,
+											_hit_info);
+}
+
+
+maths::Decimal
+TriangleMeshData::Area() const
+{
+	maths::Decimal result = 0._d;
+	for (int32_t face_index = 0; face_index < data_source_.triangle_count; ++face_index)
+		result += Triangle::FaceArea(data_source_,
+			&data_source_.indices[TriangleMeshRawData::IndexOffset(face_index)]);
 	return result;
 }
 
 
+uint32_t
+TriangleMeshData::FaceSource::primitive_count() const
+{
+	return static_cast<uint32_t>(raw_data_.triangle_count);
+}
+
+
+maths::Bounds3f
+TriangleMeshData::FaceSource::PrimitiveBounds(uint32_t _primitive_index) const
+{
+	return Triangle::FaceBounds(raw_data_,
+		&raw_data_.indices[TriangleMeshRawData::IndexOffset(static_cast<int32_t>(_primitive_index))]);
+}
+
+
+maths::Bounds3f
+TriangleMeshData::FaceSource::ClippedPrimitiveBounds(uint32_t _primitive_index,
+													 maths::Bounds3f const &_clip) const
+{
+	return Triangle::ClippedFaceBounds(raw_data_,
+		&raw_data_.indices[TriangleMeshRawData::IndexOffset(static_cast<int32_t>(_primitive_index))],
+		_clip);
+}
+
+
+void
+TriangleMeshData::BuildRecords_()
+{
+	// The primitives of the BVH are the faces, its reference indices are face indices
+	records_.Build(data_source_, bvh_.reference_primitive_indices());
+}
+
+
+void
+TriangleMeshData::LogMemoryFootprint_() const
+{
+	// Per triangle : the BVH nodes and references, and the records. The baseline is the same
+	// tree with binary unquantized nodes, and a Triangle and a GeometryPrimitive per face
+	// instead of the records, along with a pointer to each of them.
+	size_t const triangle_count = static_cast<size_t>(data_source_.triangle_count);
+	if (triangle_count == 0u)
+		return;
+	BvhAccelerator::Statistics const statistics = bvh_.ComputeStatistics();
+	double const per_triangle = 1. / static_cast<double>(triangle_count);
+	double const face_object_bytes_per_triangle = static_cast<double>(sizeof(Triangle) +
+		sizeof(GeometryPrimitive) + sizeof(Triangle const*) + sizeof(Primitive const*));
+	double const node_bytes_per_triangle =
+		static_cast<double>(statistics.node_memory_size) * per_triangle;
+	double const binary_node_bytes_per_triangle =
+		static_cast<double>(statistics.binary_node_memory_size) * per_triangle;
+	double const reference_bytes_per_triangle =
+		static_cast<double>(statistics.reference_memory_size) * per_triangle;
+	double const record_bytes_per_triangle =
+		static_cast<double>(records_.memory_size()) * per_triangle;
+	std::stringstream message{};
+	message << "Triangle mesh acceleration data : " << triangle_count << " triangles, " <<
+		(node_bytes_per_triangle + reference_bytes_per_triangle + record_bytes_per_triangle) <<
+		" bytes per triangle (BVH" << bvh_.node_width() <<
+		(bvh_.quantized_nodes() ? " quantized" : "") << " nodes " << node_bytes_per_triangle <<
+		", references " << reference_bytes_per_triangle <<
+		", records " << record_bytes_per_triangle << "), baseline " <<
+		(binary_node_bytes_per_triangle + reference_bytes_per_triangle +
+		 face_object_bytes_per_triangle) <<
+		" bytes per triangle (BVH2 nodes " << binary_node_bytes_per_triangle <<
+		", references " << reference_bytes_per_triangle <<
+		", per face objects " << face_object_bytes_per_triangle << ")";
+	LOG_INFO(tools::kChannelGeneral, message.str());
+}
+
+
 } // namespace raytracer
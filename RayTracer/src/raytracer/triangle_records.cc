@@ -0,0 +1,266 @@
+#include "raytracer/triangle_records.h"
+
+#include <emmintrin.h>
+#include <limits>
+
+#include "common_macros.h"
+#include "globals.h"
+#include "maths/ray.h"
+#include "maths/vector.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/shapes/triangle.h"
+#include "raytracer/triangle_mesh_data.h"
+
+
+namespace raytracer {
+
+
+namespace {
+
+#ifdef YS_DECIMAL_IS_DOUBLE
+// Relative error of the single precision edge functions, from the rounding of the vertices, of
+// the ray and of the operations of the test, twice Higham's bound for safety. It applies to the
+// sum of the magnitudes of the two products of each edge function.
+constexpr float		kFloatEpsilon = std::numeric_limits<float>::epsilon() * .5f;
+constexpr float		kEdgeErrorFactor = 2.f * (17.f * kFloatEpsilon) / (1.f - 17.f * kFloatEpsilon);
+#endif // YS_DECIMAL_IS_DOUBLE
+
+} // namespace
+
+
+TriangleRecords::TriangleRecords() :
+	vertices_{},
+	face_indices_{},
+	raw_data_{ nullptr }
+{}
+
+
+void
+TriangleRecords::Build(TriangleMeshRawData const &_raw_data,
+					   std::vector<uint32_t> const &_reference_faces)
+{
+	TIMED_SCOPE(TriangleRecords_Build);
+	size_t const	record_count = _reference_faces.size();
+	size_t const	padded_count = record_count + kLaneCount - 1u;
+	for (uint32_t vertex = 0u; vertex < 3u; ++vertex)
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+			vertices_[vertex][axis].assign(padded_count, 0.f);
+	face_indices_ = _reference_faces;
+	raw_data_ = &_raw_data;
+
+	for (size_t i = 0u; i < record_count; ++i)
+	{
+		int32_t const *const	vertex_index = &_raw_data.indices[
+			TriangleMeshRawData::IndexOffset(static_cast<int32_t>(_reference_faces[i]))];
+		for (uint32_t vertex = 0u; vertex < 3u; ++vertex)
+			for (uint32_t axis = 0u; axis < 3u; ++axis)
+				vertices_[vertex][axis][i] =
+					static_cast<float>(_raw_data.vertices[vertex_index[vertex]][axis]);
+	}
+}
+
+
+bool
+TriangleRecords::IntersectLeaf(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+							   HitRecord &_hit) const
+{
+	bool	hit = false;
+	for (uint32_t group = _first; group < _first + _count; group += kLaneCount)
+	{
+		maths::Decimal	t[kLaneCount], u[kLaneCount], v[kLaneCount];
+		uint32_t const	group_count = maths::Min(kLaneCount, _first + _count - group);
+		uint32_t const	hit_mask = IntersectGroup_(_ray, group, group_count, t, u, v);
+		for (uint32_t lane = 0u; lane < group_count; ++lane)
+		{
+			if ((hit_mask & (1u << lane)) == 0u || !(t[lane] < _ray.tMax))
+				continue;
+			_ray.tMax = t[lane];
+			_hit.t = t[lane];
+			_hit.uv = maths::Point2f{ u[lane], v[lane] };
+			_hit.index = group + lane;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+
+bool
+TriangleRecords::DoesIntersectLeaf(maths::Ray const &_ray, uint32_t _first,
+								   uint32_t _count) const
+{
+	for (uint32_t group = _first; group < _first + _count; group += kLaneCount)
+	{
+		maths::Decimal	t[kLaneCount], u[kLaneCount], v[kLaneCount];
+		uint32_t const	group_count = maths::Min(kLaneCount, _first + _count - group);
+		if (IntersectGroup_(_ray, group, group_count, t, u, v) != 0u)
+			return true;
+	}
+	return false;
+}
+
+
+size_t
+TriangleRecords::memory_size() const
+{
+	return vertices_[0][0].size() * sizeof(float) * 9u +
+		face_indices_.size() * sizeof(uint32_t);
+}
+
+
+uint32_t
+TriangleRecords::IntersectGroup_(maths::Ray const &_ray, uint32_t _first, uint32_t _count,
+								 maths::Decimal *_t, maths::Decimal *_u, maths::Decimal *_v) const
+{
+	YS_ASSERT(_count <= kLaneCount);
+	YS_ASSERT(_first + kLaneCount <= vertices_[0][0].size());
+	uint32_t const			count_mask = (1u << _count) - 1u;
+	maths::Ray::Shear const	&ray_shear = _ray.shear;
+	uint32_t const			axes[3]{ ray_shear.kx, ray_shear.ky, ray_shear.kz };
+	__m128 const			shear_x = _mm_set1_ps(static_cast<float>(ray_shear.sx));
+	__m128 const			shear_y = _mm_set1_ps(static_cast<float>(ray_shear.sy));
+	// Vertices relative to the ray origin, permuted and sheared as in
+	// Triangle::IntersectFaceWatertight, p[vertex][0, 1, 2] are the x, y and unscaled z.
+	__m128					p[3][3];
+	for (uint32_t vertex = 0u; vertex < 3u; ++vertex)
+	{
+		for (uint32_t i = 0u; i < 3u; ++i)
+			p[vertex][i] = _mm_sub_ps(_mm_loadu_ps(&vertices_[vertex][axes[i]][_first]),
+									  _mm_set1_ps(static_cast<float>(_ray.origin[axes[i]])));
+		p[vertex][0] = _mm_add_ps(p[vertex][0], _mm_mul_ps(shear_x, p[vertex][2]));
+		p[vertex][1] = _mm_add_ps(p[vertex][1], _mm_mul_ps(shear_y, p[vertex][2]));
+	}
+	__m128 const	e0 = _mm_sub_ps(_mm_mul_ps(p[1][0], p[2][1]), _mm_mul_ps(p[2][0], p[1][1]));
+	__m128 const	e1 = _mm_sub_ps(_mm_mul_ps(p[2][0], p[0][1]), _mm_mul_ps(p[0][0], p[2][1]));
+	__m128 const	e2 = _mm_sub_ps(_mm_mul_ps(p[0][0], p[1][1]), _mm_mul_ps(p[1][0], p[0][1]));
+	__m128 const	zero = _mm_setzero_ps();
+#ifndef YS_DECIMAL_IS_DOUBLE
+	// Same operations as the scalar test, in the same order, so that both get the same results.
+	// Lanes with a zero edge function go through the scalar test, which computes it again in
+	// double precision.
+	__m128 const	zero_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero), _mm_cmpeq_ps(e1, zero)),
+										  _mm_cmpeq_ps(e2, zero));
+	__m128 const	has_positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)),
+											 _mm_cmpgt_ps(e2, zero));
+	__m128 const	has_negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)),
+											 _mm_cmplt_ps(e2, zero));
+	__m128 const	e_sum = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+	__m128 const	shear_z = _mm_set1_ps(ray_shear.sz);
+	__m128 const	p0z = _mm_mul_ps(p[0][2], shear_z);
+	__m128 const	p1z = _mm_mul_ps(p[1][2], shear_z);
+	__m128 const	p2z = _mm_mul_ps(p[2][2], shear_z);
+	__m128 const	t_scaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, p0z), _mm_mul_ps(e1, p1z)),
+										  _mm_mul_ps(e2, p2z));
+	__m128 const	t_max_scaled = _mm_mul_ps(_mm_set1_ps(_ray.tMax), e_sum);
+	__m128 const	negative_miss = _mm_and_ps(_mm_cmplt_ps(e_sum, zero), _mm_or_ps(
+		_mm_cmpge_ps(t_scaled, zero), _mm_cmplt_ps(t_scaled, t_max_scaled)));
+	__m128 const	positive_miss = _mm_and_ps(_mm_cmpgt_ps(e_sum, zero), _mm_or_ps(
+		_mm_cmple_ps(t_scaled, zero), _mm_cmpgt_ps(t_scaled, t_max_scaled)));
+	__m128 const	miss = _mm_or_ps(_mm_or_ps(_mm_and_ps(has_positive, has_negative),
+											   _mm_cmpeq_ps(e_sum, zero)),
+									 _mm_or_ps(negative_miss, positive_miss));
+	__m128 const	e_sum_inverse = _mm_div_ps(_mm_set1_ps(1._d), e_sum);
+	__m128 const	t = _mm_mul_ps(t_scaled, e_sum_inverse);
+	// Error bounds of PBR 3.9.6
+	__m128 const	sign_mask = _mm_set1_ps(-0.f);
+	__m128 const	max_xt = _mm_max_ps(_mm_max_ps(_mm_andnot_ps(sign_mask, p[0][0]),
+												   _mm_andnot_ps(sign_mask, p[1][0])),
+										_mm_andnot_ps(sign_mask, p[2][0]));
+	__m128 const	max_yt = _mm_max_ps(_mm_max_ps(_mm_andnot_ps(sign_mask, p[0][1]),
+												   _mm_andnot_ps(sign_mask, p[1][1])),
+										_mm_andnot_ps(sign_mask, p[2][1]));
+	__m128 const	max_zt = _mm_max_ps(_mm_max_ps(_mm_andnot_ps(sign_mask, p0z),
+												   _mm_andnot_ps(sign_mask, p1z)),
+										_mm_andnot_ps(sign_mask, p2z));
+	__m128 const	gamma2 = _mm_set1_ps(maths::gamma(2u));
+	__m128 const	gamma3 = _mm_set1_ps(maths::gamma(3u));
+	__m128 const	gamma5 = _mm_set1_ps(maths::gamma(5u));
+	__m128 const	delta_x = _mm_mul_ps(gamma5, _mm_add_ps(max_xt, max_zt));
+	__m128 const	delta_y = _mm_mul_ps(gamma5, _mm_add_ps(max_yt, max_zt));
+	__m128 const	delta_z = _mm_mul_ps(gamma3, max_zt);
+	__m128 const	delta_e = _mm_mul_ps(_mm_set1_ps(2._d), _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_mul_ps(gamma2, max_xt), max_yt), _mm_mul_ps(delta_y, max_xt)),
+		_mm_mul_ps(delta_x, max_yt)));
+	__m128 const	max_e = _mm_max_ps(_mm_max_ps(_mm_andnot_ps(sign_mask, e0),
+												  _mm_andnot_ps(sign_mask, e1)),
+									   _mm_andnot_ps(sign_mask, e2));
+	__m128 const	delta_t = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(3._d), _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_mul_ps(gamma3, max_e), max_zt), _mm_mul_ps(delta_e, max_zt)),
+		_mm_mul_ps(delta_z, max_e))), _mm_andnot_ps(sign_mask, e_sum_inverse));
+	__m128 const	hit = _mm_andnot_ps(_mm_or_ps(miss, _mm_cmple_ps(t, delta_t)),
+										_mm_castsi128_ps(_mm_set1_epi32(-1)));
+	_mm_storeu_ps(_t, t);
+	_mm_storeu_ps(_u, _mm_mul_ps(e0, e_sum_inverse));
+	_mm_storeu_ps(_v, _mm_mul_ps(e1, e_sum_inverse));
+	uint32_t const	zero_edge_mask = static_cast<uint32_t>(_mm_movemask_ps(zero_edge)) & count_mask;
+	uint32_t		hit_mask = static_cast<uint32_t>(_mm_movemask_ps(hit)) & ~zero_edge_mask;
+	for (uint32_t lane = 0u; lane < _count; ++lane)
+		if ((zero_edge_mask & (1u << lane)) != 0u &&
+			IntersectRecord_(_ray, _first + lane, _t[lane], _u[lane], _v[lane]))
+			hit_mask |= 1u << lane;
+#else
+	// Candidates are the triangles whose edge functions can't be told to have opposite signs
+	// given their rounding error, the double precision test decides. The distance is left to
+	// it too, few triangles of a leaf straddle the ray line.
+	__m128 const	sign_mask = _mm_set1_ps(-0.f);
+	__m128 const	origin_magnitude[3]{
+		_mm_set1_ps(static_cast<float>(maths::Abs(_ray.origin[axes[0]]))),
+		_mm_set1_ps(static_cast<float>(maths::Abs(_ray.origin[axes[1]]))),
+		_mm_set1_ps(static_cast<float>(maths::Abs(_ray.origin[axes[2]]))) };
+	__m128 const	shear_x_magnitude = _mm_andnot_ps(sign_mask, shear_x);
+	__m128 const	shear_y_magnitude = _mm_andnot_ps(sign_mask, shear_y);
+	// Bounds of the magnitudes of the sheared coordinates and of their error
+	__m128			x_magnitude[3], y_magnitude[3];
+	for (uint32_t vertex = 0u; vertex < 3u; ++vertex)
+	{
+		__m128 magnitude[3];
+		for (uint32_t i = 0u; i < 3u; ++i)
+			magnitude[i] = _mm_add_ps(
+				_mm_andnot_ps(sign_mask, _mm_loadu_ps(&vertices_[vertex][axes[i]][_first])),
+				origin_magnitude[i]);
+		x_magnitude[vertex] = _mm_add_ps(magnitude[0], _mm_mul_ps(shear_x_magnitude, magnitude[2]));
+		y_magnitude[vertex] = _mm_add_ps(magnitude[1], _mm_mul_ps(shear_y_magnitude, magnitude[2]));
+	}
+	__m128 const	error_factor = _mm_set1_ps(kEdgeErrorFactor);
+	__m128 const	e0_error = _mm_mul_ps(error_factor, _mm_add_ps(
+		_mm_mul_ps(x_magnitude[1], y_magnitude[2]), _mm_mul_ps(x_magnitude[2], y_magnitude[1])));
+	__m128 const	e1_error = _mm_mul_ps(error_factor, _mm_add_ps(
+		_mm_mul_ps(x_magnitude[2], y_magnitude[0]), _mm_mul_ps(x_magnitude[0], y_magnitude[2])));
+	__m128 const	e2_error = _mm_mul_ps(error_factor, _mm_add_ps(
+		_mm_mul_ps(x_magnitude[0], y_magnitude[1]), _mm_mul_ps(x_magnitude[1], y_magnitude[0])));
+	__m128 const	has_positive = _mm_or_ps(_mm_or_ps(
+		_mm_cmpgt_ps(_mm_sub_ps(e0, e0_error), zero), _mm_cmpgt_ps(_mm_sub_ps(e1, e1_error), zero)),
+		_mm_cmpgt_ps(_mm_sub_ps(e2, e2_error), zero));
+	__m128 const	has_negative = _mm_or_ps(_mm_or_ps(
+		_mm_cmplt_ps(_mm_add_ps(e0, e0_error), zero), _mm_cmplt_ps(_mm_add_ps(e1, e1_error), zero)),
+		_mm_cmplt_ps(_mm_add_ps(e2, e2_error), zero));
+	uint32_t const	candidate_mask = static_cast<uint32_t>(
+		~_mm_movemask_ps(_mm_and_ps(has_positive, has_negative))) & count_mask;
+	uint32_t		hit_mask = 0u;
+	for (uint32_t lane = 0u; lane < _count; ++lane)
+		if ((candidate_mask & (1u << lane)) != 0u &&
+			IntersectRecord_(_ray, _first + lane, _t[lane], _u[lane], _v[lane]))
+			hit_mask |= 1u << lane;
+#endif // !YS_DECIMAL_IS_DOUBLE
+	return hit_mask & count_mask;
+}
+
+
+bool
+TriangleRecords::IntersectRecord_(maths::Ray const &_ray, uint32_t _record,
+								  maths::Decimal &_t, maths::Decimal &_u, maths::Decimal &_v) const
+{
+	YS_ASSERT(raw_data_ != nullptr);
+	Triangle::WatertightHit	hit;
+	if (!Triangle::IntersectFaceWatertight(*raw_data_, &raw_data_->indices[
+			TriangleMeshRawData::IndexOffset(static_cast<int32_t>(face_indices_[_record]))],
+			_ray, hit))
+		return false;
+	_t = hit.t;
+	_u = hit.b0;
+	_v = hit.b1;
+	return true;
+}
+
+
+} // namespace raytracer
@@ -0,0 +1,44 @@
+#include "raytracer/wavefront.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "globals.h"
+
+
+namespace raytracer {
+
+
+void
+RayStream::SortForTraversal(maths::Bounds3f const &_bounds, size_t const _batch_size)
+{
+	TIMED_SCOPE(RayStream_SortForTraversal);
+	order.clear();
+	if (_batch_size == 0u)
+		return;
+	constexpr uint32_t			kMortonBitsPerAxis = 10u;
+	constexpr maths::Decimal	kCellCount = static_cast<maths::Decimal>(1u << kMortonBitsPerAxis);
+	// The octant sits above the 30 bits of the origin code
+	std::vector<std::pair<uint64_t, uint32_t>>	keys(rays.size());
+	for (uint32_t i = 0u; i < static_cast<uint32_t>(rays.size()); ++i)
+	{
+		maths::Ray const	&ray = rays[i];
+		uint32_t const		octant = static_cast<uint32_t>(ray.is_negative.x) |
+			(static_cast<uint32_t>(ray.is_negative.y) << 1u) | (static_cast<uint32_t>(ray.is_negative.z) << 2u);
+		maths::Vec3f const	offset = _bounds.Offset(ray.origin);
+		uint32_t			cell[3];
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+			cell[axis] = static_cast<uint32_t>(
+				maths::Clamp(offset[axis] * kCellCount, 0._d, kCellCount - 1._d));
+		keys[i] = std::make_pair((static_cast<uint64_t>(octant) << (3u * kMortonBitsPerAxis)) |
+									 maths::EncodeMorton3(cell[0], cell[1], cell[2]), i);
+	}
+	for (size_t first = 0u; first < keys.size(); first += _batch_size)
+		std::sort(keys.begin() + first, keys.begin() + std::min(first + _batch_size, keys.size()));
+	order.resize(keys.size());
+	for (size_t i = 0u; i < keys.size(); ++i)
+		order[i] = keys[i].second;
+}
+
+
+} // namespace raytracer
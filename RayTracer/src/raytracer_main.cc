@@ -1,4 +1,5 @@
 #include <csignal>
+#include <cstdlib>
 #include <typeinfo>
 #include <iostream>
 #include <sstream>
@@ -19,7 +20,10 @@
 void flush_profiler();
 void flush_logger();
 
-void render(std::string const &_path, api::TranslationState &_translation_state)
+// _thread_count overrides the integrator's thread_count parameter when it isn't 0
+// A _frame_count above 1 renders the scene animations as a sequence of frames
+void render(std::string const &_path, api::TranslationState &_translation_state,
+			uint32_t const _thread_count, uint32_t const _frame_count)
 {
 	_translation_state.ResetResourceCounters();
 	if (!_path.empty() && boost::filesystem::exists(_path))
@@ -33,7 +37,19 @@ void render(std::string const &_path, api::TranslationState &_translation_state)
 	//
 	if (_translation_state.render_context().GoodForRender())
 	{
-		_translation_state.render_context().RenderAndWrite(_translation_state.output_path());
+		if (_thread_count != 0u)
+		{
+			_translation_state.render_context().SetThreadCount(_thread_count);
+		}
+		if (_frame_count > 1u)
+		{
+			_translation_state.render_context().RenderSequenceAndWrite(
+				_translation_state.output_path(), _frame_count);
+		}
+		else
+		{
+			_translation_state.render_context().RenderAndWrite(_translation_state.output_path());
+		}
 	}
 	else
 	{
@@ -66,6 +82,8 @@ int main(int argc, char *argv[])
 	// TODO: add support for c4d files
 	std::string absolute_path{};
 	bool interactive_mode = false;
+	uint32_t thread_count = 0u;
+	uint32_t frame_count = 1u;
 	if (argc > 1)
 	{
 		for (int i = 1; i < argc; ++i)
@@ -75,6 +93,28 @@ int main(int argc, char *argv[])
 			{
 				interactive_mode = true;
 			}
+			else if (arg == "--threads")
+			{
+				if (i + 1 < argc)
+				{
+					thread_count = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+				}
+				else
+				{
+					std::cout << "--threads expects a thread count." << std::endl;
+				}
+			}
+			else if (arg == "--frames")
+			{
+				if (i + 1 < argc)
+				{
+					frame_count = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+				}
+				else
+				{
+					std::cout << "--frames expects a frame count." << std::endl;
+				}
+			}
 			else
 			{
 				absolute_path = boost::filesystem::absolute(arg).generic_string();
@@ -103,7 +143,7 @@ int main(int argc, char *argv[])
 				std::cin >> input_string;
 				if (input_string == "render")
 				{
-					render(absolute_path, translation_state);
+					render(absolute_path, translation_state, thread_count, frame_count);
 				}
 				else if (input_string == "exit")
 				{
@@ -117,7 +157,7 @@ int main(int argc, char *argv[])
 		}
 		else
 		{
-			render(absolute_path, translation_state);
+			render(absolute_path, translation_state, thread_count, frame_count);
 		}
 	}
 
@@ -0,0 +1,1310 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core/rng.h"
+#include "maths/bounds.h"
+#include "maths/ray.h"
+#include "maths/transform.h"
+#include "raytracer/bvh_accelerator.h"
+#include "raytracer/hit_record.h"
+#include "raytracer/mesh_instances.h"
+#include "raytracer/primitive.h"
+#include "raytracer/ray_packet.h"
+#include "raytracer/surface_interaction.h"
+#include "raytracer/triangle_mesh_data.h"
+#include "raytracer/wavefront.h"
+#include "raytracer/shapes/triangle.h"
+#include "raytracer/shapes/triangle_mesh.h"
+
+
+namespace {
+
+// Axis aligned box, only its bounds matter to the BVH
+class BoxPrimitive final : public raytracer::Primitive
+{
+public:
+	BoxPrimitive(maths::Bounds3f const &_bounds) : bounds_{ _bounds } {}
+	bool Intersect(maths::Ray &_ray, raytracer::HitRecord &_hit) const override
+	{
+		maths::Decimal t0, t1;
+		if (!_ray.DoesIntersect(bounds_, t0, t1))
+			return false;
+		_ray.tMax = t0;
+		_hit.t = t0;
+		_hit.primitive = this;
+		return true;
+	}
+	bool DoesIntersect(maths::Ray const &_ray) const override
+	{
+		return _ray.DoesIntersect(bounds_);
+	}
+	maths::Bounds3f WorldBounds() const override { return bounds_; }
+	void SetBounds(maths::Bounds3f const &_bounds) { bounds_ = _bounds; }
+private:
+	maths::Bounds3f bounds_;
+};
+
+using BoxContainer_t = std::vector<BoxPrimitive>;
+
+BoxContainer_t
+MakeRandomBoxes(core::RNG &_rng, uint32_t const _count, maths::Decimal const _size)
+{
+	BoxContainer_t result{};
+	result.reserve(_count);
+	for (uint32_t i = 0u; i < _count; ++i)
+	{
+		maths::Point3f const min{ _rng.GetDecimal(), _rng.GetDecimal(), _rng.GetDecimal() };
+		maths::Vec3f const extent{ _rng.GetDecimal(), _rng.GetDecimal(), _rng.GetDecimal() };
+		result.emplace_back(maths::Bounds3f{ min, min + extent * _size });
+	}
+	return result;
+}
+
+raytracer::BvhAccelerator::PrimitiveArray_t
+MakePrimitiveArray(BoxContainer_t const &_boxes)
+{
+	raytracer::BvhAccelerator::PrimitiveArray_t result{};
+	result.reserve(_boxes.size());
+	for (BoxPrimitive const &box : _boxes)
+		result.push_back(&box);
+	return result;
+}
+
+maths::Ray
+MakeRandomRay(core::RNG &_rng)
+{
+	maths::Point3f const origin{ _rng.GetDecimal(), _rng.GetDecimal(), _rng.GetDecimal() };
+	maths::Vec3f const direction{
+		_rng.GetDecimal() - .5_d, _rng.GetDecimal() - .5_d, _rng.GetDecimal() - .5_d
+	};
+	return maths::Ray{ origin, maths::Normalized(direction), maths::infinity<maths::Decimal>, 0._d };
+}
+
+struct NodeFormat
+{
+	uint32_t	width;
+	bool		quantized;
+};
+
+constexpr NodeFormat kNodeFormats[] = {
+	{ raytracer::BvhAccelerator::kBinaryNodeWidth, false },
+	{ raytracer::BvhAccelerator::kBvh4NodeWidth, false },
+	{ raytracer::BvhAccelerator::kBvh8NodeWidth, false },
+	{ raytracer::BvhAccelerator::kBvh4NodeWidth, true },
+	{ raytracer::BvhAccelerator::kBvh8NodeWidth, true }
+};
+
+std::string
+FormatName(NodeFormat const &_format)
+{
+	return "BVH" + std::to_string(_format.width) + (_format.quantized ? "Q" : "");
+}
+
+constexpr raytracer::BvhAccelerator::BuildMethod kBuildMethods[] = {
+	raytracer::BvhAccelerator::kSahBuild,
+	raytracer::BvhAccelerator::kLinearBuild,
+	raytracer::BvhAccelerator::kSpatialSahBuild
+};
+
+std::string
+BuildMethodName(raytracer::BvhAccelerator::BuildMethod const _method)
+{
+	switch (_method)
+	{
+	case raytracer::BvhAccelerator::kLinearBuild: return "linear";
+	case raytracer::BvhAccelerator::kSpatialSahBuild: return "spatial";
+	default: return "SAH";
+	}
+}
+
+// Boxes stretched along a random axis, object splits leave their children overlapping
+BoxContainer_t
+MakeRandomSticks(core::RNG &_rng, uint32_t const _count, maths::Decimal const _length,
+				 maths::Decimal const _width)
+{
+	BoxContainer_t result{};
+	result.reserve(_count);
+	for (uint32_t i = 0u; i < _count; ++i)
+	{
+		maths::Point3f const min{ _rng.GetDecimal(), _rng.GetDecimal(), _rng.GetDecimal() };
+		maths::Vec3f extent{ _width, _width, _width };
+		extent[maths::Min(static_cast<uint32_t>(_rng.GetDecimal() * 3._d), 2u)] = _length;
+		result.emplace_back(maths::Bounds3f{ min, min + extent });
+	}
+	return result;
+}
+
+// Checks the closest and any hit queries of _bvh against every primitive
+void
+ExpectMatchesBruteForce(raytracer::BvhAccelerator const &_bvh,
+						raytracer::BvhAccelerator::PrimitiveArray_t const &_primitives,
+						core::RNG &_rng, uint32_t const _ray_count, std::string const &_name)
+{
+	for (uint32_t ray_index = 0u; ray_index < _ray_count; ++ray_index)
+	{
+		maths::Ray const ray = MakeRandomRay(_rng);
+		maths::Ray brute_force_ray{ ray };
+		bool brute_force_hit = false;
+		raytracer::HitRecord brute_force_record{};
+		for (raytracer::Primitive const *primitive : _primitives)
+			brute_force_hit = primitive->Intersect(brute_force_ray, brute_force_record) || brute_force_hit;
+		maths::Ray bvh_ray{ ray };
+		raytracer::HitRecord bvh_record{};
+		EXPECT_EQ(brute_force_hit, _bvh.Intersect(bvh_ray, bvh_record)) << _name;
+		EXPECT_EQ(brute_force_hit, _bvh.DoesIntersect(ray)) << _name;
+		if (brute_force_hit)
+		{
+			EXPECT_EQ(brute_force_ray.tMax, bvh_ray.tMax) << _name;
+			EXPECT_EQ(brute_force_record.t, bvh_record.t) << _name;
+		}
+	}
+}
+
+// Average node visits of the closest hit queries of _rays, zero unless YS_BVH_TRAVERSAL_STATS
+// is defined
+double
+NodeVisitsPerRay(raytracer::BvhAccelerator const &_bvh, std::vector<maths::Ray> const &_rays)
+{
+	raytracer::BvhAccelerator::GrabTraversalCounters();
+	raytracer::BvhAccelerator::TakeTraversalCounters();
+	for (maths::Ray const &ray : _rays)
+	{
+		maths::Ray bvh_ray{ ray };
+		raytracer::HitRecord hit{};
+		_bvh.Intersect(bvh_ray, hit);
+	}
+	return static_cast<double>(
+		raytracer::BvhAccelerator::thread_traversal_counters().node_visit_count) / _rays.size();
+}
+
+// Triangles of size _size scattered in the unit cube
+raytracer::TriangleMeshRawData
+MakeRandomTriangles(core::RNG &_rng, int32_t const _count, maths::Decimal const _size,
+					raytracer::TriangleMeshRawData::IndicesContainer_t &_indices,
+					raytracer::TriangleMeshRawData::VerticesContainer_t &_vertices)
+{
+	for (int32_t i = 0; i < _count; ++i)
+	{
+		maths::Point3f const origin{ _rng.GetDecimal(), _rng.GetDecimal(), _rng.GetDecimal() };
+		for (int32_t vertex = 0; vertex < 3; ++vertex)
+		{
+			_indices.push_back(static_cast<int32_t>(_vertices.size()));
+			_vertices.push_back(origin + _size * maths::Vec3f{
+				_rng.GetDecimal() - .5_d, _rng.GetDecimal() - .5_d, _rng.GetDecimal() - .5_d });
+		}
+	}
+	return raytracer::TriangleMeshRawData{ _count, _indices, _vertices };
+}
+
+// Pinhole camera rays looking at the unit cube, ordered by blocks of _block_width x
+// _block_height pixels so that consecutive rays form the packets of the integrator
+std::vector<maths::Ray>
+MakePrimaryRays(uint32_t const _resolution, uint32_t const _block_width,
+				uint32_t const _block_height)
+{
+	maths::Point3f const eye{ .5_d, .5_d, -1._d };
+	std::vector<maths::Ray> result{};
+	result.reserve(_resolution * _resolution);
+	for (uint32_t block_y = 0u; block_y < _resolution; block_y += _block_height)
+		for (uint32_t block_x = 0u; block_x < _resolution; block_x += _block_width)
+			for (uint32_t y = block_y; y < block_y + _block_height; ++y)
+				for (uint32_t x = block_x; x < block_x + _block_width; ++x)
+				{
+					maths::Point3f const target{ (x + .5_d) / _resolution, (y + .5_d) / _resolution, 0._d };
+					result.emplace_back(eye, maths::Normalized(target - eye),
+										maths::infinity<maths::Decimal>, 0._d);
+				}
+	return result;
+}
+
+struct PacketFormat
+{
+	uint32_t	size;
+	uint32_t	block_width;
+	uint32_t	block_height;
+};
+
+constexpr PacketFormat kPacketFormats[] = { { 4u, 2u, 2u }, { 8u, 4u, 2u }, { 16u, 4u, 4u } };
+
+// Intersects _rays by packets of _packet_size, with _ray_mask applied to every packet
+template <typename IntersectPacket_t>
+std::vector<raytracer::HitRecord>
+IntersectPackets(std::vector<maths::Ray> const &_rays, uint32_t const _packet_size,
+				 uint32_t const _ray_mask, IntersectPacket_t const &_intersect_packet)
+{
+	std::vector<raytracer::HitRecord> result(_rays.size());
+	raytracer::RayPacket packet;
+	packet.size = _packet_size;
+	for (size_t first = 0u; first < _rays.size(); first += _packet_size)
+	{
+		for (uint32_t i = 0u; i < _packet_size; ++i)
+		{
+			packet.rays[i] = _rays[first + i];
+			packet.hits[i] = raytracer::HitRecord{};
+		}
+		uint32_t const hit_mask = _intersect_packet(packet, _ray_mask);
+		for (uint32_t i = 0u; i < _packet_size; ++i)
+		{
+			EXPECT_EQ(packet.hits[i].t < maths::infinity<maths::Decimal>, (hit_mask >> i) & 1u);
+			EXPECT_EQ(packet.hits[i].t, packet.rays[i].tMax);
+			result[first + i] = packet.hits[i];
+		}
+	}
+	return result;
+}
+
+} // namespace
+
+
+TEST(BvhAccelerator, MatchesBruteForce)
+{
+	for (raytracer::BvhAccelerator::BuildMethod const method : kBuildMethods)
+		for (NodeFormat const &format : kNodeFormats)
+		{
+			std::string const name = BuildMethodName(method) + " " + FormatName(format);
+			core::RNG rng{ 0x5eedu };
+			BoxContainer_t const boxes = MakeRandomBoxes(rng, 4096u, .02_d);
+			raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+			raytracer::BvhAccelerator const bvh{ primitives, 4u, format.width, format.quantized, method };
+			ASSERT_EQ(format.width, bvh.node_width());
+			ASSERT_EQ(format.quantized, bvh.quantized_nodes());
+			ASSERT_EQ(method, bvh.build_method());
+			ExpectMatchesBruteForce(bvh, primitives, rng, 1024u, name);
+		}
+}
+
+
+TEST(BvhAccelerator, ShortStackMatchesBruteForce)
+{
+	for (raytracer::BvhAccelerator::BuildMethod const method : kBuildMethods)
+	{
+		std::string const name = BuildMethodName(method) + " short stack";
+		core::RNG rng{ 0x5eedu };
+		BoxContainer_t const boxes = MakeRandomBoxes(rng, 4096u, .02_d);
+		raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+		raytracer::BvhAccelerator bvh{ primitives, 4u, raytracer::BvhAccelerator::kBinaryNodeWidth,
+									   false, method };
+		bvh.SetShortStackTraversal(true);
+		ExpectMatchesBruteForce(bvh, primitives, rng, 1024u, name);
+	}
+}
+
+
+TEST(BvhAccelerator, SkewedTreesMatchBruteForce)
+{
+	// Boxes growing geometrically along x, each SAH split only peels the largest ones off. The
+	// tree is deep and narrow, short stacks run out and restart often.
+	BoxContainer_t boxes{};
+	maths::Decimal size = .01_d;
+	for (uint32_t i = 0u; i < 400u; ++i, size *= 1.2_d)
+		boxes.emplace_back(maths::Bounds3f{ maths::Point3f{ size, 0._d, 0._d },
+											maths::Point3f{ 2._d * size, 1._d, 1._d } });
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	for (NodeFormat const &format : kNodeFormats)
+	{
+		std::string const name = "skewed " + FormatName(format);
+		core::RNG rng{ 0x5ce3u };
+		raytracer::BvhAccelerator bvh{ primitives, 1u, format.width, format.quantized };
+		ExpectMatchesBruteForce(bvh, primitives, rng, 1024u, name);
+		if (format.width == raytracer::BvhAccelerator::kBinaryNodeWidth)
+		{
+			bvh.SetShortStackTraversal(true);
+			ExpectMatchesBruteForce(bvh, primitives, rng, 1024u, name + " short stack");
+		}
+	}
+}
+
+
+TEST(BvhAccelerator, StatisticsDescribeTheTree)
+{
+	core::RNG rng{ 0x57a7u };
+	BoxContainer_t const boxes = MakeRandomBoxes(rng, 4096u, .02_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	for (raytracer::BvhAccelerator::BuildMethod const method : kBuildMethods)
+		for (NodeFormat const &format : kNodeFormats)
+		{
+			std::string const name = BuildMethodName(method) + " " + FormatName(format);
+			raytracer::BvhAccelerator const bvh{ primitives, 4u, format.width, format.quantized, method };
+			raytracer::BvhAccelerator::Statistics const statistics = bvh.ComputeStatistics();
+			uint64_t leaf_count = 0u, reference_count = 0u;
+			for (size_t i = 0u; i < statistics.leaf_size_histogram.size(); ++i)
+			{
+				leaf_count += statistics.leaf_size_histogram[i];
+				reference_count += i * statistics.leaf_size_histogram[i];
+			}
+			EXPECT_EQ(statistics.leaf_count, leaf_count) << name;
+			EXPECT_EQ(bvh.reference_count(), reference_count) << name;
+			EXPECT_EQ(bvh.reference_count(), statistics.reference_count) << name;
+			EXPECT_EQ(0u, statistics.leaf_size_histogram[0]) << name;
+			EXPECT_LE(statistics.leaf_size_histogram.size(), 5u) << name;
+			uint64_t depth_leaf_count = 0u;
+			for (uint64_t const count : statistics.depth_histogram)
+				depth_leaf_count += count;
+			EXPECT_EQ(statistics.leaf_count, depth_leaf_count) << name;
+			ASSERT_EQ(statistics.max_depth + 1u, statistics.depth_histogram.size()) << name;
+			EXPECT_GT(statistics.depth_histogram.back(), 0u) << name;
+			EXPECT_LE(statistics.max_depth, raytracer::BvhAccelerator::kMaxTraversalDepth) << name;
+			if (format.width == raytracer::BvhAccelerator::kBinaryNodeWidth)
+			{
+				EXPECT_EQ(statistics.leaf_count - 1u, statistics.inner_node_count) << name;
+				EXPECT_EQ(statistics.leaf_count + statistics.inner_node_count,
+						  statistics.node_count) << name;
+			}
+			else
+				EXPECT_EQ(statistics.inner_node_count, statistics.node_count) << name;
+			EXPECT_EQ(bvh.sah_cost(), statistics.sah_cost) << name;
+			EXPECT_EQ(bvh.node_memory_size(), statistics.node_memory_size) << name;
+			EXPECT_EQ(bvh.reference_count() * sizeof(uint32_t), statistics.reference_memory_size) << name;
+			if (format.width == raytracer::BvhAccelerator::kBinaryNodeWidth)
+				EXPECT_EQ(statistics.node_memory_size, statistics.binary_node_memory_size) << name;
+			else if (format.quantized)
+				EXPECT_LT(statistics.node_memory_size, statistics.binary_node_memory_size) << name;
+			raytracer::BvhAccelerator::Statistics sum{};
+			sum.Add(statistics);
+			sum.Add(statistics);
+			EXPECT_EQ(2u, sum.bvh_count) << name;
+			EXPECT_EQ(2u * statistics.leaf_count, sum.leaf_count) << name;
+			EXPECT_EQ(2. * statistics.sah_cost, sum.sah_cost) << name;
+			EXPECT_EQ(statistics.max_depth, sum.max_depth) << name;
+			EXPECT_EQ(2u * statistics.depth_histogram.back(), sum.depth_histogram.back()) << name;
+
+#ifdef YS_BVH_TRAVERSAL_STATS
+			raytracer::BvhAccelerator::GrabTraversalCounters();
+			raytracer::BvhAccelerator::TakeTraversalCounters();
+			uint64_t hit_count = 0u;
+			for (uint32_t ray_index = 0u; ray_index < 256u; ++ray_index)
+			{
+				maths::Ray ray = MakeRandomRay(rng);
+				raytracer::HitRecord hit{};
+				if (bvh.Intersect(ray, hit))
+					++hit_count;
+			}
+			raytracer::BvhAccelerator::TraversalCounters const &counters =
+				raytracer::BvhAccelerator::thread_traversal_counters();
+			EXPECT_EQ(256u, counters.traversal_count) << name;
+			EXPECT_EQ(256u, counters.ray_count) << name;
+			EXPECT_EQ(hit_count, counters.hit_count) << name;
+			EXPECT_EQ(hit_count, counters.ray_hit_count) << name;
+			EXPECT_GE(counters.node_visit_count, counters.traversal_count) << name;
+			EXPECT_GE(counters.primitive_test_count, hit_count) << name;
+			raytracer::BvhAccelerator::GrabTraversalCounters();
+			EXPECT_EQ(0u, raytracer::BvhAccelerator::thread_traversal_counters().traversal_count) << name;
+			EXPECT_EQ(256u, raytracer::BvhAccelerator::TakeTraversalCounters().traversal_count) << name;
+#endif // YS_BVH_TRAVERSAL_STATS
+		}
+}
+
+
+TEST(BvhAccelerator, NodeLayoutsMatchBruteForce)
+{
+	constexpr raytracer::BvhAccelerator::NodeLayout kLayouts[] = {
+		raytracer::BvhAccelerator::kTreeletLayout,
+		raytracer::BvhAccelerator::kHotTreeletLayout,
+		raytracer::BvhAccelerator::kDepthFirstLayout
+	};
+	core::RNG rng{ 0x1a7du };
+	BoxContainer_t boxes = MakeRandomBoxes(rng, 16384u, .01_d);
+	BoxContainer_t const rest_boxes = boxes;
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	for (NodeFormat const &format : kNodeFormats)
+	{
+		raytracer::BvhAccelerator bvh{ primitives, 2u, format.width, format.quantized };
+		raytracer::BvhAccelerator::Statistics const built = bvh.ComputeStatistics();
+		for (raytracer::BvhAccelerator::NodeLayout const layout : kLayouts)
+		{
+			std::string const name = FormatName(format) + " layout " + std::to_string(layout);
+			bvh.SetNodeLayout(layout);
+			EXPECT_EQ(layout, bvh.node_layout()) << name;
+			// Only the order of the nodes changes
+			raytracer::BvhAccelerator::Statistics const statistics = bvh.ComputeStatistics();
+			EXPECT_EQ(built.node_count, statistics.node_count) << name;
+			EXPECT_EQ(built.leaf_size_histogram, statistics.leaf_size_histogram) << name;
+			EXPECT_EQ(built.depth_histogram, statistics.depth_histogram) << name;
+			ExpectMatchesBruteForce(bvh, primitives, rng, 512u, name);
+		}
+		// Refits and rebuilds read and write the nodes in the treelet layout
+		bvh.SetNodeLayout(raytracer::BvhAccelerator::kTreeletLayout);
+		std::string const name = FormatName(format) + " treelet layout update";
+		for (size_t i = 0u; i < boxes.size(); i += 4u)
+			boxes[i].SetBounds(maths::Bounds3f{ rest_boxes[i].WorldBounds().min * .1_d,
+												rest_boxes[i].WorldBounds().max * .1_d });
+		bvh.Refit();
+		ExpectMatchesBruteForce(bvh, primitives, rng, 512u, name + " refit");
+		EXPECT_LT(0u, bvh.Update()) << name;
+		EXPECT_EQ(raytracer::BvhAccelerator::kTreeletLayout, bvh.node_layout()) << name;
+		ExpectMatchesBruteForce(bvh, primitives, rng, 512u, name);
+		for (size_t i = 0u; i < boxes.size(); ++i)
+			boxes[i].SetBounds(rest_boxes[i].WorldBounds());
+	}
+}
+
+
+TEST(BvhAccelerator, RefitTracksMovingPrimitives)
+{
+	maths::AnimatedTransform const animation{
+		maths::Transform{}, 0._d,
+		maths::Translate(maths::Vec3f{ .3_d, -.2_d, 0._d }) * maths::Rotate(40._d, { 0._d, 0._d, 1._d }),
+		1._d };
+	for (raytracer::BvhAccelerator::BuildMethod const method : kBuildMethods)
+		for (NodeFormat const &format : kNodeFormats)
+		{
+			std::string const name = BuildMethodName(method) + " " + FormatName(format);
+			core::RNG rng{ 0x4ef17u };
+			BoxContainer_t boxes = MakeRandomBoxes(rng, 4096u, .02_d);
+			BoxContainer_t const rest_boxes = boxes;
+			raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+			raytracer::BvhAccelerator refitted{ primitives, 4u, format.width, format.quantized, method };
+			raytracer::BvhAccelerator updated{ primitives, 4u, format.width, format.quantized, method };
+			// Refits lose the clipping of spatial split references, which the first update of a
+			// spatial BVH may count as degraded subtrees
+			uint32_t const static_rebuilt_count = updated.Update();
+			if (method != raytracer::BvhAccelerator::kSpatialSahBuild)
+				EXPECT_EQ(0u, static_rebuilt_count) << name;
+			EXPECT_EQ(0u, updated.Update()) << name;
+			for (maths::Decimal const time : { .5_d, 1._d })
+			{
+				// Every other box follows the animation, the others stay in place
+				for (size_t i = 0u; i < boxes.size(); i += 2u)
+					boxes[i].SetBounds(animation(time, rest_boxes[i].WorldBounds()));
+				refitted.Refit();
+				updated.Update();
+				ExpectMatchesBruteForce(refitted, primitives, rng, 256u, name + " refit");
+				ExpectMatchesBruteForce(updated, primitives, rng, 256u, name + " update");
+			}
+		}
+}
+
+
+TEST(BvhAccelerator, UpdateRebuildsDegradedSubtrees)
+{
+	core::RNG rng{ 0xde94du };
+	BoxContainer_t boxes = MakeRandomBoxes(rng, 16u * 1024u, .01_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	std::vector<maths::Ray> rays{};
+	for (uint32_t i = 0u; i < 4096u; ++i)
+		rays.push_back(MakeRandomRay(rng));
+	raytracer::BvhAccelerator refitted{ primitives, 4u };
+	raytracer::BvhAccelerator updated{ primitives, 4u };
+	double const built_cost = updated.sah_cost();
+	EXPECT_EQ(0u, updated.Update());
+	EXPECT_NEAR(built_cost, updated.sah_cost(), built_cost * 1e-3);
+	// The boxes of a corner of the scene are shuffled within the corner
+	for (BoxPrimitive &box : boxes)
+	{
+		maths::Bounds3f const bounds = box.WorldBounds();
+		if (bounds.min.x < .25_d && bounds.min.y < .25_d)
+		{
+			maths::Vec3f const offset{ rng.GetDecimal() * .25_d - bounds.min.x,
+									   rng.GetDecimal() * .25_d - bounds.min.y,
+									   rng.GetDecimal() - bounds.min.z };
+			box.SetBounds(maths::Bounds3f{ bounds.min + offset, bounds.max + offset });
+		}
+	}
+	// An update that rebuilds nothing is a refit that also measures the cost growth
+	EXPECT_EQ(0u, refitted.Update(maths::infinity<double>));
+	uint32_t const rebuilt_count = updated.Update();
+	RecordProperty("rebuilt_subtree_count", static_cast<int>(rebuilt_count));
+	RecordProperty("refit_sah_cost", std::to_string(refitted.sah_cost()));
+	RecordProperty("update_sah_cost", std::to_string(updated.sah_cost()));
+	EXPECT_GT(rebuilt_count, 0u);
+	EXPECT_LT(updated.sah_cost(), refitted.sah_cost());
+#ifdef YS_BVH_TRAVERSAL_STATS
+	double const refitted_visits = NodeVisitsPerRay(refitted, rays);
+	double const updated_visits = NodeVisitsPerRay(updated, rays);
+	RecordProperty("refit_node_visits_per_ray", std::to_string(refitted_visits));
+	RecordProperty("update_node_visits_per_ray", std::to_string(updated_visits));
+	EXPECT_LT(updated_visits, refitted_visits);
+#endif // YS_BVH_TRAVERSAL_STATS
+}
+
+
+TEST(BvhAccelerator, TriangleRecordsMatchTriangles)
+{
+	// Leaves run the watertight test of the triangles, both must agree on every ray
+	constexpr uint32_t kRayCount = 1024u;
+	core::RNG rng{ 0x5eedu };
+	int32_t const triangle_count = 2048;
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	for (int32_t i = 0; i < triangle_count; ++i)
+	{
+		maths::Point3f const origin{ rng.GetDecimal(), rng.GetDecimal(), rng.GetDecimal() };
+		for (int32_t vertex = 0; vertex < 3; ++vertex)
+		{
+			indices.push_back(static_cast<int32_t>(vertices.size()));
+			vertices.push_back(origin + .05_d * maths::Vec3f{
+				rng.GetDecimal() - .5_d, rng.GetDecimal() - .5_d, rng.GetDecimal() - .5_d });
+		}
+	}
+	raytracer::TriangleMeshRawData const raw_data{ triangle_count, indices, vertices };
+	maths::Transform const identity{};
+	// Meshes don't allocate per face objects, the brute force reference does
+	std::vector<raytracer::Triangle> triangles{};
+	triangles.reserve(triangle_count);
+	for (int32_t face_index = 0; face_index < triangle_count; ++face_index)
+		triangles.emplace_back(identity, false, raw_data, face_index);
+	for (NodeFormat const &format : kNodeFormats)
+	{
+		std::string const name = FormatName(format);
+		raytracer::TriangleMeshData const mesh_data{
+			raw_data, format.width, format.quantized,
+			raytracer::BvhAccelerator::kSahBuild,
+			raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+			raytracer::InstancingPolicyClass::SharedSource{} };
+		for (uint32_t ray_index = 0u; ray_index < kRayCount; ++ray_index)
+		{
+			maths::Ray const ray = MakeRandomRay(rng);
+			raytracer::HitRecord brute_force_record{};
+			uint32_t brute_force_face = 0u;
+			for (uint32_t face_index = 0u; face_index < triangles.size(); ++face_index)
+			{
+				maths::Ray triangle_ray{ ray };
+				triangle_ray.tMax = brute_force_record.t;
+				if (triangles[face_index].Intersect(triangle_ray, brute_force_record))
+					brute_force_face = face_index;
+			}
+			maths::Decimal const brute_force_t = brute_force_record.t;
+			bool const brute_force_hit = (brute_force_t < maths::infinity<maths::Decimal>);
+			maths::Ray records_ray{ ray };
+			raytracer::HitRecord records_record{};
+			bool const records_hit = mesh_data.Intersect(records_ray, records_record);
+			EXPECT_EQ(brute_force_hit, records_hit) << name;
+			EXPECT_EQ(records_hit, mesh_data.DoesIntersect(ray)) << name;
+			if (records_hit && brute_force_hit)
+			{
+				EXPECT_NEAR(brute_force_t, records_ray.tMax, 1e-4_d) << name;
+				EXPECT_EQ(brute_force_face, records_record.index) << name;
+				raytracer::SurfaceInteraction brute_force_info{}, records_info{};
+				brute_force_record.shape->ComputeSurfaceInteraction(ray, brute_force_record,
+																	brute_force_info);
+				mesh_data.ComputeSurfaceInteraction(ray, records_record,
+													triangles[records_record.index], records_info);
+				EXPECT_NEAR(0._d, maths::Length(brute_force_info.position - records_info.position),
+							1e-4_d) << name;
+			}
+		}
+	}
+}
+
+
+TEST(BvhAccelerator, TriangleRecordsAreWatertight)
+{
+	// Rays aimed at the shared edges of a jittered grid must hit one of the two faces. The grid
+	// is a height field with slopes under .2 and the rays are steeper, they can't graze a fold.
+	constexpr int32_t kGridSize = 64;
+	constexpr uint32_t kRayCount = 32768u;
+	core::RNG rng{ 0x5eedu };
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	for (int32_t y = 0; y <= kGridSize; ++y)
+	{
+		for (int32_t x = 0; x <= kGridSize; ++x)
+		{
+			bool const border = (x == 0 || y == 0 || x == kGridSize || y == kGridSize);
+			maths::Decimal const jitter_x = border ? 0._d : .4_d * (rng.GetDecimal() - .5_d);
+			maths::Decimal const jitter_y = border ? 0._d : .4_d * (rng.GetDecimal() - .5_d);
+			vertices.emplace_back(
+				(static_cast<maths::Decimal>(x) + jitter_x) / static_cast<maths::Decimal>(kGridSize),
+				(static_cast<maths::Decimal>(y) + jitter_y) / static_cast<maths::Decimal>(kGridSize),
+				.001_d * rng.GetDecimal());
+		}
+	}
+	int32_t const row_size = kGridSize + 1;
+	for (int32_t y = 0; y < kGridSize; ++y)
+	{
+		for (int32_t x = 0; x < kGridSize; ++x)
+		{
+			int32_t const corner = y * row_size + x;
+			int32_t const quad[6]{ corner, corner + 1, corner + row_size + 1,
+								   corner, corner + row_size + 1, corner + row_size };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+	raytracer::TriangleMeshRawData const raw_data{ 2 * kGridSize * kGridSize, indices, vertices };
+	for (NodeFormat const &format : kNodeFormats)
+	{
+		std::string const name = FormatName(format);
+		raytracer::TriangleMeshData const mesh_data{
+			raw_data, format.width, format.quantized,
+			raytracer::BvhAccelerator::kSahBuild,
+			raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+			raytracer::InstancingPolicyClass::SharedSource{} };
+		uint32_t miss_count = 0u;
+		for (uint32_t ray_index = 0u; ray_index < kRayCount; ++ray_index)
+		{
+			// Diagonal of a random quad, or its right or top side when it isn't on the border
+			int32_t const x = static_cast<int32_t>(rng.GetDecimal() * (kGridSize - 1));
+			int32_t const y = static_cast<int32_t>(rng.GetDecimal() * (kGridSize - 1));
+			int32_t const corner = y * row_size + x;
+			int32_t const edges[3][2]{ { corner, corner + row_size + 1 },
+									   { corner + 1, corner + row_size + 1 },
+									   { corner + row_size, corner + row_size + 1 } };
+			int32_t const edge = maths::Min(static_cast<int32_t>(rng.GetDecimal() * 3._d), 2);
+			maths::Decimal const s = rng.GetDecimal();
+			maths::Point3f const target = maths::Point3f{ maths::Lerp(
+				maths::Vec3f{ vertices[edges[edge][0]] }, maths::Vec3f{ vertices[edges[edge][1]] }, s) };
+			maths::Point3f const origin{ 4._d * rng.GetDecimal() - 1.5_d, 4._d * rng.GetDecimal() - 1.5_d,
+										 rng.GetDecimal() < .5_d ? -1._d : 1._d };
+			maths::Ray const ray{ origin, maths::Normalized(target - origin),
+								  maths::infinity<maths::Decimal>, 0._d };
+			maths::Ray closest_hit_ray{ ray };
+			raytracer::HitRecord record{};
+			if (!mesh_data.Intersect(closest_hit_ray, record) || !mesh_data.DoesIntersect(ray))
+				++miss_count;
+		}
+		EXPECT_EQ(0u, miss_count) << name;
+	}
+}
+
+
+TEST(BvhAccelerator, MeshInstancesMatchTransformedMeshes)
+{
+	using TransformedMesh = raytracer::TriangleMesh<raytracer::InstancingPolicyClass::Transformed>;
+	// Mirrored placements must not flip the normals a second time
+	auto const expect_same_normals = [](raytracer::SurfaceInteraction const &_expected,
+										raytracer::SurfaceInteraction const &_actual) {
+		EXPECT_GT(maths::Dot(_expected.geometry.normal(), _actual.geometry.normal()), .999_d);
+		EXPECT_GT(maths::Dot(_expected.shading.normal(), _actual.shading.normal()), .999_d);
+	};
+	core::RNG rng{ 0x5eedu };
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	raytracer::TriangleMeshRawData const raw_data =
+		MakeRandomTriangles(rng, 256, .2_d, indices, vertices);
+	raytracer::TriangleMeshData const mesh_data{
+		raw_data, raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+		raytracer::BvhAccelerator::kSahBuild,
+		raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+		raytracer::InstancingPolicyClass::SharedSource{} };
+	raytracer::InstancedMesh const mesh{ mesh_data, false };
+	raytracer::GeometryPrimitive const mesh_primitive{ mesh };
+	// The reference moves a copy of the triangles to each placement, some of them mirrored
+	constexpr uint32_t kInstanceCount = 64u;
+	std::vector<maths::Transform> transforms{};
+	std::vector<std::unique_ptr<raytracer::TriangleMeshData>> placed_meshes{};
+	std::vector<std::unique_ptr<TransformedMesh>> placed_shapes{};
+	std::vector<raytracer::MeshInstances::Record> records{};
+	for (uint32_t i = 0u; i < kInstanceCount; ++i)
+	{
+		maths::Decimal const mirror = (i % 4u == 0u) ? -1._d : 1._d;
+		transforms.push_back(
+			maths::Translate({ rng.GetDecimal(), rng.GetDecimal(), rng.GetDecimal() }) *
+			maths::Rotate(360._d * rng.GetDecimal(), { rng.GetDecimal() + .1_d,
+													  rng.GetDecimal(), rng.GetDecimal() }) *
+			maths::Scale(.2_d * mirror, .2_d, .2_d));
+	}
+	for (maths::Transform const &transform : transforms)
+	{
+		placed_meshes.emplace_back(new raytracer::TriangleMeshData{
+			transform, raw_data, raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+			raytracer::BvhAccelerator::kSahBuild,
+			raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+			raytracer::InstancingPolicyClass::Transformed{} });
+		placed_shapes.emplace_back(new TransformedMesh{ transform, false, *placed_meshes.back() });
+		records.push_back(raytracer::MeshInstances::MakeRecord(mesh_primitive, nullptr, transform));
+	}
+	raytracer::MeshInstances const instances{ std::move(records),
+											  raytracer::BvhAccelerator::kBinaryNodeWidth };
+	EXPECT_EQ(kInstanceCount, instances.instance_count());
+	uint32_t hit_count = 0u;
+	for (uint32_t ray_index = 0u; ray_index < 1024u; ++ray_index)
+	{
+		maths::Ray const ray = MakeRandomRay(rng);
+		maths::Ray reference_ray{ ray };
+		raytracer::HitRecord reference_hit{};
+		uint32_t reference_instance = 0u;
+		for (uint32_t i = 0u; i < kInstanceCount; ++i)
+			if (placed_meshes[i]->Intersect(reference_ray, reference_hit))
+				reference_instance = i;
+		maths::Ray instances_ray{ ray };
+		raytracer::HitRecord instances_hit{};
+		bool const instances_hit_found = instances.Intersect(instances_ray, instances_hit);
+		bool const reference_hit_found = (reference_hit.t < maths::infinity<maths::Decimal>);
+		ASSERT_EQ(reference_hit_found, instances_hit_found);
+		EXPECT_EQ(instances_hit_found, instances.DoesIntersect(ray));
+		if (!instances_hit_found)
+			continue;
+		++hit_count;
+		EXPECT_NEAR(reference_hit.t, instances_hit.t, 1e-4_d);
+		EXPECT_EQ(1u, instances_hit.instance_path.depth);
+		EXPECT_EQ(reference_instance, instances_hit.instance_path.indices[0]);
+		EXPECT_EQ(reference_hit.index, instances_hit.index);
+		EXPECT_EQ(&instances, instances_hit.primitive);
+		raytracer::SurfaceInteraction hit_info{};
+		instances.ComputeSurfaceInteraction(ray, instances_hit, hit_info);
+		EXPECT_NEAR(0._d, maths::Length(hit_info.position - ray(instances_hit.t)), 1e-4_d);
+		raytracer::SurfaceInteraction reference_info{};
+		placed_meshes[reference_instance]->ComputeSurfaceInteraction(
+			ray, reference_hit, *placed_shapes[reference_instance], reference_info);
+		expect_same_normals(reference_info, hit_info);
+	}
+	EXPECT_GT(hit_count, 0u);
+
+	// A second level places the group of all the instances twice, the second one mirrored.
+	// Its hits go through both levels, as those of the placements composed by hand.
+	raytracer::BvhAccelerator const group_bvh{
+		raytracer::BvhAccelerator::PrimitiveArray_t{ &instances }, 4u };
+	maths::Transform const group_transforms[2]{
+		maths::Translate({ -.5_d, 0._d, 0._d }) * maths::Scale(.5_d, .5_d, .5_d),
+		maths::Translate({ .5_d, 0._d, 0._d }) * maths::Scale(-.5_d, .5_d, .5_d) };
+	std::vector<std::unique_ptr<raytracer::TriangleMeshData>> nested_meshes{};
+	std::vector<std::unique_ptr<TransformedMesh>> nested_shapes{};
+	std::vector<raytracer::MeshInstances::Record> group_records{};
+	for (maths::Transform const &group_transform : group_transforms)
+	{
+		for (maths::Transform const &transform : transforms)
+		{
+			nested_meshes.emplace_back(new raytracer::TriangleMeshData{
+				group_transform * transform, raw_data, raytracer::BvhAccelerator::kBinaryNodeWidth,
+				false, raytracer::BvhAccelerator::kSahBuild,
+				raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+				raytracer::InstancingPolicyClass::Transformed{} });
+			nested_shapes.emplace_back(new TransformedMesh{ group_transform * transform, false,
+															*nested_meshes.back() });
+		}
+		group_records.push_back(raytracer::MeshInstances::MakeRecord(group_bvh, &instances,
+																	 group_transform));
+	}
+	raytracer::MeshInstances const groups{ std::move(group_records),
+										   raytracer::BvhAccelerator::kBinaryNodeWidth };
+	EXPECT_EQ(2u, groups.instance_depth());
+	hit_count = 0u;
+	for (uint32_t ray_index = 0u; ray_index < 1024u; ++ray_index)
+	{
+		maths::Ray const ray = MakeRandomRay(rng);
+		maths::Ray reference_ray{ ray };
+		raytracer::HitRecord reference_hit{};
+		uint32_t reference_instance = 0u;
+		for (uint32_t i = 0u; i < nested_meshes.size(); ++i)
+			if (nested_meshes[i]->Intersect(reference_ray, reference_hit))
+				reference_instance = i;
+		maths::Ray groups_ray{ ray };
+		raytracer::HitRecord groups_hit{};
+		bool const groups_hit_found = groups.Intersect(groups_ray, groups_hit);
+		ASSERT_EQ(reference_hit.t < maths::infinity<maths::Decimal>, groups_hit_found);
+		EXPECT_EQ(groups_hit_found, groups.DoesIntersect(ray));
+		if (!groups_hit_found)
+			continue;
+		++hit_count;
+		EXPECT_NEAR(reference_hit.t, groups_hit.t, 1e-4_d);
+		ASSERT_EQ(2u, groups_hit.instance_path.depth);
+		EXPECT_EQ(reference_instance / kInstanceCount, groups_hit.instance_path.indices[0]);
+		EXPECT_EQ(reference_instance % kInstanceCount, groups_hit.instance_path.indices[1]);
+		EXPECT_EQ(&groups, groups_hit.primitive);
+		raytracer::SurfaceInteraction hit_info{};
+		groups.ComputeSurfaceInteraction(ray, groups_hit, hit_info);
+		EXPECT_NEAR(0._d, maths::Length(hit_info.position - ray(groups_hit.t)), 1e-4_d);
+		raytracer::SurfaceInteraction reference_info{};
+		nested_meshes[reference_instance]->ComputeSurfaceInteraction(
+			ray, reference_hit, *nested_shapes[reference_instance], reference_info);
+		expect_same_normals(reference_info, hit_info);
+	}
+	EXPECT_GT(hit_count, 0u);
+}
+
+
+TEST(BvhAccelerator, GroupedMeshesFollowTheirAnimation)
+{
+	using TransformedMesh = raytracer::TriangleMesh<raytracer::InstancingPolicyClass::Transformed>;
+	core::RNG rng{ 0x9a0bu };
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	raytracer::TriangleMeshRawData const raw_data =
+		MakeRandomTriangles(rng, 256, .2_d, indices, vertices);
+	maths::Transform const rest_transform = maths::Scale(.5_d, .5_d, .5_d);
+	raytracer::TriangleMeshData moving_data{
+		rest_transform, raw_data, raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+		raytracer::BvhAccelerator::kSahBuild,
+		raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+		raytracer::InstancingPolicyClass::Transformed{} };
+	TransformedMesh const moving_mesh{ rest_transform, false, moving_data };
+	raytracer::GeometryPrimitive const moving_primitive{ moving_mesh };
+	// The animated mesh lives in a group placed twice, as the scene setup builds it
+	raytracer::BvhAccelerator group_bvh{
+		raytracer::BvhAccelerator::PrimitiveArray_t{ &moving_primitive }, 4u };
+	maths::Transform const group_transforms[2]{
+		maths::Transform{},
+		maths::Translate({ 0._d, .5_d, 0._d }) * maths::Scale(-1._d, 1._d, 1._d) *
+			maths::Translate({ -1._d, 0._d, 0._d }) };
+	std::vector<raytracer::MeshInstances::Record> group_records{};
+	for (maths::Transform const &group_transform : group_transforms)
+		group_records.push_back(raytracer::MeshInstances::MakeRecord(group_bvh, nullptr,
+																	 group_transform));
+	raytracer::MeshInstances groups{ std::move(group_records),
+									 raytracer::BvhAccelerator::kBinaryNodeWidth };
+	raytracer::BvhAccelerator scene_bvh{ raytracer::BvhAccelerator::PrimitiveArray_t{ &groups },
+										 4u };
+	for (maths::Decimal const time : { .5_d, 1._d })
+	{
+		// Moved far enough that the bounds of the rest pose miss most of the hits
+		maths::Transform const world_transform =
+			maths::Translate({ .5_d * time, 0._d, .4_d * time }) * rest_transform;
+		moving_data.SetWorldTransform(world_transform);
+		group_bvh.Update();
+		groups.Update();
+		scene_bvh.Update();
+		std::vector<std::unique_ptr<raytracer::TriangleMeshData>> placed_meshes{};
+		for (maths::Transform const &group_transform : group_transforms)
+			placed_meshes.emplace_back(new raytracer::TriangleMeshData{
+				group_transform * world_transform, raw_data,
+				raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+				raytracer::BvhAccelerator::kSahBuild,
+				raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+				raytracer::InstancingPolicyClass::Transformed{} });
+		uint32_t hit_count = 0u;
+#ifdef YS_BVH_TRAVERSAL_STATS
+		raytracer::BvhAccelerator::GrabTraversalCounters();
+		raytracer::BvhAccelerator::TakeTraversalCounters();
+#endif // YS_BVH_TRAVERSAL_STATS
+		for (uint32_t ray_index = 0u; ray_index < 1024u; ++ray_index)
+		{
+			maths::Ray const ray = MakeRandomRay(rng);
+			maths::Ray reference_ray{ ray };
+			raytracer::HitRecord reference_hit{};
+			uint32_t reference_instance = 0u;
+			for (uint32_t i = 0u; i < placed_meshes.size(); ++i)
+				if (placed_meshes[i]->Intersect(reference_ray, reference_hit))
+					reference_instance = i;
+			maths::Ray scene_ray{ ray };
+			raytracer::HitRecord scene_hit{};
+			bool const scene_hit_found = scene_bvh.Intersect(scene_ray, scene_hit);
+			ASSERT_EQ(reference_hit.t < maths::infinity<maths::Decimal>, scene_hit_found) << time;
+			EXPECT_EQ(scene_hit_found, scene_bvh.DoesIntersect(ray)) << time;
+			if (!scene_hit_found)
+				continue;
+			++hit_count;
+			EXPECT_NEAR(reference_hit.t, scene_hit.t, 1e-4_d) << time;
+			ASSERT_EQ(1u, scene_hit.instance_path.depth) << time;
+			EXPECT_EQ(reference_instance, scene_hit.instance_path.indices[0]) << time;
+		}
+		EXPECT_GT(hit_count, 0u) << time;
+#ifdef YS_BVH_TRAVERSAL_STATS
+		// The scene queries go through the group records, the group and the mesh BVHs, only
+		// their outermost traversals are rays
+		raytracer::BvhAccelerator::TraversalCounters const &counters =
+			raytracer::BvhAccelerator::thread_traversal_counters();
+		EXPECT_EQ(1024u * (placed_meshes.size() + 2u), counters.ray_count) << time;
+		EXPECT_GT(counters.traversal_count, counters.ray_count) << time;
+#endif // YS_BVH_TRAVERSAL_STATS
+	}
+}
+
+
+TEST(BvhAccelerator, InstancePathsCompareExactly)
+{
+	// Self hit tests compare whole paths, entries past the depth don't matter
+	raytracer::InstancePath outer{};
+	outer.depth = 1u;
+	outer.indices[0] = 1u;
+	raytracer::InstancePath nested{};
+	nested.depth = 2u;
+	EXPECT_NE(outer, nested);
+	raytracer::InstancePath other_nested{ nested };
+	other_nested.indices[raytracer::InstancePath::kMaxDepth - 1u] = 1u;
+	EXPECT_EQ(nested, other_nested);
+	other_nested.indices[1] = 1u;
+	EXPECT_NE(nested, other_nested);
+}
+
+
+TEST(BvhAccelerator, CacheRoundTrip)
+{
+	std::string const cache_file = "bvh_tests_cache.ysbvh";
+	core::RNG rng{ 0xcac4eu };
+	BoxContainer_t const boxes = MakeRandomBoxes(rng, 4096u, .02_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	for (raytracer::BvhAccelerator::BuildMethod const method : kBuildMethods)
+		for (NodeFormat const &format : kNodeFormats)
+		{
+			std::string const name = BuildMethodName(method) + " " + FormatName(format);
+			std::remove(cache_file.c_str());
+			raytracer::BvhAccelerator const built{ primitives, 4u, format.width, format.quantized,
+				method, raytracer::BvhAccelerator::kDefaultDuplicationBudget, cache_file };
+			ASSERT_TRUE(std::ifstream(cache_file, std::ios::binary).good()) << name;
+			raytracer::BvhAccelerator const loaded{ primitives, 4u, format.width, format.quantized,
+				method, raytracer::BvhAccelerator::kDefaultDuplicationBudget, cache_file };
+			// A corrupted node is caught by the payload hash, the BVH is rebuilt
+			{
+				std::fstream file{ cache_file, std::ios::binary | std::ios::in | std::ios::out };
+				file.seekp(-1, std::ios::end);
+				file.put('\x5a');
+			}
+			raytracer::BvhAccelerator const rebuilt{ primitives, 4u, format.width, format.quantized,
+				method, raytracer::BvhAccelerator::kDefaultDuplicationBudget, cache_file };
+			EXPECT_EQ(built.node_memory_size(), loaded.node_memory_size()) << name;
+			EXPECT_EQ(built.node_memory_size(), rebuilt.node_memory_size()) << name;
+			EXPECT_EQ(built.reference_count(), loaded.reference_count()) << name;
+			for (uint32_t ray_index = 0u; ray_index < 256u; ++ray_index)
+			{
+				maths::Ray const ray = MakeRandomRay(rng);
+				raytracer::HitRecord hit{};
+				maths::Ray built_ray{ ray }, loaded_ray{ ray }, rebuilt_ray{ ray };
+				bool const built_hit = built.Intersect(built_ray, hit);
+				EXPECT_EQ(built_hit, loaded.Intersect(loaded_ray, hit)) << name;
+				EXPECT_EQ(built_hit, rebuilt.Intersect(rebuilt_ray, hit)) << name;
+				EXPECT_EQ(built_ray.tMax, loaded_ray.tMax) << name;
+				EXPECT_EQ(built_ray.tMax, rebuilt_ray.tMax) << name;
+			}
+		}
+	std::remove(cache_file.c_str());
+}
+
+
+TEST(BvhAccelerator, SpatialSplitsReduceNodeVisits)
+{
+	core::RNG rng{ 0x5b0a4u };
+	BoxContainer_t const boxes = MakeRandomSticks(rng, 16u * 1024u, .5_d, .002_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	std::vector<maths::Ray> rays{};
+	for (uint32_t i = 0u; i < 4096u; ++i)
+		rays.push_back(MakeRandomRay(rng));
+	raytracer::BvhAccelerator const object_bvh{ primitives, 4u };
+	raytracer::BvhAccelerator const spatial_bvh{ primitives, 4u,
+		raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+		raytracer::BvhAccelerator::kSpatialSahBuild };
+	RecordProperty("sah_cost", std::to_string(object_bvh.sah_cost()));
+	RecordProperty("spatial_sah_cost", std::to_string(spatial_bvh.sah_cost()));
+	RecordProperty("spatial_reference_count", static_cast<int>(spatial_bvh.reference_count()));
+	EXPECT_LT(spatial_bvh.sah_cost(), object_bvh.sah_cost());
+#ifdef YS_BVH_TRAVERSAL_STATS
+	double const object_visits = NodeVisitsPerRay(object_bvh, rays);
+	double const spatial_visits = NodeVisitsPerRay(spatial_bvh, rays);
+	RecordProperty("node_visits_per_ray", std::to_string(object_visits));
+	RecordProperty("spatial_node_visits_per_ray", std::to_string(spatial_visits));
+	EXPECT_LT(spatial_visits, object_visits);
+#endif // YS_BVH_TRAVERSAL_STATS
+	EXPECT_LE(spatial_bvh.reference_count(), static_cast<size_t>(
+		primitives.size() * (1.f + raytracer::BvhAccelerator::kDefaultDuplicationBudget)));
+}
+
+
+TEST(BvhAccelerator, PacketsMatchSingleRays)
+{
+	core::RNG rng{ 0x5eedu };
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	raytracer::TriangleMeshRawData const raw_data =
+		MakeRandomTriangles(rng, 4096, .05_d, indices, vertices);
+	BoxContainer_t const boxes = MakeRandomBoxes(rng, 4096u, .02_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	// Random rays make the packets diverge at once, camera rays stay coherent
+	std::vector<maths::Ray> random_rays{};
+	for (uint32_t i = 0u; i < 1024u; ++i)
+		random_rays.push_back(MakeRandomRay(rng));
+	for (NodeFormat const &format : kNodeFormats)
+	{
+		raytracer::TriangleMeshData const mesh_data{
+			raw_data, format.width, format.quantized,
+			raytracer::BvhAccelerator::kSahBuild,
+			raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+			raytracer::InstancingPolicyClass::SharedSource{} };
+		raytracer::BvhAccelerator const bvh{ primitives, 4u, format.width, format.quantized };
+		for (PacketFormat const &packet_format : kPacketFormats)
+		{
+			std::string const name = FormatName(format) + " packet " +
+				std::to_string(packet_format.size);
+			std::vector<maths::Ray> const primary_rays =
+				MakePrimaryRays(64u, packet_format.block_width, packet_format.block_height);
+			// Every other ray, the others must be left untouched
+			uint32_t const ray_masks[] = { (1u << packet_format.size) - 1u, 0x5555u };
+			for (uint32_t const ray_mask : ray_masks)
+			{
+				std::vector<raytracer::HitRecord> const mesh_hits = IntersectPackets(
+					primary_rays, packet_format.size, ray_mask,
+					[&mesh_data](raytracer::RayPacket &_packet, uint32_t const _mask) {
+						return mesh_data.IntersectPacket(_packet, _mask);
+					});
+				std::vector<raytracer::HitRecord> const box_hits = IntersectPackets(
+					random_rays, packet_format.size, ray_mask,
+					[&bvh](raytracer::RayPacket &_packet, uint32_t const _mask) {
+						return bvh.IntersectPacket(_packet, _mask);
+					});
+				for (size_t i = 0u; i < primary_rays.size(); ++i)
+				{
+					maths::Ray ray{ primary_rays[i] };
+					raytracer::HitRecord hit{};
+					if ((ray_mask & (1u << (i % packet_format.size))) != 0u)
+						mesh_data.Intersect(ray, hit);
+					EXPECT_EQ(hit.t, mesh_hits[i].t) << name;
+					EXPECT_EQ(hit.index, mesh_hits[i].index) << name;
+				}
+				for (size_t i = 0u; i < random_rays.size(); ++i)
+				{
+					maths::Ray ray{ random_rays[i] };
+					raytracer::HitRecord hit{};
+					if ((ray_mask & (1u << (i % packet_format.size))) != 0u)
+						bvh.Intersect(ray, hit);
+					EXPECT_EQ(hit.t, box_hits[i].t) << name;
+					EXPECT_EQ(hit.primitive, box_hits[i].primitive) << name;
+				}
+			}
+		}
+	}
+}
+
+
+TEST(BvhAccelerator, RayStreamSortGroupsRays)
+{
+	constexpr size_t kBatchSize = 256u;
+	core::RNG rng{ 0x5eedu };
+	raytracer::RayStream stream{};
+	for (uint32_t i = 0u; i < 1000u; ++i)
+		stream.Push(MakeRandomRay(rng), i);
+	maths::Bounds3f const bounds{ maths::Point3f{ 0._d, 0._d, 0._d }, maths::Point3f{ 1._d, 1._d, 1._d } };
+	stream.SortForTraversal(bounds, 0u);
+	EXPECT_TRUE(stream.order.empty());
+	stream.SortForTraversal(bounds, kBatchSize);
+	ASSERT_EQ(stream.size(), stream.order.size());
+	auto const octant = [&stream](uint32_t const _ray_index) {
+		maths::Vec3f const &direction = stream.rays[_ray_index].direction;
+		return ((direction.x < 0._d) ? 1u : 0u) | ((direction.y < 0._d) ? 2u : 0u) |
+			((direction.z < 0._d) ? 4u : 0u);
+	};
+	std::vector<uint8_t> seen(stream.size(), 0u);
+	for (size_t i = 0u; i < stream.order.size(); ++i)
+	{
+		uint32_t const ray_index = stream.order[i];
+		ASSERT_LT(ray_index, stream.size());
+		// rays stay in their batch, grouped by octant
+		EXPECT_EQ(i / kBatchSize, ray_index / kBatchSize);
+		EXPECT_EQ(0u, seen[ray_index]);
+		seen[ray_index] = 1u;
+		if (i % kBatchSize != 0u)
+			EXPECT_LE(octant(stream.order[i - 1u]), octant(ray_index));
+	}
+}
+
+
+TEST(BvhAccelerator, RaySlabTestMatchesIntervalTest)
+{
+	core::RNG rng{ 0x51abu };
+	BoxContainer_t const boxes = MakeRandomBoxes(rng, 1000u, .5_d);
+	for (BoxPrimitive const &box : boxes)
+	{
+		maths::Ray ray = MakeRandomRay(rng);
+		// Rays parallel to one or two axes, the zero components may be signed
+		uint32_t const parallel_axes = static_cast<uint32_t>(rng.GetDecimal() * 4._d);
+		if (parallel_axes != 0u)
+		{
+			maths::Vec3f direction = ray.direction;
+			for (uint32_t axis = 0u; axis < 3u; ++axis)
+				if ((parallel_axes & (1u << axis)) != 0u && axis != 2u)
+					direction[axis] = (direction[axis] < 0._d) ? -0._d : 0._d;
+			ray = maths::Ray{ ray.origin, direction, maths::infinity<maths::Decimal>, 0._d };
+		}
+		maths::Bounds3f const bounds = box.WorldBounds();
+		maths::Decimal t0, t1;
+		EXPECT_EQ(ray.DoesIntersect(bounds, t0, t1), ray.DoesIntersect(bounds));
+		ray.tMax = .25_d;
+		EXPECT_EQ(ray.DoesIntersect(bounds, t0, t1), ray.DoesIntersect(bounds));
+		EXPECT_EQ(maths::MaximumDimension(maths::Abs(ray.direction)), ray.shear.kz);
+		// Single precision node bounds contain the bounds they were rounded from
+		maths::Bounds3s const single_bounds = maths::ToSingleBounds(bounds);
+		maths::Bounds3f const widened_bounds = maths::ToDecimalBounds(single_bounds);
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			EXPECT_LE(widened_bounds.min[axis], bounds.min[axis]);
+			EXPECT_GE(widened_bounds.max[axis], bounds.max[axis]);
+		}
+		if (ray.DoesIntersect(bounds))
+			EXPECT_TRUE(ray.DoesIntersect(single_bounds));
+	}
+}
+
+
+// Timing benches are disabled, run them with --gtest_also_run_disabled_tests
+TEST(BvhAccelerator, DISABLED_BuildBench)
+{
+	constexpr uint32_t kPrimitiveCount = 2u * 1024u * 1024u;
+	core::RNG rng{ 0xb0a4du };
+	BoxContainer_t const boxes = MakeRandomBoxes(rng, kPrimitiveCount, .001_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	for (raytracer::BvhAccelerator::BuildMethod const method : kBuildMethods)
+	{
+		raytracer::BvhAccelerator const bvh{
+			primitives, 4u, raytracer::BvhAccelerator::kBinaryNodeWidth, false, method };
+		double const ms_per_million = bvh.build_milliseconds() * 1e6 / kPrimitiveCount;
+		RecordProperty("build_milliseconds_" + BuildMethodName(method),
+					   std::to_string(bvh.build_milliseconds()));
+		RecordProperty("ms_per_million_primitives_" + BuildMethodName(method),
+					   std::to_string(ms_per_million));
+		RecordProperty("sah_cost_" + BuildMethodName(method), std::to_string(bvh.sah_cost()));
+	}
+}
+
+
+TEST(BvhAccelerator, DISABLED_TraversalBench)
+{
+	constexpr uint32_t kRayCount = 256u * 1024u;
+	core::RNG rng{ 0x7a4e5u };
+	BoxContainer_t const boxes = MakeRandomBoxes(rng, 256u * 1024u, .005_d);
+	raytracer::BvhAccelerator::PrimitiveArray_t const primitives = MakePrimitiveArray(boxes);
+	std::vector<maths::Ray> rays{};
+	rays.reserve(kRayCount);
+	for (uint32_t i = 0u; i < kRayCount; ++i)
+		rays.push_back(MakeRandomRay(rng));
+	auto const measure = [&rays, &primitives, this](raytracer::BvhAccelerator const &_bvh,
+													 std::string const &_name) {
+		double const node_visits_per_ray = NodeVisitsPerRay(_bvh, rays);
+		raytracer::HitRecord hit{};
+		uint32_t hit_count = 0u;
+		std::chrono::high_resolution_clock::time_point const start =
+			std::chrono::high_resolution_clock::now();
+		for (maths::Ray const &ray : rays)
+		{
+			maths::Ray bvh_ray{ ray };
+			hit_count += _bvh.Intersect(bvh_ray, hit) ? 1u : 0u;
+		}
+		std::chrono::duration<double> const traversal_time =
+			std::chrono::high_resolution_clock::now() - start;
+		double const rays_per_second = kRayCount / traversal_time.count();
+		double const node_bytes_per_primitive =
+			static_cast<double>(_bvh.node_memory_size()) / primitives.size();
+		RecordProperty("hit_count_" + _name, static_cast<int>(hit_count));
+		RecordProperty("rays_per_second_" + _name, static_cast<int>(rays_per_second));
+		RecordProperty("node_visits_per_ray_" + _name, std::to_string(node_visits_per_ray));
+		RecordProperty("node_bytes_per_primitive_" + _name,
+					   std::to_string(node_bytes_per_primitive));
+	};
+	for (NodeFormat const &format : kNodeFormats)
+	{
+		raytracer::BvhAccelerator bvh{ primitives, 4u, format.width, format.quantized };
+		measure(bvh, FormatName(format));
+		if (format.width == raytracer::BvhAccelerator::kBinaryNodeWidth)
+		{
+			bvh.SetShortStackTraversal(true);
+			measure(bvh, FormatName(format) + "S");
+			bvh.SetShortStackTraversal(false);
+		}
+		bvh.SetNodeLayout(raytracer::BvhAccelerator::kTreeletLayout);
+		measure(bvh, FormatName(format) + "T");
+		bvh.SetNodeLayout(raytracer::BvhAccelerator::kHotTreeletLayout);
+		measure(bvh, FormatName(format) + "H");
+	}
+}
+
+
+TEST(BvhAccelerator, DISABLED_PacketTraversalBench)
+{
+	constexpr uint32_t kResolution = 512u;
+	core::RNG rng{ 0x9ac4e7u };
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	raytracer::TriangleMeshRawData const raw_data =
+		MakeRandomTriangles(rng, 256 * 1024, .02_d, indices, vertices);
+	raytracer::TriangleMeshData const mesh_data{
+		raw_data, raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+		raytracer::BvhAccelerator::kSahBuild,
+		raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+		raytracer::InstancingPolicyClass::SharedSource{} };
+	for (PacketFormat const &packet_format : kPacketFormats)
+	{
+		std::vector<maths::Ray> const rays =
+			MakePrimaryRays(kResolution, packet_format.block_width, packet_format.block_height);
+		raytracer::HitRecord hit{};
+		std::chrono::high_resolution_clock::time_point const single_start =
+			std::chrono::high_resolution_clock::now();
+		for (maths::Ray const &ray : rays)
+		{
+			maths::Ray mesh_ray{ ray };
+			mesh_data.Intersect(mesh_ray, hit);
+		}
+		std::chrono::duration<double> const single_time =
+			std::chrono::high_resolution_clock::now() - single_start;
+		raytracer::RayPacket packet;
+		packet.size = packet_format.size;
+		std::chrono::high_resolution_clock::time_point const packet_start =
+			std::chrono::high_resolution_clock::now();
+		for (size_t first = 0u; first < rays.size(); first += packet_format.size)
+		{
+			for (uint32_t i = 0u; i < packet_format.size; ++i)
+			{
+				packet.rays[i] = rays[first + i];
+				packet.hits[i] = raytracer::HitRecord{};
+			}
+			mesh_data.IntersectPacket(packet, packet.full_mask());
+		}
+		std::chrono::duration<double> const packet_time =
+			std::chrono::high_resolution_clock::now() - packet_start;
+		double const single_rays_per_second = rays.size() / single_time.count();
+		double const packet_rays_per_second = rays.size() / packet_time.count();
+		std::string const name = "packet_" + std::to_string(packet_format.size);
+		RecordProperty("single_rays_per_second_" + name, static_cast<int>(single_rays_per_second));
+		RecordProperty("rays_per_second_" + name, static_cast<int>(packet_rays_per_second));
+	}
+}
+
+
+TEST(BvhAccelerator, DISABLED_RaySortBench)
+{
+	// AO workload : 8 rays over the hemisphere of each primary hit on a large mesh
+	constexpr uint32_t kResolution = 256u;
+	constexpr uint32_t kAORayCount = 8u;
+	core::RNG rng{ 0x50a7u };
+	raytracer::TriangleMeshRawData::IndicesContainer_t indices{};
+	raytracer::TriangleMeshRawData::VerticesContainer_t vertices{};
+	raytracer::TriangleMeshRawData const raw_data =
+		MakeRandomTriangles(rng, 1024 * 1024, .01_d, indices, vertices);
+	raytracer::TriangleMeshData const mesh_data{
+		raw_data, raytracer::BvhAccelerator::kBinaryNodeWidth, false,
+		raytracer::BvhAccelerator::kSahBuild,
+		raytracer::BvhAccelerator::kDefaultDuplicationBudget, "",
+		raytracer::InstancingPolicyClass::SharedSource{} };
+	std::vector<maths::Ray> spawned_rays{};
+	for (maths::Ray ray : MakePrimaryRays(kResolution, 1u, 1u))
+	{
+		raytracer::HitRecord hit{};
+		if (!mesh_data.Intersect(ray, hit))
+			continue;
+		// backs off along the ray instead of using the surface normal, close enough for timings
+		maths::Point3f const origin = ray(hit.t * (1._d - 1e-4_d));
+		for (uint32_t i = 0u; i < kAORayCount; ++i)
+		{
+			maths::Vec3f direction{ rng.GetDecimal() - .5_d, rng.GetDecimal() - .5_d,
+									rng.GetDecimal() - .5_d };
+			if (maths::Dot(direction, ray.direction) > 0._d)
+				direction = -direction;
+			spawned_rays.emplace_back(origin, maths::Normalized(direction), .1_d, 0._d);
+		}
+	}
+	// Rays spawned in pixel order are already coherent, shuffled ones stand for the streams of
+	// many small primitives or lights
+	std::vector<maths::Ray> shuffled_rays{ spawned_rays };
+	for (size_t i = shuffled_rays.size() - 1u; i > 0u; --i)
+		std::swap(shuffled_rays[i], shuffled_rays[maths::Min(
+			static_cast<size_t>(rng.GetDouble() * (i + 1u)), i)]);
+	std::pair<std::string, std::vector<maths::Ray> const *> const spawn_orders[] = {
+		{ "pixel", &spawned_rays }, { "shuffled", &shuffled_rays } };
+	for (auto const &spawn_order : spawn_orders)
+	{
+		raytracer::RayStream ao_rays{};
+		for (maths::Ray const &ray : *spawn_order.second)
+			ao_rays.Push(ray, 0u);
+		size_t const batch_sizes[] = { 0u, 4096u, 65536u, ao_rays.size() };
+		for (size_t const batch_size : batch_sizes)
+		{
+			std::chrono::high_resolution_clock::time_point const start =
+				std::chrono::high_resolution_clock::now();
+			ao_rays.SortForTraversal(mesh_data.bounds(), batch_size);
+			uint32_t occluded_count = 0u;
+			for (size_t i = 0u; i < ao_rays.size(); ++i)
+			{
+				size_t const ray_index = ao_rays.order.empty() ? i : ao_rays.order[i];
+				occluded_count += mesh_data.DoesIntersect(ao_rays.rays[ray_index]) ? 1u : 0u;
+			}
+			std::chrono::duration<double> const time =
+				std::chrono::high_resolution_clock::now() - start;
+			double const rays_per_second = ao_rays.size() / time.count();
+			std::string const name = spawn_order.first + "_sort_batch_" + std::to_string(batch_size);
+			RecordProperty("occluded_count_" + name, static_cast<int>(occluded_count));
+			RecordProperty("rays_per_second_" + name, static_cast<int>(rays_per_second));
+		}
+	}
+}
@@ -1,9 +1,17 @@
 #include <cstdio>
 #include "gtest/gtest.h"
 
+#include "globals.h"
+#include "core/logger.h"
+
 GTEST_API_ int main(int _argc, char **_argv)
 {
 	testing::InitGoogleTest(&_argc, _argv);
+	// Same channels as the raytracer, the code under test logs to them and debug builds assert
+	// that they are bound.
+	globals::logger.BindPath(tools::kChannelGeneral, "unit_tests_general.log");
+	globals::logger.BindPath(tools::kChannelProfiling, "unit_tests_profiling.log");
+	globals::logger.BindPath(tools::kChannelParsing, "unit_tests_parsing.log");
 	int result = RUN_ALL_TESTS();
 
 	system("pause");
@@ -150,6 +150,19 @@ TEST(UtilityFunctions, Abs)
 }
 
 
+TEST(UtilityFunctions, EncodeMorton3)
+{
+	EXPECT_EQ(maths::EncodeMorton3(0u, 0u, 0u), 0u);
+	EXPECT_EQ(maths::EncodeMorton3(1u, 0u, 0u), 1u);
+	EXPECT_EQ(maths::EncodeMorton3(0u, 1u, 0u), 2u);
+	EXPECT_EQ(maths::EncodeMorton3(0u, 0u, 1u), 4u);
+	EXPECT_EQ(maths::EncodeMorton3(2u, 0u, 0u), 8u);
+	EXPECT_EQ(maths::EncodeMorton3(0x3ffu, 0x3ffu, 0x3ffu), 0x3fffffffu);
+	// only the 10 low bits of each coordinate are kept
+	EXPECT_EQ(maths::EncodeMorton3(0x400u, 0u, 0u), 0u);
+}
+
+
 TEST(SqrtTestFloat, Sqrt)
 {
 	maths::FloatBitsMapper mapper(0.f), root(0.f), check(0.f), sqr(0.f), sqrv(0.f);
@@ -6,6 +6,7 @@
 
 constexpr uint64_t seed{ 12439587162u };
 constexpr uint32_t trunc_seed{ static_cast<uint32_t>(seed) };
+constexpr uint64_t stream{ 8675309u };
 
 TEST(RandomNumberGeneration, ConformanceTest)
 {
@@ -20,6 +21,26 @@ TEST(RandomNumberGeneration, ConformanceTest)
 	EXPECT_EQ(subject(), ground_truth());
 }
 
+TEST(RandomNumberGeneration, StreamConformanceTest)
+{
+	pcg32_k2	ground_truth{ seed, stream };
+	core::RNG	subject{ seed, stream };
+	EXPECT_EQ(subject.Get32b(), ground_truth());
+	for (int i = 0; i < 10000; ++i)
+	{
+		ground_truth();
+		subject.Get32b();
+	}
+	EXPECT_EQ(subject.Get32b(), ground_truth());
+}
+
+TEST(RandomNumberGeneration, StreamsDiffer)
+{
+	core::RNG	first{ seed, stream };
+	core::RNG	second{ seed, stream + 1u };
+	EXPECT_NE(first.Get64b(), second.Get64b());
+}
+
 TEST(RandomNumberGeneration, InvXorshift)
 {
 	const uint32_t	ground_truth{ pcg_extras::unxorshift(trunc_seed, 32u, 10u) };